@@ -16,6 +16,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#define ZSTD_STATIC_LINKING_ONLY // For ZSTD_SKIPPABLEHEADERSIZE
 #include <zstd.h>
 #include <physfs.h>
 #define __PHYSICSFS_INTERNAL__
@@ -27,7 +28,16 @@
 #include "archiver_sarc.h"
 #include "archiver_sarc_internal.h"
 #include "vmem.h"
+#include "sarc_hash.h"
+#include "sarc_rebuild.h"
+#include "sarc_cache.h"
+#include "sarc_shm.h"
+#include "fd_pool.h"
+#include "mem_budget.h"
+#include "threads.h"
+#include "trace.h"
 #include "logging.h"
+#include "int.h"
 
 // TODO: See if we can track the number of open write handles, then rebuild the
 // SARC and turn it back into a normal read-only archive? It looks like calling
@@ -38,6 +48,9 @@ const PHYSFS_Archiver archiver_sarc_default = {
   .info = {
     // It'll work fine if we call the extension SARC, but slows everything down
     // because it just tries every possible archiver. (I lose a full second when mounting 15000 archives)
+    // Every other SARC-family extension still ends up here through that
+    // fallback, and SARC_sniffFormat() turns it away after a single read if
+    // it's not ours. Registering more archivers would only add more probes.
     .extension = "pack.zs",
     .description = "SARC for Zelda, Animal Crossing, Mario, Misc. Nintendo",
     .author = "Torphedo",
@@ -61,17 +74,385 @@ typedef struct {
   PHYSFS_ErrorCode errcode;
 }EnumStringListCallbackData;
 
+// File extensions used by SARC archives across different games. Each of these
+// can also be zstd-compressed with a ".zs" suffix.
+static const char* sarc_extensions[] = {
+  ".pack",
+  ".sarc",
+  ".bars",
+  ".blarc",
+  ".bfarc",
+  ".bgenv",
+  ".genvb",
+  ".bkres",
+  ".ssarc",
+};
+
+// How many skippable frames we'll step over before giving up on a zstd file
+#define SARC_MAX_SKIPPABLE_FRAMES 16
+
+static bool thread_safe_reads = false;
+static bool overlay_writes = false;
+static bool pooled_files = true;
+
+void SARC_setThreadSafeReads(bool enable) {
+  thread_safe_reads = enable;
+} /* SARC_setThreadSafeReads */
+
+void SARC_setOverlayWrites(bool enable) {
+  overlay_writes = enable;
+} /* SARC_setOverlayWrites */
+
+void SARC_setOpenFileLimit(uint32_t limit) {
+  pooled_files = (limit != 0);
+  if (pooled_files) {
+    fd_pool_set_limit(limit);
+  }
+} /* SARC_setOpenFileLimit */
+
+PHYSFS_Io* SARC_openFile(const char* path) {
+  if (pooled_files) {
+    return fd_pool_open(path);
+  }
+  return __PHYSFS_createNativeIo(path, 'r');
+} /* SARC_openFile */
+
+bool SARC_hasArchiveExtension(const char* path) {
+  size_t len = strlen(path);
+  // Ignore the compression suffix, the extension underneath is what matters.
+  if (len > 3 && strcmp(&path[len - 3], ".zs") == 0) {
+    len -= 3;
+  }
+
+  for (uint32_t i = 0; i < ARRAY_SIZE(sarc_extensions); i++) {
+    size_t ext_len = strlen(sarc_extensions[i]);
+    if (ext_len <= len && strncmp(&path[len - ext_len], sarc_extensions[i], ext_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+} /* SARC_hasArchiveExtension */
+
+sarc_format SARC_sniffFormat(PHYSFS_Io* io) {
+  PHYSFS_uint64 pos = 0;
+
+  for (uint32_t i = 0; i < SARC_MAX_SKIPPABLE_FRAMES; i++) {
+    // Magic, plus the frame size in case this turns out to be a skippable frame
+    uint32_t magic[2] = {0};
+    if (!io->seek(io, pos)) {
+      return SARC_FORMAT_NONE;
+    }
+    if (io->read(io, magic, sizeof(magic)) < (PHYSFS_sint64)sizeof(*magic)) {
+      return SARC_FORMAT_NONE;
+    }
+
+    if (magic[0] == SARC_MAGIC && pos == 0) {
+      return SARC_FORMAT_RAW;
+    }
+    if (magic[0] == ZSTD_MAGICNUMBER) {
+      return SARC_FORMAT_ZSTD;
+    }
+    if ((magic[0] & ZSTD_MAGIC_SKIPPABLE_MASK) != ZSTD_MAGIC_SKIPPABLE_START) {
+      break;
+    }
+    // Skippable frames only hold metadata. The real frame comes after.
+    pos += ZSTD_SKIPPABLEHEADERSIZE + magic[1];
+  }
+
+  return SARC_FORMAT_NONE;
+} /* SARC_sniffFormat */
+
+
+// Every mounted archive, hashed by real path. PhysicsFS only mounts and
+// unmounts while holding its state lock, but lookups can come from any thread.
+#define SARC_REGISTRY_BUCKETS 256
+static SARC_ctx* registry[SARC_REGISTRY_BUCKETS];
+static void* registry_lock = NULL;
+
+static uint32_t registry_bucket(const char* arc_filename) {
+  return sarc_filename_hash((char*)arc_filename, strlen(arc_filename), SFAT_HASH_KEY) % SARC_REGISTRY_BUCKETS;
+}
+
+static void registry_add(SARC_ctx* ctx) {
+  if (registry_lock == NULL) {
+    registry_lock = __PHYSFS_platformCreateMutex();
+  }
+  uint32_t bucket = registry_bucket(ctx->arc_filename);
+  __PHYSFS_platformGrabMutex(registry_lock);
+  ctx->registry_next = registry[bucket];
+  registry[bucket] = ctx;
+  __PHYSFS_platformReleaseMutex(registry_lock);
+}
+
+static void registry_remove(SARC_ctx* ctx) {
+  if (registry_lock == NULL || ctx->arc_filename == NULL) {
+    return;
+  }
+  uint32_t bucket = registry_bucket(ctx->arc_filename);
+  __PHYSFS_platformGrabMutex(registry_lock);
+  SARC_ctx** link = &registry[bucket];
+  while (*link != NULL) {
+    if (*link == ctx) {
+      *link = ctx->registry_next;
+      break;
+    }
+    link = (SARC_ctx**)&(*link)->registry_next;
+  }
+  __PHYSFS_platformReleaseMutex(registry_lock);
+}
+
+SARC_ctx* SARC_findArchive(const char* arc_filename) {
+  if (registry_lock == NULL || arc_filename == NULL) {
+    return NULL;
+  }
+  SARC_ctx* retval = NULL;
+  __PHYSFS_platformGrabMutex(registry_lock);
+  for (SARC_ctx* ctx = registry[registry_bucket(arc_filename)]; ctx != NULL; ctx = ctx->registry_next) {
+    if (strcmp(ctx->arc_filename, arc_filename) == 0) {
+      retval = ctx;
+      break;
+    }
+  }
+  __PHYSFS_platformReleaseMutex(registry_lock);
+  return retval;
+} /* SARC_findArchive */
+
+bool SARC_withArchive(const char* arc_filename, void (*callback)(SARC_ctx* ctx, void* data), void* data) {
+  if (registry_lock == NULL || arc_filename == NULL) {
+    return false;
+  }
+  bool found = false;
+  __PHYSFS_platformGrabMutex(registry_lock);
+  for (SARC_ctx* ctx = registry[registry_bucket(arc_filename)]; ctx != NULL; ctx = ctx->registry_next) {
+    if (strcmp(ctx->arc_filename, arc_filename) == 0) {
+      callback(ctx, data);
+      found = true;
+      break;
+    }
+  }
+  __PHYSFS_platformReleaseMutex(registry_lock);
+  return found;
+} /* SARC_withArchive */
+
+// Pins are counted under their own lock, so unmounting can wait on them
+// without holding the registry.
+static ZSTD_pthread_mutex_t pin_lock;
+static ZSTD_pthread_cond_t pin_released;
+static thread_once_t pin_once = THREAD_ONCE_INIT;
+
+static void pin_init(void) {
+  ZSTD_pthread_mutex_init(&pin_lock, NULL);
+  ZSTD_pthread_cond_init(&pin_released, NULL);
+}
+
+void SARC_pinArchiveLocked(SARC_ctx* ctx) {
+  thread_once(&pin_once, pin_init);
+  ZSTD_pthread_mutex_lock(&pin_lock);
+  ctx->pins++;
+  ZSTD_pthread_mutex_unlock(&pin_lock);
+} /* SARC_pinArchiveLocked */
+
+static void pin_callback(SARC_ctx* ctx, void* data) {
+  SARC_pinArchiveLocked(ctx);
+  *(SARC_ctx**)data = ctx;
+}
+
+SARC_ctx* SARC_pinArchive(const char* arc_filename) {
+  SARC_ctx* ctx = NULL;
+  SARC_withArchive(arc_filename, pin_callback, &ctx);
+  return ctx;
+} /* SARC_pinArchive */
+
+void SARC_unpinArchive(SARC_ctx* ctx) {
+  ZSTD_pthread_mutex_lock(&pin_lock);
+  if (--ctx->pins == 0) {
+    ZSTD_pthread_cond_broadcast(&pin_released);
+  }
+  ZSTD_pthread_mutex_unlock(&pin_lock);
+} /* SARC_unpinArchive */
+
+// Wait for everyone using an archive that was just taken out of the registry,
+// so nobody can pin it again.
+static void wait_unpinned(SARC_ctx* ctx) {
+  thread_once(&pin_once, pin_init);
+  ZSTD_pthread_mutex_lock(&pin_lock);
+  while (ctx->pins > 0) {
+    ZSTD_pthread_cond_wait(&pin_released, &pin_lock);
+  }
+  ZSTD_pthread_mutex_unlock(&pin_lock);
+}
+
+void SARC_forEachArchive(void (*callback)(SARC_ctx* ctx, void* data), void* data) {
+  if (registry_lock == NULL) {
+    return;
+  }
+  __PHYSFS_platformGrabMutex(registry_lock);
+  for (uint32_t i = 0; i < SARC_REGISTRY_BUCKETS; i++) {
+    for (SARC_ctx* ctx = registry[i]; ctx != NULL; ctx = ctx->registry_next) {
+      callback(ctx, data);
+    }
+  }
+  __PHYSFS_platformReleaseMutex(registry_lock);
+} /* SARC_forEachArchive */
+
+typedef struct {
+  const char* path; // Inside the archive
+  SARC_ctx* ctx;
+  SARCentry* entry;
+}resolve_args;
+
+static void resolve_callback(SARC_ctx* ctx, void* data) {
+  resolve_args* args = (resolve_args*)data;
+  SARCentry* entry = findEntry(ctx, args->path);
+  if (entry != NULL && !entry->tree.isdir) {
+    args->ctx = ctx;
+    args->entry = entry;
+  }
+}
+
+SARCentry* SARC_resolvePath(const char* path, SARC_ctx** ctx_out) {
+  const char* realdir = PHYSFS_getRealDir(path);
+  if (realdir == NULL) {
+    return NULL;
+  }
+
+  // Strip the mount point to get the path inside the archive. Both of these
+  // may or may not have a leading slash, and the mount point usually has a
+  // trailing one.
+  const char* mountpoint = PHYSFS_getMountPoint(realdir);
+  while (*path == '/') {
+    path++;
+  }
+  if (mountpoint != NULL) {
+    while (*mountpoint == '/') {
+      mountpoint++;
+    }
+    size_t len = strlen(mountpoint);
+    while (len > 0 && mountpoint[len - 1] == '/') {
+      len--;
+    }
+    // Only whole components, "data" isn't the start of "database/x"
+    if (len > 0 && strncmp(path, mountpoint, len) == 0 && (path[len] == '/' || path[len] == '\0')) {
+      path += len;
+      while (*path == '/') {
+        path++;
+      }
+    }
+  }
+
+  // Looked up with the registry locked, so the archive can't go away halfway
+  resolve_args args = { .path = path };
+  if (!SARC_withArchive(realdir, resolve_callback, &args) || args.entry == NULL) {
+    return NULL;
+  }
+  *ctx_out = args.ctx;
+  return args.entry;
+} /* SARC_resolvePath */
+
+static PHYSFS_Io* open_stream(SARC_ctx* ctx, bool can_wait) {
+  PHYSFS_Io* io = ctx->io->duplicate(ctx->io);
+  BAIL_IF_ERRPASS(!io, NULL);
+  if (ctx->is_zstd) {
+    PHYSFS_Io* zstd_io = zstd_wrap_io_owned(io, &ctx->stats, ctx->arc_filename, can_wait);
+    if (zstd_io == NULL) {
+      io->destroy(io);
+    }
+    return zstd_io;
+  }
+  return io;
+}
+
+PHYSFS_Io* SARC_openStream(SARC_ctx* ctx) {
+  return open_stream(ctx, false);
+} /* SARC_openStream */
+
+PHYSFS_Io* SARC_openStreamWaiting(SARC_ctx* ctx) {
+  return open_stream(ctx, true);
+} /* SARC_openStreamWaiting */
+
+bool SARC_readEntry(SARC_ctx* ctx, const SARCentry* entry, uint64_t offset, uint8_t* dest, size_t size,
+                    PHYSFS_Io** base, PHYSFS_Io** overlay) {
+  if (entry->data_ptr != 0) {
+    memcpy(dest, (const uint8_t*)entry->data_ptr + offset, size);
+    return true;
+  }
+
+  PHYSFS_Io** stream = entry->overlay ? overlay : base;
+  if (*stream == NULL) {
+    if (entry->overlay) {
+      *stream = (ctx->overlay_io != NULL) ? ctx->overlay_io->duplicate(ctx->overlay_io) : NULL;
+    }
+    else {
+      *stream = SARC_openStream(ctx);
+    }
+    if (*stream == NULL) {
+      return false;
+    }
+  }
+  // Entries are usually read in order, so this is where the last one ended
+  PHYSFS_uint64 pos = entry->startPos + offset;
+  if ((*stream)->tell(*stream) != (PHYSFS_sint64)pos && !(*stream)->seek(*stream, pos)) {
+    return false;
+  }
+  return (*stream)->read(*stream, dest, size) == (PHYSFS_sint64)size;
+} /* SARC_readEntry */
+
+static int source_rank(const SARCentry* entry) {
+  if (entry->data_ptr != 0) {
+    return 2;
+  }
+  return entry->overlay ? 1 : 0;
+}
+
+int SARC_compareEntrySources(const SARCentry* left, const SARCentry* right) {
+  int left_rank = source_rank(left);
+  int right_rank = source_rank(right);
+  if (left_rank != right_rank) {
+    return left_rank - right_rank;
+  }
+  if (left->startPos != right->startPos) {
+    return (left->startPos < right->startPos) ? -1 : 1;
+  }
+  return 0;
+} /* SARC_compareEntrySources */
+
+// Free the buffers of every entry that was opened for writing.
+static void free_entry_buffers(__PHYSFS_DirTreeEntry* tree_entry) {
+  for (; tree_entry != NULL; tree_entry = tree_entry->sibling) {
+    SARCentry* entry = (SARCentry*)tree_entry;
+    if (tree_entry->isdir) {
+      free_entry_buffers(tree_entry->children);
+    }
+    else if (entry->data_ptr != 0) {
+      virtual_free((void*)entry->data_ptr, entry->reserved);
+      mem_budget_release(entry->reserved);
+      entry->data_ptr = 0;
+      entry->reserved = 0;
+    }
+  }
+}
 
 // TODO: Call SARC_flush() here.
 void SARC_closeArchive(void *opaque) {
   SARC_ctx *info = ((SARC_ctx *) opaque);
   if (info) {
+    registry_remove(info);
+    wait_unpinned(info);
+    profile_forget(info);
+    free_entry_buffers(info->tree.root);
+    allocator.Free(info->index);
     __PHYSFS_DirTreeDeinit(&info->tree);
 
+    if (info->overlay_io) {
+      info->overlay_io->destroy(info->overlay_io);
+    }
+    allocator.Free(info->overlay_filename);
+
     if (info->io) {
       info->io->destroy(info->io);
     }
 
+    allocator.Free(info->arc_filename);
     allocator.Free(info);
   } /* if */
 } /* SARC_closeArchive */
@@ -85,7 +466,58 @@ void SARC_abandonArchive(void *opaque) {
   } /* if */
 } /* SARC_abandonArchive */
 
+static int index_compare(const void* a, const void* b) {
+  return strcmp((*(SARCentry**)a)->tree.name, (*(SARCentry**)b)->tree.name);
+}
+
+static int index_search_compare(const void* key, const void* element) {
+  return strcmp((const char*)key, (*(SARCentry**)element)->tree.name);
+}
+
+static bool index_collect(__PHYSFS_DirTreeEntry* entry, SARCentry*** list, uint32_t* count, uint32_t* capacity) {
+  for (; entry != NULL; entry = entry->sibling) {
+    if (*count == *capacity) {
+      *capacity = MAX(*capacity * 2, 64);
+      SARCentry** new_list = allocator.Realloc(*list, sizeof(**list) * *capacity);
+      if (new_list == NULL) {
+        return false;
+      }
+      *list = new_list;
+    }
+    (*list)[(*count)++] = (SARCentry*)entry;
+    if (entry->isdir && !index_collect(entry->children, list, count, capacity)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Build the sorted index used for lock-free lookups.
+static void index_build(SARC_ctx* ctx) {
+  SARCentry** list = NULL;
+  uint32_t count = 0;
+  uint32_t capacity = 0;
+  if (!index_collect(ctx->tree.root->children, &list, &count, &capacity)) {
+    // We can live without it, lookups will just use the dir tree.
+    allocator.Free(list);
+    return;
+  }
+  qsort(list, count, sizeof(*list), index_compare);
+  ctx->index = list;
+  ctx->index_count = count;
+}
+
 SARCentry *findEntry(SARC_ctx* ctx, const char *path) {
+  if (ctx->index != NULL) {
+    // __PHYSFS_DirTreeFind() moves entries around in its hash chains on every
+    // lookup, so we avoid it whenever possible.
+    if (*path == '\0') {
+      return (SARCentry*) ctx->tree.root;
+    }
+    SARCentry** entry = bsearch(path, ctx->index, ctx->index_count, sizeof(*ctx->index), index_search_compare);
+    BAIL_IF(!entry, PHYSFS_ERR_NOT_FOUND, NULL);
+    return *entry;
+  }
   return (SARCentry *) __PHYSFS_DirTreeFind(&ctx->tree, path);
 } /* findEntry */
 
@@ -93,6 +525,7 @@ PHYSFS_Io *SARC_openRead(void *opaque, const char *name) {
   PHYSFS_Io *retval = NULL;
   SARC_ctx *info = (SARC_ctx *) opaque;
   SARC_file_ctx* file = NULL;
+  TRACE_BEGIN(span);
   SARCentry *entry = findEntry(info, name);
 
   BAIL_IF_ERRPASS(!entry, NULL);
@@ -103,17 +536,38 @@ PHYSFS_Io *SARC_openRead(void *opaque, const char *name) {
 
   file = (SARC_file_ctx *) allocator.Malloc(sizeof (SARC_file_ctx));
   GOTO_IF(!file, PHYSFS_ERR_OUT_OF_MEMORY, SARC_openRead_failed);
+  file->io = NULL;
 
-  if (info->is_zstd)
-      file->io = zstd_wrap_io(info->io->duplicate(info->io));
-  else
-      file->io = info->io->duplicate(info->io);
-  GOTO_IF_ERRPASS(!file->io, SARC_openRead_failed);
+  if (entry->overlay) {
+    // Edited entries come from the sidecar, which is never compressed
+    GOTO_IF(!info->overlay_io, PHYSFS_ERR_IO, SARC_openRead_failed);
+    file->io = info->overlay_io->duplicate(info->overlay_io);
+    GOTO_IF_ERRPASS(!file->io, SARC_openRead_failed);
+
+    if (!file->io->seek(file->io, entry->startPos)) {
+      goto SARC_openRead_failed;
+    }
+  }
+  else if (profile_replaying && (file->io = profile_take(info, entry)) != NULL) {
+    // Already read ahead by a profile replay
+  }
+  else if (info->pio != PIO_INVALID) {
+    // Reads go straight to the shared handle at an absolute offset.
+    file->io = NULL;
+  }
+  else {
+    file->io = SARC_openStream(info);
+    GOTO_IF_ERRPASS(!file->io, SARC_openRead_failed);
 
-  if (!file->io->seek(file->io, entry->startPos)) {
-    goto SARC_openRead_failed;
+    if (!file->io->seek(file->io, entry->startPos)) {
+      goto SARC_openRead_failed;
+    }
   }
 
+  SARC_STATS_ADD(&info->stats, files_opened, 1);
+  if (profile_recording) {
+    profile_record(info, entry);
+  }
   file->curPos = 0;
   file->entry = entry;
   
@@ -126,6 +580,7 @@ PHYSFS_Io *SARC_openRead(void *opaque, const char *name) {
   // Set SARC_Io as the I/O handler for this archiver
   memcpy(retval, &SARC_Io, sizeof (*retval));
   retval->opaque = file;
+  TRACE_END(span, "SARC_openRead", info->arc_filename, name);
   return retval;
 
 SARC_openRead_failed:
@@ -143,9 +598,16 @@ SARC_openRead_failed:
   return NULL;
 } /* SARC_openRead */
 
+typedef struct {
+  SARC_ctx* ctx;
+  PHYSFS_Io* stream; // Our own stream, so we don't move anyone else's cursor
+  const char* target; // In overlay mode, the file being opened for writing
+}copy_files_data;
+
 // Copy all file contents to newly allocated buffers
 PHYSFS_EnumerateCallbackResult callback_copy_files(void *data, const char *origdir, const char *fname) {
-  SARC_ctx* ctx = (SARC_ctx*)data;
+  copy_files_data* copy = (copy_files_data*)data;
+  SARC_ctx* ctx = copy->ctx;
   char* full_path = __PHYSFS_smallAlloc(strlen(origdir) + strlen(fname) + 2); // One for the slash and one for the null terminator.
   if (full_path == NULL) {
     return PHYSFS_ENUM_ERROR;
@@ -164,15 +626,41 @@ PHYSFS_EnumerateCallbackResult callback_copy_files(void *data, const char *origd
   if  (entry->tree.isdir){
     __PHYSFS_DirTreeEnumerate(&ctx->tree, full_path, callback_copy_files, full_path, data);
   }
-  else { // We've finally got a full filename.
-    // Store the file in a new buffer and store the pointer in the entry.
-    entry->data_ptr = (uint64_t) virtual_reserve(0x500000);
+  else if (entry->data_ptr == 0) { // We've finally got a full filename.
+    // The overlay only needs what's already in it, plus the file being
+    // written. Everything else stays in the base archive.
+    if (ctx->overlay_filename != NULL && !entry->overlay && strcmp(full_path, copy->target) != 0) {
+      __PHYSFS_smallFree(full_path);
+      return PHYSFS_ENUM_OK;
+    }
+
+    // Store the file in a new buffer and store the pointer in the entry. Writes
+    // will grow it as needed, so we just reserve what we have right now.
+    entry->reserved = virtual_page_align(MAX(entry->size, 1));
+    if (!mem_budget_acquire_buffer(entry->reserved)) {
+      LOG_MSG(error, "No room in the memory budget to edit %s\n", full_path);
+      entry->reserved = 0;
+      __PHYSFS_smallFree(full_path);
+      return PHYSFS_ENUM_ERROR;
+    }
+    uint32_t hints = VMEM_HINT_SEQUENTIAL | VMEM_HINT_POPULATE; // We're about to read into all of it
+    if (entry->reserved >= VMEM_HUGE_PAGE_SIZE) {
+      hints |= VMEM_HINT_HUGE_PAGES;
+    }
+    entry->data_ptr = (uintptr_t) virtual_reserve_hinted(entry->reserved, hints);
+    if (entry->data_ptr == 0) {
+      mem_budget_release(entry->reserved);
+      entry->reserved = 0;
+      __PHYSFS_smallFree(full_path);
+      return PHYSFS_ENUM_ERROR;
+    }
     virtual_commit((void*)entry->data_ptr, entry->size);
 
-    uint64_t pos = ctx->io->tell(ctx->io); // Save position
-    ctx->io->seek(ctx->io, entry->startPos);
-    ctx->io->read(ctx->io, (void*)entry->data_ptr, entry->size);
-    ctx->io->seek(ctx->io, pos); // Go back to saved position
+    PHYSFS_Io* source = entry->overlay ? ctx->overlay_io : copy->stream;
+    if (source != NULL) {
+      source->seek(source, entry->startPos);
+      source->read(source, (void*)entry->data_ptr, entry->size);
+    }
     LOG_MSG(debug, "%s\n", full_path);
   }
 
@@ -190,8 +678,16 @@ PHYSFS_Io* SARC_openWrite(void *opaque, const char *name) {
   }
 
   // Copy file data to their own buffers for more expansion
+  copy_files_data copy = {
+    .ctx = info,
+    .stream = SARC_openStream(info),
+    .target = name
+  };
   __PHYSFS_DirTree* tree = (__PHYSFS_DirTree *) &info->tree;
-  __PHYSFS_DirTreeEnumerate(tree, "", callback_copy_files, "", opaque);
+  __PHYSFS_DirTreeEnumerate(tree, "", callback_copy_files, "", &copy);
+  if (copy.stream != NULL) {
+    copy.stream->destroy(copy.stream);
+  }
 
   info->open_write_handles++;
 
@@ -204,10 +700,7 @@ PHYSFS_Io* SARC_openWrite(void *opaque, const char *name) {
     file_info->curPos = 0;
     file_info->entry = findEntry(info, name);
     if (!newFile) {
-        if (info->is_zstd)
-            file_info->io = zstd_wrap_io(info->io->duplicate(info->io));
-        else
-            file_info->io = info->io->duplicate(info->io);
+        file_info->io = SARC_openStream(info);
     }
     else {
         file_info->io = __PHYSFS_createMemoryIo((void*)file_info->entry->data_ptr, 0, NULL);
@@ -275,6 +768,11 @@ void* SARC_addEntry(void* opaque, const char* name, const int isdir,
   SARC_ctx* info = (SARC_ctx*) opaque;
   SARCentry* entry;
 
+  // The index can't see new entries, fall back to the dir tree from now on.
+  allocator.Free(info->index);
+  info->index = NULL;
+  info->index_count = 0;
+
   entry = (SARCentry*) __PHYSFS_DirTreeAdd(&info->tree, (char*)name, isdir);
   BAIL_IF_ERRPASS(!entry, NULL);
 
@@ -297,11 +795,24 @@ void* SARC_init_archive(PHYSFS_Io* io) {
   }
   info->io = io;
   info->open_write_handles = 0;
+  info->is_cached = 0;
+  info->is_pooled = 0;
+  info->arc_filename = NULL;
+  info->registry_next = NULL;
+  info->pins = 0;
+  info->index = NULL;
+  info->index_count = 0;
+  info->pio = PIO_INVALID;
+  info->hash_key = SFAT_HASH_KEY;
+  info->overlay_filename = NULL;
+  info->overlay_io = NULL;
+  memset(&info->stats, 0x00, sizeof(info->stats));
 
   return info;
 }
 
-bool SARC_loadEntries(PHYSFS_Io* io, uint32_t count, uint32_t files_offset, SARC_ctx* archive) {
+bool SARC_loadEntries(PHYSFS_Io* io, uint32_t count, uint32_t files_offset, SARC_ctx* archive, bool overlay) {
+  TRACE_BEGIN(span);
   uint32_t name_pos = sizeof(sarc_header) + sizeof(sarc_sfat_header);
   name_pos += (sizeof(sarc_sfat_node) * count) + sizeof(sarc_sfnt_header);
   uint32_t name_buf_size = files_offset - name_pos;
@@ -318,11 +829,25 @@ bool SARC_loadEntries(PHYSFS_Io* io, uint32_t count, uint32_t files_offset, SARC
   io->read(io, name_buffer, name_buf_size);
   io->seek(io, read_pos);
 
+  // Read the whole SFAT at once, every hash is needed to check the names.
+  // (One extra slot so empty archives don't allocate 0 bytes.)
+  sarc_sfat_node* nodes = allocator.Malloc(sizeof(sarc_sfat_node) * (count + 1));
+  const char** names = allocator.Malloc(sizeof(char*) * (count + 1));
+  uint32_t* hashes = allocator.Malloc(sizeof(uint32_t) * (count + 1));
+  if (nodes == NULL || names == NULL || hashes == NULL) {
+    allocator.Free(nodes);
+    allocator.Free(names);
+    allocator.Free(hashes);
+    allocator.Free(name_buffer);
+    PHYSFS_setErrorCode(PHYSFS_ERR_OUT_OF_MEMORY);
+    return false;
+  }
+  io->read(io, nodes, sizeof(sarc_sfat_node) * count);
+
   name_pos = 0; // Reset name position offset so we start reading from the first filename.
 
   for (uint32_t i = 0; i < count; i++) {
-    sarc_sfat_node node = {0};
-    io->read(io, &node, sizeof(node));
+    sarc_sfat_node node = nodes[i];
     uint32_t size = node.file_end_offset - node.file_start_offset;
 
     // Jump to the next 4-byte alignment boundary
@@ -333,54 +858,189 @@ bool SARC_loadEntries(PHYSFS_Io* io, uint32_t count, uint32_t files_offset, SARC
     uint32_t file_pos = node.file_start_offset + files_offset;
 
     char* name = name_buffer + name_pos;
-    SARC_addEntry(archive, name, 0, -1, -1, file_pos, size);
+    // Overlay entries land on top of the base's entries with the same name
+    SARCentry* entry = SARC_addEntry(archive, name, 0, -1, -1, file_pos, size);
+    if (entry != NULL) {
+      entry->overlay = overlay;
+    }
     name_pos += strlen(name) + 1;
+
+    names[i] = name;
+    hashes[i] = node.filename_hash;
+  }
+
+  // Games look files up by hash, so a mismatch means the archive is broken
+  // (or was written with a different key than the header says).
+  uint32_t mismatches = sarc_hash_verify(names, hashes, count, archive->hash_key);
+  if (mismatches > 0) {
+    LOG_MSG(warning, "%u of %u names in %s don't match their hashes (key 0x%x)\n",
+            mismatches, count, archive->arc_filename, archive->hash_key);
   }
+
+  allocator.Free(nodes);
+  allocator.Free(names);
+  allocator.Free(hashes);
   allocator.Free(name_buffer);
 
+  TRACE_END(span, "SARC_loadEntries", archive->arc_filename, NULL);
+  return true;
+}
+
+// Layer the entries of the archive's overlay sidecar over its own, and
+// remember where the sidecar goes so writes can create it.
+static void SARC_loadOverlay(SARC_ctx* archive) {
+  size_t len = strlen(archive->arc_filename) + strlen(SARC_OVERLAY_SUFFIX) + 1;
+  archive->overlay_filename = allocator.Malloc(len);
+  if (archive->overlay_filename == NULL) {
+    return;
+  }
+  snprintf(archive->overlay_filename, len, "%s%s", archive->arc_filename, SARC_OVERLAY_SUFFIX);
+
+  PHYSFS_Stat stat = {0};
+  if (!__PHYSFS_platformStat(archive->overlay_filename, &stat, 1)) {
+    return; // No edits yet
+  }
+  // Kept open, so edits can replace the sidecar under files still reading it
+  PHYSFS_Io* io = fd_pool_open_pinned(archive->overlay_filename);
+  if (io == NULL) {
+    LOG_MSG(warning, "Can't open overlay %s\n", archive->overlay_filename);
+    return;
+  }
+
+  sarc_header header = {0};
+  sarc_sfat_header sfat_header = {0};
+  io->read(io, &header, sizeof(header));
+  io->read(io, &sfat_header, sizeof(sfat_header));
+  if (header.magic != SARC_MAGIC || sfat_header.magic != SFAT_MAGIC) {
+    LOG_MSG(warning, "Ignoring overlay %s, it isn't a SARC\n", archive->overlay_filename);
+    io->destroy(io);
+    return;
+  }
+  archive->overlay_io = io;
+  SARC_loadEntries(io, sfat_header.node_count, header.data_offset, archive, true);
+  LOG_MSG(debug, "%u entries of %s come from its overlay\n", sfat_header.node_count, archive->arc_filename);
+}
+
+// Trade the file the archive was mounted from for one from the fd pool.
+// Archives inside other archives keep the Io they were mounted with, their
+// arc_filename isn't a real file (or at least not this one).
+static bool SARC_swapFile(SARC_ctx* archive, PHYSFS_Io* io) {
+  if (io == NULL) {
+    return false;
+  }
+  if (io->length(io) != archive->io->length(archive->io)) {
+    io->destroy(io);
+    return false;
+  }
+  archive->io->destroy(archive->io);
+  archive->io = io;
   return true;
 }
 
+// Everything that happens once an archive's entries are loaded
+static void SARC_finishMount(SARC_ctx* archive, int forWriting) {
+  if (overlay_writes) {
+    SARC_loadOverlay(archive);
+  }
+  index_build(archive);
+  if (pooled_files && !forWriting && !archive->is_cached) {
+    // Only holds a descriptor while it's being read
+    archive->is_pooled = SARC_swapFile(archive, fd_pool_open(archive->arc_filename));
+  }
+  // Pooled files already read at absolute offsets. Otherwise the archive's one
+  // descriptor is kept open, and reads go straight to it.
+  if (thread_safe_reads && !forWriting && !archive->is_zstd && !archive->is_cached && !archive->is_pooled) {
+    if (SARC_swapFile(archive, fd_pool_open_pinned(archive->arc_filename))) {
+      archive->pio = fd_pool_pinned_handle(archive->io);
+    }
+    else {
+      // Probably not a real file (archive inside another archive, etc.)
+      LOG_MSG(warning, "Can't use positional reads for %s\n", archive->arc_filename);
+    }
+  }
+  registry_add(archive);
+  SARC_STATS_ADD(NULL, archives_mounted, 1);
+}
+
 void* SARC_openArchive(PHYSFS_Io* _io, const char* name, int forWriting, int* claimed) {
   assert(_io != NULL); // Sanity check.
+  TRACE_BEGIN(span);
 
   PHYSFS_Io* io = _io;
   sarc_header header = {0};
-  int headerMatches;
+  int headerMatches = 0;
   int isZSTD = 0;
-  _io->read(io, &header, sizeof(header));
-  headerMatches = (header.magic == SARC_MAGIC);
-  if (header.magic == ZSTD_MAGICNUMBER) {
+
+  // Bail out as early as possible on files that aren't ours. We get tried on
+  // every extension that doesn't match, so this needs to be cheap.
+  sarc_format format = SARC_sniffFormat(_io);
+  if (!forWriting && format == SARC_FORMAT_NONE)
+      BAIL(PHYSFS_ERR_UNSUPPORTED, NULL);
+
+  _io->seek(io, 0);
+  if (format == SARC_FORMAT_ZSTD) {
       isZSTD = 1;
-      // Reset, enable ZSTD support, and try again.
-      _io->seek(io, 0);
       // We don't overwrite data at the pointer, but this new pointer will be
       // saved in the context (used to access the IO everywhere else)
       io = zstd_wrap_io(_io);
+      BAIL_IF_ERRPASS(!io, NULL);
+  }
+  if (format != SARC_FORMAT_NONE) {
       io->read(io, &header, sizeof(header));
       headerMatches = (header.magic == SARC_MAGIC);
   }
 
-  if (!forWriting && !headerMatches)
+  if (!forWriting && !headerMatches) {
+      // Some other zstd-compressed file
+      if (isZSTD)
+          io->destroy(io);
       BAIL(PHYSFS_ERR_UNSUPPORTED, NULL);
+  }
   if (!forWriting || headerMatches) {
       // Claim the archive, because it's probably a valid SARC
       *claimed = 1;
 
+      // Skip decompression entirely if another process has shared a copy, or
+      // there's one in the cache
+      PHYSFS_Io* cached = NULL;
+      if (isZSTD && !forWriting) {
+          cached = sarc_shm_open(name);
+          if (cached == NULL)
+              cached = sarc_cache_open(_io, name);
+      }
+      if (cached != NULL) {
+          io->destroy(io);
+          io = cached;
+          isZSTD = 0;
+          io->seek(io, sizeof(header));
+      }
+
       sarc_sfat_header sfat_header = { 0 };
       io->read(io, &sfat_header, sizeof(sfat_header));
 
-      SARC_ctx* archive = SARC_init_archive(_io);
+      SARC_ctx* archive = SARC_init_archive((cached != NULL) ? cached : _io);
+      if (archive == NULL && cached != NULL) {
+          cached->destroy(cached);
+      }
       BAIL_IF_ERRPASS(!archive, NULL);
 
       archive->arc_filename = allocator.Malloc(strlen(name) + 1);
       strcpy(archive->arc_filename, name);
       archive->is_zstd = isZSTD;
+      archive->is_cached = (cached != NULL);
+      archive->hash_key = sfat_header.hash_key;
 
-      SARC_loadEntries(io, sfat_header.node_count, header.data_offset, archive);
+      SARC_loadEntries(io, sfat_header.node_count, header.data_offset, archive, false);
+      SARC_finishMount(archive, forWriting);
 
       if (isZSTD)
           io->destroy(io);
+      if (cached != NULL) {
+          // The archive holds on to the cached copy, so we're done with the
+          // compressed file.
+          _io->destroy(_io);
+      }
+      TRACE_END(span, "SARC_openArchive", name, NULL);
       return archive;
   }
   else {
@@ -402,11 +1062,28 @@ void* SARC_openArchive(PHYSFS_Io* _io, const char* name, int forWriting, int* cl
       archive->arc_filename = allocator.Malloc(strlen(name) + 1);
       strcpy(archive->arc_filename, name);
       archive->is_zstd = isZSTD;
+      archive->hash_key = sfat_header.hash_key;
 
-      SARC_loadEntries(io, sfat_header.node_count, header.data_offset, archive);
+      SARC_loadEntries(io, sfat_header.node_count, header.data_offset, archive, false);
+      SARC_finishMount(archive, forWriting);
 
       if (isZSTD)
           io->destroy(io);
+      TRACE_END(span, "SARC_openArchive", name, NULL);
       return archive;
   }
 }
+
+static void compact_level_callback(SARC_ctx* ctx, void* data) {
+  // Keep the new base in the same format as the old one
+  *(int*)data = (ctx->is_zstd || ctx->is_cached) ? ZSTD_CLEVEL_DEFAULT : 0;
+}
+
+bool SARC_compactOverlay(const char* arc_filename, const char* out_path) {
+  int level = 0;
+  if (!SARC_withArchive(arc_filename, compact_level_callback, &level)) {
+    LOG_MSG(error, "%s isn't mounted\n", arc_filename);
+    return false;
+  }
+  return SARC_rebuildTo(arc_filename, out_path, level);
+} /* SARC_compactOverlay */
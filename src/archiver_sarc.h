@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <physfs.h>
 
@@ -19,6 +20,57 @@ int SARC_stat(void* opaque, const char* path, PHYSFS_Stat* stat);
 void* SARC_openArchive(PHYSFS_Io* io, const char* name, int forWriting, int* claimed);
 void* SARC_addEntry(void* opaque, const char* name, const int isdir, const PHYSFS_sint64 ctime, const PHYSFS_sint64 mtime, const PHYSFS_uint64 pos, const PHYSFS_uint64 len);
 
+typedef enum {
+  SARC_FORMAT_NONE, // Not something we can mount
+  SARC_FORMAT_RAW,  // Uncompressed SARC
+  SARC_FORMAT_ZSTD  // zstd stream, possibly preceded by skippable frames
+}sarc_format;
+
+// Identify an archive from its first bytes. Rejecting a file that isn't ours
+// costs a single small read, so the archiver can be tried on any extension.
+sarc_format SARC_sniffFormat(PHYSFS_Io* io);
+
+// Thread-safe read mode. Archives mounted while this is enabled can be read
+// from any number of threads at once:
+//  - Uncompressed archives are read with positional reads on one shared file
+//    handle, so open files don't duplicate the archive IO or share a cursor.
+//  - Archive metadata is immutable after mounting, so looking up entries
+//    doesn't need a lock.
+// Writing to an archive still isn't thread-safe, and adding entries to an
+// archive makes lookups go through PhysicsFS's dir tree again.
+void SARC_setThreadSafeReads(bool enable);
+
+// Overlay write mode. Archives mounted while this is enabled never have their
+// base file rewritten. Entries that are written go to a sidecar archive next to
+// it (the real path plus SARC_OVERLAY_SUFFIX), so an edit only costs the size
+// of what changed and the base can stay read-only or shared. The sidecar is
+// loaded on mount and its entries replace the base's.
+// A mount only sees the sidecar as it was when it was mounted, so remount
+// archives that were edited through another mount.
+void SARC_setOverlayWrites(bool enable);
+
+#define SARC_OVERLAY_SUFFIX ".overlay"
+
+// Limit on the archive files kept open at once (FD_POOL_DEFAULT_LIMIT unless
+// this is called). Mounted archives that are real files go through a shared
+// pool of descriptors instead of holding their own for as long as they're
+// mounted. Overlays keep theirs. Idle ones are closed least recently used first and
+// reopened when they're read again, so the number of archives that can be
+// mounted is only limited by memory. Files opened inside an archive share its
+// descriptor instead of duplicating it.
+// 0 turns the pool off for archives mounted after this: each keeps its file
+// open, and every open file in it opens the archive again.
+void SARC_setOpenFileLimit(uint32_t limit);
+
+// Fold a mounted archive's overlay into a new base archive at out_path, a real
+// path that isn't the archive itself. The sidecar is left alone, the caller
+// decides when to swap the files.
+bool SARC_compactOverlay(const char* arc_filename, const char* out_path);
+
+// Check if a path ends in one of the extensions used by SARC-family archives
+// (.sarc, .pack, .bars, .blarc, etc. and their .zs variants).
+bool SARC_hasArchiveExtension(const char* path);
+
 // Archiver structs to register
 #ifdef __cplusplus
 extern "C" {
@@ -3,14 +3,19 @@
 #define __PHYSICSFS_INTERNAL__
 #include <physfs_internal.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "pio.h"
+#include "sarc_stats.h"
+
 typedef struct {
     __PHYSFS_DirTreeEntry tree;
     PHYSFS_uint64 startPos;
     PHYSFS_uint64 size;
     PHYSFS_uint64 reserved;
     uintptr_t data_ptr; // Files open for write will store a pointer here instead of an offset.
+    uint8_t overlay; // startPos is in the overlay sidecar, not the base archive
 }SARCentry;
 
 // Archiver context for each SARC archive
@@ -20,6 +25,30 @@ typedef struct {
     uint32_t open_write_handles; // The number of write handles currently open to this archive
     char* arc_filename;
     int is_zstd;
+    int is_cached; // A zstd archive served from its decompressed copy in the cache
+    int is_pooled; // io is from fd_pool.c, and only holds a descriptor while it's read
+    uint32_t hash_key; // Multiplier for name hashes, from the SFAT header
+    void* registry_next; // Next archive in the same registry bucket
+    uint32_t pins; // Threads using it outside the registry lock (see SARC_pinArchive())
+
+    // Every entry sorted by name. This is never modified after mounting, so
+    // lookups through it don't need a lock. It's thrown away if entries are
+    // added, and findEntry() falls back to the dir tree.
+    SARCentry** index;
+    uint32_t index_count;
+
+    // Shared handle for positional reads of uncompressed archives, when
+    // thread-safe reads are enabled. PIO_INVALID otherwise. It belongs to io
+    // (see fd_pool_pinned_handle()), so the archive holds one descriptor.
+    pio_handle pio;
+
+    // Overlay mode: edits go to this sidecar archive and the base is never
+    // written. Both are NULL when overlay writes are off, and overlay_io is
+    // NULL until the sidecar exists.
+    char* overlay_filename;
+    PHYSFS_Io* overlay_io;
+
+    sarc_stats stats; // Counters for this archive only
 }SARC_ctx;
 
 // Context for each IO stream (file inside a SARC)
@@ -33,3 +62,81 @@ typedef struct {
 
 SARCentry *findEntry(SARC_ctx* ctx, const char *path);
 
+// Find the context of a mounted archive from its real path (the same string
+// returned by PHYSFS_getRealDir()).
+SARC_ctx* SARC_findArchive(const char* arc_filename);
+
+// Call a function for every mounted archive. The registry is locked the whole
+// time, so the callback must not mount or unmount anything.
+void SARC_forEachArchive(void (*callback)(SARC_ctx* ctx, void* data), void* data);
+
+// Like SARC_findArchive(), but calls a function with the archive while the
+// registry is still locked, so it can't be unmounted in the meantime. Returns
+// false (without calling it) if the archive isn't mounted.
+bool SARC_withArchive(const char* arc_filename, void (*callback)(SARC_ctx* ctx, void* data), void* data);
+
+// Like SARC_findArchive(), but the archive stays mounted until it's passed to
+// SARC_unpinArchive(): unmounting it waits until then. PhysicsFS unmounts with
+// its state lock held, so don't call into PhysicsFS while holding a pin.
+// Returns NULL if the archive isn't mounted.
+SARC_ctx* SARC_pinArchive(const char* arc_filename);
+// Pin an archive from inside a SARC_forEachArchive() or SARC_withArchive()
+// callback, to keep using it after the walk.
+void SARC_pinArchiveLocked(SARC_ctx* ctx);
+void SARC_unpinArchive(SARC_ctx* ctx);
+
+// Open a new stream over the whole (decompressed) archive. Each stream has its
+// own position and decompressor, so they can be used independently. It never
+// waits for room in the memory budget, since PhysicsFS calls us with its state
+// lock held.
+PHYSFS_Io* SARC_openStream(SARC_ctx* ctx);
+
+// Same as SARC_openStream(), but waits for room in the memory budget under
+// SARC_MEMORY_WAIT. Only for threads that aren't inside a PhysicsFS call and
+// don't hold other streams.
+PHYSFS_Io* SARC_openStreamWaiting(SARC_ctx* ctx);
+
+// Copy part of an entry from wherever it's stored: its write buffer, the
+// overlay or the base archive. The streams start out NULL, are opened the
+// first time they're needed, and are kept for the entries after. Destroy
+// whichever were opened when done.
+bool SARC_readEntry(SARC_ctx* ctx, const SARCentry* entry, uint64_t offset, uint8_t* dest, size_t size,
+                    PHYSFS_Io** base, PHYSFS_Io** overlay);
+
+// The order to read many entries in with SARC_readEntry(): base entries as
+// they're stored, so a zstd archive is decompressed once front to back, then
+// the overlay, then entries held in memory.
+int SARC_compareEntrySources(const SARCentry* left, const SARCentry* right);
+
+// Open a real file read-only, through the fd pool unless it's turned off with
+// SARC_setOpenFileLimit(0).
+PHYSFS_Io* SARC_openFile(const char* path);
+
+// Write a complete SARC to io from the entries' write buffers. With
+// overlay_only, only edited entries are written, and they're repointed at the
+// new file.
+bool SARC_writeArchive(SARC_ctx* ctx, PHYSFS_Io* io, bool overlay_only);
+
+// Names of every file entry (or only the edited ones), NULL-terminated. Free
+// the list, but not the names, which belong to the dir tree.
+char** get_file_list(__PHYSFS_DirTreeEntry* entry, bool overlay_only);
+
+// Resolve a virtual path to the archive and entry that PhysicsFS would serve
+// it from. Returns NULL if the file doesn't come from a SARC archive.
+SARCentry* SARC_resolvePath(const char* path, SARC_ctx** ctx_out);
+
+// Startup profiles (sarc_profile.h). The flags are checked before calling the
+// functions, so opens cost a branch when profiles aren't used.
+extern volatile bool profile_recording;
+extern volatile bool profile_replaying;
+
+// Record an open, if it's the first of that file.
+void profile_record(SARC_ctx* ctx, SARCentry* entry);
+
+// Get a stream over an entry the replay has read ahead, positioned at its
+// start. It's handed over to the caller, so the next open of the same entry
+// reads it normally. NULL if the replay doesn't have it.
+PHYSFS_Io* profile_take(SARC_ctx* ctx, SARCentry* entry);
+
+// Drop whatever the replay read ahead from an archive that's being closed.
+void profile_forget(SARC_ctx* ctx);
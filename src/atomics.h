@@ -0,0 +1,41 @@
+#pragma once
+// Minimal atomic operations for counters and flags shared between threads.
+// We're on C99, so there's no <stdatomic.h>, but every compiler we care about
+// has builtins for this.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+// Add to a 64-bit value, returning the old value.
+#define ATOMIC_ADD64(ptr, val) ((uint64_t)_InterlockedExchangeAdd64((volatile long long*)(ptr), (long long)(val)))
+// Read a 64-bit value that other threads may be writing.
+#define ATOMIC_LOAD64(ptr) ((uint64_t)_InterlockedOr64((volatile long long*)(ptr), 0))
+// Overwrite a 64-bit value that other threads may be reading.
+#define ATOMIC_STORE64(ptr, val) ((void)_InterlockedExchange64((volatile long long*)(ptr), (long long)(val)))
+// Interlocked operations are full barriers, so these are the same as above.
+#define ATOMIC_LOAD64_ACQUIRE(ptr) ATOMIC_LOAD64(ptr)
+#define ATOMIC_STORE64_RELEASE(ptr, val) ATOMIC_STORE64(ptr, val)
+#define ATOMIC_ADD64_ACQ_REL(ptr, val) ATOMIC_ADD64(ptr, val)
+
+static __inline bool atomic_cas64(volatile uint64_t* ptr, uint64_t* expected, uint64_t desired) {
+  uint64_t prev = (uint64_t)_InterlockedCompareExchange64((volatile long long*)ptr, (long long)desired, (long long)*expected);
+  if (prev == *expected) {
+    return true;
+  }
+  *expected = prev;
+  return false;
+}
+// Replace *ptr with desired if it still holds *expected. On failure, *expected
+// is updated to the current value.
+#define ATOMIC_CAS64(ptr, expected, desired) atomic_cas64((ptr), (expected), (desired))
+#else
+#define ATOMIC_ADD64(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD64(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_STORE64(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD64_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE64_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_ADD64_ACQ_REL(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS64(ptr, expected, desired) __atomic_compare_exchange_n((ptr), (expected), (desired), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#endif
@@ -0,0 +1,708 @@
+// Self-contained benchmark for the SARC archiver. It generates synthetic
+// archives (so no game data is needed), then measures mounting, lookups,
+// reads, seeks and rebuilds, and writes the results as JSON.
+//
+// Usage: sarc_archiver_bench [options]
+//   --archives N      Number of archives to generate (default 16)
+//   --entries N       Entries per archive (default 1000)
+//   --min-size N      Smallest entry size in bytes (default 256)
+//   --max-size N      Largest entry size in bytes (default 65536)
+//   --distribution D  fixed, uniform or skewed (default skewed, mostly small
+//                     files with a long tail of big ones)
+//   --level N         zstd compression level, 0 for uncompressed SARCs (default 3)
+//   --dict            Train a dictionary and compress with it
+//   --lookups N       Number of random lookups (default 100000)
+//   --seeks N         Number of random seeks (default 10000)
+//   --seed N          Random seed (default 1)
+//   --out PATH        Where to write results, "-" for stdout (default bench_results.json)
+//   --trace PATH      Also write a Chrome trace (needs SARC_ARCHIVER_TRACING)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+#include <zdict.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "archiver_sarc.h"
+#include "sarc.h"
+#include "sarc_batch.h"
+#include "sarc_image.h"
+#include "sarc_stats.h"
+#include "threads.h"
+#include "trace.h"
+#include "zstd_io.h"
+#include "logging.h"
+#include "int.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define BENCH_DIR "sarc_bench"
+#define BENCH_DICT "bench.zsdic"
+#define BENCH_REBUILD_ARCHIVE "bench_rebuild.sarc"
+#define BENCH_DATA_ALIGNMENT 8
+
+typedef enum {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_SKEWED
+}size_distribution;
+
+typedef struct {
+    u32 archives;
+    u32 entries;
+    u32 min_size;
+    u32 max_size;
+    size_distribution distribution;
+    s32 level;
+    bool dict;
+    u32 lookups;
+    u32 seeks;
+    u64 seed;
+    const char* out_path;
+    const char* trace_path;
+}bench_config;
+
+typedef struct {
+    char name[64];
+    u32 hash;
+    u8* data;
+    u32 size;
+}bench_file;
+
+typedef struct {
+    double generate_ms;
+    u64 bytes_uncompressed;
+    u64 bytes_compressed;
+    double mount_ms;
+    double lookup_ns;
+    double seq_read_mbps;
+    double batch_read_mbps;
+    double rand_read_mbps;
+    double seek_us;
+    double rebuild_ms;
+    u64 peak_rss_kb;
+}bench_results;
+
+// Timing & memory helpers
+
+static double ns_to_ms(u64 ns) {
+    return (double)ns / 1e6;
+}
+
+static double mb_per_sec(u64 bytes, u64 ns) {
+    if (ns == 0) {
+        return 0;
+    }
+    return ((double)bytes / (1024.0 * 1024.0)) / ((double)ns / 1e9);
+}
+
+static u64 bench_peak_rss_kb(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = {0};
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// xorshift64*, so results are reproducible across platforms for a given seed
+static u64 rng_state = 1;
+
+static u64 rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static double rng_unit(void) {
+    return (double)(rng_next() >> 11) / (double)(1ull << 53);
+}
+
+static u32 rng_range(u32 max) {
+    return (u32)(rng_next() % max);
+}
+
+// Synthetic data generation
+
+static u32 pick_size(const bench_config* config) {
+    double u = rng_unit();
+    switch (config->distribution) {
+        case DIST_FIXED:
+            return config->max_size;
+        case DIST_UNIFORM:
+            return config->min_size + (u32)(u * (config->max_size - config->min_size));
+        case DIST_SKEWED:
+        default:
+            // Most game files are small, with a few huge ones.
+            return config->min_size + (u32)(u * u * u * u * (config->max_size - config->min_size));
+    }
+}
+
+// Fill a buffer with something that compresses roughly like real game data:
+// mostly repeated structures with some noise mixed in.
+static void fill_data(u8* data, u32 size) {
+    static const char* words[] = {
+        "Actor", "Component", "Param", "Armor", "Weapon", "Enemy", "Model",
+        "Texture", "Shader", "Physics", "Bone", "Anim", "Sound", "Effect",
+        "Name", "Value", "Position", "Rotation", "Scale", "Flag", "Table",
+    };
+    u32 pos = 0;
+    while (pos < size) {
+        if (rng_range(8) == 0) {
+            // Noise, like packed floats or hashes
+            u64 noise = rng_next();
+            u32 len = MIN(size - pos, (u32)sizeof(noise));
+            memcpy(&data[pos], &noise, len);
+            pos += len;
+        }
+        else {
+            const char* word = words[rng_range(ARRAY_SIZE(words))];
+            u32 len = MIN(size - pos, (u32)strlen(word));
+            memcpy(&data[pos], word, len);
+            pos += len;
+        }
+    }
+}
+
+static int bench_file_compare(const void* a, const void* b) {
+    const bench_file* file_a = (const bench_file*)a;
+    const bench_file* file_b = (const bench_file*)b;
+    if (file_a->hash == file_b->hash) {
+        return 0;
+    }
+    return (file_a->hash < file_b->hash) ? -1 : 1;
+}
+
+// Lay out a SARC image in memory. Files are sorted by hash, like the real
+// thing. Returns NULL on allocation failure.
+static u8* build_sarc(bench_file* files, u32 count, u32* size_out) {
+    qsort(files, count, sizeof(*files), bench_file_compare);
+
+    sarc_image_node* nodes = allocator.Malloc(sizeof(*nodes) * (count + 1));
+    if (nodes == NULL) {
+        return NULL;
+    }
+    u32 data_size = 0;
+    for (u32 i = 0; i < count; i++) {
+        data_size = ALIGN_UP(data_size, BENCH_DATA_ALIGNMENT);
+        nodes[i] = (sarc_image_node) {
+            .name = files[i].name,
+            .hash = files[i].hash,
+            .data_start = data_size,
+            .size = files[i].size
+        };
+        data_size += files[i].size;
+    }
+    u32 data_offset = ALIGN_UP(sarc_image_meta_size(nodes, count), BENCH_DATA_ALIGNMENT);
+
+    u32 size = data_offset + data_size;
+    u8* sarc = allocator.Malloc(size);
+    if (sarc != NULL) {
+        memset(sarc, 0, size);
+        sarc_image_write_meta(sarc, nodes, count, SFAT_HASH_KEY, data_offset, size);
+        for (u32 i = 0; i < count; i++) {
+            memcpy(sarc + data_offset + nodes[i].data_start, files[i].data, files[i].size);
+        }
+    }
+    allocator.Free(nodes);
+
+    *size_out = size;
+    return sarc;
+}
+
+static bool write_file(const char* path, const void* data, u64 size) {
+    PHYSFS_File* file = PHYSFS_openWrite(path);
+    if (file == NULL) {
+        LOG_MSG(error, "Failed to open %s for writing: %s\n", path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        return false;
+    }
+    bool success = (PHYSFS_writeBytes(file, data, size) == (PHYSFS_sint64)size);
+    PHYSFS_close(file);
+    return success;
+}
+
+static void archive_name(char* out, u32 idx, const bench_config* config) {
+    sprintf(out, "bench_%03u.%s", idx, (config->level > 0) ? "pack.zs" : "sarc");
+}
+
+// Generate all the archives into the write dir. The first archive is also
+// written uncompressed, for the rebuild benchmark.
+static bool generate_archives(const bench_config* config, bench_results* results) {
+    bench_file* files = allocator.Malloc(sizeof(*files) * config->entries);
+    if (files == NULL) {
+        return false;
+    }
+    memset(files, 0, sizeof(*files) * config->entries);
+    bool success = true;
+    ZSTD_CCtx* cctx = NULL;
+    ZSTD_CDict* cdict = NULL;
+    for (u32 i = 0; i < config->entries; i++) {
+        files[i].data = allocator.Malloc(config->max_size);
+        if (files[i].data == NULL) {
+            success = false;
+            goto generate_done;
+        }
+    }
+
+    cctx = ZSTD_createCCtx();
+    if (cctx == NULL) {
+        success = false;
+        goto generate_done;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, config->level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+
+    for (u32 arc = 0; arc < config->archives && success; arc++) {
+        for (u32 i = 0; i < config->entries; i++) {
+            sprintf(files[i].name, "Arc%03u/Dir%02u/File%06u.bin", arc, i % 32, i);
+            files[i].hash = sarc_filename_hash(files[i].name, strlen(files[i].name), SFAT_HASH_KEY);
+            files[i].size = pick_size(config);
+            fill_data(files[i].data, files[i].size);
+            results->bytes_uncompressed += files[i].size;
+        }
+
+        u32 sarc_size = 0;
+        u8* sarc = build_sarc(files, config->entries, &sarc_size);
+        if (sarc == NULL) {
+            success = false;
+            break;
+        }
+
+        if (arc == 0) {
+            success &= write_file(BENCH_REBUILD_ARCHIVE, sarc, sarc_size);
+            if (config->dict && config->level > 0) {
+                // Train on the first archive's entries, like a game would ship
+                // one dictionary trained on a sample of its content.
+                size_t* sample_sizes = allocator.Malloc(sizeof(size_t) * config->entries);
+                u8* samples = allocator.Malloc(sarc_size);
+                size_t dict_capacity = 112640;
+                u8* dict = allocator.Malloc(dict_capacity);
+                size_t sample_total = 0;
+                if (sample_sizes == NULL || samples == NULL || dict == NULL) {
+                    success = false;
+                }
+                else {
+                    for (u32 i = 0; i < config->entries; i++) {
+                        memcpy(samples + sample_total, files[i].data, files[i].size);
+                        sample_sizes[i] = files[i].size;
+                        sample_total += files[i].size;
+                    }
+                    size_t dict_size = ZDICT_trainFromBuffer(dict, dict_capacity, samples, sample_sizes, config->entries);
+                    if (ZDICT_isError(dict_size)) {
+                        LOG_MSG(warning, "Dictionary training failed: %s\n", ZDICT_getErrorName(dict_size));
+                    }
+                    else {
+                        success &= write_file(BENCH_DICT, dict, dict_size);
+                        cdict = ZSTD_createCDict(dict, dict_size, config->level);
+                        ZSTD_CCtx_refCDict(cctx, cdict);
+                    }
+                }
+                allocator.Free(dict);
+                allocator.Free(samples);
+                allocator.Free(sample_sizes);
+            }
+        }
+
+        char name[64] = {0};
+        archive_name(name, arc, config);
+        if (config->level > 0) {
+            size_t capacity = ZSTD_compressBound(sarc_size);
+            u8* compressed = allocator.Malloc(capacity);
+            size_t compressed_size = 0;
+            if (compressed == NULL) {
+                success = false;
+            }
+            else if (ZSTD_isError(compressed_size = ZSTD_compress2(cctx, compressed, capacity, sarc, sarc_size))) {
+                LOG_MSG(error, "Compression failed: %s\n", ZSTD_getErrorName(compressed_size));
+                success = false;
+            }
+            else {
+                success &= write_file(name, compressed, compressed_size);
+                results->bytes_compressed += compressed_size;
+            }
+            allocator.Free(compressed);
+        }
+        else {
+            success &= write_file(name, sarc, sarc_size);
+            results->bytes_compressed += sarc_size;
+        }
+        allocator.Free(sarc);
+    }
+
+generate_done:
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeCCtx(cctx);
+    for (u32 i = 0; i < config->entries; i++) {
+        allocator.Free(files[i].data);
+    }
+    allocator.Free(files);
+    return success;
+}
+
+// The benchmarks themselves
+
+static void entry_path(char* out, u32 arc, u32 idx) {
+    sprintf(out, "Arc%03u/Dir%02u/File%06u.bin", arc, idx % 32, idx);
+}
+
+static bool bench_mount(const char* work_dir, const bench_config* config, bench_results* results) {
+    u64 start = thread_now_ns();
+    for (u32 arc = 0; arc < config->archives; arc++) {
+        char name[64] = {0};
+        char path[1024] = {0};
+        archive_name(name, arc, config);
+        sprintf(path, "%s%s", work_dir, name);
+        if (!PHYSFS_mount(path, "/", 1)) {
+            LOG_MSG(error, "Failed to mount %s: %s\n", path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+            return false;
+        }
+    }
+    results->mount_ms = ns_to_ms(thread_now_ns() - start);
+    return true;
+}
+
+static void bench_lookup(const bench_config* config, bench_results* results) {
+    char path[64] = {0};
+    u32 found = 0;
+    u64 start = thread_now_ns();
+    for (u32 i = 0; i < config->lookups; i++) {
+        entry_path(path, rng_range(config->archives), rng_range(config->entries));
+        found += PHYSFS_exists(path);
+    }
+    u64 elapsed = thread_now_ns() - start;
+    if (found != config->lookups) {
+        LOG_MSG(warning, "Only found %u of %u files\n", found, config->lookups);
+    }
+    results->lookup_ns = (double)elapsed / MAX(config->lookups, 1);
+}
+
+// Read every file once, in the given order. Returns bytes read.
+static u64 read_files(const bench_config* config, const u32* order, u8* buf) {
+    char path[64] = {0};
+    u64 total = 0;
+    for (u32 i = 0; i < config->archives * config->entries; i++) {
+        entry_path(path, order[i] / config->entries, order[i] % config->entries);
+        PHYSFS_File* file = PHYSFS_openRead(path);
+        if (file == NULL) {
+            continue;
+        }
+        PHYSFS_sint64 rc = PHYSFS_readBytes(file, buf, config->max_size);
+        total += MAX(rc, 0);
+        PHYSFS_close(file);
+    }
+    return total;
+}
+
+static void bench_reads(const bench_config* config, bench_results* results) {
+    u32 count = config->archives * config->entries;
+    u32* order = allocator.Malloc(sizeof(u32) * count);
+    u8* buf = allocator.Malloc(config->max_size);
+    for (u32 i = 0; i < count; i++) {
+        order[i] = i;
+    }
+
+    u64 start = thread_now_ns();
+    u64 bytes = read_files(config, order, buf);
+    results->seq_read_mbps = mb_per_sec(bytes, thread_now_ns() - start);
+
+    // Fisher-Yates shuffle for random order
+    for (u32 i = count - 1; i > 0; i--) {
+        u32 j = rng_range(i + 1);
+        u32 tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    start = thread_now_ns();
+    bytes = read_files(config, order, buf);
+    results->rand_read_mbps = mb_per_sec(bytes, thread_now_ns() - start);
+
+    // Same files through the batch API, one archive at a time
+    sarc_batch_request* requests = allocator.Malloc(sizeof(*requests) * config->entries);
+    if (requests != NULL) {
+        memset(requests, 0, sizeof(*requests) * config->entries);
+    }
+    u8* batch_buf = allocator.Malloc((u64)config->entries * config->max_size);
+    char* paths = allocator.Malloc((u64)config->entries * 64);
+    bytes = 0;
+    start = thread_now_ns();
+    for (u32 arc = 0; arc < config->archives && requests && batch_buf && paths; arc++) {
+        for (u32 i = 0; i < config->entries; i++) {
+            entry_path(&paths[i * 64], arc, i);
+            requests[i].path = &paths[i * 64];
+            requests[i].dest = batch_buf + ((u64)i * config->max_size);
+            requests[i].dest_size = config->max_size;
+        }
+        SARC_readBatch(requests, config->entries, NULL, NULL);
+        for (u32 i = 0; i < config->entries; i++) {
+            bytes += MAX(requests[i].result, 0);
+        }
+    }
+    results->batch_read_mbps = mb_per_sec(bytes, thread_now_ns() - start);
+
+    allocator.Free(paths);
+    allocator.Free(batch_buf);
+    allocator.Free(requests);
+    allocator.Free(buf);
+    allocator.Free(order);
+}
+
+// Random seeks + small reads inside the biggest file of the first archive
+static void bench_seek(const bench_config* config, bench_results* results) {
+    char path[64] = {0};
+    PHYSFS_File* file = NULL;
+    PHYSFS_sint64 best_length = 0;
+    for (u32 i = 0; i < config->entries; i++) {
+        entry_path(path, 0, i);
+        PHYSFS_File* candidate = PHYSFS_openRead(path);
+        if (candidate == NULL) {
+            continue;
+        }
+        PHYSFS_sint64 length = PHYSFS_fileLength(candidate);
+        if (length > best_length) {
+            if (file != NULL) {
+                PHYSFS_close(file);
+            }
+            file = candidate;
+            best_length = length;
+        }
+        else {
+            PHYSFS_close(candidate);
+        }
+    }
+    if (file == NULL) {
+        results->seek_us = -1;
+        return;
+    }
+
+    u8 buf[256];
+    u64 start = thread_now_ns();
+    for (u32 i = 0; i < config->seeks; i++) {
+        PHYSFS_uint64 pos = rng_next() % (PHYSFS_uint64)MAX(best_length - (PHYSFS_sint64)sizeof(buf), 1);
+        PHYSFS_seek(file, pos);
+        PHYSFS_readBytes(file, buf, sizeof(buf));
+    }
+    results->seek_us = (double)(thread_now_ns() - start) / 1000.0 / MAX(config->seeks, 1);
+    PHYSFS_close(file);
+}
+
+// Modify one file in an uncompressed archive, which rebuilds the whole thing
+// when the write handle is closed.
+static void bench_rebuild(const char* work_dir, const bench_config* config, bench_results* results) {
+    char arc_path[1024] = {0};
+    sprintf(arc_path, "%s%s", work_dir, BENCH_REBUILD_ARCHIVE);
+    const char* old_write_dir_temp = PHYSFS_getWriteDir();
+    char* old_write_dir = allocator.Malloc(strlen(old_write_dir_temp) + 1);
+    strcpy(old_write_dir, old_write_dir_temp);
+
+    results->rebuild_ms = -1;
+    char path[64] = {0};
+    entry_path(path, 0, 0);
+    u8 data[256];
+    fill_data(data, sizeof(data));
+
+    u64 start = thread_now_ns();
+    if (PHYSFS_setWriteDir(arc_path)) {
+        PHYSFS_File* file = PHYSFS_openWrite(path);
+        if (file != NULL) {
+            PHYSFS_writeBytes(file, data, sizeof(data));
+            PHYSFS_close(file);
+            results->rebuild_ms = ns_to_ms(thread_now_ns() - start);
+        }
+    }
+    if (results->rebuild_ms < 0) {
+        LOG_MSG(warning, "Rebuild failed: %s\n", PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+    }
+
+    PHYSFS_setWriteDir(old_write_dir);
+    allocator.Free(old_write_dir);
+}
+
+static const char* distribution_name(size_distribution distribution) {
+    switch (distribution) {
+        case DIST_FIXED: return "fixed";
+        case DIST_UNIFORM: return "uniform";
+        case DIST_SKEWED:
+        default: return "skewed";
+    }
+}
+
+static void write_results(FILE* out, const bench_config* config, const bench_results* results) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"archives\": %u,\n", config->archives);
+    fprintf(out, "    \"entries\": %u,\n", config->entries);
+    fprintf(out, "    \"min_size\": %u,\n", config->min_size);
+    fprintf(out, "    \"max_size\": %u,\n", config->max_size);
+    fprintf(out, "    \"distribution\": \"%s\",\n", distribution_name(config->distribution));
+    fprintf(out, "    \"level\": %d,\n", config->level);
+    fprintf(out, "    \"dict\": %s,\n", config->dict ? "true" : "false");
+    fprintf(out, "    \"seed\": %llu\n", (unsigned long long)config->seed);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"results\": {\n");
+    fprintf(out, "    \"generate_ms\": %.3f,\n", results->generate_ms);
+    fprintf(out, "    \"bytes_uncompressed\": %llu,\n", (unsigned long long)results->bytes_uncompressed);
+    fprintf(out, "    \"bytes_compressed\": %llu,\n", (unsigned long long)results->bytes_compressed);
+    fprintf(out, "    \"mount_ms\": %.3f,\n", results->mount_ms);
+    fprintf(out, "    \"lookup_ns\": %.1f,\n", results->lookup_ns);
+    fprintf(out, "    \"seq_read_mbps\": %.2f,\n", results->seq_read_mbps);
+    fprintf(out, "    \"rand_read_mbps\": %.2f,\n", results->rand_read_mbps);
+    fprintf(out, "    \"batch_read_mbps\": %.2f,\n", results->batch_read_mbps);
+    fprintf(out, "    \"seek_us\": %.3f,\n", results->seek_us);
+    fprintf(out, "    \"rebuild_ms\": %.3f,\n", results->rebuild_ms);
+    fprintf(out, "    \"peak_rss_kb\": %llu\n", (unsigned long long)results->peak_rss_kb);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"counters\": ");
+    sarc_stats_write_json(out, &sarc_global_stats);
+    fprintf(out, "\n");
+    fprintf(out, "}\n");
+}
+
+static bool parse_args(int argc, char** argv, bench_config* config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--dict") == 0) {
+            config->dict = true;
+            continue;
+        }
+        if (value == NULL) {
+            LOG_MSG(error, "Missing value for %s\n", arg);
+            return false;
+        }
+        i++;
+        if (strcmp(arg, "--archives") == 0) config->archives = strtoul(value, NULL, 0);
+        else if (strcmp(arg, "--entries") == 0) config->entries = strtoul(value, NULL, 0);
+        else if (strcmp(arg, "--min-size") == 0) config->min_size = strtoul(value, NULL, 0);
+        else if (strcmp(arg, "--max-size") == 0) config->max_size = strtoul(value, NULL, 0);
+        else if (strcmp(arg, "--level") == 0) config->level = strtol(value, NULL, 0);
+        else if (strcmp(arg, "--lookups") == 0) config->lookups = strtoul(value, NULL, 0);
+        else if (strcmp(arg, "--seeks") == 0) config->seeks = strtoul(value, NULL, 0);
+        else if (strcmp(arg, "--seed") == 0) config->seed = strtoull(value, NULL, 0);
+        else if (strcmp(arg, "--out") == 0) config->out_path = value;
+        else if (strcmp(arg, "--trace") == 0) config->trace_path = value;
+        else if (strcmp(arg, "--distribution") == 0) {
+            if (strcmp(value, "fixed") == 0) config->distribution = DIST_FIXED;
+            else if (strcmp(value, "uniform") == 0) config->distribution = DIST_UNIFORM;
+            else if (strcmp(value, "skewed") == 0) config->distribution = DIST_SKEWED;
+            else {
+                LOG_MSG(error, "Unknown distribution %s\n", value);
+                return false;
+            }
+        }
+        else {
+            LOG_MSG(error, "Unknown option %s\n", arg);
+            return false;
+        }
+    }
+
+    if (config->archives == 0 || config->entries == 0 || config->max_size == 0 || config->min_size > config->max_size) {
+        LOG_MSG(error, "Invalid archive/entry/size configuration\n");
+        return false;
+    }
+    if (config->seed == 0) {
+        config->seed = 1; // xorshift gets stuck on 0
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    enable_win_ansi();
+    bench_config config = {
+        .archives = 16,
+        .entries = 1000,
+        .min_size = 256,
+        .max_size = 65536,
+        .distribution = DIST_SKEWED,
+        .level = 3,
+        .dict = false,
+        .lookups = 100000,
+        .seeks = 10000,
+        .seed = 1,
+        .out_path = "bench_results.json",
+        .trace_path = NULL
+    };
+    if (!parse_args(argc, argv, &config)) {
+        return 1;
+    }
+    rng_state = config.seed;
+
+    PHYSFS_init(argv[0]);
+    PHYSFS_permitDanglingWriteHandles(1);
+    PHYSFS_registerArchiver(&archiver_sarc_default);
+
+    // Everything goes in a scratch folder next to the executable.
+    const char* base = PHYSFS_getBaseDir();
+    char work_dir[1024] = {0};
+    sprintf(work_dir, "%s%s%s", base, BENCH_DIR, PHYSFS_getDirSeparator());
+    PHYSFS_setWriteDir(base);
+    PHYSFS_mkdir(BENCH_DIR);
+    if (!PHYSFS_setWriteDir(work_dir)) {
+        LOG_MSG(error, "Can't write to %s\n", work_dir);
+        PHYSFS_deinit();
+        return 1;
+    }
+
+    if (config.trace_path != NULL) {
+        SARC_traceStart(config.trace_path);
+    }
+
+    bench_results results = {0};
+    u64 start = thread_now_ns();
+    if (!generate_archives(&config, &results)) {
+        LOG_MSG(error, "Failed to generate archives\n");
+        PHYSFS_deinit();
+        return 1;
+    }
+    results.generate_ms = ns_to_ms(thread_now_ns() - start);
+
+    if (config.dict && config.level > 0) {
+        PHYSFS_mount(work_dir, "/bench_dict", 1);
+        zstd_io_add_dict("/bench_dict/" BENCH_DICT);
+    }
+
+    if (!bench_mount(work_dir, &config, &results)) {
+        PHYSFS_deinit();
+        return 1;
+    }
+    bench_lookup(&config, &results);
+    bench_reads(&config, &results);
+    bench_seek(&config, &results);
+    bench_rebuild(work_dir, &config, &results);
+    results.peak_rss_kb = bench_peak_rss_kb();
+    SARC_traceStop();
+
+    FILE* out = stdout;
+    if (strcmp(config.out_path, "-") != 0) {
+        out = fopen(config.out_path, "w");
+        if (out == NULL) {
+            LOG_MSG(error, "Can't open %s\n", config.out_path);
+            out = stdout;
+        }
+    }
+    write_results(out, &config, &results);
+    if (out != stdout) {
+        fclose(out);
+        LOG_MSG(info, "Results written to %s\n", config.out_path);
+    }
+
+    PHYSFS_deinit();
+    return 0;
+}
@@ -0,0 +1,508 @@
+// Behaviour checks for the SARC archiver, run by ctest. Like the benchmark, it
+// generates its own archives (in the working directory), so no game data is
+// needed. Each check drives the archiver directly, the way PhysicsFS would.
+// They stop at the first failure, since a failed check can leave settings
+// and archives behind, and the process exits with 1.
+//
+// Usage: sarc_archiver_checks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc.h"
+#include "archiver_sarc.h"
+#include "archiver_sarc_internal.h"
+#include "sarc_image.h"
+#include "sarc_rebuild.h"
+#include "sarc_profile.h"
+#include "sarc_stats.h"
+#include "mem_budget.h"
+#include "fd_pool.h"
+#include "pio.h"
+#include "threads.h"
+#include "logging.h"
+#include "int.h"
+
+#define CHECK_ENTRIES 48
+#define CHECK_MAX_SIZE 0x6000
+#define CHECK_DATA_ALIGNMENT 8
+
+#define CHECK_ARCHIVE "checks_base.sarc"
+#define CHECK_PACKED "checks_packed.sarc.zs"
+#define CHECK_REBUILT "checks_rebuilt.sarc"
+#define CHECK_REBUILT_PACKED "checks_rebuilt.sarc.zs"
+#define CHECK_PROFILE "checks_profile.txt"
+#define CHECK_FD_A "checks_fd_a.bin"
+#define CHECK_FD_B "checks_fd_b.bin"
+#define CHECK_FD_NEW "checks_fd_new.bin"
+
+// Log the condition and fail the check. Whatever it had open is leaked, the
+// process is about to exit anyway.
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      LOG_MSG(error, "Failed: %s (line %d)\n", #cond, __LINE__); \
+      return false; \
+    } \
+  } while (0)
+
+typedef struct {
+  char name[64];
+  u32 hash;
+  u32 size;
+  u8* data;
+}check_file;
+
+// The entries every generated archive holds
+static check_file files[CHECK_ENTRIES];
+
+static u64 rng_state = 1;
+
+static u32 rng_range(u32 max) {
+  rng_state = rng_state * 6364136223846793005ull + 1442695040888963407ull;
+  return (u32)(rng_state >> 33) % max;
+}
+
+// Words with some noise, so zstd has something to do but still spans blocks
+static void fill_data(u8* data, u32 size) {
+  static const char* words[] = { "Actor", "Param", "Model", "Bone", "Anim", "Sound", "Flag", "Table" };
+  u32 pos = 0;
+  while (pos < size) {
+    if (rng_range(6) == 0) {
+      data[pos++] = (u8)rng_range(256);
+      continue;
+    }
+    const char* word = words[rng_range(ARRAY_SIZE(words))];
+    u32 len = MIN(size - pos, (u32)strlen(word));
+    memcpy(&data[pos], word, len);
+    pos += len;
+  }
+}
+
+static int check_file_compare(const void* a, const void* b) {
+  u32 hash_a = ((const check_file*)a)->hash;
+  u32 hash_b = ((const check_file*)b)->hash;
+  if (hash_a == hash_b) {
+    return 0;
+  }
+  return (hash_a < hash_b) ? -1 : 1;
+}
+
+static const check_file* find_file(const char* name) {
+  for (u32 i = 0; i < CHECK_ENTRIES; i++) {
+    if (strcmp(files[i].name, name) == 0) {
+      return &files[i];
+    }
+  }
+  return NULL;
+}
+
+static bool write_file(const char* path, const void* data, u64 size) {
+  pio_handle file = pio_create(path);
+  if (file == PIO_INVALID) {
+    LOG_MSG(error, "Can't create %s\n", path);
+    return false;
+  }
+  bool ok = pio_write(file, data, size, 0);
+  pio_close(file);
+  return ok;
+}
+
+// Write the entries out as an uncompressed SARC and as a zstd one
+static bool generate_archives(void) {
+  for (u32 i = 0; i < CHECK_ENTRIES; i++) {
+    snprintf(files[i].name, sizeof(files[i].name), "Dir%u/File%03u.bin", i % 4, i);
+    files[i].hash = sarc_filename_hash(files[i].name, strlen(files[i].name), SFAT_HASH_KEY);
+    files[i].size = 1 + rng_range(CHECK_MAX_SIZE);
+    files[i].data = allocator.Malloc(files[i].size);
+    if (files[i].data == NULL) {
+      return false;
+    }
+    fill_data(files[i].data, files[i].size);
+  }
+  qsort(files, CHECK_ENTRIES, sizeof(*files), check_file_compare);
+
+  sarc_image_node nodes[CHECK_ENTRIES];
+  u32 data_size = 0;
+  for (u32 i = 0; i < CHECK_ENTRIES; i++) {
+    data_size = ALIGN_UP(data_size, CHECK_DATA_ALIGNMENT);
+    nodes[i] = (sarc_image_node) {
+      .name = files[i].name,
+      .hash = files[i].hash,
+      .data_start = data_size,
+      .size = files[i].size
+    };
+    data_size += files[i].size;
+  }
+  u32 data_offset = ALIGN_UP(sarc_image_meta_size(nodes, CHECK_ENTRIES), CHECK_DATA_ALIGNMENT);
+  u32 size = data_offset + data_size;
+  u8* sarc = allocator.Malloc(size);
+  size_t capacity = ZSTD_compressBound(size);
+  u8* packed = allocator.Malloc(capacity);
+  bool ok = false;
+  if (sarc != NULL && packed != NULL) {
+    memset(sarc, 0, size);
+    sarc_image_write_meta(sarc, nodes, CHECK_ENTRIES, SFAT_HASH_KEY, data_offset, size);
+    for (u32 i = 0; i < CHECK_ENTRIES; i++) {
+      memcpy(sarc + data_offset + nodes[i].data_start, files[i].data, files[i].size);
+    }
+    size_t packed_size = ZSTD_compress(packed, capacity, sarc, size, 3);
+    ok = !ZSTD_isError(packed_size) && write_file(CHECK_ARCHIVE, sarc, size) &&
+         write_file(CHECK_PACKED, packed, packed_size);
+  }
+  allocator.Free(packed);
+  allocator.Free(sarc);
+  return ok;
+}
+
+static SARC_ctx* mount(const char* path) {
+  PHYSFS_Io* io = __PHYSFS_createNativeIo(path, 'r');
+  if (io == NULL) {
+    return NULL;
+  }
+  int claimed = 0;
+  SARC_ctx* ctx = SARC_openArchive(io, path, 0, &claimed);
+  if (ctx == NULL) {
+    io->destroy(io);
+  }
+  return ctx;
+}
+
+static bool read_all(PHYSFS_Io* io, void* buf, u64 size) {
+  u8* out = buf;
+  while (size > 0) {
+    PHYSFS_sint64 read = io->read(io, out, size);
+    if (read <= 0) {
+      return false;
+    }
+    out += read;
+    size -= (u64)read;
+  }
+  return true;
+}
+
+// Whether an open file holds exactly data
+static bool io_matches(PHYSFS_Io* io, const void* data, u64 size) {
+  u8 buf[CHECK_MAX_SIZE + 1];
+  if (io == NULL || size > CHECK_MAX_SIZE || (u64)io->length(io) != size) {
+    return false;
+  }
+  // Reading one byte past the end makes sure there's nothing else
+  return read_all(io, buf, size) && io->read(io, buf, 1) == 0 && memcmp(buf, data, size) == 0;
+}
+
+static bool entry_matches(SARC_ctx* ctx, const char* name, const void* data, u64 size) {
+  PHYSFS_Io* io = SARC_openRead(ctx, name);
+  bool ok = io_matches(io, data, size);
+  if (io != NULL) {
+    io->destroy(io);
+  }
+  return ok;
+}
+
+static bool image_matches(const char* path) {
+  sarc_image image;
+  if (!sarc_image_load(&image, path)) {
+    return false;
+  }
+  bool ok = (sarc_image_count(&image) == CHECK_ENTRIES);
+  for (u32 i = 0; ok && i < CHECK_ENTRIES; i++) {
+    const check_file* file = find_file(sarc_image_name(&image, i));
+    ok = file != NULL && sarc_image_size(&image, i) == file->size &&
+         memcmp(sarc_image_data(&image, i), file->data, file->size) == 0;
+  }
+  sarc_image_free(&image);
+  return ok;
+}
+
+static bool write_entry(SARC_ctx* ctx, const char* name, const char* text) {
+  PHYSFS_Io* io = SARC_openWrite(ctx, name);
+  if (io == NULL) {
+    return false;
+  }
+  bool ok = io->write(io, text, strlen(text)) == (PHYSFS_sint64)strlen(text) && io->trunc(io, strlen(text));
+  // Flushing is what writes the overlay, as PHYSFS_close() does
+  ok = io->flush(io) && ok;
+  io->destroy(io);
+  return ok;
+}
+
+// Edits go to the sidecar, survive a remount, and replacing the sidecar
+// doesn't pull it out from under files that are reading it.
+static bool check_overlay(void) {
+  SARC_setOverlayWrites(true);
+  const check_file* edited = &files[0];
+  const check_file* untouched = &files[1];
+
+  SARC_ctx* ctx = mount(CHECK_ARCHIVE);
+  CHECK(ctx != NULL);
+  CHECK(write_entry(ctx, edited->name, "first edit"));
+  CHECK(entry_matches(ctx, edited->name, "first edit", 10));
+  SARC_closeArchive(ctx);
+  // The base is never written
+  CHECK(image_matches(CHECK_ARCHIVE));
+
+  ctx = mount(CHECK_ARCHIVE);
+  CHECK(ctx != NULL);
+  CHECK(entry_matches(ctx, edited->name, "first edit", 10));
+  CHECK(entry_matches(ctx, untouched->name, untouched->data, untouched->size));
+
+  PHYSFS_Io* reader = SARC_openRead(ctx, edited->name);
+  CHECK(reader != NULL);
+  CHECK(write_entry(ctx, edited->name, "second edit"));
+  char buf[16] = {0};
+  CHECK(read_all(reader, buf, 10) && memcmp(buf, "first edit", 10) == 0);
+  reader->destroy(reader);
+  SARC_closeArchive(ctx);
+
+  ctx = mount(CHECK_ARCHIVE);
+  CHECK(ctx != NULL);
+  CHECK(entry_matches(ctx, edited->name, "second edit", 11));
+  SARC_closeArchive(ctx);
+
+  SARC_setOverlayWrites(false);
+  return true;
+}
+
+// Rebuilding a mounted archive gives back every entry, compressed or not
+static bool check_rebuild(void) {
+  SARC_ctx* ctx = mount(CHECK_PACKED);
+  CHECK(ctx != NULL);
+  CHECK(SARC_rebuildTo(CHECK_PACKED, CHECK_REBUILT, 0));
+  CHECK(SARC_rebuildTo(CHECK_PACKED, CHECK_REBUILT_PACKED, 3));
+  CHECK(!SARC_rebuildTo(CHECK_PACKED, CHECK_PACKED, 0));
+  SARC_closeArchive(ctx);
+  CHECK(image_matches(CHECK_REBUILT));
+  CHECK(image_matches(CHECK_REBUILT_PACKED));
+
+  ctx = mount(CHECK_REBUILT_PACKED);
+  CHECK(ctx != NULL);
+  for (u32 i = 0; i < CHECK_ENTRIES; i++) {
+    CHECK(entry_matches(ctx, files[i].name, files[i].data, files[i].size));
+  }
+  SARC_closeArchive(ctx);
+  return true;
+}
+
+typedef struct {
+  SARC_ctx* ctx;
+  PHYSFS_Io* stream;
+  volatile bool done;
+}wait_args;
+
+static void* wait_main(void* arg) {
+  wait_args* args = (wait_args*)arg;
+  args->stream = SARC_openStreamWaiting(args->ctx);
+  args->done = true;
+  return NULL;
+}
+
+// Each policy, on a budget with room for a couple of zstd streams
+static bool check_budget(void) {
+  SARC_ctx* ctx = mount(CHECK_PACKED);
+  CHECK(ctx != NULL);
+  SARC_memoryUsage usage;
+  SARC_getMemoryUsage(&usage);
+  u64 idle = usage.used;
+  PHYSFS_Io* ios[4] = {0};
+  ios[0] = SARC_openRead(ctx, files[0].name);
+  CHECK(ios[0] != NULL);
+  SARC_getMemoryUsage(&usage);
+  u64 per_stream = usage.used - idle;
+  ios[0]->destroy(ios[0]);
+  CHECK(per_stream > 0);
+
+  // Some fit, the rest are refused
+  SARC_setMemoryBudget(idle + per_stream * 2, SARC_MEMORY_FAIL);
+  SARC_resetMemoryPeak();
+  u32 opened = 0;
+  for (u32 i = 0; i < ARRAY_SIZE(ios); i++) {
+    ios[i] = SARC_openRead(ctx, files[i].name);
+    opened += (ios[i] != NULL);
+  }
+  PHYSFS_ErrorCode error_code = PHYSFS_getLastErrorCode();
+  SARC_getMemoryUsage(&usage);
+  for (u32 i = 0; i < ARRAY_SIZE(ios); i++) {
+    if (ios[i] != NULL) {
+      ios[i]->destroy(ios[i]);
+    }
+  }
+  CHECK(opened > 0 && opened < ARRAY_SIZE(ios));
+  CHECK(error_code == PHYSFS_ERR_OUT_OF_MEMORY);
+  CHECK(usage.denials > 0 && usage.peak <= usage.limit);
+
+  // Everything opens, and files read in turns still come out right
+  SARC_setMemoryBudget(idle + per_stream * 2, SARC_MEMORY_DEGRADE);
+  SARC_resetMemoryPeak();
+  for (u32 i = 0; i < ARRAY_SIZE(ios); i++) {
+    ios[i] = SARC_openRead(ctx, files[i].name);
+    CHECK(ios[i] != NULL);
+  }
+  for (u32 round = 0; round < 2; round++) {
+    for (u32 i = ARRAY_SIZE(ios); i-- > 0;) {
+      CHECK(ios[i]->seek(ios[i], 0));
+      CHECK(io_matches(ios[i], files[i].data, files[i].size));
+    }
+  }
+  for (u32 i = 0; i < ARRAY_SIZE(ios); i++) {
+    ios[i]->destroy(ios[i]);
+  }
+  SARC_getMemoryUsage(&usage);
+  CHECK(usage.degraded > 0);
+
+  // Streams opened outside PhysicsFS wait for room. PhysicsFS's opens fail
+  // instead, since the stream they'd wait for can only be closed through it.
+  // The shared decoder stays charged once it's been set up, so there's room
+  // for one stream on top of it.
+  SARC_setMemoryBudget(usage.used + per_stream, SARC_MEMORY_WAIT);
+  SARC_resetMemoryPeak();
+  PHYSFS_Io* held = SARC_openStreamWaiting(ctx);
+  CHECK(held != NULL);
+  CHECK(SARC_openRead(ctx, files[0].name) == NULL);
+  wait_args args = { .ctx = ctx };
+  ZSTD_pthread_t waiter;
+  CHECK(ZSTD_pthread_create(&waiter, NULL, wait_main, &args) == 0);
+  thread_sleep_ms(50);
+  bool waited = !args.done;
+  held->destroy(held);
+  ZSTD_pthread_join(waiter);
+  CHECK(waited);
+  CHECK(args.stream != NULL);
+  args.stream->destroy(args.stream);
+  SARC_getMemoryUsage(&usage);
+  CHECK(usage.waits > 0);
+
+  SARC_setMemoryBudget(0, SARC_MEMORY_FAIL);
+  SARC_closeArchive(ctx);
+  return true;
+}
+
+static bool pooled_matches(PHYSFS_Io* io, const check_file* file) {
+  return io->seek(io, 0) && io_matches(io, file->data, file->size);
+}
+
+// Files closed by the pool reopen as the same file, or not at all
+static bool check_fd_pool(void) {
+  const check_file* a = &files[0];
+  const check_file* b = &files[1];
+  const check_file* replacement = &files[2];
+  CHECK(write_file(CHECK_FD_A, a->data, a->size));
+  CHECK(write_file(CHECK_FD_B, b->data, b->size));
+  fd_pool_set_limit(1);
+
+  PHYSFS_Io* io_a = fd_pool_open(CHECK_FD_A);
+  PHYSFS_Io* io_b = fd_pool_open(CHECK_FD_B);
+  CHECK(io_a != NULL && io_b != NULL);
+  CHECK(fd_pool_open_count() == 1);
+  sarc_stats before;
+  SARC_getGlobalStats(&before);
+  CHECK(pooled_matches(io_a, a));
+  PHYSFS_Io* dup_a = io_a->duplicate(io_a);
+  CHECK(dup_a != NULL && pooled_matches(dup_a, a));
+  CHECK(pooled_matches(io_b, b));
+  CHECK(pooled_matches(io_a, a));
+  sarc_stats after;
+  SARC_getGlobalStats(&after);
+  CHECK(after.fd_reopens >= before.fd_reopens + 2);
+  CHECK(fd_pool_open_count() == 1);
+
+  // a is closed again once b is read. Replacing it means it can't come back.
+  CHECK(pooled_matches(io_b, b));
+  CHECK(write_file(CHECK_FD_NEW, replacement->data, replacement->size));
+  CHECK(pio_replace(CHECK_FD_NEW, CHECK_FD_A));
+  u8 byte = 0;
+  CHECK(io_a->seek(io_a, 0) && io_a->read(io_a, &byte, 1) < 0);
+  CHECK(dup_a->seek(dup_a, 0) && dup_a->read(dup_a, &byte, 1) < 0);
+  dup_a->destroy(dup_a);
+  io_a->destroy(io_a);
+
+  // Pinned files keep theirs, and go on reading the file they opened
+  PHYSFS_Io* pinned = fd_pool_open_pinned(CHECK_FD_B);
+  CHECK(pinned != NULL && fd_pool_pinned_handle(pinned) != PIO_INVALID);
+  CHECK(fd_pool_pinned_handle(io_b) == PIO_INVALID);
+  CHECK(write_file(CHECK_FD_NEW, replacement->data, replacement->size));
+  CHECK(pio_replace(CHECK_FD_NEW, CHECK_FD_B));
+  CHECK(pooled_matches(pinned, b));
+  pinned->destroy(pinned);
+  io_b->destroy(io_b);
+
+  fd_pool_set_limit(FD_POOL_DEFAULT_LIMIT);
+  return true;
+}
+
+// A replayed profile reads the recorded files ahead, and opening them takes
+// what it read.
+static bool check_profile(void) {
+  const u32 recorded = 8;
+  SARC_ctx* ctx = mount(CHECK_PACKED);
+  CHECK(ctx != NULL);
+  CHECK(SARC_profileRecordStart(CHECK_PROFILE));
+  u64 recorded_bytes = 0;
+  for (u32 i = 0; i < recorded; i++) {
+    CHECK(entry_matches(ctx, files[i].name, files[i].data, files[i].size));
+    recorded_bytes += files[i].size;
+  }
+  SARC_profileRecordStop();
+
+  SARC_resetStats();
+  CHECK(SARC_profileReplayStart(CHECK_PROFILE, 0x1000000));
+  // Give the worker up to 5 seconds to read everything
+  sarc_stats stats;
+  for (u32 i = 0; i < 500; i++) {
+    SARC_getGlobalStats(&stats);
+    if (stats.prefetch_bytes >= recorded_bytes) {
+      break;
+    }
+    thread_sleep_ms(10);
+  }
+  CHECK(stats.prefetch_bytes >= recorded_bytes);
+  for (u32 i = 0; i < recorded; i++) {
+    CHECK(entry_matches(ctx, files[i].name, files[i].data, files[i].size));
+  }
+  SARC_getGlobalStats(&stats);
+  CHECK(stats.prefetch_hits == recorded);
+  SARC_profileReplayStop();
+  SARC_closeArchive(ctx);
+  return true;
+}
+
+typedef struct {
+  const char* name;
+  bool (*run)(void);
+}check;
+
+static const check checks[] = {
+  { "overlay", check_overlay },
+  { "rebuild", check_rebuild },
+  { "budget", check_budget },
+  { "fd_pool", check_fd_pool },
+  { "profile", check_profile },
+};
+
+int main(int argc, char** argv) {
+  PHYSFS_init(argv[0]);
+  // Left over from an earlier run, it would be loaded on mount
+  __PHYSFS_platformDelete(CHECK_ARCHIVE SARC_OVERLAY_SUFFIX);
+
+  int failures = 0;
+  if (!generate_archives()) {
+    LOG_MSG(error, "Can't generate the test archives\n");
+    failures++;
+  }
+  for (u32 i = 0; failures == 0 && i < ARRAY_SIZE(checks); i++) {
+    bool ok = checks[i].run();
+    LOG_MSG(info, "%s: %s\n", checks[i].name, ok ? "passed" : "FAILED");
+    failures += !ok;
+  }
+  for (u32 i = 0; i < CHECK_ENTRIES; i++) {
+    allocator.Free(files[i].data);
+  }
+
+  PHYSFS_deinit();
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,24 @@
+#include "cpu.h"
+
+#if defined(SARC_X86) && defined(_MSC_VER)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+bool cpu_has_avx2(void) {
+#ifndef SARC_X86
+  return false;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  // The OS also has to save the AVX registers on context switches
+  bool os_saves_avx = (info[2] & (1 << 27)) && ((_xgetbv(0) & 0x6) == 0x6);
+  if (!os_saves_avx) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
@@ -0,0 +1,19 @@
+#pragma once
+// What the CPU we're running on supports, for picking SIMD code at runtime.
+// Only x86 has anything to pick between so far.
+
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SARC_X86
+#ifdef _MSC_VER
+// MSVC lets us use any intrinsic without changing the target
+#define SARC_TARGET_AVX2
+#else
+#define SARC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Whether AVX2 code can run: the CPU has it, and the OS saves its registers.
+// Always false off x86.
+bool cpu_has_avx2(void);
@@ -0,0 +1,380 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "fd_pool.h"
+#include "pio.h"
+#include "threads.h"
+#include "atomics.h"
+#include "sarc_stats.h"
+#include "logging.h"
+
+// Added to a file's readers while the pool closes its handle. Reads that see
+// it back off and take the slow path, which waits for pool_lock.
+#define POOL_CLOSING (1ull << 62)
+
+// One per fd_pool_open() call, shared by every Io duplicated from it. Opening
+// the same path twice gives two of these, each with its own descriptor.
+typedef struct pool_file {
+  char* path;
+  PHYSFS_uint64 length;
+  pio_file_id id; // What path named when it was first opened
+  uint32_t refs; // Ios using this file
+  bool pinned; // Open until the last Io goes, and not in the list or the count
+  // These three are read and written without pool_lock
+  volatile uint64_t handle; // A pio_handle, PIO_INVALID while closed
+  volatile uint64_t readers; // Reads in progress, plus POOL_CLOSING while closing
+  volatile uint64_t used; // Read since the last close_idle() passed it
+  struct pool_file* prev; // Neighbours in the list of open files
+  struct pool_file* next;
+}pool_file;
+
+typedef struct {
+  pool_file* file;
+  PHYSFS_uint64 pos;
+}pool_io;
+
+static thread_once_t pool_once = THREAD_ONCE_INIT;
+static void* pool_lock = NULL;
+static pool_file* lru_head = NULL;
+static pool_file* lru_tail = NULL;
+static uint32_t open_count = 0;
+static uint32_t open_limit = FD_POOL_DEFAULT_LIMIT;
+
+static const PHYSFS_Io pool_io_interface;
+
+static void pool_init(void) {
+  pool_lock = __PHYSFS_platformCreateMutex();
+}
+
+// Everything below that touches the list or opens or closes a handle needs
+// pool_lock
+
+static void lru_unlink(pool_file* file) {
+  if (file->prev != NULL) {
+    file->prev->next = file->next;
+  }
+  else {
+    lru_head = file->next;
+  }
+  if (file->next != NULL) {
+    file->next->prev = file->prev;
+  }
+  else {
+    lru_tail = file->prev;
+  }
+  file->prev = NULL;
+  file->next = NULL;
+}
+
+static void lru_push_front(pool_file* file) {
+  file->next = lru_head;
+  if (lru_head != NULL) {
+    lru_head->prev = file;
+  }
+  lru_head = file;
+  if (lru_tail == NULL) {
+    lru_tail = file;
+  }
+}
+
+// Close a file's handle if nothing is reading through it. Returns false if
+// something is.
+static bool close_file(pool_file* file) {
+  uint64_t idle = 0;
+  if (!ATOMIC_CAS64(&file->readers, &idle, POOL_CLOSING)) {
+    return false;
+  }
+  lru_unlink(file);
+  pio_close((pio_handle)file->handle);
+  ATOMIC_STORE64_RELEASE(&file->handle, (uint64_t)PIO_INVALID);
+  // Reads that backed off in the meantime take themselves off again
+  ATOMIC_ADD64_ACQ_REL(&file->readers, -POOL_CLOSING);
+  open_count--;
+  return true;
+}
+
+// Close idle files until at most keep are open. Reads don't touch the list,
+// they only flag their file as used. Going from the oldest end, flagged files
+// get their flag cleared and go to the front, so they're closed after the rest
+// (the same as a CLOCK cache). Two passes clear every flag, so that's as far
+// as it goes. Files being read are skipped.
+static void close_idle(uint32_t keep) {
+  uint32_t steps = open_count * 2;
+  pool_file* file = lru_tail;
+  while (open_count > keep && file != NULL && steps-- > 0) {
+    pool_file* prev = file->prev;
+    if (ATOMIC_LOAD64(&file->used) != 0) {
+      ATOMIC_STORE64(&file->used, 0);
+      lru_unlink(file);
+      lru_push_front(file);
+      // Past the old head, prev leads on to the files moved to the front
+      if (prev == NULL) {
+        prev = file;
+      }
+    }
+    else {
+      close_file(file);
+    }
+    file = prev;
+  }
+}
+
+// Open a file's handle again after the pool closed it, making sure the path
+// still names the same file.
+static pio_handle reopen_file(pool_file* file) {
+  close_idle(open_limit - 1);
+  pio_handle handle = pio_open(file->path);
+  if (handle == PIO_INVALID) {
+    LOG_MSG(error, "Failed to reopen %s\n", file->path);
+    return PIO_INVALID;
+  }
+  pio_file_id id;
+  if (!pio_identify(handle, &id) || !pio_same_file(&id, &file->id)) {
+    LOG_MSG(error, "%s was replaced or changed since it was opened\n", file->path);
+    pio_close(handle);
+    return PIO_INVALID;
+  }
+  ATOMIC_STORE64_RELEASE(&file->handle, (uint64_t)handle);
+  lru_push_front(file);
+  open_count++;
+  SARC_STATS_ADD(NULL, fd_reopens, 1);
+  return handle;
+}
+
+// Get a handle to read through, reopening the file if the pool closed it.
+// Reads of a file that's open don't take any locks.
+static pio_handle acquire_handle(pool_file* file) {
+  if (ATOMIC_LOAD64(&file->used) == 0) {
+    ATOMIC_STORE64(&file->used, 1);
+  }
+  // Pairs with close_file(), so a handle we see open stays open until we're done
+  if (ATOMIC_ADD64_ACQ_REL(&file->readers, 1) < POOL_CLOSING) {
+    pio_handle handle = (pio_handle)ATOMIC_LOAD64_ACQUIRE(&file->handle);
+    if (handle != PIO_INVALID) {
+      return handle;
+    }
+  }
+  ATOMIC_ADD64_ACQ_REL(&file->readers, -1);
+
+  // Closed, or being closed. Nothing closes it while we hold the lock.
+  __PHYSFS_platformGrabMutex(pool_lock);
+  pio_handle handle = (pio_handle)ATOMIC_LOAD64(&file->handle);
+  if (handle == PIO_INVALID) {
+    handle = reopen_file(file);
+  }
+  if (handle != PIO_INVALID) {
+    ATOMIC_ADD64(&file->readers, 1);
+  }
+  __PHYSFS_platformReleaseMutex(pool_lock);
+  return handle;
+}
+
+static void release_handle(pool_file* file) {
+  ATOMIC_ADD64_ACQ_REL(&file->readers, -1);
+}
+
+static PHYSFS_Io* pool_io_create(pool_file* file) {
+  PHYSFS_Io* io = allocator.Malloc(sizeof(*io));
+  pool_io* opaque = allocator.Malloc(sizeof(*opaque));
+  if (io == NULL || opaque == NULL) {
+    allocator.Free(io);
+    allocator.Free(opaque);
+    BAIL(PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+  }
+  opaque->file = file;
+  opaque->pos = 0;
+  memcpy(io, &pool_io_interface, sizeof(*io));
+  io->opaque = opaque;
+  return io;
+}
+
+static PHYSFS_sint64 pool_io_read(PHYSFS_Io* io, void* buf, PHYSFS_uint64 len) {
+  pool_io* opaque = (pool_io*)io->opaque;
+  pool_file* file = opaque->file;
+  if (opaque->pos >= file->length) {
+    return 0;
+  }
+  if (len > file->length - opaque->pos) {
+    len = file->length - opaque->pos;
+  }
+  pio_handle handle = acquire_handle(file);
+  BAIL_IF(handle == PIO_INVALID, PHYSFS_ERR_IO, -1);
+  int64_t rc = pio_read(handle, buf, len, opaque->pos);
+  release_handle(file);
+  BAIL_IF(rc < 0, PHYSFS_ERR_IO, -1);
+  opaque->pos += (PHYSFS_uint64)rc;
+  return rc;
+}
+
+static PHYSFS_sint64 pool_io_write(PHYSFS_Io* io, const void* buf, PHYSFS_uint64 len) {
+  BAIL(PHYSFS_ERR_READ_ONLY, -1);
+}
+
+static int pool_io_seek(PHYSFS_Io* io, PHYSFS_uint64 offset) {
+  pool_io* opaque = (pool_io*)io->opaque;
+  BAIL_IF(offset > opaque->file->length, PHYSFS_ERR_PAST_EOF, 0);
+  opaque->pos = offset;
+  return 1;
+}
+
+static PHYSFS_sint64 pool_io_tell(PHYSFS_Io* io) {
+  return (PHYSFS_sint64)((pool_io*)io->opaque)->pos;
+}
+
+static PHYSFS_sint64 pool_io_length(PHYSFS_Io* io) {
+  return (PHYSFS_sint64)((pool_io*)io->opaque)->file->length;
+}
+
+static PHYSFS_Io* pool_io_duplicate(PHYSFS_Io* io) {
+  pool_file* file = ((pool_io*)io->opaque)->file;
+  PHYSFS_Io* dup = pool_io_create(file);
+  BAIL_IF_ERRPASS(dup == NULL, NULL);
+  __PHYSFS_platformGrabMutex(pool_lock);
+  file->refs++;
+  __PHYSFS_platformReleaseMutex(pool_lock);
+  return dup;
+}
+
+static int pool_io_flush(PHYSFS_Io* io) {
+  return 1;
+}
+
+static void pool_io_destroy(PHYSFS_Io* io) {
+  pool_file* file = ((pool_io*)io->opaque)->file;
+  __PHYSFS_platformGrabMutex(pool_lock);
+  // With no Ios left, nothing can be reading it
+  bool last = (--file->refs == 0);
+  if (last && file->pinned) {
+    pio_close((pio_handle)file->handle);
+  }
+  else if (last && (pio_handle)file->handle != PIO_INVALID) {
+    close_file(file);
+  }
+  __PHYSFS_platformReleaseMutex(pool_lock);
+  if (last) {
+    allocator.Free(file->path);
+    allocator.Free(file);
+  }
+  allocator.Free(io->opaque);
+  allocator.Free(io);
+}
+
+static const PHYSFS_Io pool_io_interface = {
+  .version = 0,
+  .opaque = NULL,
+  .read = pool_io_read,
+  .write = pool_io_write,
+  .seek = pool_io_seek,
+  .tell = pool_io_tell,
+  .length = pool_io_length,
+  .duplicate = pool_io_duplicate,
+  .flush = pool_io_flush,
+  .destroy = pool_io_destroy
+};
+
+static PHYSFS_Io* open_file(const char* path, bool pinned) {
+  thread_once(&pool_once, pool_init);
+  BAIL_IF(pool_lock == NULL, PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+  PHYSFS_Stat stat;
+  BAIL_IF_ERRPASS(!__PHYSFS_platformStat(path, &stat, 1), NULL);
+  BAIL_IF(stat.filetype != PHYSFS_FILETYPE_REGULAR, PHYSFS_ERR_NOT_A_FILE, NULL);
+
+  pool_file* file = allocator.Malloc(sizeof(*file));
+  char* path_copy = allocator.Malloc(strlen(path) + 1);
+  if (file == NULL || path_copy == NULL) {
+    allocator.Free(file);
+    allocator.Free(path_copy);
+    BAIL(PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+  }
+  strcpy(path_copy, path);
+  memset(file, 0, sizeof(*file));
+  file->path = path_copy;
+  file->refs = 1;
+  file->pinned = pinned;
+  file->handle = (uint64_t)PIO_INVALID;
+
+  // Open it now, so a file we can't read fails here instead of on first use.
+  // It's likely to be read again soon (mounting reads the whole header).
+  __PHYSFS_platformGrabMutex(pool_lock);
+  if (!pinned) {
+    close_idle(open_limit - 1);
+  }
+  pio_handle handle = pio_open(path);
+  if (handle != PIO_INVALID && !pio_identify(handle, &file->id)) {
+    pio_close(handle);
+    handle = PIO_INVALID;
+  }
+  if (handle != PIO_INVALID) {
+    file->handle = (uint64_t)handle;
+    file->length = file->id.size;
+    if (!pinned) {
+      open_count++;
+      lru_push_front(file);
+    }
+  }
+  __PHYSFS_platformReleaseMutex(pool_lock);
+
+  PHYSFS_Io* io = NULL;
+  if (handle != PIO_INVALID) {
+    io = pool_io_create(file);
+  }
+  else {
+    PHYSFS_setErrorCode(PHYSFS_ERR_IO);
+  }
+  if (io == NULL) {
+    __PHYSFS_platformGrabMutex(pool_lock);
+    if (handle != PIO_INVALID && pinned) {
+      pio_close(handle);
+    }
+    else if (handle != PIO_INVALID) {
+      close_file(file);
+    }
+    __PHYSFS_platformReleaseMutex(pool_lock);
+    allocator.Free(file->path);
+    allocator.Free(file);
+  }
+  return io;
+}
+
+PHYSFS_Io* fd_pool_open(const char* path) {
+  return open_file(path, false);
+} /* fd_pool_open */
+
+PHYSFS_Io* fd_pool_open_pinned(const char* path) {
+  return open_file(path, true);
+} /* fd_pool_open_pinned */
+
+pio_handle fd_pool_pinned_handle(PHYSFS_Io* io) {
+  if (io->read != pool_io_read) {
+    return PIO_INVALID;
+  }
+  const pool_file* file = ((pool_io*)io->opaque)->file;
+  return file->pinned ? (pio_handle)file->handle : PIO_INVALID;
+} /* fd_pool_pinned_handle */
+
+void fd_pool_set_limit(uint32_t limit) {
+  thread_once(&pool_once, pool_init);
+  if (pool_lock == NULL) {
+    return;
+  }
+  __PHYSFS_platformGrabMutex(pool_lock);
+  // At least one, or nothing could be read
+  open_limit = (limit > 0) ? limit : 1;
+  close_idle(open_limit);
+  __PHYSFS_platformReleaseMutex(pool_lock);
+} /* fd_pool_set_limit */
+
+uint32_t fd_pool_open_count(void) {
+  thread_once(&pool_once, pool_init);
+  if (pool_lock == NULL) {
+    return 0;
+  }
+  __PHYSFS_platformGrabMutex(pool_lock);
+  uint32_t count = open_count;
+  __PHYSFS_platformReleaseMutex(pool_lock);
+  return count;
+} /* fd_pool_open_count */
@@ -0,0 +1,46 @@
+#pragma once
+// A bounded pool of open archive files, so the number of archives that can be
+// mounted isn't limited by the process's file descriptor limit. Files opened
+// through the pool only keep their path while they're idle. They get a
+// descriptor when they're read, and the least recently used descriptors are
+// closed to stay under the limit, to be reopened on their next read.
+//
+// Reads are positional (see pio.h), so every Io duplicated from the same
+// fd_pool_open() shares one descriptor, and duplicating never opens anything.
+// Reads of a file that's open don't take any locks.
+//
+// A file that's replaced or modified while the pool has it closed fails to
+// reopen, and reads from it fail with PHYSFS_ERR_IO, rather than returning
+// data from a different file.
+
+#include <stdint.h>
+
+#include <physfs.h>
+
+#include "pio.h"
+
+// The default limit. It leaves most of a typical 1024 descriptor soft limit
+// for everything else.
+#define FD_POOL_DEFAULT_LIMIT 512
+
+// Open a real file read-only through the pool. The file is opened once here,
+// to check it exists and get its size. Returns NULL on failure.
+PHYSFS_Io* fd_pool_open(const char* path);
+
+// Same as fd_pool_open(), but the descriptor stays open until the last Io
+// duplicated from it is destroyed, outside the limit. The Ios keep reading the
+// file they opened even if the path is replaced in the meantime.
+PHYSFS_Io* fd_pool_open_pinned(const char* path);
+
+// The descriptor behind an Io from fd_pool_open_pinned(), for positional reads
+// of its own while the Io is alive. PIO_INVALID for any other Io.
+pio_handle fd_pool_pinned_handle(PHYSFS_Io* io);
+
+// Change how many descriptors the pool keeps open at once. Lowering it closes
+// idle ones right away. Descriptors in the middle of a read are never closed,
+// so the pool can briefly go over the limit when more files than that are read
+// at once.
+void fd_pool_set_limit(uint32_t limit);
+
+// Number of descriptors the pool has open right now.
+uint32_t fd_pool_open_count(void);
@@ -15,7 +15,7 @@ typedef int32_t s32;
 typedef int64_t s64;
 
 // Round a number up to any boundary
-#define ALIGN_UP(x, bound) (((x - 1) & (bound * 0xF)) + bound)
+#define ALIGN_UP(x, bound) ((((x) + (bound) - 1) / (bound)) * (bound))
 
 // Prevent conflicts with other headers that have their own MIN/MAX
 #undef MIN
@@ -1,10 +1,42 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
+#include "logging.h"
+#include "atomics.h"
+#include "threads.h"
+
+// Longest message the async logger keeps, anything past this is cut off
+#define LOG_SLOT_TEXT_SIZE 256
+// How long the writer thread naps when there's nothing to print
+#define LOG_WRITER_IDLE_MS 1
+
+// One message waiting in the ring buffer. The sequence number says who owns
+// the slot: the writer can take it once it's pos + 1, and producers can claim
+// it again once it's pos + slot count. (Dmitry Vyukov's bounded queue)
+typedef struct {
+    uint64_t sequence;
+    const char* type;
+    const char* function;
+    char text[LOG_SLOT_TEXT_SIZE];
+}log_slot;
+
+typedef struct {
+    log_slot* slots;
+    uint64_t mask;
+    uint64_t enqueue_pos; // Shared by every producer
+    uint64_t dequeue_pos; // Only used by the writer thread
+    volatile bool stopping;
+    ZSTD_pthread_t writer;
+}log_ring;
+
+static log_ring ring;
+static volatile bool async_running = false;
+
 unsigned short enable_win_ansi() {
 // Nothing but the return statement is included in non-Windows builds
 #ifdef _WIN32
@@ -27,16 +59,141 @@ unsigned short enable_win_ansi() {
     return 1;
 }
 
-int logging_print(char* type, char* function, char* format_str, ...) {
-    // Print "__func__(): " with function name in color and the rest in white
-    printf("\033[%sm%s\033[0m(): ", type, function);
+// Claim a slot and format a message into it. Returns false if the buffer is full.
+static bool ring_push(const char* type, const char* function, const char* format_str, va_list arg_list) {
+    uint64_t pos = ATOMIC_LOAD64(&ring.enqueue_pos);
+    log_slot* slot = NULL;
+    for (;;) {
+        slot = &ring.slots[pos & ring.mask];
+        int64_t diff = (int64_t)ATOMIC_LOAD64_ACQUIRE(&slot->sequence) - (int64_t)pos;
+        if (diff == 0) {
+            // The slot is free, try to take it before another thread does.
+            if (ATOMIC_CAS64(&ring.enqueue_pos, &pos, pos + 1)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // The writer hasn't caught up with the slot from last time around.
+            return false;
+        }
+        else {
+            pos = ATOMIC_LOAD64(&ring.enqueue_pos);
+        }
+    }
+
+    slot->type = type;
+    slot->function = function;
+    vsnprintf(slot->text, sizeof(slot->text), format_str, arg_list);
+    ATOMIC_STORE64_RELEASE(&slot->sequence, pos + 1);
+    return true;
+}
+
+// Print the next message in the buffer, if there is one.
+static bool ring_pop(void) {
+    uint64_t pos = ring.dequeue_pos;
+    log_slot* slot = &ring.slots[pos & ring.mask];
+    if (ATOMIC_LOAD64_ACQUIRE(&slot->sequence) != pos + 1) {
+        return false;
+    }
+
+    printf("\033[%sm%s\033[0m(): %s", slot->type, slot->function, slot->text);
+    ATOMIC_STORE64_RELEASE(&slot->sequence, pos + ring.mask + 1);
+    ring.dequeue_pos = pos + 1;
+    return true;
+}
+
+static void* log_writer_thread(void* data) {
+    for (;;) {
+        if (ring_pop()) {
+            continue;
+        }
+        fflush(stdout);
+
+        // Producers are done by the time we're asked to stop, so an empty
+        // buffer means we've printed everything.
+        if (ring.stopping) {
+            break;
+        }
+        thread_sleep_ms(LOG_WRITER_IDLE_MS);
+    }
+    return NULL;
+}
+
+bool logging_async_start(uint32_t slots) {
+    if (async_running) {
+        return true;
+    }
+
+    uint64_t count = 2;
+    while (count < slots) {
+        count <<= 1;
+    }
+    ring.slots = malloc(sizeof(log_slot) * count);
+    if (ring.slots == NULL) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        ring.slots[i].sequence = i;
+    }
+    ring.mask = count - 1;
+    ring.enqueue_pos = 0;
+    ring.dequeue_pos = 0;
+    ring.stopping = false;
 
+    if (ZSTD_pthread_create(&ring.writer, NULL, log_writer_thread, NULL) != 0) {
+        free(ring.slots);
+        ring.slots = NULL;
+        return false;
+    }
+    async_running = true;
+    return true;
+}
+
+void logging_async_stop(void) {
+    if (!async_running) {
+        return;
+    }
+    async_running = false;
+    ring.stopping = true;
+    ZSTD_pthread_join(ring.writer);
+    free(ring.slots);
+    ring.slots = NULL;
+}
+
+int logging_print(const char* type, const char* function, const char* format_str, ...) {
     // We use helpers from stdarg.h to handle the variadic (...) arguments.
     va_list arg_list = {0};
     va_start(arg_list, format_str);
+
+    if (async_running) {
+        // A full buffer means we're logging faster than the console can keep
+        // up, so wait for the writer rather than losing messages.
+        while (!ring_push(type, function, format_str, arg_list)) {
+            thread_sleep_ms(0);
+        }
+        va_end(arg_list);
+        return 0;
+    }
+
+    // Print "__func__(): " with function name in color and the rest in white
+    printf("\033[%sm%s\033[0m(): ", type, function);
     int return_code = vprintf(format_str, arg_list);
     va_end(arg_list);
 
     return return_code;
 }
 
+void json_write_string(FILE* out, const char* str) {
+    fputc('"', out);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', out);
+        }
+        if ((unsigned char)*str < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char)*str);
+            continue;
+        }
+        fputc(*str, out);
+    }
+    fputc('"', out);
+}
@@ -1,6 +1,10 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
 static const char error[] = "31";
 static const char warning[] = "33";
 static const char info[] = "32";
@@ -20,14 +24,45 @@ int logging_print(const char* type, const char* function, const char* format_str
 // In the console, this appears as "main(): num = 5" with "main" colored green.
 
 
+// Verbosity of each message type, for SARC_LOG_LEVEL
+#define LOG_LEVEL_error 0
+#define LOG_LEVEL_warning 1
+#define LOG_LEVEL_info 2
+#define LOG_LEVEL_debug 3
+
+// The most verbose message type that gets compiled in. Anything above it is
+// removed entirely, arguments included. Set by CMake with SARC_ARCHIVER_LOG_LEVEL.
+#ifndef SARC_LOG_LEVEL
+#define SARC_LOG_LEVEL LOG_LEVEL_debug
+#endif
+
 /// A simple logging utility for color-coded output that automatically logs the
 /// function name. The outer interface is a macro to avoid passing "__func__"
 /// every time. Usage is identical to printf() but with a message type first.
 /// \param type\n error = red\n warning = yellow\n info = green\n debug = blue
 /// \param ... A format string and extra arguments, just like printf().
-#define LOG_MSG(type, ...) logging_print(type, __func__, __VA_ARGS__)
+#define LOG_MSG(type, ...) do { \
+    if (LOG_LEVEL_##type <= SARC_LOG_LEVEL) { \
+        logging_print(type, __func__, __VA_ARGS__); \
+    } \
+} while (0)
+
+/// Move console output to a background thread. Messages are formatted by the
+/// caller into a lock-free ring buffer, and the colors and printing happen on
+/// the writer thread. If the buffer fills up, callers wait for the writer.
+/// \param slots Number of messages the buffer holds, rounded up to a power of 2
+/// \return false if the buffer or thread couldn't be created
+bool logging_async_start(uint32_t slots);
+
+/// Print everything still buffered and go back to printing directly. Call this
+/// once other threads have stopped logging, such as before PHYSFS_deinit().
+void logging_async_stop(void);
 
 // Enables ANSI escape codes on Windows (used for color, cursor control, etc.)
 unsigned short enable_win_ansi();
 
+// Print a string as a JSON string literal, escaping Windows path separators
+// and anything else that needs it.
+void json_write_string(FILE* out, const char* str);
+
 #endif // LOGGING_H
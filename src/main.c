@@ -8,36 +8,8 @@
 #include "logging.h"
 #include "int.h"
 
-#ifdef PHYSFS_PLATFORM_UNIX
-// Linux-only
-#include <sys/resource.h>
-
-bool increase_file_limit() {
-    struct rlimit rlim;
-    int err = getrlimit(RLIMIT_NOFILE, &rlim);
-    if (err < 0) {
-        LOG_MSG(error, "Failed to get rlimit (code %d)\n", err);
-        return false;
-    }
-    rlim.rlim_cur = 200100;
-    err = setrlimit(RLIMIT_NOFILE, &rlim);
-    if (err < 0) {
-        LOG_MSG(error, "Failed to set rlimit (code %d)\n", err);
-        return false;
-    }
-    return true;
-}
-#else
-bool increase_file_limit() {
-    return true;
-}
-#endif
-
 int main(int argc, char** argv) {
   enable_win_ansi();
-  if (!increase_file_limit()) {
-      return 1;
-  }
 
   clock_t start_clock = clock();
   PHYSFS_init(argv[0]);
@@ -54,9 +26,12 @@ int main(int argc, char** argv) {
         printf("\t[%s] (%s).\n", (*i)->extension, (*i)->description);
   }
 
+  // Mounting logs a line per archive, so keep the console writes off this thread
+  logging_async_start(4096);
   LOG_MSG(info, "Mounting all SARC archives...\n");
-  mount_archive_recursive(".pack.zs", "data", "/");
+  mount_archive_recursive(NULL, "data", "/");
   LOG_MSG(info, "Done.\n");
+  logging_async_stop();
   const char* base = PHYSFS_getBaseDir();
   PHYSFS_unmount(base);
 
@@ -0,0 +1,138 @@
+#include "mem_budget.h"
+#include "zstd_io.h"
+#include "threads.h"
+#include "atomics.h"
+#include "logging.h"
+
+// used is updated atomically, so accounting never takes the lock. The lock is
+// only for checking the limit and waiting for memory to come back.
+static struct {
+  uint64_t limit;
+  uint64_t used;
+  uint64_t peak;
+  uint64_t waits;
+  uint64_t denials;
+  uint64_t degraded;
+  SARC_memoryPolicy policy;
+  uint32_t window_log_max;
+  ZSTD_pthread_mutex_t lock;
+  ZSTD_pthread_cond_t released;
+}budget = { .policy = SARC_MEMORY_FAIL };
+
+static thread_once_t budget_once = THREAD_ONCE_INIT;
+
+static void budget_init(void) {
+  ZSTD_pthread_mutex_init(&budget.lock, NULL);
+  ZSTD_pthread_cond_init(&budget.released, NULL);
+}
+
+static void lock_budget(void) {
+  thread_once(&budget_once, budget_init);
+  ZSTD_pthread_mutex_lock(&budget.lock);
+}
+
+static void update_peak(uint64_t used) {
+  uint64_t peak = ATOMIC_LOAD64(&budget.peak);
+  while (used > peak && !ATOMIC_CAS64(&budget.peak, &peak, used)) {
+  }
+}
+
+static void take(uint64_t size) {
+  update_peak(ATOMIC_ADD64(&budget.used, size) + size);
+}
+
+void SARC_setMemoryBudget(uint64_t limit, SARC_memoryPolicy policy) {
+  if (policy == SARC_MEMORY_DEGRADE) {
+    zstd_io_setup_shared();
+  }
+  lock_budget();
+  budget.limit = limit;
+  budget.policy = policy;
+  // A bigger limit might let waiting opens through
+  ZSTD_pthread_cond_broadcast(&budget.released);
+  ZSTD_pthread_mutex_unlock(&budget.lock);
+} /* SARC_setMemoryBudget */
+
+void SARC_getMemoryUsage(SARC_memoryUsage* out) {
+  out->limit = budget.limit;
+  out->used = ATOMIC_LOAD64(&budget.used);
+  out->peak = ATOMIC_LOAD64(&budget.peak);
+  out->waits = ATOMIC_LOAD64(&budget.waits);
+  out->denials = ATOMIC_LOAD64(&budget.denials);
+  out->degraded = ATOMIC_LOAD64(&budget.degraded);
+} /* SARC_getMemoryUsage */
+
+void SARC_resetMemoryPeak(void) {
+  ATOMIC_STORE64(&budget.peak, ATOMIC_LOAD64(&budget.used));
+  ATOMIC_STORE64(&budget.waits, 0);
+  ATOMIC_STORE64(&budget.denials, 0);
+  ATOMIC_STORE64(&budget.degraded, 0);
+} /* SARC_resetMemoryPeak */
+
+void SARC_setWindowLogMax(uint32_t log) {
+  budget.window_log_max = log;
+} /* SARC_setWindowLogMax */
+
+SARC_memoryPolicy mem_budget_policy(void) {
+  return budget.policy;
+}
+
+uint32_t mem_budget_window_log_max(void) {
+  return budget.window_log_max;
+}
+
+static bool fits(uint64_t size) {
+  uint64_t used = ATOMIC_LOAD64(&budget.used);
+  return used == 0 || used + size <= budget.limit;
+}
+
+bool mem_budget_acquire(uint64_t size, bool can_wait) {
+  if (budget.limit == 0) {
+    take(size);
+    return true;
+  }
+  lock_budget();
+  if (!fits(size) && budget.policy == SARC_MEMORY_WAIT && can_wait) {
+    ATOMIC_ADD64(&budget.waits, 1);
+    LOG_MSG(debug, "Waiting for %llu bytes of memory\n", (unsigned long long)size);
+    while (!fits(size) && budget.limit != 0 && budget.policy == SARC_MEMORY_WAIT) {
+      ZSTD_pthread_cond_wait(&budget.released, &budget.lock);
+    }
+  }
+  bool ok = (budget.limit == 0 || fits(size));
+  if (ok) {
+    take(size);
+  }
+  else if (budget.policy == SARC_MEMORY_DEGRADE) {
+    ATOMIC_ADD64(&budget.degraded, 1);
+  }
+  else {
+    ATOMIC_ADD64(&budget.denials, 1);
+  }
+  ZSTD_pthread_mutex_unlock(&budget.lock);
+  return ok;
+}
+
+bool mem_budget_acquire_buffer(uint64_t size) {
+  if (budget.limit == 0 || budget.policy != SARC_MEMORY_FAIL) {
+    take(size);
+    return true;
+  }
+  lock_budget();
+  bool ok = fits(size);
+  if (ok) {
+    take(size);
+  }
+  else {
+    ATOMIC_ADD64(&budget.denials, 1);
+  }
+  ZSTD_pthread_mutex_unlock(&budget.lock);
+  return ok;
+}
+
+void mem_budget_release(uint64_t size) {
+  ATOMIC_ADD64(&budget.used, (uint64_t)0 - size);
+  lock_budget();
+  ZSTD_pthread_cond_broadcast(&budget.released);
+  ZSTD_pthread_mutex_unlock(&budget.lock);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A process-wide budget for the memory behind open streams: zstd decoders
+// (their window and our staging buffers), and the buffers of files open for
+// writing. Usage is always tracked, so it can be measured before picking a
+// limit. Once there's a limit, opening a zstd stream that doesn't fit fails,
+// shares a decoder or waits, depending on the policy.
+//
+// Nothing PhysicsFS asks of us ever waits for memory. It calls the archiver
+// (mounting, PHYSFS_openRead() and friends) with its state lock held, and
+// PHYSFS_close(), which is what gives memory back, needs the same lock. A
+// wait there would never end.
+
+typedef enum {
+  // Like SARC_MEMORY_FAIL, except for SARC_readBatch() and the workers behind
+  // SARC_readAsync(), which run outside PhysicsFS: their streams block until
+  // other streams are closed. A thread that waits while it holds the streams
+  // that use the budget waits forever.
+  SARC_MEMORY_WAIT,
+  // Opening a stream fails with PHYSFS_ERR_OUT_OF_MEMORY. The default.
+  SARC_MEMORY_FAIL,
+  // The stream is opened without a decoder of its own, and borrows one shared
+  // by every such stream. Whenever another stream used it last, it's rebuilt
+  // by decompressing from the start up to this stream's position, so this
+  // trades a lot of CPU for a fixed amount of memory. The shared decoder is
+  // kept once it's made, and counts against the budget.
+  SARC_MEMORY_DEGRADE
+}SARC_memoryPolicy;
+
+typedef struct {
+  uint64_t limit; // 0 when there's no limit
+  uint64_t used; // Bytes held right now
+  uint64_t peak; // Most bytes held at once
+  uint64_t waits; // Opens that had to wait for memory
+  uint64_t denials; // Opens and writes refused for lack of memory
+  uint64_t degraded; // Streams opened on the shared decoder
+}SARC_memoryUsage;
+
+/// Set the budget for streams opened from now on. Streams that are already
+/// open keep what they have, but count against it.
+/// \param limit Bytes, or 0 for no limit
+void SARC_setMemoryBudget(uint64_t limit, SARC_memoryPolicy policy);
+
+/// Get a snapshot of the budget and its counters.
+void SARC_getMemoryUsage(SARC_memoryUsage* out);
+
+/// Reset the peak to the current usage, and the counters to 0.
+void SARC_resetMemoryPeak(void);
+
+/// Limit the zstd window (2^log bytes) a frame may use. Archives that need a
+/// bigger one fail to open instead of allocating it. 0 for zstd's default
+/// limit (2^27, 128 MiB).
+void SARC_setWindowLogMax(uint32_t log);
+
+// The current policy and window limit (0 if it's zstd's default)
+SARC_memoryPolicy mem_budget_policy(void);
+uint32_t mem_budget_window_log_max(void);
+
+// Take size bytes from the budget for a decoder. Returns false if it doesn't
+// fit, after waiting if the policy is SARC_MEMORY_WAIT and can_wait is set
+// (never from inside a PhysicsFS call, see above). A request bigger than the
+// whole budget is let through when nothing else is using it, so it can't wait
+// forever.
+bool mem_budget_acquire(uint64_t size, bool can_wait);
+
+// Take size bytes for memory that can't wait or be shared (write buffers).
+// Only refused with SARC_MEMORY_FAIL, otherwise it can go over the limit.
+bool mem_budget_acquire_buffer(uint64_t size);
+
+// Give back bytes taken by either function.
+void mem_budget_release(uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,140 +1,81 @@
 #include <physfs.h>
+#include <stdio.h>
 #include <string.h>
 #define __PHYSICSFS_INTERNAL__
 #include <physfs_internal.h>
 
 #include "zstd_io.h"
+#include "archiver_sarc.h"
 #include "physfs_utils.h"
+#include "trace.h"
 #include "logging.h"
 
-typedef struct {
-  char **list;
-  PHYSFS_uint32 size;
-  __PHYSFS_DirTree* tree;
-}EnumStringListCallbackData;
-
-static int locateInStringList(const char *str, char **list, PHYSFS_uint32 *pos) {
-  PHYSFS_uint32 len = *pos;
-  PHYSFS_uint32 half_len;
-  PHYSFS_uint32 lo = 0;
-  PHYSFS_uint32 middle;
-  int cmp;
-
-  while (len > 0) {
-    half_len = len >> 1;
-    middle = lo + half_len;
-    cmp = strcmp(list[middle], str);
-
-    if (cmp == 0) {  /* it's in the list already. */
-      return 1;
-    }
-    else if (cmp > 0) {
-      len = half_len;
+// Tree nodes already hold their full path, so there's nothing to build. We
+// only follow the child and sibling links.
+static PHYSFS_EnumerateCallbackResult walk_entries(__PHYSFS_DirTreeEntry* entry, tree_walk_callback callback, void* data) {
+  for (; entry != NULL; entry = entry->sibling) {
+    PHYSFS_EnumerateCallbackResult result = entry->isdir ?
+      walk_entries(entry->children, callback, data) : callback(data, entry);
+    if (result != PHYSFS_ENUM_OK) {
+      return result;
     }
-    else {
-      lo = middle + 1;
-      len -= half_len + 1;
-    } /* else */
-  } /* while */
-
-  *pos = lo;
-  return 0;
-} /* locateInStringList */
-
-static PHYSFS_EnumerateCallbackResult enumFilesCallback(void* data, const char* origdir, const char *fname) {
-  callback_data* callback = (callback_data*)data;
-
-  // The plus 2 at the end is important! We need space for both the null terminator and the "/" we insert.
-  char* full_path = __PHYSFS_smallAlloc(strlen(origdir) + strlen(fname) + 2);
-  if (full_path == NULL) {
-    return PHYSFS_ENUM_ERROR;
-  }
-
-  // It doesn't want a leading slash, but we need a slash between directories.
-  if (origdir[0] == 0) {
-    // No containing dir.
-    strcpy(full_path, fname);
-  } else {
-    sprintf(full_path, "%s/%s", origdir, fname);
   }
-
-  PHYSFS_Stat statbuf = {0};
-  PHYSFS_stat(full_path, &statbuf);
-  if  (statbuf.filetype == PHYSFS_FILETYPE_DIRECTORY) {
-    __PHYSFS_DirTreeEnumerate(callback->tree, full_path, enumFilesCallback, full_path, data);
-    __PHYSFS_smallFree(full_path);
-  }
-  else {
-    // We've finally got a real file.
-    uint32_t size = strlen(full_path) + 1;
-    char* target = allocator.Malloc(size);
-    if (target == NULL) {
-      return PHYSFS_ENUM_ERROR;
-    }
-    strncpy(target, full_path, size);
-
-    callback->file_list[callback->current] = target;
-    callback->current++;
-  }
-
   return PHYSFS_ENUM_OK;
-} /* enumFilesCallback */
-
-PHYSFS_EnumerateCallbackResult callback_file_count(void *data, const char *origdir, const char *fname) {
-  callback_data* callback = (callback_data*)data;
-  // The plus 2 at the end is important! We need space for both the null terminator and the "/" we insert.
-  char* full_path = __PHYSFS_smallAlloc(strlen(origdir) + strlen(fname) + 2);
-  if (full_path == NULL) {
-    return PHYSFS_ENUM_ERROR;
-  }
+}
 
-  // It doesn't want a leading slash, but we need a slash between directories.
-  if (origdir[0] == 0) {
-    // No containing dir.
-    strcpy(full_path, fname);
-  } else {
-    sprintf(full_path, "%s/%s", origdir, fname);
-  }
+PHYSFS_EnumerateCallbackResult tree_walk(__PHYSFS_DirTree* tree, const char* path, tree_walk_callback callback, void* data) {
+  __PHYSFS_DirTreeEntry* dir = (path == NULL || path[0] == '\0') ? tree->root : __PHYSFS_DirTreeFind(tree, path);
+  BAIL_IF(dir == NULL || !dir->isdir, PHYSFS_ERR_NOT_FOUND, PHYSFS_ENUM_ERROR);
+  return walk_entries(dir->children, callback, data);
+} /* tree_walk */
 
-  PHYSFS_Stat statbuf = {0};
-  PHYSFS_stat(full_path, &statbuf);
-  if  (statbuf.filetype == PHYSFS_FILETYPE_DIRECTORY) {
-    __PHYSFS_DirTreeEnumerate(callback->tree, full_path, callback_file_count, full_path, data);
-  }
-  else {
-    // We've finally got a real file.
-    callback->file_count++;
+typedef struct {
+  __PHYSFS_DirTreeEntry** entries;
+  uint32_t count;
+  uint32_t capacity;
+  size_t name_bytes;
+}tree_listing;
+
+static PHYSFS_EnumerateCallbackResult list_entry(void* data, __PHYSFS_DirTreeEntry* entry) {
+  tree_listing* listing = (tree_listing*)data;
+  if (listing->count == listing->capacity) {
+    uint32_t capacity = (listing->capacity == 0) ? 256 : listing->capacity * 2;
+    __PHYSFS_DirTreeEntry** entries = allocator.Realloc(listing->entries, sizeof(*entries) * capacity);
+    BAIL_IF(entries == NULL, PHYSFS_ERR_OUT_OF_MEMORY, PHYSFS_ENUM_ERROR);
+    listing->entries = entries;
+    listing->capacity = capacity;
   }
-
-  __PHYSFS_smallFree(full_path);
+  listing->entries[listing->count++] = entry;
+  listing->name_bytes += strlen(entry->name) + 1;
   return PHYSFS_ENUM_OK;
 }
 
 char** __PHYSFS_enumerateFilesTree(void* dir_tree, const char *path) {
-  __PHYSFS_DirTree* tree = (__PHYSFS_DirTree*) dir_tree;
-  callback_data data = {
-    .tree = dir_tree,
-    .file_count = 0,
-    .file_list = 0
-  };
-  // Get file count first.
-  __PHYSFS_DirTreeEnumerate(data.tree, path, callback_file_count, path, &data);
-  uint32_t size = (data.file_count + 1) * sizeof(char*);
-  data.file_list = allocator.Malloc(size);
-  memset(data.file_list, 0x00, size);
-
-  BAIL_IF(!data.file_list, PHYSFS_ERR_OUT_OF_MEMORY, NULL);
-  if (!__PHYSFS_DirTreeEnumerate(tree, path, enumFilesCallback, path, &data)) {
-    for (PHYSFS_uint32 i = 0; i < data.file_count; i++) {
-      allocator.Free(data.file_list[i]);
-    }
-    allocator.Free(data.file_list);
+  tree_listing listing = {0};
+  if (tree_walk((__PHYSFS_DirTree*)dir_tree, path, list_entry, &listing) != PHYSFS_ENUM_OK) {
+    allocator.Free(listing.entries);
     return NULL;
   }
 
-  data.file_list[data.file_count] = NULL;
-  return data.file_list;
-} /* PHYSFS_enumerateFiles */
+  // The pointers, then the names they point to, in a single block
+  size_t list_size = sizeof(char*) * (listing.count + 1);
+  char** list = allocator.Malloc(list_size + listing.name_bytes);
+  if (list == NULL) {
+    allocator.Free(listing.entries);
+    BAIL(PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+  }
+  char* arena = (char*)list + list_size;
+  for (uint32_t i = 0; i < listing.count; i++) {
+    size_t size = strlen(listing.entries[i]->name) + 1;
+    memcpy(arena, listing.entries[i]->name, size);
+    list[i] = arena;
+    arena += size;
+  }
+  list[listing.count] = NULL;
+
+  allocator.Free(listing.entries);
+  return list;
+} /* __PHYSFS_enumerateFilesTree */
 
 bool path_has_extension(const char* path, const char* extension) {
     uint32_t pos = strlen(path);
@@ -147,7 +88,18 @@ bool path_has_extension(const char* path, const char* extension) {
     return (strncmp(&path[pos - ext_length], extension, ext_length) == 0);
 }
 
+char* path_join(const char* dir, const char* name) {
+    const char* separator = PHYSFS_getDirSeparator();
+    size_t len = strlen(dir) + strlen(separator) + strlen(name) + 1;
+    char* path = allocator.Malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s%s%s", dir, separator, name);
+    }
+    return path;
+}
+
 void mount_archive_recursive(const char* extension, const char* dir, const char* mountpoint) {
+    TRACE_BEGIN(span);
     const char* base = PHYSFS_getBaseDir();
     char zsdic_path[512] = {0};
     sprintf(zsdic_path, "%s%s%s%s", base, dir, PHYSFS_getDirSeparator(), "/ZsDic.pack.zs");
@@ -167,7 +119,14 @@ void mount_archive_recursive(const char* extension, const char* dir, const char*
             PHYSFS_freeList(file_list);
             return;
         }
-        if (path_has_extension(*i, extension)) {
+        bool matches = false;
+        if (extension == NULL) {
+            matches = SARC_hasArchiveExtension(*i);
+        }
+        else {
+            matches = path_has_extension(*i, extension);
+        }
+        if (matches) {
             char full_path[512] = {0}; // 512 bytes is enough...right?
 
             // Get full virtual filesystem path.
@@ -188,4 +147,5 @@ void mount_archive_recursive(const char* extension, const char* dir, const char*
         }
     }
     PHYSFS_freeList(file_list);
+    TRACE_END(span, "mount_archive_recursive", dir, NULL);
 } /* mount_archive_recursive */
@@ -6,15 +6,25 @@
 #define __PHYSICSFS_INTERNAL__
 #include <physfs_internal.h>
 
-typedef struct {
-  char** file_list;
-  uint32_t file_count;
-  uint32_t current;
-  __PHYSFS_DirTree* tree;
-}callback_data;
+// Called for each file found by tree_walk(). entry->name is its full path in
+// the tree. Return PHYSFS_ENUM_OK to keep going.
+typedef PHYSFS_EnumerateCallbackResult (*tree_walk_callback)(void* data, __PHYSFS_DirTreeEntry* entry);
 
-PHYSFS_EnumerateCallbackResult callback_file_count(void *data, const char *origdir, const char *fname);
+// Visit every file under path in a dir tree ("" for all of them), depth first,
+// in one pass with no allocations. Returns PHYSFS_ENUM_ERROR if path isn't a
+// directory in the tree, otherwise what the last callback returned.
+PHYSFS_EnumerateCallbackResult tree_walk(__PHYSFS_DirTree* tree, const char* path, tree_walk_callback callback, void* data);
+
+// Full paths of every file under path in a dir tree, NULL-terminated. The list
+// and the names are one allocation, freed with a single allocator.Free().
 char** __PHYSFS_enumerateFilesTree(void* dir_tree, const char *path);
 
 bool path_has_extension(const char* path, const char* extension);
+
+// A real directory and a name in it, joined with the platform's separator.
+// Free it with allocator.Free(). NULL if out of memory.
+char* path_join(const char* dir, const char* name);
+
+// Mount every archive in a directory whose name ends in the given extension.
+// Pass NULL to mount everything with a known SARC-family extension.
 void mount_archive_recursive(const char* extension, const char* dir, const char* mountpoint);
@@ -0,0 +1,234 @@
+#include "pio.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+pio_handle pio_open(const char* path) {
+  // FILE_SHARE_DELETE lets pio_replace() replace it while it's open
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return PIO_INVALID;
+  }
+  return (pio_handle)file;
+}
+
+int64_t pio_read(pio_handle handle, void* buf, uint64_t size, uint64_t offset) {
+  uint64_t total = 0;
+  while (total < size) {
+    // ReadFile() takes a 32-bit size, so big reads are split up.
+    DWORD chunk = (DWORD)((size - total > 0x40000000) ? 0x40000000 : (size - total));
+    OVERLAPPED overlapped = {0};
+    overlapped.Offset = (DWORD)(offset + total);
+    overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+    DWORD bytes_read = 0;
+    if (!ReadFile((HANDLE)handle, (char*)buf + total, chunk, &bytes_read, &overlapped)) {
+      return (GetLastError() == ERROR_HANDLE_EOF) ? (int64_t)total : -1;
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+    total += bytes_read;
+  }
+  return (int64_t)total;
+}
+
+void pio_close(pio_handle handle) {
+  if (handle != PIO_INVALID) {
+    CloseHandle((HANDLE)handle);
+  }
+}
+
+bool pio_identify(pio_handle handle, pio_file_id* id) {
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle((HANDLE)handle, &info)) {
+    return false;
+  }
+  id->device = info.dwVolumeSerialNumber;
+  id->index = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+  id->size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  id->modtime = (int64_t)(((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime);
+  return true;
+}
+
+pio_handle pio_create(const char* path) {
+  HANDLE file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return PIO_INVALID;
+  }
+  return (pio_handle)file;
+}
+
+bool pio_write(pio_handle handle, const void* buf, uint64_t size, uint64_t offset) {
+  uint64_t total = 0;
+  while (total < size) {
+    DWORD chunk = (DWORD)((size - total > 0x40000000) ? 0x40000000 : (size - total));
+    OVERLAPPED overlapped = {0};
+    overlapped.Offset = (DWORD)(offset + total);
+    overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+    DWORD written = 0;
+    if (!WriteFile((HANDLE)handle, (const char*)buf + total, chunk, &written, &overlapped) || written == 0) {
+      return false;
+    }
+    total += written;
+  }
+  return true;
+}
+
+bool pio_preallocate(pio_handle handle, uint64_t size) {
+  FILE_ALLOCATION_INFO info = {0};
+  info.AllocationSize.QuadPart = (LONGLONG)size;
+  return SetFileInformationByHandle((HANDLE)handle, FileAllocationInfo, &info, sizeof(info)) != 0;
+}
+
+bool pio_replace(const char* from, const char* to) {
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+void* pio_map(const char* path, uint64_t* size) {
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return NULL;
+  }
+  LARGE_INTEGER file_size = {0};
+  void* addr = NULL;
+  if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+    // The view keeps the file open, so we can close our handles right away
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL) {
+      addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+  if (addr != NULL) {
+    *size = (uint64_t)file_size.QuadPart;
+  }
+  return addr;
+}
+
+void pio_unmap(void* addr, uint64_t size) {
+  if (addr != NULL) {
+    UnmapViewOfFile(addr);
+  }
+}
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+pio_handle pio_open(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return PIO_INVALID;
+  }
+  return (pio_handle)fd;
+}
+
+int64_t pio_read(pio_handle handle, void* buf, uint64_t size, uint64_t offset) {
+  uint64_t total = 0;
+  while (total < size) {
+    ssize_t rc = pread((int)handle, (char*)buf + total, size - total, (off_t)(offset + total));
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (rc == 0) {
+      break;
+    }
+    total += (uint64_t)rc;
+  }
+  return (int64_t)total;
+}
+
+void pio_close(pio_handle handle) {
+  if (handle != PIO_INVALID) {
+    close((int)handle);
+  }
+}
+
+bool pio_identify(pio_handle handle, pio_file_id* id) {
+  struct stat st;
+  if (fstat((int)handle, &st) != 0) {
+    return false;
+  }
+  id->device = (uint64_t)st.st_dev;
+  id->index = (uint64_t)st.st_ino;
+  id->size = (uint64_t)st.st_size;
+  id->modtime = (int64_t)st.st_mtime;
+  return true;
+}
+
+pio_handle pio_create(const char* path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return PIO_INVALID;
+  }
+  return (pio_handle)fd;
+}
+
+bool pio_write(pio_handle handle, const void* buf, uint64_t size, uint64_t offset) {
+  uint64_t total = 0;
+  while (total < size) {
+    ssize_t rc = pwrite((int)handle, (const char*)buf + total, size - total, (off_t)(offset + total));
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    total += (uint64_t)rc;
+  }
+  return true;
+}
+
+bool pio_preallocate(pio_handle handle, uint64_t size) {
+#if defined(__APPLE__)
+  fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)size, 0 };
+  return fcntl((int)handle, F_PREALLOCATE, &store) != -1;
+#else
+  return posix_fallocate((int)handle, 0, (off_t)size) == 0;
+#endif
+}
+
+bool pio_replace(const char* from, const char* to) {
+  return rename(from, to) == 0;
+}
+
+void* pio_map(const char* path, uint64_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  void* addr = NULL;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    // The mapping keeps the file open, so we can close the descriptor
+    addr = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      addr = NULL;
+    }
+  }
+  close(fd);
+  if (addr != NULL) {
+    *size = (uint64_t)info.st_size;
+  }
+  return addr;
+}
+
+void pio_unmap(void* addr, uint64_t size) {
+  if (addr != NULL) {
+    munmap(addr, (size_t)size);
+  }
+}
+#endif
+
+bool pio_same_file(const pio_file_id* a, const pio_file_id* b) {
+  return a->device == b->device && a->index == b->index && a->size == b->size && a->modtime == b->modtime;
+}
@@ -0,0 +1,50 @@
+#pragma once
+// Positional (pread-style) file I/O. Reads take an explicit offset and never
+// touch a shared file cursor, so any number of threads can read through the
+// same handle at once. Contains implementations for Windows and Unix.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef intptr_t pio_handle;
+#define PIO_INVALID ((pio_handle)-1)
+
+// Open a file for reading. Returns PIO_INVALID on failure.
+pio_handle pio_open(const char* path);
+// Read up to size bytes starting at offset. Returns the number of bytes read,
+// or -1 on failure.
+int64_t pio_read(pio_handle handle, void* buf, uint64_t size, uint64_t offset);
+void pio_close(pio_handle handle);
+
+// What an open file is, to tell whether a path still names the same file
+// later on.
+typedef struct {
+  uint64_t device;
+  uint64_t index; // Inode, or the file index on Windows
+  uint64_t size;
+  int64_t modtime;
+}pio_file_id;
+
+// Identify an open file. Returns false on failure.
+bool pio_identify(pio_handle handle, pio_file_id* id);
+// Whether two identities are the same file, unchanged.
+bool pio_same_file(const pio_file_id* a, const pio_file_id* b);
+
+// Create (or truncate) a file for writing. Returns PIO_INVALID on failure.
+pio_handle pio_create(const char* path);
+// Write all of buf at offset. Returns false on failure.
+bool pio_write(pio_handle handle, const void* buf, uint64_t size, uint64_t offset);
+// Reserve size bytes of disk for a file before it's written, so it's laid out
+// in one piece. Only a hint: returns false if the filesystem can't do it, and
+// the file can still be written.
+bool pio_preallocate(pio_handle handle, uint64_t size);
+// Rename from to to, replacing to if it exists, in one step: to is never
+// missing or half written. Handles already open on the old to keep reading it.
+// Returns false on failure.
+bool pio_replace(const char* from, const char* to);
+
+// Map a whole file read-only. Returns NULL on failure or for empty files,
+// otherwise the mapping, with its size in *size.
+void* pio_map(const char* path, uint64_t* size);
+// Unmap a file mapped with pio_map().
+void pio_unmap(void* addr, uint64_t size);
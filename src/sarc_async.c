@@ -0,0 +1,359 @@
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "archiver_sarc_internal.h"
+#include "sarc_async.h"
+#include "threads.h"
+#include "logging.h"
+#include "int.h"
+
+typedef enum {
+    REQUEST_PENDING,
+    REQUEST_RUNNING,
+    REQUEST_DONE,
+    REQUEST_CANCELLED
+}request_state;
+
+struct sarc_async_request {
+    // Links in the pending queue
+    sarc_async_request* prev;
+    sarc_async_request* next;
+
+    SARC_ctx* ctx; // NULL for files that aren't inside a SARC
+    SARCentry* entry;
+    char* path; // Only kept for files outside of a SARC
+
+    void* dest;
+    PHYSFS_uint64 dest_size;
+    s32 priority;
+    u64 sequence; // Submission order, so equal priorities are first-come first-serve
+    sarc_async_callback callback;
+    void* userdata;
+
+    request_state state;
+    PHYSFS_sint64 result;
+    u32 refs; // One for the caller, one for the pool until it's finished
+};
+
+typedef struct {
+    ZSTD_pthread_t thread;
+    // The archive stream this worker has open, and where the last read left it
+    SARC_ctx* ctx;
+    PHYSFS_Io* stream;
+    PHYSFS_uint64 stream_pos;
+}async_worker;
+
+static struct {
+    ZSTD_pthread_mutex_t lock;
+    ZSTD_pthread_cond_t work_available;
+    ZSTD_pthread_cond_t request_done;
+    sarc_async_request* pending;
+    u64 next_sequence;
+    async_worker* workers;
+    u32 worker_count;
+    u32 live_requests; // Requests not freed yet, which still use the lock
+    bool running;
+}pool;
+
+// Must hold the pool lock.
+static void request_release_locked(sarc_async_request* request) {
+    request->refs--;
+    if (request->refs == 0) {
+        allocator.Free(request->path);
+        allocator.Free(request);
+        pool.live_requests--;
+        if (pool.live_requests == 0) {
+            ZSTD_pthread_cond_broadcast(&pool.request_done);
+        }
+    }
+}
+
+// Must hold the pool lock.
+static void queue_unlink(sarc_async_request* request) {
+    if (request->prev != NULL) {
+        request->prev->next = request->next;
+    }
+    else {
+        pool.pending = request->next;
+    }
+    if (request->next != NULL) {
+        request->next->prev = request->prev;
+    }
+    request->prev = NULL;
+    request->next = NULL;
+}
+
+// Whether this request can be served by moving forward in the worker's stream
+static bool continues_stream(const sarc_async_request* request, const async_worker* worker) {
+    return worker->stream != NULL && request->ctx == worker->ctx && request->entry->startPos >= worker->stream_pos;
+}
+
+static bool request_is_better(const sarc_async_request* a, const sarc_async_request* b, const async_worker* worker) {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    // Stay on the archive we already have open. Seeking backwards (or opening
+    // a different archive) means decompressing from the start again.
+    bool a_continues = continues_stream(a, worker);
+    bool b_continues = continues_stream(b, worker);
+    if (a_continues != b_continues) {
+        return a_continues;
+    }
+    if (a_continues) {
+        return a->entry->startPos < b->entry->startPos;
+    }
+    return a->sequence < b->sequence;
+}
+
+// Must hold the pool lock, and the queue must not be empty.
+static sarc_async_request* queue_pick(const async_worker* worker) {
+    sarc_async_request* best = pool.pending;
+    for (sarc_async_request* i = best->next; i != NULL; i = i->next) {
+        if (request_is_better(i, best, worker)) {
+            best = i;
+        }
+    }
+    queue_unlink(best);
+    return best;
+}
+
+static void worker_close_stream(async_worker* worker) {
+    if (worker->stream != NULL) {
+        worker->stream->destroy(worker->stream);
+    }
+    worker->stream = NULL;
+    worker->ctx = NULL;
+    worker->stream_pos = 0;
+}
+
+static PHYSFS_sint64 worker_read(async_worker* worker, sarc_async_request* request) {
+    if (request->ctx == NULL) {
+        PHYSFS_File* file = PHYSFS_openRead(request->path);
+        if (file == NULL) {
+            return -1;
+        }
+        PHYSFS_sint64 rc = PHYSFS_readBytes(file, request->dest, request->dest_size);
+        PHYSFS_close(file);
+        return rc;
+    }
+
+    if (worker->ctx != request->ctx || worker->stream == NULL) {
+        worker_close_stream(worker);
+        worker->stream = SARC_openStreamWaiting(request->ctx);
+        if (worker->stream == NULL) {
+            LOG_MSG(error, "Failed to open %s\n", request->ctx->arc_filename);
+            return -1;
+        }
+        worker->ctx = request->ctx;
+    }
+
+    const SARCentry* entry = request->entry;
+    if (!worker->stream->seek(worker->stream, entry->startPos)) {
+        worker_close_stream(worker);
+        return -1;
+    }
+    PHYSFS_sint64 rc = worker->stream->read(worker->stream, request->dest, MIN(entry->size, request->dest_size));
+    worker->stream_pos = entry->startPos + MAX(rc, 0);
+    return rc;
+}
+
+static void* worker_main(void* opaque) {
+    async_worker* worker = (async_worker*)opaque;
+
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.running && pool.pending == NULL) {
+            if (worker->stream != NULL) {
+                // Don't hold on to archives while we're idle, they might be
+                // unmounted before the next request comes in.
+                ZSTD_pthread_mutex_unlock(&pool.lock);
+                worker_close_stream(worker);
+                ZSTD_pthread_mutex_lock(&pool.lock);
+                continue;
+            }
+            ZSTD_pthread_cond_wait(&pool.work_available, &pool.lock);
+        }
+        if (!pool.running) {
+            break;
+        }
+
+        sarc_async_request* request = queue_pick(worker);
+        request->state = REQUEST_RUNNING;
+        ZSTD_pthread_mutex_unlock(&pool.lock);
+
+        PHYSFS_sint64 result = worker_read(worker, request);
+        request->result = result;
+        if (request->callback != NULL) {
+            request->callback(request, result, request->userdata);
+        }
+
+        ZSTD_pthread_mutex_lock(&pool.lock);
+        request->state = REQUEST_DONE;
+        ZSTD_pthread_cond_broadcast(&pool.request_done);
+        request_release_locked(request);
+    }
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+
+    worker_close_stream(worker);
+    return NULL;
+}
+
+bool SARC_asyncInit(uint32_t thread_count) {
+    if (pool.running) {
+        return true;
+    }
+    if (thread_count == 0) {
+        thread_count = thread_core_count();
+    }
+
+    pool.workers = allocator.Malloc(sizeof(*pool.workers) * thread_count);
+    BAIL_IF(!pool.workers, PHYSFS_ERR_OUT_OF_MEMORY, false);
+    memset(pool.workers, 0x00, sizeof(*pool.workers) * thread_count);
+
+    ZSTD_pthread_mutex_init(&pool.lock, NULL);
+    ZSTD_pthread_cond_init(&pool.work_available, NULL);
+    ZSTD_pthread_cond_init(&pool.request_done, NULL);
+    pool.pending = NULL;
+    pool.next_sequence = 0;
+    pool.live_requests = 0;
+    pool.running = true;
+
+    pool.worker_count = 0;
+    for (u32 i = 0; i < thread_count; i++) {
+        if (ZSTD_pthread_create(&pool.workers[i].thread, NULL, worker_main, &pool.workers[i]) != 0) {
+            LOG_MSG(warning, "Only started %d of %d worker threads\n", i, thread_count);
+            break;
+        }
+        pool.worker_count++;
+    }
+    if (pool.worker_count == 0) {
+        SARC_asyncDeinit();
+        BAIL(PHYSFS_ERR_OS_ERROR, false);
+    }
+
+    return true;
+} /* SARC_asyncInit */
+
+void SARC_asyncDeinit(void) {
+    if (pool.workers == NULL) {
+        return;
+    }
+
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    pool.running = false;
+    while (pool.pending != NULL) {
+        sarc_async_request* request = pool.pending;
+        queue_unlink(request);
+        request->state = REQUEST_CANCELLED;
+        request->result = -1;
+        request_release_locked(request);
+    }
+    ZSTD_pthread_cond_broadcast(&pool.work_available);
+    ZSTD_pthread_cond_broadcast(&pool.request_done);
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+
+    for (u32 i = 0; i < pool.worker_count; i++) {
+        ZSTD_pthread_join(pool.workers[i].thread);
+    }
+
+    // Handles the caller still has lock the pool when they're waited on or
+    // released, so it has to outlive them
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    if (pool.live_requests > 0) {
+        LOG_MSG(debug, "Waiting for %u async requests to be released\n", pool.live_requests);
+    }
+    while (pool.live_requests > 0) {
+        ZSTD_pthread_cond_wait(&pool.request_done, &pool.lock);
+    }
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+
+    ZSTD_pthread_cond_destroy(&pool.request_done);
+    ZSTD_pthread_cond_destroy(&pool.work_available);
+    ZSTD_pthread_mutex_destroy(&pool.lock);
+    allocator.Free(pool.workers);
+    pool.workers = NULL;
+    pool.worker_count = 0;
+} /* SARC_asyncDeinit */
+
+sarc_async_request* SARC_readAsync(const char* path, void* dest, PHYSFS_uint64 dest_size, int32_t priority, sarc_async_callback callback, void* userdata) {
+    BAIL_IF(!pool.running, PHYSFS_ERR_NOT_INITIALIZED, NULL);
+    BAIL_IF(!path || !dest, PHYSFS_ERR_INVALID_ARGUMENT, NULL);
+
+    sarc_async_request* request = allocator.Malloc(sizeof(*request));
+    BAIL_IF(!request, PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+    memset(request, 0x00, sizeof(*request));
+
+    // Resolve the archive now, so the scheduler can group requests by archive.
+    request->entry = SARC_resolvePath(path, &request->ctx);
+    if (request->entry == NULL) {
+        request->ctx = NULL;
+        request->path = allocator.Malloc(strlen(path) + 1);
+        if (request->path == NULL) {
+            allocator.Free(request);
+            BAIL(PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+        }
+        strcpy(request->path, path);
+    }
+
+    request->dest = dest;
+    request->dest_size = dest_size;
+    request->priority = priority;
+    request->callback = callback;
+    request->userdata = userdata;
+    request->state = REQUEST_PENDING;
+    request->result = -1;
+    request->refs = 2;
+
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    pool.live_requests++;
+    request->sequence = pool.next_sequence++;
+    request->next = pool.pending;
+    if (pool.pending != NULL) {
+        pool.pending->prev = request;
+    }
+    pool.pending = request;
+    ZSTD_pthread_cond_signal(&pool.work_available);
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+
+    return request;
+} /* SARC_readAsync */
+
+bool SARC_asyncCancel(sarc_async_request* request) {
+    bool cancelled = false;
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    if (request->state == REQUEST_PENDING) {
+        queue_unlink(request);
+        request->state = REQUEST_CANCELLED;
+        request->result = -1;
+        ZSTD_pthread_cond_broadcast(&pool.request_done);
+        request_release_locked(request);
+        cancelled = true;
+    }
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+    return cancelled;
+} /* SARC_asyncCancel */
+
+bool SARC_asyncIsDone(sarc_async_request* request) {
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    bool done = (request->state == REQUEST_DONE || request->state == REQUEST_CANCELLED);
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+    return done;
+} /* SARC_asyncIsDone */
+
+PHYSFS_sint64 SARC_asyncWait(sarc_async_request* request) {
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    while (request->state == REQUEST_PENDING || request->state == REQUEST_RUNNING) {
+        ZSTD_pthread_cond_wait(&pool.request_done, &pool.lock);
+    }
+    PHYSFS_sint64 result = request->result;
+    request_release_locked(request);
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+    return result;
+} /* SARC_asyncWait */
+
+void SARC_asyncRelease(sarc_async_request* request) {
+    ZSTD_pthread_mutex_lock(&pool.lock);
+    request_release_locked(request);
+    ZSTD_pthread_mutex_unlock(&pool.lock);
+} /* SARC_asyncRelease */
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <physfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Asynchronous file reads on a pool of worker threads. Requests are picked by
+// priority, and workers prefer requests from the archive they already have
+// open so they can keep using the same decompressor instead of starting a new
+// stream from the beginning of the file.
+//
+// Archives must stay mounted until every request that reads from them has
+// finished or been cancelled.
+
+typedef struct sarc_async_request sarc_async_request;
+
+// Called on a worker thread once a request is finished. result is the number
+// of bytes read, or -1 on failure. Not called for cancelled requests.
+typedef void (*sarc_async_callback)(sarc_async_request* request, PHYSFS_sint64 result, void* userdata);
+
+/// Start the worker threads.
+/// \param thread_count Number of workers, or 0 to use one per CPU core.
+bool SARC_asyncInit(uint32_t thread_count);
+
+/// Stop the worker threads. Requests that haven't started are cancelled, and
+/// it then waits until every handle has been passed to SARC_asyncWait() or
+/// SARC_asyncRelease(), so the thread calling it mustn't hold any itself.
+void SARC_asyncDeinit(void);
+
+/// Queue a file to be read into a buffer.
+/// \param path Virtual path of the file
+/// \param dest Buffer to read into. Must stay valid until the request is done.
+/// \param dest_size Size of dest. Larger files are truncated to fit.
+/// \param priority Higher priorities are read first
+/// \param callback Completion callback, may be NULL.
+/// \param userdata Passed to the callback
+/// \return A handle that must be passed to SARC_asyncWait() or
+/// SARC_asyncRelease() once you're done with it, or NULL on failure.
+sarc_async_request* SARC_readAsync(const char* path, void* dest, PHYSFS_uint64 dest_size, int32_t priority, sarc_async_callback callback, void* userdata);
+
+/// Cancel a request if it hasn't started yet.
+/// \return true if the request was cancelled, false if it already started.
+bool SARC_asyncCancel(sarc_async_request* request);
+
+/// Check if a request has finished (or was cancelled) without blocking.
+bool SARC_asyncIsDone(sarc_async_request* request);
+
+/// Block until a request is finished, then release it.
+/// \return Bytes read, or -1 if the read failed or was cancelled.
+PHYSFS_sint64 SARC_asyncWait(sarc_async_request* request);
+
+/// Release a request without waiting for it. The read still happens (unless
+/// cancelled) and the callback still runs.
+void SARC_asyncRelease(sarc_async_request* request);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "archiver_sarc_internal.h"
+#include "sarc_batch.h"
+#include "logging.h"
+#include "int.h"
+
+typedef struct {
+    sarc_batch_request* request;
+    SARC_ctx* ctx; // NULL for files that aren't inside a SARC
+    SARCentry* entry;
+}batch_item;
+
+// Sort by archive, then by position inside the archive.
+static int batch_item_compare(const void* a, const void* b) {
+    const batch_item* item_a = (const batch_item*)a;
+    const batch_item* item_b = (const batch_item*)b;
+    uintptr_t ctx_a = (uintptr_t)item_a->ctx;
+    uintptr_t ctx_b = (uintptr_t)item_b->ctx;
+    if (ctx_a != ctx_b) {
+        return (ctx_a < ctx_b) ? -1 : 1;
+    }
+    if (item_a->ctx == NULL) {
+        return 0;
+    }
+    if (item_a->entry->startPos != item_b->entry->startPos) {
+        return (item_a->entry->startPos < item_b->entry->startPos) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Files from a directory or other archiver go through PhysicsFS as usual.
+static PHYSFS_sint64 read_loose_file(sarc_batch_request* request) {
+    PHYSFS_File* file = PHYSFS_openRead(request->path);
+    if (file == NULL) {
+        return -1;
+    }
+    PHYSFS_sint64 rc = PHYSFS_readBytes(file, request->dest, request->dest_size);
+    PHYSFS_close(file);
+    return rc;
+}
+
+static PHYSFS_sint64 read_entry(PHYSFS_Io* stream, const SARCentry* entry, sarc_batch_request* request) {
+    PHYSFS_uint64 size = MIN(entry->size, request->dest_size);
+    if (!stream->seek(stream, entry->startPos)) {
+        return -1;
+    }
+    return stream->read(stream, request->dest, size);
+}
+
+PHYSFS_uint32 SARC_readBatch(sarc_batch_request* requests, PHYSFS_uint32 count, sarc_batch_callback callback, void* userdata) {
+    PHYSFS_uint32 succeeded = 0;
+    if (count == 0) {
+        return 0;
+    }
+
+    batch_item* items = allocator.Malloc(sizeof(*items) * count);
+    BAIL_IF(!items, PHYSFS_ERR_OUT_OF_MEMORY, 0);
+
+    for (PHYSFS_uint32 i = 0; i < count; i++) {
+        items[i].request = &requests[i];
+        items[i].ctx = NULL;
+        items[i].entry = SARC_resolvePath(requests[i].path, &items[i].ctx);
+        if (items[i].entry == NULL) {
+            items[i].ctx = NULL;
+        }
+    }
+    qsort(items, count, sizeof(*items), batch_item_compare);
+
+    PHYSFS_uint32 i = 0;
+    while (i < count) {
+        SARC_ctx* ctx = items[i].ctx;
+        if (ctx == NULL) {
+            items[i].request->result = read_loose_file(items[i].request);
+            succeeded += (items[i].request->result >= 0);
+            if (callback != NULL) {
+                callback(items[i].request, userdata);
+            }
+            i++;
+            continue;
+        }
+
+        // One stream for the whole archive. Since the entries are sorted,
+        // every seek is forwards and zstd never has to restart.
+        PHYSFS_Io* stream = SARC_openStreamWaiting(ctx);
+        if (stream == NULL) {
+            LOG_MSG(error, "Failed to open %s\n", ctx->arc_filename);
+        }
+        for (; i < count && items[i].ctx == ctx; i++) {
+            sarc_batch_request* request = items[i].request;
+            request->result = -1;
+            if (stream != NULL) {
+                request->result = read_entry(stream, items[i].entry, request);
+            }
+            succeeded += (request->result >= 0);
+            if (callback != NULL) {
+                callback(request, userdata);
+            }
+        }
+        if (stream != NULL) {
+            stream->destroy(stream);
+        }
+    }
+
+    allocator.Free(items);
+    return succeeded;
+} /* SARC_readBatch */
@@ -0,0 +1,35 @@
+#pragma once
+#include <physfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Batched reads of many files at once. Requests are grouped by archive and
+// sorted by their position inside it, so each archive is read front to back in
+// a single pass with one decompression stream, instead of every file seeking
+// (and decompressing from the start) on its own handle.
+
+typedef struct {
+    const char* path; // Virtual path of the file to read
+    void* dest; // Buffer to read the file into
+    PHYSFS_uint64 dest_size; // Size of dest. Larger files are truncated to fit.
+    PHYSFS_sint64 result; // Bytes read, or -1 on failure. Set by SARC_readBatch().
+    void* userdata; // Not touched by the batch reader
+}sarc_batch_request;
+
+// Called once for each request as soon as its data is in place (or it failed)
+typedef void (*sarc_batch_callback)(sarc_batch_request* request, void* userdata);
+
+/// Read a list of files, filling every destination buffer.
+/// \param requests Files to read. Order doesn't matter, they're reordered
+/// internally (the array itself isn't modified other than the result field).
+/// \param count Number of requests
+/// \param callback Completion callback, may be NULL.
+/// \param userdata Passed to the callback
+/// \return The number of requests that were read successfully.
+PHYSFS_uint32 SARC_readBatch(sarc_batch_request* requests, PHYSFS_uint32 count, sarc_batch_callback callback, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#include <sys/utime.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include <zstd.h>
+#include <common/xxhash.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc.h"
+#include "sarc_cache.h"
+#include "sarc_stats.h"
+#include "zstd_io.h"
+#include "pio.h"
+#include "physfs_utils.h"
+#include "atomics.h"
+#include "logging.h"
+
+#define CACHE_EXTENSION ".sarc"
+
+static char* cache_dir = NULL;
+static uint64_t cache_max_bytes = 0;
+
+void SARC_setCacheDir(const char* dir, uint64_t max_bytes) {
+  allocator.Free(cache_dir);
+  cache_dir = NULL;
+  cache_max_bytes = max_bytes;
+  if (dir == NULL) {
+    return;
+  }
+
+  cache_dir = allocator.Malloc(strlen(dir) + 1);
+  if (cache_dir == NULL) {
+    return;
+  }
+  strcpy(cache_dir, dir);
+  // Fails harmlessly if it's already there
+  __PHYSFS_platformMkDir(dir);
+} /* SARC_setCacheDir */
+
+static char* cache_path(const char* fname) {
+  return path_join(cache_dir, fname);
+}
+
+uint64_t sarc_cache_key(const char* arc_filename, const PHYSFS_Stat* stat) {
+  uint64_t fields[2] = { (uint64_t)stat->filesize, (uint64_t)stat->modtime };
+  uint64_t seed = XXH64(arc_filename, strlen(arc_filename), 0);
+  return XXH64(fields, sizeof(fields), seed);
+}
+
+// Images are exactly archive_size bytes long (cache_map() checks), so that's
+// all we need to unmap them.
+static void cache_unmap(void* data) {
+  pio_unmap(data, ((const sarc_header*)data)->archive_size);
+}
+
+// Map an image and make sure it's a complete SARC.
+static PHYSFS_Io* cache_map(const char* path) {
+  uint64_t size = 0;
+  void* data = pio_map(path, &size);
+  if (data == NULL) {
+    return NULL;
+  }
+  const sarc_header* header = (const sarc_header*)data;
+  if (size < sizeof(*header) || header->magic != SARC_MAGIC || header->archive_size != size) {
+    LOG_MSG(warning, "Ignoring broken cache image %s\n", path);
+    pio_unmap(data, size);
+    return NULL;
+  }
+
+  PHYSFS_Io* io = __PHYSFS_createMemoryIo(data, size, cache_unmap);
+  if (io == NULL) {
+    pio_unmap(data, size);
+  }
+  return io;
+}
+
+// Modification times stand in for access times, which often aren't updated.
+static void cache_touch(const char* path) {
+  utime(path, NULL);
+}
+
+// Decompress an archive to path. It's written under a temporary name and
+// renamed once it's complete, so a crash never leaves a truncated image. The
+// name is unique to this process and call, so two fills of the same archive
+// never write to the same file.
+static bool cache_fill(PHYSFS_Io* io, const char* path) {
+  static uint64_t fill_count = 0;
+  size_t temp_len = strlen(path) + 48;
+  char* temp_path = allocator.Malloc(temp_len);
+  // Our own cursor, so the caller's IO isn't moved
+  PHYSFS_Io* source = io->duplicate(io);
+  ZSTD_DCtx* dctx = ZSTD_createDCtx();
+  size_t in_size = ZSTD_DStreamInSize();
+  size_t out_size = ZSTD_DStreamOutSize();
+  void* in_buf = allocator.Malloc(in_size);
+  void* out_buf = allocator.Malloc(out_size);
+  PHYSFS_Io* out = NULL;
+  bool ok = false;
+  if (temp_path == NULL || source == NULL || dctx == NULL || in_buf == NULL || out_buf == NULL) {
+    goto fill_done;
+  }
+  snprintf(temp_path, temp_len, "%s.%llu-%llu.tmp", path, (unsigned long long)getpid(),
+           (unsigned long long)ATOMIC_ADD64(&fill_count, 1));
+  out = __PHYSFS_createNativeIo(temp_path, 'w');
+  if (out == NULL) {
+    LOG_MSG(warning, "Can't write to the cache at %s\n", temp_path);
+    goto fill_done;
+  }
+  zstd_io_ref_dicts(dctx);
+
+  source->seek(source, 0);
+  ok = true;
+  PHYSFS_sint64 read = 0;
+  // 0 once the last frame is complete
+  size_t rc = 1;
+  while (ok && (read = source->read(source, in_buf, in_size)) > 0) {
+    ZSTD_inBuffer in = { in_buf, (size_t)read, 0 };
+    ZSTD_outBuffer out_buffer = { out_buf, out_size, 0 };
+    // Keep going until the input is used up and the output stops filling
+    do {
+      out_buffer.pos = 0;
+      rc = ZSTD_decompressStream(dctx, &out_buffer, &in);
+      if (ZSTD_isError(rc)) {
+        LOG_MSG(warning, "Can't decompress into the cache [%s]\n", ZSTD_getErrorName(rc));
+        ok = false;
+        break;
+      }
+      if (out->write(out, out_buf, out_buffer.pos) != (PHYSFS_sint64)out_buffer.pos) {
+        LOG_MSG(warning, "Failed to write %s\n", temp_path);
+        ok = false;
+        break;
+      }
+    } while (in.pos < in.size || out_buffer.pos == out_buffer.size);
+  }
+  ok = ok && (read == 0);
+  if (ok && rc != 0) {
+    LOG_MSG(warning, "Can't decompress into the cache, the archive is truncated\n");
+    ok = false;
+  }
+
+fill_done:
+  if (out != NULL) {
+    out->destroy(out);
+    if (ok && rename(temp_path, path) != 0) {
+      // Another process may have just cached the same archive
+      LOG_MSG(debug, "Can't rename %s\n", temp_path);
+      ok = false;
+    }
+    if (!ok) {
+      __PHYSFS_platformDelete(temp_path);
+    }
+  }
+  if (source != NULL) {
+    source->destroy(source);
+  }
+  ZSTD_freeDCtx(dctx);
+  allocator.Free(in_buf);
+  allocator.Free(out_buf);
+  allocator.Free(temp_path);
+  return ok;
+}
+
+typedef struct {
+  char* path;
+  uint64_t size;
+  int64_t modtime;
+}cache_image;
+
+typedef struct {
+  cache_image* images;
+  uint32_t count;
+  uint32_t capacity;
+  uint64_t total_size;
+}cache_listing;
+
+static PHYSFS_EnumerateCallbackResult list_images(void* data, const char* origdir, const char* fname) {
+  cache_listing* listing = (cache_listing*)data;
+  size_t len = strlen(fname);
+  size_t ext_len = strlen(CACHE_EXTENSION);
+  if (len < ext_len || strcmp(fname + len - ext_len, CACHE_EXTENSION) != 0) {
+    return PHYSFS_ENUM_OK;
+  }
+
+  char* path = cache_path(fname);
+  PHYSFS_Stat stat = {0};
+  if (path == NULL || !__PHYSFS_platformStat(path, &stat, 0)) {
+    allocator.Free(path);
+    return PHYSFS_ENUM_OK;
+  }
+  if (listing->count == listing->capacity) {
+    uint32_t capacity = (listing->capacity == 0) ? 64 : listing->capacity * 2;
+    cache_image* images = allocator.Realloc(listing->images, sizeof(*images) * capacity);
+    if (images == NULL) {
+      allocator.Free(path);
+      return PHYSFS_ENUM_STOP;
+    }
+    listing->images = images;
+    listing->capacity = capacity;
+  }
+  listing->images[listing->count++] = (cache_image) {
+    .path = path,
+    .size = (uint64_t)stat.filesize,
+    .modtime = stat.modtime
+  };
+  listing->total_size += (uint64_t)stat.filesize;
+  return PHYSFS_ENUM_OK;
+}
+
+static int compare_modtimes(const void* a, const void* b) {
+  const cache_image* left = (const cache_image*)a;
+  const cache_image* right = (const cache_image*)b;
+  if (left->modtime != right->modtime) {
+    return (left->modtime < right->modtime) ? -1 : 1;
+  }
+  return 0;
+}
+
+// Delete the least recently used images until the cache fits in its limit.
+// keep is the image that was just added, which is never deleted.
+static void cache_evict(const char* keep) {
+  if (cache_max_bytes == 0) {
+    return;
+  }
+  cache_listing listing = {0};
+  __PHYSFS_platformEnumerate(cache_dir, list_images, cache_dir, &listing);
+
+  qsort(listing.images, listing.count, sizeof(*listing.images), compare_modtimes);
+  for (uint32_t i = 0; i < listing.count && listing.total_size > cache_max_bytes; i++) {
+    cache_image* image = &listing.images[i];
+    if (strcmp(image->path, keep) != 0 && __PHYSFS_platformDelete(image->path)) {
+      LOG_MSG(debug, "Evicted %s from the cache\n", image->path);
+      listing.total_size -= image->size;
+    }
+  }
+
+  for (uint32_t i = 0; i < listing.count; i++) {
+    allocator.Free(listing.images[i].path);
+  }
+  allocator.Free(listing.images);
+}
+
+PHYSFS_Io* sarc_cache_open(PHYSFS_Io* io, const char* arc_filename) {
+  if (cache_dir == NULL) {
+    return NULL;
+  }
+  PHYSFS_Stat stat = {0};
+  if (!__PHYSFS_platformStat(arc_filename, &stat, 1)) {
+    return NULL; // Not a real file
+  }
+
+  char fname[32] = {0};
+  snprintf(fname, sizeof(fname), "%016llx%s", (unsigned long long)sarc_cache_key(arc_filename, &stat), CACHE_EXTENSION);
+  char* path = cache_path(fname);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  PHYSFS_Io* cached = NULL;
+  PHYSFS_Stat image_stat = {0};
+  if (__PHYSFS_platformStat(path, &image_stat, 0)) {
+    cached = cache_map(path);
+    if (cached != NULL) {
+      cache_touch(path);
+      SARC_STATS_ADD(NULL, cache_hits, 1);
+    }
+  }
+  if (cached == NULL && cache_fill(io, path)) {
+    LOG_MSG(debug, "Cached %s as %s\n", arc_filename, path);
+    SARC_STATS_ADD(NULL, cache_misses, 1);
+    cache_evict(path);
+    cached = cache_map(path);
+  }
+  allocator.Free(path);
+  return cached;
+}
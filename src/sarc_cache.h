@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+
+#include <physfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Persistent cache of decompressed archives. The first time a zstd archive is
+// mounted it's decompressed into the cache directory, and from then on it's
+// mounted from that copy, mapped into memory, like an uncompressed SARC. Tools
+// that restart often don't pay for decompression again until the archive
+// changes.
+//
+// Cache images are named after a hash of the archive's real path, size and
+// modification time. Editing an archive gives it a new image, and the old one
+// ages out. Archives that aren't real files (inside other archives, etc.)
+// aren't cached.
+
+/// Turn the cache on for archives mounted from now on.
+/// \param dir Cache directory, created if it doesn't exist. NULL turns the
+/// cache off.
+/// \param max_bytes Size limit for the directory. The least recently used
+/// images are deleted when it's exceeded. 0 for no limit.
+void SARC_setCacheDir(const char* dir, uint64_t max_bytes);
+
+// Get an IO over the decompressed copy of a zstd archive, decompressing it
+// into the cache first if needed. io is the compressed archive, and isn't
+// moved. Returns NULL if the cache is off or anything goes wrong, in which case
+// the archive should be mounted as usual.
+PHYSFS_Io* sarc_cache_open(PHYSFS_Io* io, const char* arc_filename);
+
+// Key naming the decompressed copy of an archive, from its real path, size
+// and modification time.
+uint64_t sarc_cache_key(const char* arc_filename, const PHYSFS_Stat* stat);
+
+#ifdef __cplusplus
+}
+#endif
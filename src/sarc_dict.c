@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+#define ZDICT_STATIC_LINKING_ONLY
+#include <zdict.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc_dict.h"
+#include "archiver_sarc_internal.h"
+#include "zstd_io.h"
+#include "pio.h"
+#include "threads.h"
+#include "trace.h"
+#include "logging.h"
+#include "int.h"
+
+// The same default as the zstd CLI
+#define DICT_DEFAULT_SIZE 112640
+// Longer entries only contribute their start. Dictionaries mostly help the
+// first few KiB of a frame anyway, and this keeps big files from crowding out
+// the rest of the samples.
+#define DICT_SAMPLE_LIMIT 0x20000
+
+typedef struct {
+  const char* extension;
+  uint64_t entries; // Entries that match
+  uint64_t bytes; // Sample bytes they'd give, after DICT_SAMPLE_LIMIT
+}dict_census;
+
+typedef struct {
+  SARCentry* entry;
+  const char* name;
+}dict_pick;
+
+// Entries picked from one archive, which stays pinned until they're read
+typedef struct {
+  SARC_ctx* ctx;
+  dict_pick* picks;
+  uint32_t count;
+}dict_archive;
+
+typedef struct {
+  const char* extension;
+  uint64_t stride; // Take every stride'th matching entry
+  uint64_t index; // Matching entries seen so far, across archives
+  dict_archive* archives;
+  uint32_t archive_count;
+  uint32_t archive_capacity;
+  uint32_t picked; // Across archives, never more than max_count
+  uint8_t* buffer; // Samples, back to back
+  uint64_t capacity;
+  uint64_t used;
+  size_t* sizes;
+  uint32_t count;
+  uint32_t max_count;
+  bool failed;
+}dict_samples;
+
+static bool name_matches(const char* name, const char* extension) {
+  if (extension == NULL) {
+    return true;
+  }
+  size_t len = strlen(name);
+  size_t ext_len = strlen(extension);
+  return len >= ext_len && strcmp(&name[len - ext_len], extension) == 0;
+}
+
+static uint64_t sample_size(const SARCentry* entry) {
+  return MIN(entry->size, DICT_SAMPLE_LIMIT);
+}
+
+static void count_entries(SARC_ctx* ctx, void* data) {
+  dict_census* census = (dict_census*)data;
+  char** names = get_file_list(ctx->tree.root, false);
+  for (char** i = names; i != NULL && *i != NULL; i++) {
+    SARCentry* entry = findEntry(ctx, *i);
+    if (entry != NULL && entry->size > 0 && name_matches(*i, census->extension)) {
+      census->entries++;
+      census->bytes += sample_size(entry);
+    }
+  }
+  allocator.Free(names);
+}
+
+static int compare_picks(const void* a, const void* b) {
+  return SARC_compareEntrySources(((const dict_pick*)a)->entry, ((const dict_pick*)b)->entry);
+}
+
+// Pick the entries to sample from one archive. This runs with the registry
+// locked, so it only takes names and pins the archive: the reads happen in
+// read_samples() once the walk is over.
+static void pick_samples(SARC_ctx* ctx, void* data) {
+  dict_samples* samples = (dict_samples*)data;
+  if (samples->failed || samples->picked == samples->max_count) {
+    return;
+  }
+  if (samples->archive_count == samples->archive_capacity) {
+    uint32_t capacity = (samples->archive_capacity == 0) ? 16 : samples->archive_capacity * 2;
+    dict_archive* archives = allocator.Realloc(samples->archives, sizeof(*archives) * capacity);
+    if (archives == NULL) {
+      LOG_MSG(error, "Out of memory sampling %s\n", ctx->arc_filename);
+      samples->failed = true;
+      return;
+    }
+    samples->archives = archives;
+    samples->archive_capacity = capacity;
+  }
+  char** names = get_file_list(ctx->tree.root, false);
+  uint32_t name_count = 0;
+  while (names != NULL && names[name_count] != NULL) {
+    name_count++;
+  }
+  dict_pick* picks = allocator.Malloc(sizeof(*picks) * (name_count + 1));
+  if (names == NULL || picks == NULL) {
+    LOG_MSG(error, "Out of memory sampling %s\n", ctx->arc_filename);
+    samples->failed = true;
+    allocator.Free(picks);
+    allocator.Free(names);
+    return;
+  }
+
+  // Pick evenly through every archive, rather than filling up on the first
+  uint32_t pick_count = 0;
+  for (uint32_t i = 0; i < name_count && samples->picked < samples->max_count; i++) {
+    SARCentry* entry = findEntry(ctx, names[i]);
+    if (entry == NULL || entry->size == 0 || !name_matches(names[i], samples->extension)) {
+      continue;
+    }
+    if (samples->index++ % samples->stride == 0) {
+      picks[pick_count++] = (dict_pick) { entry, names[i] };
+      samples->picked++;
+    }
+  }
+  allocator.Free(names);
+  if (pick_count == 0) {
+    allocator.Free(picks);
+    return;
+  }
+  SARC_pinArchiveLocked(ctx);
+  samples->archives[samples->archive_count++] = (dict_archive) { ctx, picks, pick_count };
+}
+
+// Read one archive's picks into the sample buffer, in storage order
+static void read_samples(dict_samples* samples, dict_archive* archive) {
+  SARC_ctx* ctx = archive->ctx;
+  dict_pick* picks = archive->picks;
+  qsort(picks, archive->count, sizeof(*picks), compare_picks);
+
+  PHYSFS_Io* base = NULL;
+  PHYSFS_Io* overlay = NULL;
+  for (uint32_t i = 0; i < archive->count && samples->count < samples->max_count; i++) {
+    uint64_t size = sample_size(picks[i].entry);
+    if (samples->used + size > samples->capacity) {
+      continue;
+    }
+    if (!SARC_readEntry(ctx, picks[i].entry, 0, samples->buffer + samples->used, size, &base, &overlay)) {
+      LOG_MSG(warning, "Failed to read %s from %s, skipping it\n", picks[i].name, ctx->arc_filename);
+      continue;
+    }
+    samples->sizes[samples->count++] = (size_t)size;
+    samples->used += size;
+  }
+
+  if (base != NULL) {
+    base->destroy(base);
+  }
+  if (overlay != NULL) {
+    overlay->destroy(overlay);
+  }
+}
+
+static bool write_dict(const char* out_path, const void* dict, size_t size) {
+  pio_handle file = pio_create(out_path);
+  if (file == PIO_INVALID) {
+    LOG_MSG(error, "Can't create %s\n", out_path);
+    return false;
+  }
+  bool ok = pio_write(file, dict, size, 0);
+  pio_close(file);
+  if (!ok) {
+    LOG_MSG(error, "Failed to write %s\n", out_path);
+  }
+  return ok;
+}
+
+bool SARC_trainDictionary(const SARC_dictOptions* options, const char* out_path) {
+  TRACE_BEGIN(span);
+  SARC_dictOptions defaults = {0};
+  if (options == NULL) {
+    options = &defaults;
+  }
+  size_t dict_capacity = (options->dict_size != 0) ? options->dict_size : DICT_DEFAULT_SIZE;
+  uint64_t sample_bytes = (options->sample_bytes != 0) ? options->sample_bytes : (uint64_t)dict_capacity * 100;
+
+  dict_census census = { .extension = options->extension };
+  SARC_forEachArchive(count_entries, &census);
+  if (census.entries == 0) {
+    LOG_MSG(error, "No mounted entries to train a dictionary on\n");
+    return false;
+  }
+
+  dict_samples samples = {
+    .extension = options->extension,
+    .stride = MAX(1, (census.bytes + sample_bytes - 1) / sample_bytes),
+    .capacity = MIN(sample_bytes, census.bytes)
+  };
+  samples.max_count = (uint32_t)MIN(census.entries / samples.stride + 1, UINT32_MAX);
+  samples.buffer = allocator.Malloc(samples.capacity);
+  samples.sizes = allocator.Malloc(sizeof(*samples.sizes) * samples.max_count);
+  void* dict = allocator.Malloc(dict_capacity);
+  bool ok = false;
+  if (samples.buffer == NULL || samples.sizes == NULL || dict == NULL) {
+    LOG_MSG(error, "Out of memory training a dictionary\n");
+    goto train_done;
+  }
+  SARC_forEachArchive(pick_samples, &samples);
+  if (!samples.failed) {
+    for (uint32_t i = 0; i < samples.archive_count; i++) {
+      read_samples(&samples, &samples.archives[i]);
+    }
+  }
+  for (uint32_t i = 0; i < samples.archive_count; i++) {
+    allocator.Free(samples.archives[i].picks);
+    SARC_unpinArchive(samples.archives[i].ctx);
+  }
+  allocator.Free(samples.archives);
+  if (samples.failed) {
+    goto train_done;
+  }
+
+  // d=8 and 4 steps are what ZDICT_trainFromBuffer() uses, but here the
+  // candidate parameters are tried on every core
+  ZDICT_fastCover_params_t params = {0};
+  params.d = 8;
+  params.steps = 4;
+  params.nbThreads = thread_core_count();
+  params.zParams.compressionLevel = options->level;
+  size_t dict_size = ZDICT_optimizeTrainFromBuffer_fastCover(dict, dict_capacity, samples.buffer, samples.sizes,
+                                                             samples.count, &params);
+  if (ZDICT_isError(dict_size)) {
+    LOG_MSG(error, "Dictionary training failed on %u samples [%s]\n", samples.count, ZDICT_getErrorName(dict_size));
+    goto train_done;
+  }
+  LOG_MSG(info, "Trained a %zu byte dictionary (k=%u) from %u samples, %llu bytes\n", dict_size, params.k,
+          samples.count, (unsigned long long)samples.used);
+
+  if (!write_dict(out_path, dict, dict_size)) {
+    goto train_done;
+  }
+  // Named after the file, the same as if it was loaded with zstd_io_add_dict()
+  const char* separator = PHYSFS_getDirSeparator();
+  const char* fname = out_path;
+  for (const char* i = out_path; *i != '\0'; i++) {
+    if (*i == '/' || *i == separator[0]) {
+      fname = i + 1;
+    }
+  }
+  ok = zstd_io_add_dict_buffer(dict, dict_size, fname);
+  if (ok) {
+    TRACE_END(span, "SARC_trainDictionary", NULL, NULL);
+  }
+
+train_done:
+  allocator.Free(dict);
+  allocator.Free(samples.sizes);
+  allocator.Free(samples.buffer);
+  return ok;
+} /* SARC_trainDictionary */
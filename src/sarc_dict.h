@@ -0,0 +1,33 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Training zstd dictionaries on the content of mounted archives, for packs of
+// our own that the game's dictionaries don't suit. Samples are taken evenly
+// from every mounted archive's entries and handed to zstd's fastcover
+// trainer, which tries a range of parameters and keeps the best.
+
+typedef struct {
+  const char* extension; // Only sample entries ending in this (".bgyml"), NULL for all
+  size_t dict_size; // Largest dictionary to make. 0 for zstd's default (110 KiB)
+  uint64_t sample_bytes; // Sample data to train on. 0 for 100x dict_size
+  int level; // Compression level to tune for. 0 for zstd's default
+}SARC_dictOptions;
+
+/// Train a dictionary on the mounted archives and write it to out_path (a real
+/// path). It's also added with zstd_io_add_dict_buffer(), named after out_path,
+/// so it's used for decompression right away, and by the packer for archives
+/// its name matches. Unmounting an archive waits while its samples are read.
+/// \param options NULL for the defaults
+/// \return false on failure, with the reason logged. Training fails when there
+/// are too few samples for a dictionary to help.
+bool SARC_trainDictionary(const SARC_dictOptions* options, const char* out_path);
+
+#ifdef __cplusplus
+}
+#endif
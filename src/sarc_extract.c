@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc_extract.h"
+#include "sarc_image.h"
+#include "archiver_sarc.h"
+#include "pio.h"
+#include "physfs_utils.h"
+#include "threads.h"
+#include "trace.h"
+#include "logging.h"
+
+typedef struct {
+  char* path; // Real path of the archive
+  const char* relative; // Points into path, past the root
+  uint64_t size; // On disk, used to hand out the biggest archives first
+}extract_archive;
+
+typedef struct {
+  extract_archive* archives;
+  uint32_t count;
+  uint32_t capacity;
+  size_t root_len;
+}extract_listing;
+
+// One SARC_extractAll() call, shared by its workers
+typedef struct {
+  ZSTD_pthread_mutex_t lock;
+  ZSTD_pthread_cond_t memory_freed;
+  extract_listing listing;
+  uint32_t next_archive;
+  uint64_t memory_budget;
+  uint64_t memory_used;
+  const char* out_dir;
+}extract_job;
+
+typedef struct {
+  ZSTD_pthread_t thread;
+  extract_job* job;
+  // Totals for this worker's archives, summed once every worker has finished
+  uint32_t archives;
+  uint32_t failed;
+  uint64_t files;
+  uint64_t bytes;
+}extract_worker;
+
+static PHYSFS_EnumerateCallbackResult list_archives(void* data, const char* origdir, const char* fname) {
+  extract_listing* listing = (extract_listing*)data;
+  char* path = path_join(origdir, fname);
+  PHYSFS_Stat stat = {0};
+  if (path == NULL || !__PHYSFS_platformStat(path, &stat, 1)) {
+    allocator.Free(path);
+    return PHYSFS_ENUM_OK;
+  }
+  if (stat.filetype == PHYSFS_FILETYPE_DIRECTORY) {
+    PHYSFS_EnumerateCallbackResult result = __PHYSFS_platformEnumerate(path, list_archives, path, listing);
+    allocator.Free(path);
+    return (result == PHYSFS_ENUM_ERROR) ? PHYSFS_ENUM_OK : result;
+  }
+  if (stat.filetype != PHYSFS_FILETYPE_REGULAR || !SARC_hasArchiveExtension(fname)) {
+    allocator.Free(path);
+    return PHYSFS_ENUM_OK;
+  }
+
+  if (listing->count == listing->capacity) {
+    uint32_t capacity = (listing->capacity == 0) ? 64 : listing->capacity * 2;
+    extract_archive* archives = allocator.Realloc(listing->archives, sizeof(*archives) * capacity);
+    if (archives == NULL) {
+      allocator.Free(path);
+      return PHYSFS_ENUM_STOP;
+    }
+    listing->archives = archives;
+    listing->capacity = capacity;
+  }
+  listing->archives[listing->count++] = (extract_archive) {
+    .path = path,
+    .relative = path + listing->root_len,
+    .size = (uint64_t)stat.filesize
+  };
+  return PHYSFS_ENUM_OK;
+}
+
+static int compare_sizes(const void* a, const void* b) {
+  const extract_archive* left = (const extract_archive*)a;
+  const extract_archive* right = (const extract_archive*)b;
+  if (left->size != right->size) {
+    return (left->size > right->size) ? -1 : 1;
+  }
+  return strcmp(left->path, right->path);
+}
+
+// Wait until size bytes fit in the budget. With nothing else loaded, anything
+// fits, so an archive bigger than the budget still gets extracted (alone).
+static void memory_acquire(extract_job* job, uint64_t size) {
+  ZSTD_pthread_mutex_lock(&job->lock);
+  while (job->memory_budget != 0 && job->memory_used != 0 && job->memory_used + size > job->memory_budget) {
+    ZSTD_pthread_cond_wait(&job->memory_freed, &job->lock);
+  }
+  job->memory_used += size;
+  ZSTD_pthread_mutex_unlock(&job->lock);
+}
+
+static void memory_release(extract_job* job, uint64_t size) {
+  ZSTD_pthread_mutex_lock(&job->lock);
+  job->memory_used -= size;
+  ZSTD_pthread_cond_broadcast(&job->memory_freed);
+  ZSTD_pthread_mutex_unlock(&job->lock);
+}
+
+// Entry names come from the archive, so don't let them climb out of out_dir.
+static bool name_is_safe(const char* name) {
+  if (strchr(name, '\\') != NULL || strchr(name, ':') != NULL) {
+    return false;
+  }
+  const char* part = name;
+  while (true) {
+    const char* end = strchr(part, '/');
+    size_t len = (end != NULL) ? (size_t)(end - part) : strlen(part);
+    if (len == 0 || (len == 2 && part[0] == '.' && part[1] == '.')) {
+      return false;
+    }
+    if (end == NULL) {
+      break;
+    }
+    part = end + 1;
+  }
+  return true;
+}
+
+// Create every directory leading up to path. Each one past the first that
+// exists fails harmlessly.
+static void make_parents(char* path) {
+  char separator = PHYSFS_getDirSeparator()[0];
+  for (char* i = path + 1; *i != '\0'; i++) {
+    if (*i == '/' || *i == separator) {
+      char c = *i;
+      *i = '\0';
+      __PHYSFS_platformMkDir(path);
+      *i = c;
+    }
+  }
+}
+
+static bool write_entry(char* path, const uint8_t* data, uint32_t size) {
+  // Most entries share directories with the ones before, so only make them
+  // when the file can't be created.
+  pio_handle file = pio_create(path);
+  if (file == PIO_INVALID) {
+    make_parents(path);
+    file = pio_create(path);
+  }
+  if (file == PIO_INVALID) {
+    LOG_MSG(error, "Can't create %s\n", path);
+    return false;
+  }
+  if (size > 0) {
+    pio_preallocate(file, size);
+  }
+  bool ok = pio_write(file, data, size, 0);
+  pio_close(file);
+  if (!ok) {
+    LOG_MSG(error, "Failed to write %s\n", path);
+  }
+  return ok;
+}
+
+static bool extract_archive_to(extract_worker* worker, const extract_archive* archive) {
+  extract_job* job = worker->job;
+  TRACE_BEGIN(span);
+  uint64_t reserved = sarc_image_peek_size(archive->path);
+  if (reserved == 0) {
+    return false;
+  }
+  memory_acquire(job, reserved);
+
+  sarc_image image;
+  if (!sarc_image_load(&image, archive->path)) {
+    memory_release(job, reserved);
+    return false;
+  }
+
+  char* dir = path_join(job->out_dir, archive->relative);
+  bool ok = (dir != NULL);
+  uint32_t count = sarc_image_count(&image);
+  for (uint32_t i = 0; ok && i < count; i++) {
+    const char* name = sarc_image_name(&image, i);
+    if (!name_is_safe(name)) {
+      LOG_MSG(warning, "%s: skipping unsafe entry name %s\n", archive->path, name);
+      continue;
+    }
+    char* path = path_join(dir, name);
+    uint32_t size = sarc_image_size(&image, i);
+    ok = (path != NULL) && write_entry(path, sarc_image_data(&image, i), size);
+    if (ok) {
+      worker->files++;
+      worker->bytes += size;
+    }
+    allocator.Free(path);
+  }
+
+  allocator.Free(dir);
+  sarc_image_free(&image);
+  memory_release(job, reserved);
+  if (ok) {
+    TRACE_END(span, "extract", archive->relative, NULL);
+  }
+  return ok;
+}
+
+static void* extract_worker_main(void* arg) {
+  extract_worker* worker = (extract_worker*)arg;
+  extract_job* job = worker->job;
+  while (true) {
+    ZSTD_pthread_mutex_lock(&job->lock);
+    uint32_t next = job->next_archive;
+    if (next < job->listing.count) {
+      job->next_archive++;
+    }
+    ZSTD_pthread_mutex_unlock(&job->lock);
+    if (next >= job->listing.count) {
+      break;
+    }
+
+    const extract_archive* archive = &job->listing.archives[next];
+    if (extract_archive_to(worker, archive)) {
+      worker->archives++;
+    }
+    else {
+      LOG_MSG(error, "Failed to extract %s\n", archive->path);
+      worker->failed++;
+    }
+  }
+  return NULL;
+}
+
+bool SARC_extractAll(const char* root, const char* out_dir, uint32_t threads, uint64_t memory_budget, SARC_extractReport* report) {
+  uint64_t start = thread_now_ns();
+  extract_job job = {
+    .out_dir = out_dir,
+    .memory_budget = memory_budget
+  };
+
+  // Relative paths start past the root and its separator
+  job.listing.root_len = strlen(root) + strlen(PHYSFS_getDirSeparator());
+  __PHYSFS_platformEnumerate(root, list_archives, root, &job.listing);
+  qsort(job.listing.archives, job.listing.count, sizeof(*job.listing.archives), compare_sizes);
+  __PHYSFS_platformMkDir(out_dir);
+
+  if (threads == 0) {
+    threads = thread_core_count();
+  }
+  if (threads > job.listing.count) {
+    threads = (job.listing.count > 0) ? job.listing.count : 1;
+  }
+
+  extract_worker* workers = allocator.Malloc(sizeof(*workers) * threads);
+  if (workers == NULL) {
+    LOG_MSG(error, "Out of memory starting extraction\n");
+    threads = 0;
+  }
+  else {
+    memset(workers, 0, sizeof(*workers) * threads);
+    for (uint32_t i = 0; i < threads; i++) {
+      workers[i].job = &job;
+    }
+  }
+  ZSTD_pthread_mutex_init(&job.lock, NULL);
+  ZSTD_pthread_cond_init(&job.memory_freed, NULL);
+
+  // The calling thread is the first worker
+  uint32_t started = 1;
+  for (; started < threads; started++) {
+    if (ZSTD_pthread_create(&workers[started].thread, NULL, extract_worker_main, &workers[started]) != 0) {
+      LOG_MSG(warning, "Only started %u extraction threads\n", started);
+      break;
+    }
+  }
+  if (threads > 0) {
+    extract_worker_main(&workers[0]);
+  }
+
+  SARC_extractReport totals = {0};
+  for (uint32_t i = 0; i < threads && i < started; i++) {
+    if (i > 0) {
+      ZSTD_pthread_join(workers[i].thread);
+    }
+    totals.archives += workers[i].archives;
+    totals.failed += workers[i].failed;
+    totals.files += workers[i].files;
+    totals.bytes += workers[i].bytes;
+  }
+  if (workers == NULL) {
+    totals.failed = job.listing.count;
+  }
+
+  ZSTD_pthread_cond_destroy(&job.memory_freed);
+  ZSTD_pthread_mutex_destroy(&job.lock);
+  allocator.Free(workers);
+  for (uint32_t i = 0; i < job.listing.count; i++) {
+    allocator.Free(job.listing.archives[i].path);
+  }
+  allocator.Free(job.listing.archives);
+
+  totals.seconds = (double)(thread_now_ns() - start) / 1e9;
+  if (totals.seconds > 0) {
+    totals.mb_per_sec = (double)totals.bytes / (1024.0 * 1024.0) / totals.seconds;
+    totals.files_per_sec = (double)totals.files / totals.seconds;
+  }
+  LOG_MSG(info, "Extracted %u archives (%u failed), %llu files, %.1f MB in %.2fs: %.1f MB/s, %.0f files/s\n",
+    totals.archives, totals.failed, (unsigned long long)totals.files, (double)totals.bytes / (1024.0 * 1024.0),
+    totals.seconds, totals.mb_per_sec, totals.files_per_sec);
+  if (report != NULL) {
+    *report = totals;
+  }
+  return totals.failed == 0;
+} /* SARC_extractAll */
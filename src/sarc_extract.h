@@ -0,0 +1,43 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bulk extraction of every archive under a directory, for dumping a whole game
+// to loose files. Each archive is decompressed once, into memory, and all of
+// its entries are written straight out of that copy. Archives are extracted in
+// parallel, biggest first, with the memory their images take kept under a
+// budget. Output files are preallocated before they're written.
+//
+// Archives land in a directory named after their path relative to the root,
+// so root/Pack/Actor.pack.zs extracts to out_dir/Pack/Actor.pack.zs/... Only
+// real directories are walked; archives nested in other archives are written
+// out as files, not extracted.
+
+typedef struct {
+  uint32_t archives; // Archives extracted
+  uint32_t failed; // Archives that couldn't be read, or had files that couldn't be written
+  uint64_t files; // Files written
+  uint64_t bytes; // Bytes written
+  double seconds; // Wall time for the whole extraction
+  double mb_per_sec; // Output throughput, bytes / 2^20 / seconds
+  double files_per_sec;
+}SARC_extractReport;
+
+/// Extract every archive under root into out_dir.
+/// \param root Real directory to search for archives (recursively)
+/// \param out_dir Real directory to extract to, created if needed
+/// \param threads Number of archives to extract at once. 0 for one per core.
+/// \param memory_budget Limit on the bytes of decompressed archives held at
+/// once. An archive bigger than the whole budget is extracted on its own.
+/// 0 for no limit.
+/// \param report Filled with counts and throughput, may be NULL.
+/// \return false if any archive failed, with the reasons logged.
+bool SARC_extractAll(const char* root, const char* out_dir, uint32_t threads, uint64_t memory_budget, SARC_extractReport* report);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+// Batch versions of sarc_filename_hash() (see sarc.h). Hashing is a serial
+// multiply-add per character, so one name at a time is bound by multiply
+// latency. These hash a block of characters per step instead, using AVX2
+// lanes when the CPU has them.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hash count names, writing the results to hashes. lengths can be NULL, in
+// which case the names must be null-terminated.
+void sarc_hash_batch(const char* const* names, const uint32_t* lengths, uint32_t count, uint32_t key, uint32_t* hashes);
+
+// Check names against the hashes stored for them. Returns the number of names
+// that don't match.
+uint32_t sarc_hash_verify(const char* const* names, const uint32_t* expected, uint32_t count, uint32_t key);
+
+// Name of the implementation in use ("avx2" or "scalar").
+const char* sarc_hash_impl(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,292 @@
+#include <string.h>
+
+#include <physfs.h>
+#include <zstd.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc_image.h"
+#include "archiver_sarc.h"
+#include "vmem.h"
+#include "logging.h"
+#include "int.h"
+
+// Make sure every structure and every node's name and data lie inside the
+// image, so callers can use the pointers without checking.
+static bool image_validate(sarc_image* image, const char* path) {
+  uint64_t size = image->size;
+  uint64_t pos = sizeof(sarc_header) + sizeof(sarc_sfat_header);
+  if (size < pos) {
+    LOG_MSG(error, "%s is too small to be a SARC\n", path);
+    return false;
+  }
+  image->header = (sarc_header*)image->data;
+  image->sfat = (sarc_sfat_header*)(image->data + sizeof(sarc_header));
+  if (image->sfat->magic != SFAT_MAGIC) {
+    LOG_MSG(error, "%s has no SFAT\n", path);
+    return false;
+  }
+
+  image->nodes = (sarc_sfat_node*)(image->data + pos);
+  pos += (uint64_t)image->sfat->node_count * sizeof(sarc_sfat_node);
+  if (size < pos + sizeof(sarc_sfnt_header)) {
+    LOG_MSG(error, "%s has a truncated SFAT\n", path);
+    return false;
+  }
+  pos += sizeof(sarc_sfnt_header);
+  image->names = (const char*)(image->data + pos);
+
+  uint64_t data_offset = image->header->data_offset;
+  if (data_offset < pos || data_offset > size) {
+    LOG_MSG(error, "%s has a bad data offset\n", path);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < image->sfat->node_count; i++) {
+    sarc_sfat_node* node = &image->nodes[i];
+    uint64_t name_pos = pos + (uint64_t)node->filename_offset * 4;
+    if (name_pos >= data_offset || memchr(image->data + name_pos, '\0', data_offset - name_pos) == NULL) {
+      LOG_MSG(error, "%s: node %u has a bad name\n", path, i);
+      return false;
+    }
+    if (node->file_start_offset > node->file_end_offset || data_offset + node->file_end_offset > size) {
+      LOG_MSG(error, "%s: node %u has bad data offsets\n", path, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads the archive from the file, decompressing it on the way if it's zstd.
+// This keeps its own stream rather than going through zstd_io, which serves
+// small reads at random offsets; here we want one pass into one buffer.
+typedef struct {
+  PHYSFS_Io* io;
+  ZSTD_DStream* dstream; // NULL for a plain SARC
+  uint8_t* in_buf;
+  size_t in_buf_size;
+  ZSTD_inBuffer in;
+}image_reader;
+
+static bool image_read(image_reader* reader, void* dest, size_t size, const char* path) {
+  if (reader->dstream == NULL) {
+    uint8_t* out = dest;
+    while (size > 0) {
+      PHYSFS_sint64 read = reader->io->read(reader->io, out, size);
+      if (read <= 0) {
+        return false;
+      }
+      out += read;
+      size -= (size_t)read;
+    }
+    return true;
+  }
+
+  ZSTD_outBuffer out = {dest, size, 0};
+  while (out.pos < out.size) {
+    if (reader->in.pos == reader->in.size) {
+      PHYSFS_sint64 read = reader->io->read(reader->io, reader->in_buf, reader->in_buf_size);
+      if (read <= 0) {
+        return false;
+      }
+      reader->in.src = reader->in_buf;
+      reader->in.size = (size_t)read;
+      reader->in.pos = 0;
+    }
+    size_t rc = ZSTD_decompressStream(reader->dstream, &out, &reader->in);
+    if (ZSTD_isError(rc)) {
+      LOG_MSG(error, "Can't decompress %s: %s\n", path, ZSTD_getErrorName(rc));
+      return false;
+    }
+  }
+  return true;
+}
+
+static void image_reader_close(image_reader* reader) {
+  if (reader->dstream != NULL) {
+    ZSTD_freeDStream(reader->dstream);
+  }
+  if (reader->in_buf != NULL) {
+    allocator.Free(reader->in_buf);
+  }
+  reader->io->destroy(reader->io);
+}
+
+// Open path and read its SARC header, setting up decompression if it's zstd.
+static bool image_reader_open(image_reader* reader, sarc_header* header, const char* path) {
+  memset(reader, 0, sizeof(*reader));
+  reader->io = __PHYSFS_createNativeIo(path, 'r');
+  if (reader->io == NULL) {
+    LOG_MSG(error, "Can't open %s\n", path);
+    return false;
+  }
+  sarc_format format = SARC_sniffFormat(reader->io);
+  if (format == SARC_FORMAT_NONE) {
+    LOG_MSG(error, "%s isn't a SARC archive\n", path);
+    reader->io->destroy(reader->io);
+    return false;
+  }
+  reader->io->seek(reader->io, 0);
+  if (format == SARC_FORMAT_ZSTD) {
+    // Skippable frames are stepped over by the decompressor
+    reader->dstream = ZSTD_createDStream();
+    reader->in_buf_size = ZSTD_DStreamInSize();
+    reader->in_buf = allocator.Malloc(reader->in_buf_size);
+    if (reader->dstream == NULL || reader->in_buf == NULL) {
+      LOG_MSG(error, "Out of memory loading %s\n", path);
+      image_reader_close(reader);
+      return false;
+    }
+  }
+
+  // The header tells us how big the whole archive is, compressed or not
+  if (!image_read(reader, header, sizeof(*header), path) || header->magic != SARC_MAGIC) {
+    LOG_MSG(error, "%s has a bad SARC header\n", path);
+    image_reader_close(reader);
+    return false;
+  }
+  return true;
+}
+
+uint64_t sarc_image_peek_size(const char* path) {
+  image_reader reader;
+  sarc_header header = {0};
+  if (!image_reader_open(&reader, &header, path)) {
+    return 0;
+  }
+  image_reader_close(&reader);
+  return virtual_page_align(header.archive_size);
+}
+
+static void* image_alloc_vmem(uint64_t size, void* data) {
+  sarc_image* image = (sarc_image*)data;
+  image->reserved = virtual_page_align(size);
+  uint32_t hints = VMEM_HINT_SEQUENTIAL | VMEM_HINT_POPULATE;
+  if (image->reserved >= VMEM_HUGE_PAGE_SIZE) {
+    hints |= VMEM_HINT_HUGE_PAGES;
+  }
+  return virtual_reserve_hinted(image->reserved, hints);
+}
+
+bool sarc_image_load_into(sarc_image* image, const char* path, sarc_image_alloc alloc, void* alloc_data) {
+  memset(image, 0, sizeof(*image));
+
+  image_reader reader;
+  sarc_header header = {0};
+  if (!image_reader_open(&reader, &header, path)) {
+    return false;
+  }
+  image->size = header.archive_size;
+  if (image->size < sizeof(header)) {
+    LOG_MSG(error, "%s has a bad archive size\n", path);
+    image_reader_close(&reader);
+    return false;
+  }
+  image->data = alloc(image->size, alloc_data);
+  if (image->data == NULL) {
+    LOG_MSG(error, "Out of memory loading %s\n", path);
+    image_reader_close(&reader);
+    return false;
+  }
+
+  memcpy(image->data, &header, sizeof(header));
+  bool read = image_read(&reader, image->data + sizeof(header), image->size - sizeof(header), path);
+  image_reader_close(&reader);
+  if (!read) {
+    LOG_MSG(error, "%s is shorter than its header says\n", path);
+    return false;
+  }
+  return image_validate(image, path);
+}
+
+bool sarc_image_check(const uint8_t* data, uint64_t size, const char* name) {
+  sarc_image image = { .data = (uint8_t*)data, .size = size };
+  return image_validate(&image, name);
+}
+
+bool sarc_image_load(sarc_image* image, const char* path) {
+  if (!sarc_image_load_into(image, path, image_alloc_vmem, image)) {
+    sarc_image_free(image);
+    return false;
+  }
+  return true;
+}
+
+void sarc_image_free(sarc_image* image) {
+  if (image->data != NULL) {
+    virtual_free(image->data, image->reserved);
+  }
+  memset(image, 0, sizeof(*image));
+}
+
+uint32_t sarc_image_count(const sarc_image* image) {
+  return image->sfat->node_count;
+}
+
+const char* sarc_image_name(const sarc_image* image, uint32_t node) {
+  return image->names + (uint32_t)image->nodes[node].filename_offset * 4;
+}
+
+const uint8_t* sarc_image_data(const sarc_image* image, uint32_t node) {
+  return image->data + image->header->data_offset + image->nodes[node].file_start_offset;
+}
+
+uint32_t sarc_image_size(const sarc_image* image, uint32_t node) {
+  return image->nodes[node].file_end_offset - image->nodes[node].file_start_offset;
+}
+
+uint64_t sarc_image_meta_size(const sarc_image_node* nodes, uint32_t count) {
+  uint64_t names_size = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    names_size += ALIGN_UP(strlen(nodes[i].name) + 1, 4);
+  }
+  if (names_size / 4 > UINT16_MAX) {
+    return 0;
+  }
+  return sizeof(sarc_header) + sizeof(sarc_sfat_header) + (sizeof(sarc_sfat_node) * count) +
+         sizeof(sarc_sfnt_header) + names_size;
+}
+
+void sarc_image_write_meta(uint8_t* meta, const sarc_image_node* nodes, uint32_t count, uint32_t hash_key,
+                           uint64_t data_offset, uint64_t archive_size) {
+  sarc_header header = {
+    .magic = SARC_MAGIC,
+    .header_size = SARC_HEADER_SIZE,
+    .byte_order_mark = SARC_LITTLE_ENDIAN,
+    .archive_size = archive_size,
+    .data_offset = data_offset,
+    .version = SARC_VERSION,
+    .reserved = 0
+  };
+  sarc_sfat_header sfat_header = {
+    .magic = SFAT_MAGIC,
+    .header_size = SFAT_HEADER_SIZE,
+    .node_count = count,
+    .hash_key = hash_key
+  };
+  sarc_sfnt_header sfnt_header = {
+    .magic = SFNT_MAGIC,
+    .header_size = SFNT_HEADER_SIZE,
+    .reserved = 0
+  };
+  memcpy(meta, &header, sizeof(header));
+  memcpy(meta + sizeof(header), &sfat_header, sizeof(sfat_header));
+
+  sarc_sfat_node* sfat = (sarc_sfat_node*)(meta + sizeof(header) + sizeof(sfat_header));
+  memcpy(&sfat[count], &sfnt_header, sizeof(sfnt_header));
+  uint8_t* names = (uint8_t*)&sfat[count] + sizeof(sfnt_header);
+  uint32_t name_pos = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    sarc_sfat_node node = {
+      .filename_hash = nodes[i].hash,
+      .enable_offset = 0x0100,
+      .filename_offset = name_pos / 4,
+      .file_start_offset = nodes[i].data_start,
+      .file_end_offset = nodes[i].data_start + nodes[i].size
+    };
+    memcpy(&sfat[i], &node, sizeof(node));
+    size_t len = strlen(nodes[i].name) + 1;
+    memcpy(names + name_pos, nodes[i].name, len);
+    name_pos += ALIGN_UP(len, 4);
+  }
+}
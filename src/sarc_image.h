@@ -0,0 +1,85 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sarc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A whole SARC archive decompressed into memory, for tools that work on every
+// entry at once (diffing, patching) rather than serving files through
+// PhysicsFS. Nothing here is mounted or registered.
+
+typedef struct {
+  uint8_t* data; // The decompressed archive, from vmem.c
+  uint64_t size; // Bytes of archive data (header.archive_size)
+  uint64_t reserved; // Bytes reserved for data
+
+  // Pointers into data
+  sarc_header* header;
+  sarc_sfat_header* sfat;
+  sarc_sfat_node* nodes;
+  const char* names; // Start of the SFNT name table
+}sarc_image;
+
+// Load a SARC from a real (not PhysicsFS) path, decompressing it if it's zstd.
+// The layout is checked, so every node's name and data are in bounds.
+bool sarc_image_load(sarc_image* image, const char* path);
+
+// Where sarc_image_load_into() should put an archive of size bytes, or NULL to
+// give up.
+typedef void* (*sarc_image_alloc)(uint64_t size, void* data);
+
+// Same as sarc_image_load(), but into memory from alloc, which is called once
+// the header says how big the archive is. image->reserved is left at 0. On
+// failure, cleaning up whatever alloc returned is up to the caller, so don't
+// sarc_image_free() the image.
+bool sarc_image_load_into(sarc_image* image, const char* path, sarc_image_alloc alloc, void* alloc_data);
+
+// Check an archive that's already in memory, as sarc_image_load() does, for
+// images it didn't load itself. name is for the log.
+bool sarc_image_check(const uint8_t* data, uint64_t size, const char* name);
+
+// Memory sarc_image_load() would reserve for path, from its header alone (so
+// only the first block of a zstd archive is decompressed). 0 on failure.
+uint64_t sarc_image_peek_size(const char* path);
+
+// Free an image loaded with sarc_image_load().
+void sarc_image_free(sarc_image* image);
+
+// Number of entries in the archive
+uint32_t sarc_image_count(const sarc_image* image);
+
+// Name of an entry, by its position in the SFAT.
+const char* sarc_image_name(const sarc_image* image, uint32_t node);
+
+// Data of an entry, by its position in the SFAT.
+const uint8_t* sarc_image_data(const sarc_image* image, uint32_t node);
+
+// Size of an entry's data.
+uint32_t sarc_image_size(const sarc_image* image, uint32_t node);
+
+// A file in an archive being written, for the functions below
+typedef struct {
+  const char* name;
+  uint32_t hash;
+  uint32_t data_start; // Relative to the data section
+  uint32_t size;
+}sarc_image_node;
+
+// Bytes the header, SFAT and SFNT take for these files, which is where the
+// data section can start at the earliest. 0 if there are too many names for
+// SARC's 16-bit name offsets.
+uint64_t sarc_image_meta_size(const sarc_image_node* nodes, uint32_t count);
+
+// Write the header, SFAT and SFNT to the front of an archive. nodes must be
+// sorted by hash, and meta must be zeroed up to data_offset, since name
+// padding is skipped.
+void sarc_image_write_meta(uint8_t* meta, const sarc_image_node* nodes, uint32_t count, uint32_t hash_key,
+                           uint64_t data_offset, uint64_t archive_size);
+
+#ifdef __cplusplus
+}
+#endif
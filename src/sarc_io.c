@@ -1,3 +1,14 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
 #include <physfs.h>
 #define __PHYSICSFS_INTERNAL__
 #include <physfs_internal.h>
@@ -6,48 +17,80 @@
 #include "archiver_sarc_internal.h"
 #include "sarc_io.h"
 #include "vmem.h"
+#include "mem_budget.h"
 #include "physfs_utils.h"
 #include "logging.h"
+#include "pio.h"
+#include "int.h"
+#include "sarc_stats.h"
+#include "sarc_hash.h"
+#include "trace.h"
+#include "atomics.h"
+#include "fd_pool.h"
+
+// Entries that belong in the overlay: the ones already in it, and the ones
+// that have been opened for writing.
+static bool entry_in_overlay(__PHYSFS_DirTreeEntry* entry) {
+    const SARCentry* sarc_entry = (const SARCentry*)entry;
+    return sarc_entry->overlay || sarc_entry->data_ptr != 0;
+}
 
-uint32_t get_file_list_count(__PHYSFS_DirTreeEntry* entry) {
+uint32_t get_file_list_count(__PHYSFS_DirTreeEntry* entry, bool overlay_only) {
     uint32_t retval = 0;
 
     while (entry != NULL) {
-        if (!entry->isdir)
-            retval++;
+        if (!entry->isdir) {
+            if (!overlay_only || entry_in_overlay(entry))
+                retval++;
+        }
         else
-            retval += get_file_list_count(entry->children);
+            retval += get_file_list_count(entry->children, overlay_only);
         entry = entry->sibling;
     }
 
     return retval;
 }
 
-void write_file_list(__PHYSFS_DirTreeEntry* entry, char** arr, int* currentIndex) {
+void write_file_list(__PHYSFS_DirTreeEntry* entry, char** arr, int* currentIndex, bool overlay_only) {
     while (entry != NULL) {
         if (!entry->isdir) {
-            arr[*currentIndex] = entry->name;
-            (*currentIndex)++;
+            if (!overlay_only || entry_in_overlay(entry)) {
+                arr[*currentIndex] = entry->name;
+                (*currentIndex)++;
+            }
         }
         else
-            write_file_list(entry->children, arr, currentIndex);
+            write_file_list(entry->children, arr, currentIndex, overlay_only);
         entry = entry->sibling;
     }
 }
 
-char** get_file_list(__PHYSFS_DirTreeEntry* entry) {
-    uint32_t count = get_file_list_count(entry);
+char** get_file_list(__PHYSFS_DirTreeEntry* entry, bool overlay_only) {
+    uint32_t count = get_file_list_count(entry, overlay_only);
     char** retval = allocator.Malloc(sizeof(char*) * (count + 1));
     memset(retval, 0x0, sizeof(char*) * (count + 1));
     int currentIndex = 0;
-    write_file_list(entry, retval, &currentIndex);
+    write_file_list(entry, retval, &currentIndex, overlay_only);
     retval[count] = NULL;
     return retval;
 }
 
-// Update the SARC file on disk that this IO stream (file) belongs to.
-void rebuild_sarc(SARC_ctx* ctx) {
-    PHYSFS_Io* io = ctx->io;
+typedef struct {
+    uint32_t hash;
+    char* name;
+}hashed_name;
+
+static int compare_hashed_names(const void* a, const void* b) {
+    const hashed_name* left = (const hashed_name*)a;
+    const hashed_name* right = (const hashed_name*)b;
+    if (left->hash != right->hash) {
+        return (left->hash < right->hash) ? -1 : 1;
+    }
+    // Collisions are rare, but the output shouldn't depend on the tree order
+    return strcmp(left->name, right->name);
+}
+
+bool SARC_writeArchive(SARC_ctx* ctx, PHYSFS_Io* io, bool overlay_only) {
 
     sarc_header header = {
         .magic = SARC_MAGIC,
@@ -62,7 +105,7 @@ void rebuild_sarc(SARC_ctx* ctx) {
         .magic = SFAT_MAGIC,
         .header_size = SFAT_HEADER_SIZE,
         .node_count = 0, // Number of files in archive
-        .hash_key = SFAT_HASH_KEY
+        .hash_key = ctx->hash_key
     };
     sarc_sfnt_header sfnt_header = {
         .magic = SFNT_MAGIC,
@@ -75,7 +118,7 @@ void rebuild_sarc(SARC_ctx* ctx) {
     io->seek(io, sizeof(header) + sizeof(sfat_header));
 
     __PHYSFS_DirTree* tree = &ctx->tree;
-    char** file_list_unsorted = get_file_list(tree->root);
+    char** file_list_unsorted = get_file_list(tree->root, overlay_only);
 
     // Get file count first.
     for (char** i = file_list_unsorted; *i != NULL; i++) {
@@ -83,50 +126,24 @@ void rebuild_sarc(SARC_ctx* ctx) {
     }
 
     // The files are ordered by hash, so we need to sort them before writing.
-    uint32_t sorted = 0;
+    uint32_t* unsorted_hashes = allocator.Malloc(sizeof(uint32_t) * (sfat_header.node_count + 1));
+    hashed_name* hashed = allocator.Malloc(sizeof(hashed_name) * (sfat_header.node_count + 1));
+    sarc_hash_batch((const char* const*)file_list_unsorted, NULL, sfat_header.node_count, sfat_header.hash_key, unsorted_hashes);
+    for (uint32_t i = 0; i < sfat_header.node_count; i++) {
+        hashed[i].hash = unsorted_hashes[i];
+        hashed[i].name = file_list_unsorted[i];
+    }
+    qsort(hashed, sfat_header.node_count, sizeof(hashed_name), compare_hashed_names);
 
     uint32_t size = sizeof(char*) * (sfat_header.node_count + 1);
     char** file_list = allocator.Malloc(size);
     memset(file_list, 0x00, size);
-
-    // This is a really terrible sorting algorithm I wrote on the spot.
-    // TODO: See if __PHYSFS_sort() can be used here?
-    // TODO: Replace this with quicksort or something. The reduced syscalls alone
-    //       should make it worthwhile.
-    while(sorted < sfat_header.node_count) {
-        uint32_t smallest_hash = 0;
-        for (char** i = file_list_unsorted; *i != NULL; i++) {
-            if (*i == (void*)1) {
-                continue;
-            }
-            // Hash and store the last string in the list that hasn't been eliminated yet
-            smallest_hash = sarc_filename_hash(*i, strlen(*i), sfat_header.hash_key);
-        }
-        for (char** i = file_list_unsorted; *i != NULL; i++) {
-            // Skip entries that have already been sorted
-            if (*i == (void*)1) {
-                continue;
-            }
-            uint32_t hash = sarc_filename_hash(*i, strlen(*i), sfat_header.hash_key);
-            if (hash < smallest_hash) {
-                // By the end of the loop, smallest_hash will have the smallest hash.
-                smallest_hash = hash;
-            }
-        }
-        for (char** i = file_list_unsorted; *i != NULL; i++) {
-            if (*i == (void*)1) {
-                continue;
-            }
-            uint32_t hash = sarc_filename_hash(*i, strlen(*i), sfat_header.hash_key);
-            // Search for the smallest hash in the list, skipping sorted entries.
-            if (hash == smallest_hash) {
-                // Put the smallest hash next in the sorted list and free the original.
-                file_list[sorted++] = *i;
-                *i = (void*)1;
-                break;
-            }
-        }
+    uint32_t* hashes = unsorted_hashes; // Reused in sorted order
+    for (uint32_t i = 0; i < sfat_header.node_count; i++) {
+        file_list[i] = hashed[i].name;
+        hashes[i] = hashed[i].hash;
     }
+    allocator.Free(hashed);
     allocator.Free(file_list_unsorted);
 
 
@@ -156,7 +173,7 @@ void rebuild_sarc(SARC_ctx* ctx) {
         SARCentry* entry = findEntry(ctx, *i);
 
         sarc_sfat_node node = {
-            .filename_hash = sarc_filename_hash(*i, strlen(*i), sfat_header.hash_key),
+            .filename_hash = hashes[i - file_list],
             .enable_offset = 0x0100,
             .filename_offset = (filename_pos - filename_start) / 4,
             .file_start_offset = file_write_pos - header.data_offset,
@@ -167,9 +184,16 @@ void rebuild_sarc(SARC_ctx* ctx) {
         io->seek(io, file_write_pos);
         if ((void*)entry->data_ptr == NULL) {
             LOG_MSG(error, "invalid file data pointer!\n");
-            return;
+            allocator.Free(hashes);
+            allocator.Free(file_list);
+            return false;
         }
         io->write(io, (void*)entry->data_ptr, entry->size);
+        if (overlay_only) {
+            // The entry's data lives in the overlay from now on
+            entry->startPos = file_write_pos;
+            entry->overlay = 1;
+        }
         // Update our file write position and align to 4 byte boundary
         file_write_pos = io->tell(io);
         while((file_write_pos % 8) != 0) {
@@ -196,7 +220,64 @@ void rebuild_sarc(SARC_ctx* ctx) {
 
     io->trunc(io, file_write_pos);
 
+    allocator.Free(hashes);
     allocator.Free(file_list);
+    return true;
+}
+
+// Write every edited entry to the overlay sidecar. The base archive isn't
+// touched. Opening a write handle pulled everything in the old sidecar into
+// memory, so it can be replaced: the new one is written under a temporary name and
+// renamed over it once it's complete, so a failed write leaves the old one
+// whole. Files that are open on the old sidecar hold its descriptor (see
+// fd_pool_open_pinned()), and keep reading it until they're closed.
+static bool write_overlay(SARC_ctx* ctx) {
+    static uint64_t write_count = 0;
+    size_t temp_len = strlen(ctx->overlay_filename) + 48;
+    char* temp_path = allocator.Malloc(temp_len);
+    BAIL_IF(temp_path == NULL, PHYSFS_ERR_OUT_OF_MEMORY, false);
+    snprintf(temp_path, temp_len, "%s.%llu-%llu.tmp", ctx->overlay_filename, (unsigned long long)getpid(),
+             (unsigned long long)ATOMIC_ADD64(&write_count, 1));
+
+    PHYSFS_Io* io = __PHYSFS_createNativeIo(temp_path, 'w');
+    if (io == NULL) {
+        LOG_MSG(error, "Can't create overlay %s\n", temp_path);
+        allocator.Free(temp_path);
+        return false;
+    }
+    bool ok = SARC_writeArchive(ctx, io, true);
+    io->destroy(io);
+    if (ok && !pio_replace(temp_path, ctx->overlay_filename)) {
+        LOG_MSG(error, "Can't replace overlay %s\n", ctx->overlay_filename);
+        ok = false;
+    }
+    if (!ok) {
+        __PHYSFS_platformDelete(temp_path);
+    }
+    allocator.Free(temp_path);
+
+    // Reads of the entries we just wrote come from the new one. If it didn't
+    // make it, their offsets don't match the old one either, so they fail.
+    PHYSFS_Io* overlay_io = ok ? fd_pool_open_pinned(ctx->overlay_filename) : NULL;
+    if (ctx->overlay_io != NULL) {
+        ctx->overlay_io->destroy(ctx->overlay_io);
+    }
+    ctx->overlay_io = overlay_io;
+    return overlay_io != NULL;
+}
+
+// Update the SARC file on disk that this IO stream (file) belongs to, or just
+// its overlay in overlay mode.
+void rebuild_sarc(SARC_ctx* ctx) {
+    TRACE_BEGIN(span);
+    SARC_STATS_ADD(&ctx->stats, rebuilds, 1);
+    if (ctx->overlay_filename != NULL) {
+        write_overlay(ctx);
+    }
+    else {
+        SARC_writeArchive(ctx, ctx->io, false);
+    }
+    TRACE_END(span, "rebuild_sarc", ctx->arc_filename, NULL);
 }
 
 // Rebuild archive and write to disk.
@@ -208,20 +289,39 @@ void close_write_handle(PHYSFS_Io* io) {
 }
 
 // Resize a file's reserved memory region.
-void resize_entry(SARCentry* entry, PHYSFS_uint64 len) {
-    uint64_t commitSize;
-    if (len <= entry->reserved)
-        commitSize = len;
-    else
-        commitSize = len + 500;
-
-    if (virtual_commit((void*)entry->data_ptr, commitSize) == -1) {
-        void* newMemory = virtual_reserve(commitSize);
-        virtual_free((void*)entry->data_ptr, entry->reserved);
+bool resize_entry(SARCentry* entry, PHYSFS_uint64 len) {
+    if (len > entry->reserved) {
+        // Grow geometrically, so a long run of small writes only moves the
+        // buffer a handful of times.
+        uint64_t capacity = virtual_page_align(MAX(entry->reserved * 2, len));
+        if (!mem_budget_acquire_buffer(capacity - entry->reserved)) {
+            LOG_MSG(error, "No room in the memory budget to grow entry to %llu bytes\n", capacity);
+            return false;
+        }
+        void* newMemory = virtual_resize((void*)entry->data_ptr, entry->reserved, capacity);
+        if (newMemory == NULL) {
+            LOG_MSG(error, "Failed to grow entry to %llu bytes\n", capacity);
+            mem_budget_release(capacity - entry->reserved);
+            return false;
+        }
+        if (capacity >= VMEM_HUGE_PAGE_SIZE) {
+            virtual_advise(newMemory, capacity, VMEM_HINT_HUGE_PAGES);
+        }
         entry->data_ptr = (uintptr_t)newMemory;
+        entry->reserved = capacity;
+    }
+    else if (len < entry->size) {
+        // Shrinking. Keep the address space for later writes, but give back
+        // the memory behind any whole pages we don't need anymore.
+        uint64_t used = virtual_page_align(len);
+        uint64_t old_used = virtual_page_align(entry->size);
+        if (old_used > used) {
+            virtual_release((void*)(entry->data_ptr + used), old_used - used);
+        }
     }
+    virtual_commit((void*)entry->data_ptr, len);
     entry->size = len;
-    entry->reserved = commitSize;
+    return true;
 }
 
 // PHYSFS_Io implementation for SARC
@@ -236,10 +336,18 @@ PHYSFS_sint64 SARC_read(PHYSFS_Io *io, void *buffer, PHYSFS_uint64 len) {
         len = bytesLeft;
     }
 
-    rc = file->io->read(file->io, buffer, len);
+    if (file->io == NULL) {
+        // Thread-safe mode, read from the shared handle at an absolute offset
+        rc = pio_read(file->arc_info->pio, buffer, len, entry->startPos + file->curPos);
+    }
+    else {
+        rc = file->io->read(file->io, buffer, len);
+    }
     if (rc > 0) {
         file->curPos += (PHYSFS_uint32) rc;
+        SARC_STATS_ADD(&file->arc_info->stats, bytes_served, rc);
     }
+    SARC_STATS_ADD(&file->arc_info->stats, read_calls, 1);
 
     return rc;
 } /* SARC_read */
@@ -269,17 +377,17 @@ PHYSFS_sint64 SARC_write(PHYSFS_Io *io, const void* buf, PHYSFS_uint64 len) {
 
     // Since files open for writing are only in memory until they're flushed by
     // closing the handle, we just do a memcpy.
-    if (file->curPos + len >= entry->size) {
-        // We're out of space, time to expand. Expand enough to fit this entire
-        // write plus 500 bytes.
-
-        resize_entry(entry, entry->size + len);
+    if (file->curPos + len > entry->size) {
+        // The file is getting bigger, make sure it fits.
+        if (!resize_entry(entry, file->curPos + len)) {
+            BAIL(PHYSFS_ERR_OUT_OF_MEMORY, -1);
+        }
     }
 
-    memcpy((void*)((char*)entry->data_ptr + ((SARC_file_ctx*)io->opaque)->curPos), buf, len);
-    ((SARC_file_ctx*)io->opaque)->curPos += len;
+    memcpy((void*)((char*)entry->data_ptr + file->curPos), buf, len);
+    file->curPos += len;
 
-    return 0;
+    return len;
 } /* SARC_write */
 
 PHYSFS_sint64 SARC_tell(PHYSFS_Io *io) {
@@ -292,7 +400,9 @@ int SARC_seek(PHYSFS_Io *io, PHYSFS_uint64 offset) {
     int rc = 0;
 
     BAIL_IF(offset > entry->size, PHYSFS_ERR_PAST_EOF, 0);
-    if (!file->open_for_write)
+    if (file->io == NULL)
+        rc = 1; // Positional reads don't have a cursor to move
+    else if (!file->open_for_write)
         rc = file->io->seek(file->io, entry->startPos + offset);
     if (rc || file->open_for_write) {
         file->curPos = (PHYSFS_uint32) offset;
@@ -308,6 +418,9 @@ PHYSFS_sint64 SARC_length(PHYSFS_Io *io) {
 
 int SARC_trunc(PHYSFS_Io* io, PHYSFS_uint64 len) {
     const SARC_file_ctx* file = (SARC_file_ctx*)io->opaque;
+    if (file->open_for_write) {
+        return resize_entry(file->entry, len);
+    }
     file->entry->size = len;
     return 1;
 } /* SARC_trunc */
@@ -320,10 +433,14 @@ PHYSFS_Io *SARC_duplicate(PHYSFS_Io *_io) {
     GOTO_IF(!retval, PHYSFS_ERR_OUT_OF_MEMORY, SARC_duplicate_failed);
     GOTO_IF(!newfile, PHYSFS_ERR_OUT_OF_MEMORY, SARC_duplicate_failed);
 
-    io = original_file->io->duplicate(original_file->io);
-    if (!io) goto SARC_duplicate_failed;
+    if (original_file->io != NULL) {
+        io = original_file->io->duplicate(original_file->io);
+        if (!io) goto SARC_duplicate_failed;
+    }
     newfile->io = io;
     newfile->entry = original_file->entry;
+    newfile->arc_info = original_file->arc_info;
+    newfile->open_for_write = original_file->open_for_write;
     newfile->curPos = 0;
     memcpy(retval, _io, sizeof (PHYSFS_Io));
     retval->opaque = newfile;
@@ -347,7 +464,9 @@ int SARC_flush(PHYSFS_Io *io) {
 
 void SARC_destroy(PHYSFS_Io *io) {
     SARC_file_ctx* file = (SARC_file_ctx*)io->opaque;
-    file->io->destroy(file->io);
+    if (file->io != NULL) {
+        file->io->destroy(file->io);
+    }
     allocator.Free(file);
     allocator.Free(io);
 } /* SARC_destroy */
@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc.h"
+#include "sarc_pack.h"
+#include "sarc_hash.h"
+#include "sarc_image.h"
+#include "physfs_utils.h"
+#include "zstd_io.h"
+#include "pio.h"
+#include "vmem.h"
+#include "atomics.h"
+#include "threads.h"
+#include "trace.h"
+#include "logging.h"
+#include "int.h"
+
+// Entries start 8-byte aligned, the same as rebuild_sarc() writes them
+#define PACK_DATA_ALIGN 8
+
+typedef struct {
+  char* path; // Real path of the file
+  char* name; // Entry name, relative to the packed directory
+  uint64_t size;
+  uint32_t hash;
+  uint32_t data_start; // Relative to the data section
+}pack_item;
+
+typedef struct {
+  pack_item* items;
+  uint32_t count;
+  uint32_t capacity;
+  size_t root_len;
+  bool failed;
+}pack_listing;
+
+// A job's files being read into its image, by any number of threads
+typedef struct {
+  pack_item* items;
+  uint32_t count;
+  uint8_t* data; // Start of the image's data section
+  volatile uint64_t next; // Next item to read
+  volatile uint64_t failed;
+}pack_reads;
+
+typedef struct {
+  SARC_packJob* jobs;
+  ZSTD_CDict** cdicts; // One per job, NULL for no dictionary
+  uint32_t count;
+  uint32_t readers; // Threads reading files for each job
+  volatile uint64_t next; // Next job to pack
+}pack_batch;
+
+typedef struct {
+  int dict;
+  int level;
+  ZSTD_CDict* cdict;
+}pack_cdict;
+
+static PHYSFS_EnumerateCallbackResult list_files(void* data, const char* origdir, const char* fname) {
+  pack_listing* listing = (pack_listing*)data;
+  char* path = path_join(origdir, fname);
+  PHYSFS_Stat stat = {0};
+  if (path == NULL || !__PHYSFS_platformStat(path, &stat, 1)) {
+    LOG_MSG(error, "Can't stat %s\n", (path != NULL) ? path : fname);
+    allocator.Free(path);
+    listing->failed = true;
+    return PHYSFS_ENUM_STOP;
+  }
+  if (stat.filetype == PHYSFS_FILETYPE_DIRECTORY) {
+    PHYSFS_EnumerateCallbackResult result = __PHYSFS_platformEnumerate(path, list_files, path, listing);
+    allocator.Free(path);
+    return listing->failed ? PHYSFS_ENUM_STOP : result;
+  }
+  if (stat.filetype != PHYSFS_FILETYPE_REGULAR) {
+    allocator.Free(path);
+    return PHYSFS_ENUM_OK;
+  }
+
+  // Entry names always use '/', whatever the platform's separator is
+  const char* relative = path + listing->root_len;
+  char* name = allocator.Malloc(strlen(relative) + 1);
+  if (listing->count == listing->capacity) {
+    uint32_t capacity = (listing->capacity == 0) ? 64 : listing->capacity * 2;
+    pack_item* items = allocator.Realloc(listing->items, sizeof(*items) * capacity);
+    if (items != NULL) {
+      listing->items = items;
+      listing->capacity = capacity;
+    }
+  }
+  if (name == NULL || listing->count == listing->capacity) {
+    LOG_MSG(error, "Out of memory listing %s\n", path);
+    allocator.Free(name);
+    allocator.Free(path);
+    listing->failed = true;
+    return PHYSFS_ENUM_STOP;
+  }
+  char separator = PHYSFS_getDirSeparator()[0];
+  for (size_t i = 0; ; i++) {
+    name[i] = (relative[i] == separator) ? '/' : relative[i];
+    if (relative[i] == '\0') {
+      break;
+    }
+  }
+  listing->items[listing->count++] = (pack_item) {
+    .path = path,
+    .name = name,
+    .size = (uint64_t)stat.filesize
+  };
+  return PHYSFS_ENUM_OK;
+}
+
+static void free_listing(pack_listing* listing) {
+  for (uint32_t i = 0; i < listing->count; i++) {
+    allocator.Free(listing->items[i].path);
+    allocator.Free(listing->items[i].name);
+  }
+  allocator.Free(listing->items);
+}
+
+static int compare_items(const void* a, const void* b) {
+  const pack_item* left = (const pack_item*)a;
+  const pack_item* right = (const pack_item*)b;
+  if (left->hash != right->hash) {
+    return (left->hash < right->hash) ? -1 : 1;
+  }
+  return strcmp(left->name, right->name);
+}
+
+// Work out where everything goes, filling in nodes for the SFAT. Returns the
+// offset of the data section, and the size of the whole archive in
+// *archive_size, or 0 if it's too big for SARC's 32-bit offsets.
+static uint64_t layout_items(pack_item* items, sarc_image_node* nodes, uint32_t count, uint64_t* archive_size) {
+  for (uint32_t i = 0; i < count; i++) {
+    nodes[i].name = items[i].name;
+    nodes[i].hash = items[i].hash;
+  }
+  uint64_t data_offset = sarc_image_meta_size(nodes, count);
+  if (data_offset == 0) {
+    return 0;
+  }
+
+  uint64_t pos = data_offset;
+  for (uint32_t i = 0; i < count; i++) {
+    pos = ALIGN_UP(pos, PACK_DATA_ALIGN);
+    items[i].data_start = (uint32_t)(pos - data_offset);
+    nodes[i].data_start = items[i].data_start;
+    nodes[i].size = (uint32_t)items[i].size;
+    pos += items[i].size;
+  }
+  if (pos > UINT32_MAX) {
+    return 0;
+  }
+  *archive_size = pos;
+  return data_offset;
+}
+
+static bool read_item(const pack_item* item, uint8_t* dest) {
+  pio_handle file = pio_open(item->path);
+  if (file == PIO_INVALID) {
+    LOG_MSG(error, "Can't open %s\n", item->path);
+    return false;
+  }
+  // One more byte than expected, to notice files that grew since we listed them
+  uint8_t extra = 0;
+  int64_t read = pio_read(file, dest, item->size, 0);
+  int64_t more = (read == (int64_t)item->size) ? pio_read(file, &extra, 1, item->size) : 0;
+  pio_close(file);
+  if (read != (int64_t)item->size || more != 0) {
+    LOG_MSG(error, "%s changed while it was being packed\n", item->path);
+    return false;
+  }
+  return true;
+}
+
+static void* reader_main(void* opaque) {
+  pack_reads* reads = (pack_reads*)opaque;
+  while (ATOMIC_LOAD64(&reads->failed) == 0) {
+    uint64_t i = ATOMIC_ADD64(&reads->next, 1);
+    if (i >= reads->count) {
+      break;
+    }
+    const pack_item* item = &reads->items[i];
+    if (!read_item(item, reads->data + item->data_start)) {
+      ATOMIC_STORE64(&reads->failed, 1);
+    }
+  }
+  return NULL;
+}
+
+// Read every item into the image, on up to readers threads (counting ours).
+static bool read_items(pack_reads* reads, uint32_t readers) {
+  if (readers > reads->count) {
+    readers = reads->count;
+  }
+  ZSTD_pthread_t threads[64];
+  if (readers > ARRAY_SIZE(threads) + 1) {
+    readers = ARRAY_SIZE(threads) + 1;
+  }
+  uint32_t started = 0;
+  while (started + 1 < readers && ZSTD_pthread_create(&threads[started], NULL, reader_main, reads) == 0) {
+    started++;
+  }
+  reader_main(reads);
+  for (uint32_t i = 0; i < started; i++) {
+    ZSTD_pthread_join(threads[i]);
+  }
+  return reads->failed == 0;
+}
+
+static bool write_output(const char* out_path, const uint8_t* data, uint64_t size) {
+  pio_handle file = pio_create(out_path);
+  if (file == PIO_INVALID) {
+    LOG_MSG(error, "Can't create %s\n", out_path);
+    return false;
+  }
+  pio_preallocate(file, size);
+  bool ok = pio_write(file, data, size, 0);
+  pio_close(file);
+  if (!ok) {
+    LOG_MSG(error, "Failed to write %s\n", out_path);
+    __PHYSFS_platformDelete(out_path);
+  }
+  return ok;
+}
+
+// Compress the image and write it out. A single-threaded context, so the
+// output doesn't depend on how zstd was built or how many cores there are.
+static bool write_compressed(const char* out_path, const uint8_t* image, uint64_t size, int level, const ZSTD_CDict* cdict) {
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  uint64_t bound = virtual_page_align(ZSTD_compressBound(size));
+  uint8_t* out = virtual_reserve_hinted(bound, VMEM_HINT_SEQUENTIAL);
+  bool ok = false;
+  if (cctx == NULL || out == NULL) {
+    LOG_MSG(error, "Out of memory compressing %s\n", out_path);
+    goto compressed_done;
+  }
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  if (cdict != NULL) {
+    ZSTD_CCtx_refCDict(cctx, cdict);
+  }
+  size_t written = ZSTD_compress2(cctx, out, bound, image, size);
+  if (ZSTD_isError(written)) {
+    LOG_MSG(error, "Can't compress %s [%s]\n", out_path, ZSTD_getErrorName(written));
+    goto compressed_done;
+  }
+  ok = write_output(out_path, out, written);
+
+compressed_done:
+  if (out != NULL) {
+    virtual_free(out, bound);
+  }
+  ZSTD_freeCCtx(cctx);
+  return ok;
+}
+
+static bool pack_one(const SARC_packJob* job, const ZSTD_CDict* cdict, uint32_t readers) {
+  TRACE_BEGIN(span);
+  pack_listing listing = {0};
+  listing.root_len = strlen(job->dir) + strlen(PHYSFS_getDirSeparator());
+  __PHYSFS_platformEnumerate(job->dir, list_files, job->dir, &listing);
+
+  bool ok = false;
+  uint8_t* image = NULL;
+  uint64_t reserved = 0;
+  const char** names = allocator.Malloc(sizeof(*names) * (listing.count + 1));
+  uint32_t* hashes = allocator.Malloc(sizeof(*hashes) * (listing.count + 1));
+  sarc_image_node* nodes = allocator.Malloc(sizeof(*nodes) * (listing.count + 1));
+  if (listing.failed || names == NULL || hashes == NULL || nodes == NULL) {
+    goto pack_done;
+  }
+  if (listing.count > UINT16_MAX) {
+    LOG_MSG(error, "%s has too many files for SARC (%u)\n", job->dir, listing.count);
+    goto pack_done;
+  }
+
+  for (uint32_t i = 0; i < listing.count; i++) {
+    names[i] = listing.items[i].name;
+  }
+  sarc_hash_batch(names, NULL, listing.count, SFAT_HASH_KEY, hashes);
+  for (uint32_t i = 0; i < listing.count; i++) {
+    listing.items[i].hash = hashes[i];
+  }
+  qsort(listing.items, listing.count, sizeof(*listing.items), compare_items);
+
+  uint64_t archive_size = 0;
+  uint64_t data_offset = layout_items(listing.items, nodes, listing.count, &archive_size);
+  if (data_offset == 0) {
+    LOG_MSG(error, "%s is too big for SARC\n", job->dir);
+    goto pack_done;
+  }
+  reserved = virtual_page_align(archive_size);
+  image = virtual_reserve_hinted(reserved, VMEM_HINT_SEQUENTIAL);
+  if (image == NULL) {
+    LOG_MSG(error, "Out of memory packing %s\n", job->dir);
+    goto pack_done;
+  }
+  // The image starts zeroed, so the padding after each name already is
+  sarc_image_write_meta(image, nodes, listing.count, SFAT_HASH_KEY, data_offset, archive_size);
+
+  pack_reads reads = {
+    .items = listing.items,
+    .count = listing.count,
+    .data = image + data_offset
+  };
+  if (!read_items(&reads, readers)) {
+    goto pack_done;
+  }
+
+  if (job->level > 0) {
+    ok = write_compressed(job->out_path, image, archive_size, job->level, cdict);
+  }
+  else {
+    ok = write_output(job->out_path, image, archive_size);
+  }
+  if (ok) {
+    TRACE_END(span, "SARC_pack", job->out_path, NULL);
+  }
+
+pack_done:
+  if (image != NULL) {
+    virtual_free(image, reserved);
+  }
+  allocator.Free(nodes);
+  allocator.Free(hashes);
+  allocator.Free(names);
+  free_listing(&listing);
+  return ok;
+}
+
+static void* batch_main(void* opaque) {
+  pack_batch* batch = (pack_batch*)opaque;
+  while (true) {
+    uint64_t i = ATOMIC_ADD64(&batch->next, 1);
+    if (i >= batch->count) {
+      break;
+    }
+    SARC_packJob* job = &batch->jobs[i];
+    job->ok = pack_one(job, batch->cdicts[i], batch->readers);
+    if (!job->ok) {
+      LOG_MSG(error, "Failed to pack %s into %s\n", job->dir, job->out_path);
+    }
+  }
+  return NULL;
+}
+
+bool SARC_packDirectory(const char* dir, const char* out_path, int level) {
+  SARC_packJob job = {
+    .dir = dir,
+    .out_path = out_path,
+    .level = level
+  };
+  return SARC_packBatch(&job, 1, 0) == 1;
+} /* SARC_packDirectory */
+
+uint32_t SARC_packBatch(SARC_packJob* jobs, uint32_t count, uint32_t threads) {
+  if (count == 0) {
+    return 0;
+  }
+  if (threads == 0) {
+    threads = thread_core_count();
+  }
+  pack_batch batch = {
+    .jobs = jobs,
+    .count = count,
+    .cdicts = allocator.Malloc(sizeof(ZSTD_CDict*) * count)
+  };
+  if (batch.cdicts == NULL) {
+    LOG_MSG(error, "Out of memory starting the packer\n");
+    return 0;
+  }
+
+  // Digesting a dictionary is slow, so jobs with the same dictionary and level
+  // share one. CDicts are read-only once they're made.
+  pack_cdict* shared = allocator.Malloc(sizeof(*shared) * count);
+  uint32_t shared_count = 0;
+  if (shared == NULL) {
+    LOG_MSG(error, "Out of memory starting the packer\n");
+    allocator.Free(batch.cdicts);
+    return 0;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    jobs[i].ok = false;
+    batch.cdicts[i] = NULL;
+    int dict = (jobs[i].level > 0) ? zstd_io_find_dict(jobs[i].out_path) : -1;
+    if (dict < 0) {
+      continue;
+    }
+    uint32_t j = 0;
+    while (j < shared_count && (shared[j].dict != dict || shared[j].level != jobs[i].level)) {
+      j++;
+    }
+    if (j == shared_count) {
+      shared[shared_count++] = (pack_cdict) {
+        .dict = dict,
+        .level = jobs[i].level,
+        .cdict = zstd_io_create_cdict(dict, jobs[i].level)
+      };
+    }
+    batch.cdicts[i] = shared[j].cdict;
+  }
+
+  uint32_t workers = (threads < count) ? threads : count;
+  batch.readers = threads / workers;
+
+  ZSTD_pthread_t* pool = allocator.Malloc(sizeof(ZSTD_pthread_t) * workers);
+  uint32_t started = 0;
+  while (pool != NULL && started + 1 < workers && ZSTD_pthread_create(&pool[started], NULL, batch_main, &batch) == 0) {
+    started++;
+  }
+  // The calling thread packs too
+  batch_main(&batch);
+  for (uint32_t i = 0; i < started; i++) {
+    ZSTD_pthread_join(pool[i]);
+  }
+  allocator.Free(pool);
+
+  uint32_t packed = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    packed += jobs[i].ok;
+  }
+  for (uint32_t i = 0; i < shared_count; i++) {
+    ZSTD_freeCDict(shared[i].cdict);
+  }
+  allocator.Free(shared);
+  allocator.Free(batch.cdicts);
+  return packed;
+} /* SARC_packBatch */
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Packing directories into new archives, without mounting anything. Every file
+// under the directory becomes an entry named by its path relative to it, with
+// '/' separators. Entries are sorted by name hash, with data 8-byte aligned in
+// the same order, the same as archives written by the archiver itself.
+//
+// The output only depends on the files' names and contents, the level and the
+// dictionaries added with zstd_io_add_dict(), so packing the same directory
+// twice gives the same bytes. Compressed archives use the dictionary
+// zstd_io_find_dict() picks for their name, if any.
+//
+// Each archive is built in memory, with its files read in parallel, and then
+// compressed and written in one go.
+
+typedef struct {
+  const char* dir; // Real directory to pack
+  const char* out_path; // Real path of the archive to write
+  int level; // 0 to write an uncompressed SARC, otherwise the zstd level
+  bool ok; // Set by SARC_packBatch()
+}SARC_packJob;
+
+/// Pack one directory into an archive.
+/// \return false on failure, with the reason logged. Nothing is left at
+/// out_path if it fails.
+bool SARC_packDirectory(const char* dir, const char* out_path, int level);
+
+/// Pack many directories at once, each on its own thread. Threads left over
+/// when there are fewer jobs than threads read files for the jobs instead.
+/// \param threads Number of threads to use. 0 for one per core.
+/// \return The number of jobs that succeeded. Each job's ok field says which.
+uint32_t SARC_packBatch(SARC_packJob* jobs, uint32_t count, uint32_t threads);
+
+#ifdef __cplusplus
+}
+#endif
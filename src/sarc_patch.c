@@ -0,0 +1,546 @@
+#include <stdlib.h>
+#include <string.h>
+
+#define ZSTD_STATIC_LINKING_ONLY // For the window log limits
+#include <zstd.h>
+#define XXH_STATIC_LINKING_ONLY // For XXH64_state_t
+#include <common/xxhash.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc_patch.h"
+#include "sarc_image.h"
+#include "logging.h"
+
+#define SARC_PATCH_MAGIC 0x54415053 // 'SPAT'
+#define SARC_PATCH_VERSION 1
+
+// Window logs above this get long distance matching, like zstd --patch-from
+#define PATCH_LONG_WINDOW_LOG 27
+
+// Patch file layout:
+//   sarc_patch_header
+//   The new archive's headers, SFAT and SFNT (meta_size bytes), zstd-compressed
+//   sarc_patch_entry[entry_count], sorted by start
+//   The payload of each entry, in the same order
+typedef struct {
+  uint32_t magic; // 'SPAT'
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t old_hash; // XXH64 of the whole (decompressed) old archive
+  uint64_t new_hash; // XXH64 of the whole (decompressed) new archive
+  uint32_t new_size;
+  uint32_t meta_size; // Everything before the new archive's data_offset
+  uint32_t meta_compressed_size;
+  uint32_t entry_count;
+}sarc_patch_header;
+
+typedef enum {
+  PATCH_COPY = 0, // Same data as the old entry
+  PATCH_DELTA = 1, // zstd frame, with the old entry as its prefix
+  PATCH_FULL = 2, // zstd frame on its own
+}sarc_patch_op;
+
+// A range of the new archive's data section. Most are entries, but anything
+// non-zero between entries gets one too.
+typedef struct {
+  uint32_t start; // Offsets are from the start of the archive
+  uint32_t size;
+  uint32_t old_start;
+  uint32_t old_size;
+  uint32_t payload_size; // Bytes in the patch after the table, 0 for PATCH_COPY
+  uint32_t op;
+}sarc_patch_entry;
+
+typedef struct {
+  const char* name;
+  uint32_t node;
+}named_node;
+
+static int compare_named_nodes(const void* a, const void* b) {
+  return strcmp(((const named_node*)a)->name, ((const named_node*)b)->name);
+}
+
+// A node's data range, sorted by position. qsort() has no context pointer,
+// so the range is copied next to the node instead of looked up.
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  uint32_t node;
+}node_range;
+
+static int compare_node_ranges(const void* a, const void* b) {
+  const node_range* left = (const node_range*)a;
+  const node_range* right = (const node_range*)b;
+  if (left->start != right->start) {
+    return (left->start < right->start) ? -1 : 1;
+  }
+  if (left->end != right->end) {
+    return (left->end < right->end) ? -1 : 1;
+  }
+  return 0;
+}
+
+// Smallest window that covers the prefix and the data after it
+static int patch_window_log(uint64_t prefix_size, uint64_t size) {
+  uint64_t total = prefix_size + size;
+  int window_log = ZSTD_WINDOWLOG_MIN;
+  while (window_log < ZSTD_WINDOWLOG_MAX && ((uint64_t)1 << window_log) < total) {
+    window_log++;
+  }
+  return window_log;
+}
+
+// Make sure a buffer has at least size bytes
+static bool reserve_buffer(uint8_t** buffer, size_t* capacity, size_t size) {
+  if (*capacity >= size) {
+    return true;
+  }
+  uint8_t* bigger = allocator.Realloc(*buffer, size);
+  if (bigger == NULL) {
+    return false;
+  }
+  *buffer = bigger;
+  *capacity = size;
+  return true;
+}
+
+static bool is_zero(const uint8_t* data, uint64_t size) {
+  for (uint64_t i = 0; i < size; i++) {
+    if (data[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Add an entry for the bytes between two entries, unless they're padding.
+static void add_gap(sarc_patch_entry* entries, uint32_t* count, const sarc_image* image, uint32_t start, uint32_t end) {
+  if (end <= start || is_zero(image->data + start, end - start)) {
+    return;
+  }
+  sarc_patch_entry* entry = &entries[(*count)++];
+  memset(entry, 0, sizeof(*entry));
+  entry->start = start;
+  entry->size = end - start;
+  entry->op = PATCH_FULL;
+}
+
+// Work out what every range of the new archive's data will be made from.
+// Returns the number of entries written to entries, which needs room for
+// twice the node count plus one.
+static uint32_t plan_entries(const sarc_image* old_image, const sarc_image* new_image, sarc_patch_entry* entries) {
+  uint32_t old_count = sarc_image_count(old_image);
+  uint32_t new_count = sarc_image_count(new_image);
+
+  named_node* old_names = allocator.Malloc(sizeof(named_node) * (old_count + 1));
+  node_range* order = allocator.Malloc(sizeof(node_range) * (new_count + 1));
+  if (old_names == NULL || order == NULL) {
+    allocator.Free(old_names);
+    allocator.Free(order);
+    return UINT32_MAX;
+  }
+  for (uint32_t i = 0; i < old_count; i++) {
+    old_names[i].name = sarc_image_name(old_image, i);
+    old_names[i].node = i;
+  }
+  qsort(old_names, old_count, sizeof(named_node), compare_named_nodes);
+  for (uint32_t i = 0; i < new_count; i++) {
+    order[i].start = new_image->nodes[i].file_start_offset;
+    order[i].end = new_image->nodes[i].file_end_offset;
+    order[i].node = i;
+  }
+  qsort(order, new_count, sizeof(node_range), compare_node_ranges);
+
+  uint32_t data_offset = new_image->header->data_offset;
+  uint32_t pos = data_offset;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < new_count; i++) {
+    uint32_t node = order[i].node;
+    uint32_t start = data_offset + new_image->nodes[node].file_start_offset;
+    uint32_t size = sarc_image_size(new_image, node);
+    add_gap(entries, &count, new_image, pos, start);
+
+    sarc_patch_entry* entry = &entries[count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->start = start;
+    entry->size = size;
+    entry->op = PATCH_FULL;
+
+    named_node key = { .name = sarc_image_name(new_image, node) };
+    named_node* old = bsearch(&key, old_names, old_count, sizeof(named_node), compare_named_nodes);
+    if (old != NULL) {
+      entry->old_start = old_image->header->data_offset + old_image->nodes[old->node].file_start_offset;
+      entry->old_size = sarc_image_size(old_image, old->node);
+      bool same = (entry->old_size == size) && memcmp(old_image->data + entry->old_start, new_image->data + start, size) == 0;
+      entry->op = same ? PATCH_COPY : PATCH_DELTA;
+    }
+
+    if (start + size > pos) {
+      pos = start + size;
+    }
+  }
+  add_gap(entries, &count, new_image, pos, (uint32_t)new_image->size);
+
+  allocator.Free(old_names);
+  allocator.Free(order);
+  return count;
+}
+
+// Compress one entry into buffer, with an optional prefix. Returns the
+// compressed size, or 0 on failure.
+static size_t compress_entry(ZSTD_CCtx* cctx, int level, const uint8_t* prefix, size_t prefix_size,
+                             const uint8_t* data, size_t size, uint8_t** buffer, size_t* capacity) {
+  if (!reserve_buffer(buffer, capacity, ZSTD_compressBound(size))) {
+    return 0;
+  }
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  if (prefix != NULL) {
+    int window_log = patch_window_log(prefix_size, size);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, window_log);
+    if (window_log > PATCH_LONG_WINDOW_LOG) {
+      ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    }
+    ZSTD_CCtx_refPrefix(cctx, prefix, prefix_size);
+  }
+  size_t result = ZSTD_compress2(cctx, *buffer, *capacity, data, size);
+  if (ZSTD_isError(result)) {
+    LOG_MSG(error, "ZSTD error [%s]\n", ZSTD_getErrorName(result));
+    return 0;
+  }
+  return result;
+}
+
+static bool write_all(PHYSFS_Io* io, const void* data, size_t size) {
+  return io->write(io, data, size) == (PHYSFS_sint64)size;
+}
+
+bool SARC_createPatch(const char* old_path, const char* new_path, const char* patch_path, int level) {
+  sarc_image old_image, new_image;
+  if (!sarc_image_load(&old_image, old_path)) {
+    return false;
+  }
+  if (!sarc_image_load(&new_image, new_path)) {
+    sarc_image_free(&old_image);
+    return false;
+  }
+
+  bool success = false;
+  PHYSFS_Io* io = NULL;
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  uint8_t* buffer = NULL;
+  size_t capacity = 0;
+  uint32_t max_entries = sarc_image_count(&new_image) * 2 + 1;
+  sarc_patch_entry* entries = allocator.Malloc(sizeof(sarc_patch_entry) * max_entries);
+  if (cctx == NULL || entries == NULL) {
+    LOG_MSG(error, "Out of memory\n");
+    goto createPatch_done;
+  }
+
+  sarc_patch_header header = {
+    .magic = SARC_PATCH_MAGIC,
+    .version = SARC_PATCH_VERSION,
+    .reserved = 0,
+    .old_hash = XXH64(old_image.data, old_image.size, 0),
+    .new_hash = XXH64(new_image.data, new_image.size, 0),
+    .new_size = (uint32_t)new_image.size,
+    .meta_size = new_image.header->data_offset,
+  };
+  header.entry_count = plan_entries(&old_image, &new_image, entries);
+  if (header.entry_count == UINT32_MAX) {
+    LOG_MSG(error, "Out of memory\n");
+    goto createPatch_done;
+  }
+
+  io = __PHYSFS_createNativeIo(patch_path, 'w');
+  if (io == NULL) {
+    LOG_MSG(error, "Can't create %s\n", patch_path);
+    goto createPatch_done;
+  }
+
+  // Headers and names rarely change much, they're compressed on their own.
+  header.meta_compressed_size = compress_entry(cctx, level, NULL, 0, new_image.data, header.meta_size, &buffer, &capacity);
+  if (header.meta_compressed_size == 0) {
+    goto createPatch_done;
+  }
+  if (!write_all(io, &header, sizeof(header)) ||
+      !write_all(io, buffer, header.meta_compressed_size)) {
+    LOG_MSG(error, "Can't write to %s\n", patch_path);
+    goto createPatch_done;
+  }
+
+  // Payload sizes aren't known yet, the table is written again at the end.
+  PHYSFS_sint64 table_pos = io->tell(io);
+  if (!write_all(io, entries, sizeof(sarc_patch_entry) * header.entry_count)) {
+    LOG_MSG(error, "Can't write to %s\n", patch_path);
+    goto createPatch_done;
+  }
+
+  uint32_t counts[3] = {0};
+  for (uint32_t i = 0; i < header.entry_count; i++) {
+    sarc_patch_entry* entry = &entries[i];
+    counts[entry->op]++;
+    if (entry->op == PATCH_COPY) {
+      continue;
+    }
+    const uint8_t* prefix = (entry->op == PATCH_DELTA) ? old_image.data + entry->old_start : NULL;
+    size_t size = compress_entry(cctx, level, prefix, entry->old_size, new_image.data + entry->start, entry->size, &buffer, &capacity);
+    if (size == 0) {
+      goto createPatch_done;
+    }
+    entry->payload_size = (uint32_t)size;
+    if (!write_all(io, buffer, size)) {
+      LOG_MSG(error, "Can't write to %s\n", patch_path);
+      goto createPatch_done;
+    }
+  }
+  PHYSFS_sint64 patch_size = io->tell(io);
+
+  if (!io->seek(io, table_pos) ||
+      !write_all(io, entries, sizeof(sarc_patch_entry) * header.entry_count) ||
+      !io->flush(io)) {
+    LOG_MSG(error, "Can't write to %s\n", patch_path);
+    goto createPatch_done;
+  }
+
+  LOG_MSG(info, "Patch is %lld bytes (%u unchanged, %u changed, %u new)\n",
+          (long long)patch_size, counts[PATCH_COPY], counts[PATCH_DELTA], counts[PATCH_FULL]);
+  success = true;
+
+createPatch_done:
+  if (io != NULL) {
+    io->destroy(io);
+  }
+  ZSTD_freeCCtx(cctx);
+  allocator.Free(buffer);
+  allocator.Free(entries);
+  sarc_image_free(&old_image);
+  sarc_image_free(&new_image);
+  return success;
+} /* SARC_createPatch */
+
+
+// Writes the rebuilt archive, compressing it on the way if asked to, and
+// hashes everything so the result can be checked against the patch.
+typedef struct {
+  PHYSFS_Io* io;
+  ZSTD_CCtx* cctx; // NULL for an uncompressed archive
+  uint8_t* out_buf;
+  size_t out_size;
+  XXH64_state_t hash;
+  uint64_t written;
+}patch_writer;
+
+static bool writer_flush(patch_writer* writer, ZSTD_inBuffer* in, ZSTD_EndDirective mode) {
+  for (;;) {
+    ZSTD_outBuffer out = { writer->out_buf, writer->out_size, 0 };
+    size_t remaining = ZSTD_compressStream2(writer->cctx, &out, in, mode);
+    if (ZSTD_isError(remaining)) {
+      LOG_MSG(error, "ZSTD error [%s]\n", ZSTD_getErrorName(remaining));
+      return false;
+    }
+    if (out.pos > 0 && writer->io->write(writer->io, writer->out_buf, out.pos) != (PHYSFS_sint64)out.pos) {
+      return false;
+    }
+    bool done = (mode == ZSTD_e_end) ? (remaining == 0) : (in->pos == in->size);
+    if (done) {
+      return true;
+    }
+  }
+}
+
+static bool writer_write(patch_writer* writer, const void* data, size_t size) {
+  XXH64_update(&writer->hash, data, size);
+  writer->written += size;
+  if (writer->cctx == NULL) {
+    return writer->io->write(writer->io, data, size) == (PHYSFS_sint64)size;
+  }
+  ZSTD_inBuffer in = { data, size, 0 };
+  return writer_flush(writer, &in, ZSTD_e_continue);
+}
+
+// Pad with zeros up to an offset in the archive
+static bool writer_pad(patch_writer* writer, uint64_t offset) {
+  static const uint8_t zeros[256] = {0};
+  while (writer->written < offset) {
+    uint64_t size = offset - writer->written;
+    if (!writer_write(writer, zeros, (size < sizeof(zeros)) ? size : sizeof(zeros))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Read a payload from the patch and decompress it into buffer
+static bool read_payload(PHYSFS_Io* patch, ZSTD_DCtx* dctx, const sarc_patch_entry* entry, const uint8_t* prefix,
+                         uint8_t** payload, size_t* payload_capacity, uint8_t* out) {
+  if (!reserve_buffer(payload, payload_capacity, entry->payload_size)) {
+    return false;
+  }
+  if (patch->read(patch, *payload, entry->payload_size) != (PHYSFS_sint64)entry->payload_size) {
+    LOG_MSG(error, "The patch is truncated\n");
+    return false;
+  }
+
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+  if (prefix != NULL) {
+    int window_log = patch_window_log(entry->old_size, entry->size);
+    if (window_log > ZSTD_WINDOWLOG_LIMIT_DEFAULT) {
+      ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, window_log);
+    }
+    ZSTD_DCtx_refPrefix(dctx, prefix, entry->old_size);
+  }
+  size_t result = ZSTD_decompressDCtx(dctx, out, entry->size, *payload, entry->payload_size);
+  if (ZSTD_isError(result) || result != entry->size) {
+    LOG_MSG(error, "Bad entry in the patch at offset %u\n", entry->start);
+    return false;
+  }
+  return true;
+}
+
+bool SARC_applyPatch(const char* old_path, const char* patch_path, const char* out_path, int level) {
+  sarc_image old_image;
+  if (!sarc_image_load(&old_image, old_path)) {
+    return false;
+  }
+
+  bool success = false;
+  PHYSFS_Io* patch = __PHYSFS_createNativeIo(patch_path, 'r');
+  ZSTD_DCtx* dctx = ZSTD_createDCtx();
+  sarc_patch_entry* entries = NULL;
+  uint8_t* payload = NULL;
+  size_t payload_capacity = 0;
+  uint8_t* data = NULL;
+  size_t data_capacity = 0;
+  patch_writer writer = {0};
+
+  if (patch == NULL) {
+    LOG_MSG(error, "Can't open %s\n", patch_path);
+    goto applyPatch_done;
+  }
+  if (dctx == NULL) {
+    LOG_MSG(error, "Out of memory\n");
+    GOTO(PHYSFS_ERR_OUT_OF_MEMORY, applyPatch_done);
+  }
+  sarc_patch_header header = {0};
+  if (patch->read(patch, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != SARC_PATCH_MAGIC || header.version != SARC_PATCH_VERSION) {
+    LOG_MSG(error, "%s isn't a SARC patch\n", patch_path);
+    goto applyPatch_done;
+  }
+  if (XXH64(old_image.data, old_image.size, 0) != header.old_hash) {
+    LOG_MSG(error, "%s isn't the archive this patch was made for\n", old_path);
+    goto applyPatch_done;
+  }
+
+  // Start writing as soon as possible, everything is in order from here on.
+  writer.io = __PHYSFS_createNativeIo(out_path, 'w');
+  if (writer.io == NULL) {
+    LOG_MSG(error, "Can't create %s\n", out_path);
+    goto applyPatch_done;
+  }
+  XXH64_reset(&writer.hash, 0);
+  if (level > 0) {
+    writer.cctx = ZSTD_createCCtx();
+    writer.out_size = ZSTD_CStreamOutSize();
+    writer.out_buf = allocator.Malloc(writer.out_size);
+    if (writer.cctx == NULL || writer.out_buf == NULL) {
+      LOG_MSG(error, "Out of memory\n");
+      goto applyPatch_done;
+    }
+    ZSTD_CCtx_setParameter(writer.cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setPledgedSrcSize(writer.cctx, header.new_size);
+  }
+
+  sarc_patch_entry meta = {
+    .start = 0,
+    .size = header.meta_size,
+    .payload_size = header.meta_compressed_size,
+    .op = PATCH_FULL
+  };
+  if (!reserve_buffer(&data, &data_capacity, meta.size) ||
+      !read_payload(patch, dctx, &meta, NULL, &payload, &payload_capacity, data) ||
+      !writer_write(&writer, data, meta.size)) {
+    goto applyPatch_done;
+  }
+
+  entries = allocator.Malloc(sizeof(sarc_patch_entry) * (header.entry_count + 1));
+  if (entries == NULL) {
+    LOG_MSG(error, "Out of memory\n");
+    goto applyPatch_done;
+  }
+  PHYSFS_sint64 table_size = sizeof(sarc_patch_entry) * header.entry_count;
+  if (patch->read(patch, entries, table_size) != table_size) {
+    LOG_MSG(error, "The patch is truncated\n");
+    goto applyPatch_done;
+  }
+
+  for (uint32_t i = 0; i < header.entry_count; i++) {
+    sarc_patch_entry* entry = &entries[i];
+    if (entry->op > PATCH_FULL ||
+        (entry->op != PATCH_FULL && (uint64_t)entry->old_start + entry->old_size > old_image.size) ||
+        (uint64_t)entry->start + entry->size > header.new_size) {
+      LOG_MSG(error, "Bad entry in the patch at offset %u\n", entry->start);
+      goto applyPatch_done;
+    }
+
+    const uint8_t* source = NULL;
+    if (entry->op == PATCH_COPY) {
+      source = old_image.data + entry->old_start;
+    }
+    else {
+      const uint8_t* prefix = (entry->op == PATCH_DELTA) ? old_image.data + entry->old_start : NULL;
+      if (!reserve_buffer(&data, &data_capacity, entry->size) ||
+          !read_payload(patch, dctx, entry, prefix, &payload, &payload_capacity, data)) {
+        goto applyPatch_done;
+      }
+      source = data;
+    }
+
+    // Entries can share data, only write the part that isn't out yet.
+    if (!writer_pad(&writer, entry->start)) {
+      goto applyPatch_done;
+    }
+    uint64_t skip = writer.written - entry->start;
+    if (skip < entry->size && !writer_write(&writer, source + skip, entry->size - skip)) {
+      goto applyPatch_done;
+    }
+  }
+  if (!writer_pad(&writer, header.new_size)) {
+    goto applyPatch_done;
+  }
+  if (writer.cctx != NULL) {
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+    if (!writer_flush(&writer, &in, ZSTD_e_end)) {
+      goto applyPatch_done;
+    }
+  }
+  if (!writer.io->flush(writer.io)) {
+    LOG_MSG(error, "Can't write to %s\n", out_path);
+    goto applyPatch_done;
+  }
+
+  if (XXH64_digest(&writer.hash) != header.new_hash) {
+    LOG_MSG(error, "%s doesn't match the archive the patch was made from\n", out_path);
+    goto applyPatch_done;
+  }
+  success = true;
+
+applyPatch_done:
+  if (writer.io != NULL) {
+    writer.io->destroy(writer.io);
+  }
+  ZSTD_freeCCtx(writer.cctx);
+  allocator.Free(writer.out_buf);
+  if (patch != NULL) {
+    patch->destroy(patch);
+  }
+  ZSTD_freeDCtx(dctx);
+  allocator.Free(entries);
+  allocator.Free(payload);
+  allocator.Free(data);
+  sarc_image_free(&old_image);
+  return success;
+} /* SARC_applyPatch */
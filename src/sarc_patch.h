@@ -0,0 +1,32 @@
+#pragma once
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Patches between two versions of a SARC archive. Entries are matched by name:
+// unchanged entries are copied from the old archive, changed ones are stored
+// with zstd using the old entry as a reference prefix (the same thing as
+// "zstd --patch-from"), and new ones are compressed on their own. The patch
+// also holds the new archive's headers and name table, so applying it rebuilds
+// the new archive byte for byte, in one pass from front to back.
+//
+// All paths are real paths, not PhysicsFS ones. Archives can be plain or
+// zstd-compressed.
+
+/// Create a patch that turns old_path into new_path.
+/// \param level zstd compression level for changed and new entries
+/// \return false on failure, with the reason logged
+bool SARC_createPatch(const char* old_path, const char* new_path, const char* patch_path, int level);
+
+/// Rebuild the new archive from the old one and a patch. The patch checks that
+/// it's being applied to the right archive, and that the result is correct.
+/// \param level 0 to write an uncompressed SARC, otherwise the zstd level
+/// \return false on failure, with the reason logged. out_path may be left
+/// partly written.
+bool SARC_applyPatch(const char* old_path, const char* patch_path, const char* out_path, int level);
+
+#ifdef __cplusplus
+}
+#endif
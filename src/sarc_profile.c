@@ -0,0 +1,722 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/xxhash.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc_profile.h"
+#include "archiver_sarc_internal.h"
+#include "mem_budget.h"
+#include "sarc_stats.h"
+#include "threads.h"
+#include "int.h"
+#include "logging.h"
+
+#define PREFETCH_BUCKETS 256
+// Reads that only warm the page cache go through a buffer this big
+#define WARM_CHUNK_SIZE 0x100000
+
+volatile bool profile_recording = false;
+volatile bool profile_replaying = false;
+
+static uint64_t file_key(const char* arc_filename, const char* name) {
+  uint64_t seed = XXH64(arc_filename, strlen(arc_filename), 0);
+  uint64_t key = XXH64(name, strlen(name), seed);
+  // 0 marks empty slots in a key_table
+  return (key != 0) ? key : 1;
+}
+
+// Open addressing from file keys to profile lines
+typedef struct {
+  uint64_t* keys;
+  uint32_t* values;
+  uint32_t capacity; // Always a power of 2
+  uint32_t count;
+}key_table;
+
+static uint32_t key_table_slot(const key_table* table, uint64_t key) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t slot = (uint32_t)key & mask;
+  while (table->keys[slot] != 0 && table->keys[slot] != key) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static bool key_table_find(const key_table* table, uint64_t key, uint32_t* value) {
+  if (table->capacity == 0) {
+    return false;
+  }
+  uint32_t slot = key_table_slot(table, key);
+  if (table->keys[slot] == 0) {
+    return false;
+  }
+  *value = table->values[slot];
+  return true;
+}
+
+// Returns false if the key was already there, or there's no memory for it
+static bool key_table_insert(key_table* table, uint64_t key, uint32_t value) {
+  // Stay at most half full
+  if ((table->count + 1) * 2 > table->capacity) {
+    key_table grown = { .capacity = (table->capacity == 0) ? 1024 : table->capacity * 2 };
+    grown.keys = allocator.Malloc(sizeof(*grown.keys) * grown.capacity);
+    grown.values = allocator.Malloc(sizeof(*grown.values) * grown.capacity);
+    if (grown.keys == NULL || grown.values == NULL) {
+      allocator.Free(grown.keys);
+      allocator.Free(grown.values);
+      return false;
+    }
+    memset(grown.keys, 0, sizeof(*grown.keys) * grown.capacity);
+    for (uint32_t i = 0; i < table->capacity; i++) {
+      if (table->keys[i] != 0) {
+        uint32_t slot = key_table_slot(&grown, table->keys[i]);
+        grown.keys[slot] = table->keys[i];
+        grown.values[slot] = table->values[i];
+      }
+    }
+    grown.count = table->count;
+    allocator.Free(table->keys);
+    allocator.Free(table->values);
+    *table = grown;
+  }
+  uint32_t slot = key_table_slot(table, key);
+  if (table->keys[slot] != 0) {
+    return false;
+  }
+  table->keys[slot] = key;
+  table->values[slot] = value;
+  table->count++;
+  return true;
+}
+
+static void key_table_free(key_table* table) {
+  allocator.Free(table->keys);
+  allocator.Free(table->values);
+  memset(table, 0, sizeof(*table));
+}
+
+// Recording
+
+static struct {
+  ZSTD_pthread_mutex_t lock;
+  FILE* file;
+  key_table seen; // Files already recorded, the values are unused
+}recorder;
+
+static thread_once_t recorder_once = THREAD_ONCE_INIT;
+
+static void recorder_init(void) {
+  ZSTD_pthread_mutex_init(&recorder.lock, NULL);
+}
+
+bool SARC_profileRecordStart(const char* path) {
+  SARC_profileRecordStop();
+
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    LOG_MSG(error, "Can't open profile %s\n", path);
+    return false;
+  }
+  ZSTD_pthread_mutex_lock(&recorder.lock);
+  recorder.file = file;
+  ZSTD_pthread_mutex_unlock(&recorder.lock);
+
+  profile_recording = true;
+  return true;
+} /* SARC_profileRecordStart */
+
+void SARC_profileRecordStop(void) {
+  thread_once(&recorder_once, recorder_init);
+  profile_recording = false;
+
+  ZSTD_pthread_mutex_lock(&recorder.lock);
+  if (recorder.file != NULL) {
+    fclose(recorder.file);
+    recorder.file = NULL;
+  }
+  key_table_free(&recorder.seen);
+  ZSTD_pthread_mutex_unlock(&recorder.lock);
+} /* SARC_profileRecordStop */
+
+void profile_record(SARC_ctx* ctx, SARCentry* entry) {
+  uint64_t key = file_key(ctx->arc_filename, entry->tree.name);
+  ZSTD_pthread_mutex_lock(&recorder.lock);
+  // Recording may have been stopped since the flag was checked
+  if (recorder.file != NULL && key_table_insert(&recorder.seen, key, 0)) {
+    fprintf(recorder.file, "%s\t%s\n", ctx->arc_filename, entry->tree.name);
+  }
+  ZSTD_pthread_mutex_unlock(&recorder.lock);
+}
+
+// Replaying
+
+typedef struct {
+  const char* archive;
+  const char* path;
+  // The file, looked up when the replay starts. ctx is NULL if there's nothing
+  // to read ahead for the line, or once its archive is unmounted.
+  SARC_ctx* ctx;
+  SARCentry* entry;
+  uint64_t start;
+  uint64_t size;
+}profile_line;
+
+// An entry read ahead. It sits in the table until it's taken by an open, and
+// then belongs to the streams reading it.
+typedef struct prefetched {
+  SARC_ctx* ctx;
+  SARCentry* entry;
+  uint32_t line;
+  uint8_t* data;
+  uint64_t size;
+  uint32_t refs; // Streams using it, once it's taken
+  struct prefetched* next; // Next in the same bucket
+}prefetched;
+
+// Everything below is only touched with replay.lock held, except the profile
+// itself (text, lines and line_count), which the worker reads without it. The
+// lines' ctx is the exception to the exception, profile_forget() clears it.
+static struct {
+  ZSTD_pthread_mutex_t lock;
+  ZSTD_pthread_cond_t changed; // Signalled when entries are taken, or it's stopping
+  ZSTD_pthread_t thread;
+  bool running; // The thread was started and not joined yet
+  bool stopping;
+
+  char* text; // The whole profile, lines point into it
+  profile_line* lines;
+  uint32_t line_count;
+  key_table index; // File keys to line numbers
+
+  SARC_ctx* stream_ctx; // Archive the worker is reading, which can't go away
+  uint32_t cursor; // Line after the furthest one the tool has opened
+  uint64_t max_bytes;
+  uint64_t held; // Bytes in the table
+  prefetched* table[PREFETCH_BUCKETS];
+}replay;
+
+static thread_once_t replay_once = THREAD_ONCE_INIT;
+
+static void replay_init(void) {
+  ZSTD_pthread_mutex_init(&replay.lock, NULL);
+  ZSTD_pthread_cond_init(&replay.changed, NULL);
+}
+
+static uint32_t prefetched_bucket(const SARCentry* entry) {
+  return (uint32_t)(((uintptr_t)entry >> 4) % PREFETCH_BUCKETS);
+}
+
+static void prefetched_free(prefetched* item) {
+  mem_budget_release(item->size);
+  allocator.Free(item->data);
+  allocator.Free(item);
+}
+
+// Free every entry in the table that matches. Called with the lock held.
+static void table_drop(bool (*match)(const prefetched* item, const void* data), const void* data) {
+  for (uint32_t i = 0; i < PREFETCH_BUCKETS; i++) {
+    prefetched** link = &replay.table[i];
+    while (*link != NULL) {
+      prefetched* item = *link;
+      if (match(item, data)) {
+        *link = item->next;
+        replay.held -= item->size;
+        prefetched_free(item);
+      }
+      else {
+        link = &item->next;
+      }
+    }
+  }
+  ZSTD_pthread_cond_broadcast(&replay.changed);
+}
+
+static bool match_all(const prefetched* item, const void* data) {
+  return true;
+}
+
+static bool match_ctx(const prefetched* item, const void* data) {
+  return item->ctx == (const SARC_ctx*)data;
+}
+
+// Entries the tool went past without opening them
+static bool match_passed(const prefetched* item, const void* data) {
+  return item->line < *(const uint32_t*)data;
+}
+
+// Streams over a taken entry. Positions are in the whole archive, like the
+// streams SARC_openRead() makes, and only the entry's own range can be read.
+typedef struct {
+  prefetched* item;
+  PHYSFS_uint64 pos;
+}prefetch_io;
+
+static const PHYSFS_Io prefetch_io_interface;
+
+static PHYSFS_Io* prefetch_io_create(prefetched* item) {
+  PHYSFS_Io* io = allocator.Malloc(sizeof(*io));
+  prefetch_io* opaque = allocator.Malloc(sizeof(*opaque));
+  if (io == NULL || opaque == NULL) {
+    allocator.Free(io);
+    allocator.Free(opaque);
+    BAIL(PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+  }
+  opaque->item = item;
+  opaque->pos = item->entry->startPos;
+  memcpy(io, &prefetch_io_interface, sizeof(*io));
+  io->opaque = opaque;
+  return io;
+}
+
+static PHYSFS_sint64 prefetch_io_read(PHYSFS_Io* io, void* buf, PHYSFS_uint64 len) {
+  prefetch_io* opaque = (prefetch_io*)io->opaque;
+  const prefetched* item = opaque->item;
+  PHYSFS_uint64 start = item->entry->startPos;
+  BAIL_IF(opaque->pos < start, PHYSFS_ERR_IO, -1);
+  PHYSFS_uint64 offset = opaque->pos - start;
+  if (offset >= item->size) {
+    return 0;
+  }
+  len = MIN(len, item->size - offset);
+  memcpy(buf, item->data + offset, len);
+  opaque->pos += len;
+  return (PHYSFS_sint64)len;
+}
+
+static PHYSFS_sint64 prefetch_io_write(PHYSFS_Io* io, const void* buf, PHYSFS_uint64 len) {
+  BAIL(PHYSFS_ERR_READ_ONLY, -1);
+}
+
+static int prefetch_io_seek(PHYSFS_Io* io, PHYSFS_uint64 offset) {
+  prefetch_io* opaque = (prefetch_io*)io->opaque;
+  const prefetched* item = opaque->item;
+  BAIL_IF(offset < item->entry->startPos, PHYSFS_ERR_IO, 0);
+  BAIL_IF(offset > item->entry->startPos + item->size, PHYSFS_ERR_PAST_EOF, 0);
+  opaque->pos = offset;
+  return 1;
+}
+
+static PHYSFS_sint64 prefetch_io_tell(PHYSFS_Io* io) {
+  return (PHYSFS_sint64)((prefetch_io*)io->opaque)->pos;
+}
+
+static PHYSFS_sint64 prefetch_io_length(PHYSFS_Io* io) {
+  const prefetched* item = ((prefetch_io*)io->opaque)->item;
+  return (PHYSFS_sint64)(item->entry->startPos + item->size);
+}
+
+static PHYSFS_Io* prefetch_io_duplicate(PHYSFS_Io* io) {
+  prefetched* item = ((prefetch_io*)io->opaque)->item;
+  PHYSFS_Io* dup = prefetch_io_create(item);
+  BAIL_IF_ERRPASS(dup == NULL, NULL);
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  item->refs++;
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  return dup;
+}
+
+static int prefetch_io_flush(PHYSFS_Io* io) {
+  return 1;
+}
+
+static void prefetch_io_destroy(PHYSFS_Io* io) {
+  prefetched* item = ((prefetch_io*)io->opaque)->item;
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  bool last = (--item->refs == 0);
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  if (last) {
+    prefetched_free(item);
+  }
+  allocator.Free(io->opaque);
+  allocator.Free(io);
+}
+
+static const PHYSFS_Io prefetch_io_interface = {
+  .version = 0,
+  .opaque = NULL,
+  .read = prefetch_io_read,
+  .write = prefetch_io_write,
+  .seek = prefetch_io_seek,
+  .tell = prefetch_io_tell,
+  .length = prefetch_io_length,
+  .duplicate = prefetch_io_duplicate,
+  .flush = prefetch_io_flush,
+  .destroy = prefetch_io_destroy
+};
+
+// Move the cursor past line, and drop anything read ahead for the lines the
+// tool skipped. Called with the lock held.
+static void advance_cursor(uint32_t line) {
+  if (line < replay.cursor) {
+    return;
+  }
+  replay.cursor = line + 1;
+  if (replay.held > 0) {
+    table_drop(match_passed, &replay.cursor);
+  }
+}
+
+PHYSFS_Io* profile_take(SARC_ctx* ctx, SARCentry* entry) {
+  uint64_t key = file_key(ctx->arc_filename, entry->tree.name);
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  prefetched* item = NULL;
+  prefetched** link = &replay.table[prefetched_bucket(entry)];
+  for (; *link != NULL; link = &(*link)->next) {
+    if ((*link)->entry == entry && (*link)->ctx == ctx) {
+      item = *link;
+      *link = item->next;
+      item->next = NULL;
+      item->refs = 1;
+      replay.held -= item->size;
+      ZSTD_pthread_cond_broadcast(&replay.changed);
+      break;
+    }
+  }
+  // Written since it was read ahead
+  if (item != NULL && entry->data_ptr != 0) {
+    prefetched_free(item);
+    item = NULL;
+  }
+  uint32_t line = 0;
+  if (key_table_find(&replay.index, key, &line)) {
+    advance_cursor(line);
+  }
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  if (item == NULL) {
+    return NULL;
+  }
+
+  PHYSFS_Io* io = prefetch_io_create(item);
+  if (io == NULL) {
+    prefetched_free(item);
+    return NULL;
+  }
+  SARC_STATS_ADD(&ctx->stats, prefetch_hits, 1);
+  return io;
+}
+
+void profile_forget(SARC_ctx* ctx) {
+  thread_once(&replay_once, replay_init);
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  for (uint32_t i = 0; i < replay.line_count; i++) {
+    if (replay.lines[i].ctx == ctx) {
+      replay.lines[i].ctx = NULL;
+    }
+  }
+  table_drop(match_ctx, ctx);
+  // The worker lets go of the archive as soon as it sees its lines are gone
+  while (replay.stream_ctx == ctx) {
+    ZSTD_pthread_cond_wait(&replay.changed, &replay.lock);
+  }
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+}
+
+// Whether the worker should still read a line. Called with the lock held.
+static bool line_wanted(uint32_t line) {
+  return !replay.stopping && replay.lines[line].ctx != NULL && replay.cursor <= line;
+}
+
+static bool read_fully(PHYSFS_Io* stream, void* buf, PHYSFS_uint64 size) {
+  uint8_t* out = buf;
+  while (size > 0) {
+    PHYSFS_sint64 read = stream->read(stream, out, size);
+    if (read <= 0) {
+      return false;
+    }
+    out += read;
+    size -= (PHYSFS_uint64)read;
+  }
+  return true;
+}
+
+// Decompress a line's file into the table, once there's room for it. Returns
+// false if it wasn't read.
+static bool prefetch_entry(PHYSFS_Io* stream, uint32_t line) {
+  const profile_line* file = &replay.lines[line];
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  // Anything bigger than the limit is still read, alone
+  while (!replay.stopping && file->ctx != NULL && replay.held > 0 && replay.held + file->size > replay.max_bytes) {
+    ZSTD_pthread_cond_wait(&replay.changed, &replay.lock);
+  }
+  bool wanted = line_wanted(line);
+  SARC_ctx* ctx = file->ctx;
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  if (!wanted || !mem_budget_acquire_buffer(file->size)) {
+    return false;
+  }
+
+  prefetched* item = allocator.Malloc(sizeof(*item));
+  uint8_t* data = allocator.Malloc(MAX(file->size, 1));
+  if (item == NULL || data == NULL || !stream->seek(stream, file->start) || !read_fully(stream, data, file->size)) {
+    LOG_MSG(debug, "Can't read ahead %s\n", file->path);
+    mem_budget_release(file->size);
+    allocator.Free(item);
+    allocator.Free(data);
+    return false;
+  }
+  *item = (prefetched) {
+    .ctx = ctx,
+    .entry = file->entry,
+    .line = line,
+    .data = data,
+    .size = file->size
+  };
+  SARC_STATS_ADD(&ctx->stats, prefetch_bytes, file->size);
+
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  uint32_t bucket = prefetched_bucket(item->entry);
+  bool keep = line_wanted(line);
+  for (prefetched* other = replay.table[bucket]; keep && other != NULL; other = other->next) {
+    // Listed twice in the profile
+    keep = (other->entry != item->entry || other->ctx != ctx);
+  }
+  if (keep) {
+    item->next = replay.table[bucket];
+    replay.table[bucket] = item;
+    replay.held += item->size;
+  }
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  if (!keep) {
+    prefetched_free(item);
+  }
+  return true;
+}
+
+// Read a line's file and throw it away, so it's in the page cache when it's
+// opened. Returns false if it wasn't read.
+static bool warm_entry(PHYSFS_Io* stream, uint32_t line, uint8_t* scratch) {
+  const profile_line* file = &replay.lines[line];
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  bool wanted = line_wanted(line);
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  if (!wanted || !stream->seek(stream, file->start)) {
+    return false;
+  }
+  PHYSFS_uint64 left = file->size;
+  while (left > 0) {
+    PHYSFS_sint64 read = stream->read(stream, scratch, MIN(left, WARM_CHUNK_SIZE));
+    if (read <= 0) {
+      return false;
+    }
+    left -= (PHYSFS_uint64)read;
+  }
+  return true;
+}
+
+static int compare_line_starts(const void* a, const void* b) {
+  uint64_t start_a = replay.lines[*(const uint32_t*)a].start;
+  uint64_t start_b = replay.lines[*(const uint32_t*)b].start;
+  return (start_a > start_b) - (start_a < start_b);
+}
+
+// Close the worker's stream, and let profile_forget() have the archive
+static void release_stream(PHYSFS_Io** stream) {
+  if (*stream != NULL) {
+    (*stream)->destroy(*stream);
+    *stream = NULL;
+  }
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  replay.stream_ctx = NULL;
+  ZSTD_pthread_cond_broadcast(&replay.changed);
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+}
+
+static void* replay_main(void* opaque) {
+  // Lines are read in batches: a run of lines from the same archive, up to
+  // max_bytes of files. Each batch is read in the order its files are stored,
+  // so the stream only moves forward within it. A profile whose batches come
+  // in storage order (as one recorded from a tool that reads an archive front
+  // to back does) decompresses each archive once.
+  uint32_t* batch = allocator.Malloc(sizeof(*batch) * MAX(replay.line_count, 1));
+  if (batch == NULL) {
+    LOG_MSG(error, "Out of memory replaying a profile\n");
+    return NULL;
+  }
+  PHYSFS_Io* stream = NULL;
+  uint8_t* scratch = NULL;
+  uint32_t done = 0;
+  uint32_t line = 0;
+  while (true) {
+    ZSTD_pthread_mutex_lock(&replay.lock);
+    line = MAX(line, replay.cursor);
+    while (line < replay.line_count && replay.lines[line].ctx == NULL) {
+      line++;
+    }
+    bool stop = replay.stopping || line >= replay.line_count;
+    SARC_ctx* ctx = stop ? NULL : replay.lines[line].ctx;
+    // The old archive's stream goes before anything is read from the next
+    bool switching = (replay.stream_ctx != NULL && replay.stream_ctx != ctx);
+    uint32_t count = 0;
+    if (!stop && !switching) {
+      replay.stream_ctx = ctx;
+      uint64_t bytes = 0;
+      for (; line < replay.line_count; line++) {
+        const profile_line* next = &replay.lines[line];
+        // Lines with nothing to read don't end a run
+        if (next->ctx == NULL) {
+          continue;
+        }
+        if (next->ctx != ctx || (count > 0 && bytes + next->size > replay.max_bytes)) {
+          break;
+        }
+        batch[count++] = line;
+        bytes += next->size;
+      }
+    }
+    ZSTD_pthread_mutex_unlock(&replay.lock);
+    if (stop) {
+      break;
+    }
+    if (switching) {
+      release_stream(&stream);
+      continue;
+    }
+    if (stream == NULL && (stream = SARC_openStream(ctx)) == NULL) {
+      continue;
+    }
+
+    qsort(batch, count, sizeof(*batch), compare_line_starts);
+    for (uint32_t i = 0; i < count; i++) {
+      if (ctx->is_zstd) {
+        done += prefetch_entry(stream, batch[i]);
+      }
+      else if (scratch != NULL || (scratch = allocator.Malloc(WARM_CHUNK_SIZE)) != NULL) {
+        done += warm_entry(stream, batch[i], scratch);
+      }
+    }
+  }
+  LOG_MSG(debug, "Profile replay read %u files\n", done);
+
+  release_stream(&stream);
+  allocator.Free(scratch);
+  allocator.Free(batch);
+  return NULL;
+}
+
+// Split a profile into lines. Malformed lines are skipped.
+static bool load_profile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    LOG_MSG(error, "Can't open profile %s\n", path);
+    return false;
+  }
+  long size = -1;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+  }
+  char* text = (size >= 0) ? allocator.Malloc((size_t)size + 1) : NULL;
+  if (text == NULL || fread(text, 1, (size_t)size, file) != (size_t)size) {
+    LOG_MSG(error, "Can't read profile %s\n", path);
+    allocator.Free(text);
+    fclose(file);
+    return false;
+  }
+  fclose(file);
+  text[size] = '\0';
+
+  uint32_t capacity = 1;
+  for (long i = 0; i < size; i++) {
+    capacity += (text[i] == '\n');
+  }
+  replay.lines = allocator.Malloc(sizeof(*replay.lines) * capacity);
+  if (replay.lines == NULL) {
+    allocator.Free(text);
+    return false;
+  }
+  replay.text = text;
+  replay.line_count = 0;
+
+  char* line = text;
+  while (*line != '\0') {
+    char* end = strchr(line, '\n');
+    char* next = (end != NULL) ? end + 1 : line + strlen(line);
+    if (end != NULL) {
+      *end = '\0';
+      if (end > line && end[-1] == '\r') {
+        end[-1] = '\0';
+      }
+    }
+    char* tab = strchr(line, '\t');
+    if (tab != NULL) {
+      *tab = '\0';
+      uint64_t key = file_key(line, tab + 1);
+      if (key_table_insert(&replay.index, key, replay.line_count)) {
+        replay.lines[replay.line_count++] = (profile_line) { .archive = line, .path = tab + 1 };
+      }
+    }
+    line = next;
+  }
+  return true;
+}
+
+// Look a line's file up in its archive, with the archive registry locked
+static void resolve_line(SARC_ctx* ctx, void* data) {
+  profile_line* line = (profile_line*)data;
+  SARCentry* entry = findEntry(ctx, line->path);
+  // Edited entries don't come from the archive's stream
+  if (entry == NULL || entry->tree.isdir || entry->overlay || entry->data_ptr != 0) {
+    return;
+  }
+  line->ctx = ctx;
+  line->entry = entry;
+  line->start = entry->startPos;
+  line->size = entry->size;
+}
+
+void SARC_profileReplayStop(void) {
+  thread_once(&replay_once, replay_init);
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  replay.stopping = true;
+  ZSTD_pthread_cond_broadcast(&replay.changed);
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  if (replay.running) {
+    ZSTD_pthread_join(replay.thread);
+    replay.running = false;
+  }
+  profile_replaying = false;
+
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  table_drop(match_all, NULL);
+  key_table_free(&replay.index);
+  allocator.Free(replay.lines);
+  allocator.Free(replay.text);
+  replay.lines = NULL;
+  replay.text = NULL;
+  replay.line_count = 0;
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+} /* SARC_profileReplayStop */
+
+bool SARC_profileReplayStart(const char* path, uint64_t max_bytes) {
+  SARC_profileReplayStop();
+
+  ZSTD_pthread_mutex_lock(&replay.lock);
+  bool loaded = load_profile(path);
+  // Here rather than on the worker, so every lookup happens on a thread that
+  // may touch the archives' trees
+  for (uint32_t i = 0; loaded && i < replay.line_count; i++) {
+    SARC_withArchive(replay.lines[i].archive, resolve_line, &replay.lines[i]);
+  }
+  replay.stopping = false;
+  replay.cursor = 0;
+  replay.max_bytes = max_bytes;
+  ZSTD_pthread_mutex_unlock(&replay.lock);
+  if (!loaded) {
+    SARC_profileReplayStop();
+    return false;
+  }
+  LOG_MSG(debug, "Replaying %u files from %s\n", replay.line_count, path);
+
+  profile_replaying = true;
+  if (ZSTD_pthread_create(&replay.thread, NULL, replay_main, NULL) != 0) {
+    LOG_MSG(error, "Can't start the profile replay thread\n");
+    SARC_profileReplayStop();
+    return false;
+  }
+  replay.running = true;
+  return true;
+} /* SARC_profileReplayStart */
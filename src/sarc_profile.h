@@ -0,0 +1,48 @@
+#pragma once
+// Startup profiles: the files a tool opens from mounted archives, in the order
+// it opens them. Record one once, then replay it on later runs, and a worker
+// thread reads the same files ahead of the tool while it starts up. Nothing
+// changes for the code that opens the files.
+//
+// Replaying decompresses files from zstd archives into memory, where the next
+// SARC_openRead() of each one picks them up instead of decompressing again.
+// Files from uncompressed (or cached) archives are just read once, to get them
+// into the OS's page cache. If the tool gets ahead of the replay, the replay
+// skips ahead to where the tool is.
+//
+// Profiles are text, a line per file: the archive's real path (as mounted), a
+// tab, and the path inside the archive. Each file is only recorded the first
+// time it's opened.
+//
+// The hooks SARC_openRead() calls are in archiver_sarc_internal.h.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Start recording opens to a profile at path (a real path, not a PhysicsFS
+/// one). Returns false if the file can't be created.
+bool SARC_profileRecordStart(const char* path);
+
+/// Stop recording and close the profile. Safe to call if it never started.
+void SARC_profileRecordStop(void);
+
+/// Start replaying a profile on a worker thread. Files are looked up in
+/// their archives here, so mount the archives first; files in archives that
+/// aren't mounted yet are skipped. Unmounting an archive waits for the worker
+/// to stop reading it.
+/// \param max_bytes Most decompressed bytes held ahead of the tool. The
+/// replay waits for the tool to open what it has before reading more, and
+/// reads files that many bytes at a time in the order they're stored.
+/// \return false if the profile can't be read or the thread can't start.
+bool SARC_profileReplayStart(const char* path, uint64_t max_bytes);
+
+/// Stop replaying, and free whatever was read ahead and not opened yet.
+void SARC_profileReplayStop(void);
+
+#ifdef __cplusplus
+}
+#endif
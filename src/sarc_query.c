@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc_query.h"
+#include "archiver_sarc_internal.h"
+#include "physfs_utils.h"
+#include "trace.h"
+#include "logging.h"
+#include "int.h"
+
+// Strings are offsets into the arena until the end, since it moves as it grows
+typedef struct {
+  size_t path;
+  size_t archive;
+  PHYSFS_uint64 size;
+}query_hit;
+
+typedef struct {
+  const char* pattern;
+  size_t prefix_len; // Characters before the first wildcard
+
+  query_hit* hits;
+  uint32_t count;
+  uint32_t capacity;
+  char* arena;
+  size_t arena_used;
+  size_t arena_capacity;
+  bool failed;
+
+  // The archive being searched, and its name's offset once something matched
+  SARC_ctx* ctx;
+  size_t archive;
+  bool archive_stored;
+}query_state;
+
+static bool glob_match(const char* pattern, const char* name) {
+  while (*pattern != '\0') {
+    if (pattern[0] == '*' && pattern[1] == '*') {
+      while (*pattern == '*') {
+        pattern++;
+      }
+      for (;; name++) {
+        if (glob_match(pattern, name)) {
+          return true;
+        }
+        if (*name == '\0') {
+          return false;
+        }
+      }
+    }
+    if (*pattern == '*') {
+      pattern++;
+      for (;; name++) {
+        if (glob_match(pattern, name)) {
+          return true;
+        }
+        if (*name == '\0' || *name == '/') {
+          return false;
+        }
+      }
+    }
+    if (*name == '\0' || (*pattern == '?' ? *name == '/' : *pattern != *name)) {
+      return false;
+    }
+    pattern++;
+    name++;
+  }
+  return *name == '\0';
+}
+
+static bool arena_add(query_state* state, const char* str, size_t* offset) {
+  size_t size = strlen(str) + 1;
+  if (state->arena_used + size > state->arena_capacity) {
+    size_t capacity = MAX(state->arena_capacity * 2, state->arena_used + size + 4096);
+    char* arena = allocator.Realloc(state->arena, capacity);
+    if (arena == NULL) {
+      return false;
+    }
+    state->arena = arena;
+    state->arena_capacity = capacity;
+  }
+  memcpy(state->arena + state->arena_used, str, size);
+  *offset = state->arena_used;
+  state->arena_used += size;
+  return true;
+}
+
+static PHYSFS_EnumerateCallbackResult add_hit(void* data, __PHYSFS_DirTreeEntry* tree_entry) {
+  query_state* state = (query_state*)data;
+  if (tree_entry->isdir || !glob_match(state->pattern, tree_entry->name)) {
+    return PHYSFS_ENUM_OK;
+  }
+  if (state->count == state->capacity) {
+    uint32_t capacity = (state->capacity == 0) ? 64 : state->capacity * 2;
+    query_hit* hits = allocator.Realloc(state->hits, sizeof(*hits) * capacity);
+    if (hits == NULL) {
+      state->failed = true;
+      return PHYSFS_ENUM_STOP;
+    }
+    state->hits = hits;
+    state->capacity = capacity;
+  }
+  query_hit* hit = &state->hits[state->count];
+  if (!state->archive_stored) {
+    state->archive_stored = arena_add(state, state->ctx->arc_filename, &state->archive);
+  }
+  if (!state->archive_stored || !arena_add(state, tree_entry->name, &hit->path)) {
+    state->failed = true;
+    return PHYSFS_ENUM_STOP;
+  }
+  hit->archive = state->archive;
+  hit->size = ((SARCentry*)tree_entry)->size;
+  state->count++;
+  return PHYSFS_ENUM_OK;
+}
+
+// First index entry that's not less than the prefix. Everything starting with
+// the prefix follows it.
+static uint32_t index_lower_bound(const SARC_ctx* ctx, const char* prefix, size_t prefix_len) {
+  uint32_t lo = 0;
+  uint32_t len = ctx->index_count;
+  while (len > 0) {
+    uint32_t half = len >> 1;
+    const char* name = ctx->index[lo + half]->tree.name;
+    if (strncmp(name, prefix, prefix_len) < 0) {
+      lo += half + 1;
+      len -= half + 1;
+    }
+    else {
+      len = half;
+    }
+  }
+  return lo;
+}
+
+static void query_archive(SARC_ctx* ctx, void* data) {
+  query_state* state = (query_state*)data;
+  if (state->failed) {
+    return;
+  }
+  state->ctx = ctx;
+  state->archive_stored = false;
+
+  if (ctx->index != NULL) {
+    uint32_t i = index_lower_bound(ctx, state->pattern, state->prefix_len);
+    for (; i < ctx->index_count; i++) {
+      __PHYSFS_DirTreeEntry* entry = &ctx->index[i]->tree;
+      if (strncmp(entry->name, state->pattern, state->prefix_len) != 0 || add_hit(state, entry) != PHYSFS_ENUM_OK) {
+        break;
+      }
+    }
+    return;
+  }
+
+  // Entries were added since mounting, so there's no index. Walk the deepest
+  // directory the prefix names instead of the whole tree.
+  size_t dir_len = state->prefix_len;
+  while (dir_len > 0 && state->pattern[dir_len - 1] != '/') {
+    dir_len--;
+  }
+  char* dir = allocator.Malloc(dir_len + 1);
+  if (dir == NULL) {
+    state->failed = true;
+    return;
+  }
+  memcpy(dir, state->pattern, dir_len);
+  dir[(dir_len > 0) ? dir_len - 1 : 0] = '\0';
+  tree_walk(&ctx->tree, dir, add_hit, state);
+  allocator.Free(dir);
+}
+
+static int compare_results(const void* a, const void* b) {
+  const SARC_queryResult* left = (const SARC_queryResult*)a;
+  const SARC_queryResult* right = (const SARC_queryResult*)b;
+  int cmp = strcmp(left->path, right->path);
+  return (cmp != 0) ? cmp : strcmp(left->archive, right->archive);
+}
+
+SARC_queryResult* SARC_query(const char* pattern, PHYSFS_uint32* count) {
+  TRACE_BEGIN(span);
+  query_state state = {
+    .pattern = pattern,
+    .prefix_len = strcspn(pattern, "*?")
+  };
+  SARC_forEachArchive(query_archive, &state);
+
+  SARC_queryResult* results = NULL;
+  if (!state.failed) {
+    size_t list_size = sizeof(*results) * state.count;
+    results = allocator.Malloc(list_size + state.arena_used + 1);
+    state.failed = (results == NULL);
+  }
+  if (state.failed) {
+    LOG_MSG(error, "Out of memory querying %s\n", pattern);
+    allocator.Free(state.hits);
+    allocator.Free(state.arena);
+    BAIL(PHYSFS_ERR_OUT_OF_MEMORY, NULL);
+  }
+
+  char* arena = (char*)(results + state.count);
+  if (state.arena_used > 0) {
+    memcpy(arena, state.arena, state.arena_used);
+  }
+  for (uint32_t i = 0; i < state.count; i++) {
+    results[i] = (SARC_queryResult) {
+      .path = arena + state.hits[i].path,
+      .archive = arena + state.hits[i].archive,
+      .size = state.hits[i].size
+    };
+  }
+  qsort(results, state.count, sizeof(*results), compare_results);
+
+  allocator.Free(state.hits);
+  allocator.Free(state.arena);
+  *count = state.count;
+  TRACE_END(span, "SARC_query", NULL, pattern);
+  return results;
+} /* SARC_query */
+
+void SARC_freeQuery(SARC_queryResult* results) {
+  allocator.Free(results);
+} /* SARC_freeQuery */
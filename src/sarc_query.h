@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+#include <physfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Finding entries by prefix or glob across every mounted archive, without
+// enumerating everything through PhysicsFS. Each archive's sorted name index
+// (built when it's mounted) is searched for the part of the pattern before
+// the first wildcard, so a query costs a binary search per archive plus the
+// names under that prefix, not a walk over every file.
+//
+// Patterns are matched against paths inside the archives:
+//   *   any run of characters except '/'
+//   **  any run of characters, including '/'
+//   ?   any one character except '/'
+// So "Component/ArmorParam/*.bgyml" matches that directory's .bgyml files, and
+// "Actor/**" is everything under Actor/.
+
+typedef struct {
+  const char* path; // Path of the entry inside its archive
+  const char* archive; // Real path of the archive it's in
+  PHYSFS_uint64 size;
+}SARC_queryResult;
+
+/// Find every entry matching a pattern, in every mounted archive.
+/// \param count Set to the number of results
+/// \return Results sorted by path (then archive), or NULL on failure. The
+/// results and their strings are one allocation, which stays valid after the
+/// archives are unmounted. Free it with SARC_freeQuery(). When nothing matches,
+/// this is an empty list, not NULL.
+SARC_queryResult* SARC_query(const char* pattern, PHYSFS_uint32* count);
+
+void SARC_freeQuery(SARC_queryResult* results);
+
+#ifdef __cplusplus
+}
+#endif
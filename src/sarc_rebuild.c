@@ -0,0 +1,384 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc.h"
+#include "sarc_rebuild.h"
+#include "archiver_sarc_internal.h"
+#include "sarc_hash.h"
+#include "sarc_image.h"
+#include "vmem.h"
+#include "threads.h"
+#include "trace.h"
+#include "logging.h"
+#include "int.h"
+
+// The reader fills blocks of the new data section while the writer compresses
+// the ones before. Apart from edited entries, this is all the archive data we
+// hold at once.
+#define REBUILD_BLOCK_SIZE 0x100000
+#define REBUILD_BLOCK_COUNT 4
+
+// Entries start 8-byte aligned, the same as rebuild_sarc() writes them
+#define REBUILD_DATA_ALIGN 8
+
+typedef struct {
+  SARCentry* entry;
+  const char* name;
+  uint32_t hash;
+  uint32_t data_start; // Relative to the data section
+}rebuild_item;
+
+typedef struct {
+  uint8_t* data;
+  size_t size;
+}rebuild_block;
+
+typedef struct {
+  SARC_ctx* ctx;
+  rebuild_item** order; // Items in the order their data is written
+  uint32_t count;
+  uint64_t data_size; // Size of the whole data section, with padding
+
+  ZSTD_pthread_mutex_t lock;
+  ZSTD_pthread_cond_t changed; // A block was filled or emptied
+  rebuild_block blocks[REBUILD_BLOCK_COUNT];
+  uint32_t head; // Oldest filled block
+  uint32_t filled; // Blocks waiting to be written
+  bool reader_done;
+  bool failed; // Either side gave up, and the other should stop
+}rebuild_pipeline;
+
+typedef struct {
+  PHYSFS_Io* io;
+  ZSTD_CCtx* cctx; // NULL for an uncompressed archive
+  uint8_t* out_buf;
+  size_t out_size;
+}rebuild_writer;
+
+static int compare_items(const void* a, const void* b) {
+  const rebuild_item* left = (const rebuild_item*)a;
+  const rebuild_item* right = (const rebuild_item*)b;
+  if (left->hash != right->hash) {
+    return (left->hash < right->hash) ? -1 : 1;
+  }
+  return strcmp(left->name, right->name);
+}
+
+static int compare_sources(const void* a, const void* b) {
+  return SARC_compareEntrySources((*(const rebuild_item**)a)->entry, (*(const rebuild_item**)b)->entry);
+}
+
+static void* reader_main(void* opaque) {
+  rebuild_pipeline* pipe = (rebuild_pipeline*)opaque;
+  PHYSFS_Io* base = NULL;
+  PHYSFS_Io* overlay = NULL;
+  uint32_t item = 0;
+  uint64_t item_offset = 0; // How much of the current item is copied
+  uint64_t pos = 0; // Position in the data section
+  bool ok = true;
+
+  while (ok && pos < pipe->data_size) {
+    ZSTD_pthread_mutex_lock(&pipe->lock);
+    while (pipe->filled == REBUILD_BLOCK_COUNT && !pipe->failed) {
+      ZSTD_pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    bool stop = pipe->failed;
+    rebuild_block* block = &pipe->blocks[(pipe->head + pipe->filled) % REBUILD_BLOCK_COUNT];
+    ZSTD_pthread_mutex_unlock(&pipe->lock);
+    if (stop) {
+      break;
+    }
+
+    block->size = 0;
+    while (block->size < REBUILD_BLOCK_SIZE && pos < pipe->data_size) {
+      uint8_t* dest = block->data + block->size;
+      size_t room = REBUILD_BLOCK_SIZE - block->size;
+      uint64_t next_start = (item < pipe->count) ? pipe->order[item]->data_start : pipe->data_size;
+      if (pos < next_start) {
+        // Alignment padding
+        size_t len = MIN(room, next_start - pos);
+        memset(dest, 0, len);
+        block->size += len;
+        pos += len;
+        continue;
+      }
+
+      const SARCentry* entry = pipe->order[item]->entry;
+      size_t len = MIN(room, entry->size - item_offset);
+      if (len > 0 && !SARC_readEntry(pipe->ctx, entry, item_offset, dest, len, &base, &overlay)) {
+        LOG_MSG(error, "Failed to read %s from %s\n", pipe->order[item]->name, pipe->ctx->arc_filename);
+        ok = false;
+        break;
+      }
+      block->size += len;
+      pos += len;
+      item_offset += len;
+      if (item_offset == entry->size) {
+        item++;
+        item_offset = 0;
+      }
+    }
+
+    ZSTD_pthread_mutex_lock(&pipe->lock);
+    if (ok) {
+      pipe->filled++;
+    }
+    ZSTD_pthread_cond_broadcast(&pipe->changed);
+    ZSTD_pthread_mutex_unlock(&pipe->lock);
+  }
+
+  ZSTD_pthread_mutex_lock(&pipe->lock);
+  pipe->reader_done = true;
+  if (!ok) {
+    pipe->failed = true;
+  }
+  ZSTD_pthread_cond_broadcast(&pipe->changed);
+  ZSTD_pthread_mutex_unlock(&pipe->lock);
+
+  if (base != NULL) {
+    base->destroy(base);
+  }
+  if (overlay != NULL) {
+    overlay->destroy(overlay);
+  }
+  return NULL;
+}
+
+static bool writer_write(rebuild_writer* writer, const void* data, size_t size, ZSTD_EndDirective mode) {
+  if (writer->cctx == NULL) {
+    return writer->io->write(writer->io, data, size) == (PHYSFS_sint64)size;
+  }
+  ZSTD_inBuffer in = { data, size, 0 };
+  for (;;) {
+    ZSTD_outBuffer out = { writer->out_buf, writer->out_size, 0 };
+    size_t remaining = ZSTD_compressStream2(writer->cctx, &out, &in, mode);
+    if (ZSTD_isError(remaining)) {
+      LOG_MSG(error, "ZSTD error [%s]\n", ZSTD_getErrorName(remaining));
+      return false;
+    }
+    if (out.pos > 0 && writer->io->write(writer->io, writer->out_buf, out.pos) != (PHYSFS_sint64)out.pos) {
+      return false;
+    }
+    bool done = (mode == ZSTD_e_end) ? (remaining == 0) : (in.pos == in.size);
+    if (done) {
+      return true;
+    }
+  }
+}
+
+// Take filled blocks from the reader and write them until the data section is
+// done. Runs on the calling thread.
+static bool write_blocks(rebuild_pipeline* pipe, rebuild_writer* writer) {
+  bool ok = true;
+  ZSTD_pthread_mutex_lock(&pipe->lock);
+  while (1) {
+    while (pipe->filled == 0 && !pipe->reader_done && !pipe->failed) {
+      ZSTD_pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    if (pipe->failed) {
+      ok = false;
+      break;
+    }
+    if (pipe->filled == 0) {
+      break; // The reader is done and we've written everything
+    }
+    rebuild_block* block = &pipe->blocks[pipe->head];
+    ZSTD_pthread_mutex_unlock(&pipe->lock);
+
+    ok = writer_write(writer, block->data, block->size, ZSTD_e_continue);
+
+    ZSTD_pthread_mutex_lock(&pipe->lock);
+    if (!ok) {
+      pipe->failed = true;
+      ZSTD_pthread_cond_broadcast(&pipe->changed);
+      break;
+    }
+    pipe->head = (pipe->head + 1) % REBUILD_BLOCK_COUNT;
+    pipe->filled--;
+    ZSTD_pthread_cond_broadcast(&pipe->changed);
+  }
+  ZSTD_pthread_mutex_unlock(&pipe->lock);
+  return ok;
+}
+
+// Serialise the header, SFAT and SFNT for items sorted by hash, and give every
+// entry its place in the data section. Returns NULL if the archive is too big
+// for SARC's 32-bit offsets.
+static uint8_t* build_metadata(rebuild_item* items, rebuild_item** order, uint32_t count, uint32_t hash_key,
+                               uint32_t* meta_size, uint64_t* data_size) {
+  sarc_image_node* nodes = allocator.Malloc(sizeof(*nodes) * (count + 1));
+  if (nodes == NULL) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    nodes[i].name = items[i].name;
+    nodes[i].hash = items[i].hash;
+    nodes[i].size = items[i].entry->size;
+  }
+  uint64_t data_offset = sarc_image_meta_size(nodes, count);
+
+  // Lay out the data in the order it'll be read
+  uint64_t pos = data_offset;
+  for (uint32_t i = 0; i < count; i++) {
+    order[i]->data_start = pos - data_offset;
+    pos = ALIGN_UP(pos + order[i]->entry->size, REBUILD_DATA_ALIGN);
+  }
+  if (data_offset == 0 || pos > UINT32_MAX) {
+    LOG_MSG(error, "Archive is too big for SARC (0x%llx bytes)\n", (unsigned long long)pos);
+    allocator.Free(nodes);
+    return NULL;
+  }
+
+  uint8_t* meta = allocator.Malloc(data_offset);
+  if (meta != NULL) {
+    for (uint32_t i = 0; i < count; i++) {
+      nodes[i].data_start = items[i].data_start;
+    }
+    memset(meta, 0, data_offset);
+    sarc_image_write_meta(meta, nodes, count, hash_key, data_offset, pos);
+    *meta_size = data_offset;
+    *data_size = pos - data_offset;
+  }
+  allocator.Free(nodes);
+  return meta;
+}
+
+bool SARC_rebuildTo(const char* arc_filename, const char* out_path, int level) {
+  TRACE_BEGIN(span);
+  // Unmounting it waits until we're done
+  SARC_ctx* ctx = SARC_pinArchive(arc_filename);
+  if (ctx == NULL) {
+    LOG_MSG(error, "%s isn't mounted\n", arc_filename);
+    return false;
+  }
+  // Both are read while the new archive is written
+  if (strcmp(arc_filename, out_path) == 0 ||
+      (ctx->overlay_filename != NULL && strcmp(ctx->overlay_filename, out_path) == 0)) {
+    LOG_MSG(error, "Can't rebuild %s into itself\n", arc_filename);
+    SARC_unpinArchive(ctx);
+    return false;
+  }
+
+  bool success = false;
+  char** file_list = get_file_list(ctx->tree.root, false);
+  uint32_t count = 0;
+  while (file_list != NULL && file_list[count] != NULL) {
+    count++;
+  }
+  rebuild_item* items = allocator.Malloc(sizeof(rebuild_item) * (count + 1));
+  rebuild_item** order = allocator.Malloc(sizeof(rebuild_item*) * (count + 1));
+  uint32_t* hashes = allocator.Malloc(sizeof(uint32_t) * (count + 1));
+  uint8_t* meta = NULL;
+  uint8_t* block_memory = NULL;
+  rebuild_writer writer = {0};
+  rebuild_pipeline pipe = {0};
+  if (file_list == NULL || items == NULL || order == NULL || hashes == NULL) {
+    LOG_MSG(error, "Out of memory\n");
+    goto rebuildTo_done;
+  }
+  if (count > UINT16_MAX) {
+    LOG_MSG(error, "%s has too many entries for SARC (%u)\n", arc_filename, count);
+    goto rebuildTo_done;
+  }
+
+  sarc_hash_batch((const char* const*)file_list, NULL, count, ctx->hash_key, hashes);
+  for (uint32_t i = 0; i < count; i++) {
+    items[i].entry = findEntry(ctx, file_list[i]);
+    items[i].name = file_list[i];
+    items[i].hash = hashes[i];
+  }
+  qsort(items, count, sizeof(*items), compare_items);
+  for (uint32_t i = 0; i < count; i++) {
+    order[i] = &items[i];
+  }
+  qsort(order, count, sizeof(*order), compare_sources);
+
+  uint32_t meta_size = 0;
+  meta = build_metadata(items, order, count, ctx->hash_key, &meta_size, &pipe.data_size);
+  if (meta == NULL) {
+    goto rebuildTo_done;
+  }
+
+  writer.io = __PHYSFS_createNativeIo(out_path, 'w');
+  if (writer.io == NULL) {
+    LOG_MSG(error, "Can't create %s\n", out_path);
+    goto rebuildTo_done;
+  }
+  if (level > 0) {
+    writer.cctx = ZSTD_createCCtx();
+    writer.out_size = ZSTD_CStreamOutSize();
+    writer.out_buf = allocator.Malloc(writer.out_size);
+    if (writer.cctx == NULL || writer.out_buf == NULL) {
+      LOG_MSG(error, "Out of memory\n");
+      goto rebuildTo_done;
+    }
+    ZSTD_CCtx_setParameter(writer.cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setPledgedSrcSize(writer.cctx, meta_size + pipe.data_size);
+    // zstd compresses on its own workers while we keep feeding it. This fails
+    // harmlessly if it was built without threads.
+    size_t rc = ZSTD_CCtx_setParameter(writer.cctx, ZSTD_c_nbWorkers, thread_core_count());
+    if (ZSTD_isError(rc)) {
+      LOG_MSG(debug, "Compressing on one thread [%s]\n", ZSTD_getErrorName(rc));
+    }
+  }
+  if (!writer_write(&writer, meta, meta_size, ZSTD_e_continue)) {
+    LOG_MSG(error, "Failed to write %s\n", out_path);
+    goto rebuildTo_done;
+  }
+
+  block_memory = virtual_reserve_hinted(REBUILD_BLOCK_SIZE * REBUILD_BLOCK_COUNT, VMEM_HINT_SEQUENTIAL | VMEM_HINT_POPULATE);
+  if (block_memory == NULL) {
+    LOG_MSG(error, "Out of memory\n");
+    goto rebuildTo_done;
+  }
+  for (uint32_t i = 0; i < REBUILD_BLOCK_COUNT; i++) {
+    pipe.blocks[i].data = block_memory + (REBUILD_BLOCK_SIZE * i);
+  }
+  pipe.ctx = ctx;
+  pipe.order = order;
+  pipe.count = count;
+  ZSTD_pthread_mutex_init(&pipe.lock, NULL);
+  ZSTD_pthread_cond_init(&pipe.changed, NULL);
+
+  ZSTD_pthread_t reader;
+  bool data_written = false;
+  if (ZSTD_pthread_create(&reader, NULL, reader_main, &pipe) != 0) {
+    LOG_MSG(error, "Failed to start the reader thread\n");
+  }
+  else {
+    data_written = write_blocks(&pipe, &writer);
+    ZSTD_pthread_join(reader);
+  }
+  ZSTD_pthread_cond_destroy(&pipe.changed);
+  ZSTD_pthread_mutex_destroy(&pipe.lock);
+  if (!data_written || !writer_write(&writer, NULL, 0, ZSTD_e_end)) {
+    LOG_MSG(error, "Failed to rebuild %s into %s\n", arc_filename, out_path);
+    goto rebuildTo_done;
+  }
+
+  SARC_STATS_ADD(&ctx->stats, rebuilds, 1);
+  success = true;
+  TRACE_END(span, "SARC_rebuildTo", arc_filename, NULL);
+
+rebuildTo_done:
+  if (block_memory != NULL) {
+    virtual_free(block_memory, REBUILD_BLOCK_SIZE * REBUILD_BLOCK_COUNT);
+  }
+  if (writer.io != NULL) {
+    writer.io->destroy(writer.io);
+  }
+  ZSTD_freeCCtx(writer.cctx);
+  allocator.Free(writer.out_buf);
+  allocator.Free(meta);
+  allocator.Free(hashes);
+  allocator.Free(order);
+  allocator.Free(items);
+  allocator.Free(file_list);
+  SARC_unpinArchive(ctx);
+  return success;
+} /* SARC_rebuildTo */
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Streaming rebuilds of a mounted archive into a new file. Unedited entries are
+// read from the archive (or its overlay) in the order they're stored, edited
+// ones come from their write buffers, and the new SARC is serialised and
+// compressed as it goes. A reader thread fills a few fixed-size blocks while
+// the calling thread compresses and writes the ones before, with zstd's own
+// workers compressing in parallel. Memory use doesn't grow with the archive.
+//
+// Entry data is laid out in the order it's read rather than by name hash. The
+// SFAT is still sorted by hash, so games can't tell the difference.
+
+/// Write a mounted archive, with all its edits, to out_path. Unmounting the
+/// archive waits until it's done.
+/// \param arc_filename Real path of the mounted archive (see SARC_findArchive())
+/// \param out_path Real path to write to. Can't be the archive or its overlay.
+/// \param level 0 to write an uncompressed SARC, otherwise the zstd level
+/// \return false on failure, with the reason logged. out_path may be left
+/// partly written.
+bool SARC_rebuildTo(const char* arc_filename, const char* out_path, int level);
+
+#ifdef __cplusplus
+}
+#endif
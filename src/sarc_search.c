@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc_search.h"
+#include "archiver_sarc_internal.h"
+#include "threads.h"
+#include "atomics.h"
+#include "trace.h"
+#include "logging.h"
+#include "cpu.h"
+#include "int.h"
+
+#ifdef SARC_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SARC_SEARCH_SSE2
+#endif
+#endif
+
+// Entries from streams are scanned this much at a time, so memory doesn't
+// depend on how big they are
+#define SEARCH_BLOCK_SIZE 0x100000
+
+typedef const uint8_t* (*search_find_fn)(const uint8_t* data, size_t size, const uint8_t* pattern, size_t pattern_len);
+
+typedef struct {
+  SARC_ctx* ctx;
+  SARCentry** entries; // In the order they're read
+  uint32_t count;
+  uint64_t bytes; // Total size of the entries, used to hand out the biggest archives first
+}search_archive;
+
+typedef struct {
+  const uint8_t* pattern;
+  size_t pattern_len;
+  search_find_fn find;
+  SARC_searchCallback callback;
+  void* data;
+
+  search_archive* archives;
+  uint32_t count;
+  uint32_t capacity;
+  bool list_failed;
+
+  ZSTD_pthread_mutex_t lock; // Held for next_archive and callbacks
+  uint32_t next_archive;
+  uint64_t hits;
+  uint64_t stopped; // The callback asked to stop, read without the lock
+  bool failed;
+}search_state;
+
+static const uint8_t* find_scalar(const uint8_t* data, size_t size, const uint8_t* pattern, size_t pattern_len) {
+  if (size < pattern_len) {
+    return NULL;
+  }
+  const uint8_t* end = data + size - pattern_len + 1;
+  for (const uint8_t* i = data; i < end; i++) {
+    i = memchr(i, pattern[0], (size_t)(end - i));
+    if (i == NULL) {
+      return NULL;
+    }
+    if (memcmp(i + 1, pattern + 1, pattern_len - 1) == 0) {
+      return i;
+    }
+  }
+  return NULL;
+}
+
+#ifdef SARC_X86
+static uint32_t lowest_bit(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (uint32_t)index;
+#else
+  return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+// Each bit in mask is a position in the block where the first and last bytes
+// of the pattern match. Most blocks have none, so the rest of the pattern is
+// rarely compared.
+static const uint8_t* check_candidates(const uint8_t* block, uint32_t mask, const uint8_t* pattern, size_t pattern_len) {
+  while (mask != 0) {
+    uint32_t bit = lowest_bit(mask);
+    if (pattern_len <= 2 || memcmp(block + bit + 1, pattern + 1, pattern_len - 2) == 0) {
+      return block + bit;
+    }
+    mask &= mask - 1;
+  }
+  return NULL;
+}
+
+#ifdef SARC_SEARCH_SSE2
+static const uint8_t* find_sse2(const uint8_t* data, size_t size, const uint8_t* pattern, size_t pattern_len) {
+  const __m128i first = _mm_set1_epi8((char)pattern[0]);
+  const __m128i last = _mm_set1_epi8((char)pattern[pattern_len - 1]);
+  size_t pos = 0;
+  for (; size >= pattern_len - 1 + 16 && pos <= size - (pattern_len - 1) - 16; pos += 16) {
+    __m128i starts = _mm_loadu_si128((const __m128i*)(data + pos));
+    __m128i ends = _mm_loadu_si128((const __m128i*)(data + pos + pattern_len - 1));
+    __m128i both = _mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last));
+    const uint8_t* found = check_candidates(data + pos, (uint32_t)_mm_movemask_epi8(both), pattern, pattern_len);
+    if (found != NULL) {
+      return found;
+    }
+  }
+  return find_scalar(data + pos, size - pos, pattern, pattern_len);
+}
+#endif
+
+SARC_TARGET_AVX2 static const uint8_t* find_avx2(const uint8_t* data, size_t size, const uint8_t* pattern, size_t pattern_len) {
+  const __m256i first = _mm256_set1_epi8((char)pattern[0]);
+  const __m256i last = _mm256_set1_epi8((char)pattern[pattern_len - 1]);
+  size_t pos = 0;
+  for (; size >= pattern_len - 1 + 32 && pos <= size - (pattern_len - 1) - 32; pos += 32) {
+    __m256i starts = _mm256_loadu_si256((const __m256i*)(data + pos));
+    __m256i ends = _mm256_loadu_si256((const __m256i*)(data + pos + pattern_len - 1));
+    __m256i both = _mm256_and_si256(_mm256_cmpeq_epi8(starts, first), _mm256_cmpeq_epi8(ends, last));
+    const uint8_t* found = check_candidates(data + pos, (uint32_t)_mm256_movemask_epi8(both), pattern, pattern_len);
+    if (found != NULL) {
+      return found;
+    }
+  }
+  return find_scalar(data + pos, size - pos, pattern, pattern_len);
+}
+#endif
+
+static search_find_fn pick_find(const char** name) {
+#ifdef SARC_X86
+  if (cpu_has_avx2()) {
+    *name = "avx2";
+    return find_avx2;
+  }
+#endif
+#ifdef SARC_SEARCH_SSE2
+  *name = "sse2";
+  return find_sse2;
+#else
+  *name = "scalar";
+  return find_scalar;
+#endif
+}
+
+static int compare_entries(const void* a, const void* b) {
+  return SARC_compareEntrySources(*(const SARCentry* const*)a, *(const SARCentry* const*)b);
+}
+
+static int compare_archives(const void* a, const void* b) {
+  const search_archive* left = (const search_archive*)a;
+  const search_archive* right = (const search_archive*)b;
+  if (left->bytes != right->bytes) {
+    return (left->bytes > right->bytes) ? -1 : 1;
+  }
+  return 0;
+}
+
+static void list_archive(SARC_ctx* ctx, void* data) {
+  search_state* state = (search_state*)data;
+  if (state->list_failed) {
+    return;
+  }
+  if (state->count == state->capacity) {
+    uint32_t capacity = (state->capacity == 0) ? 16 : state->capacity * 2;
+    search_archive* archives = allocator.Realloc(state->archives, sizeof(*archives) * capacity);
+    if (archives == NULL) {
+      state->list_failed = true;
+      return;
+    }
+    state->archives = archives;
+    state->capacity = capacity;
+  }
+
+  char** names = get_file_list(ctx->tree.root, false);
+  uint32_t name_count = 0;
+  while (names != NULL && names[name_count] != NULL) {
+    name_count++;
+  }
+  search_archive* archive = &state->archives[state->count];
+  *archive = (search_archive) { .ctx = ctx };
+  archive->entries = allocator.Malloc(sizeof(*archive->entries) * (name_count + 1));
+  if (names == NULL || archive->entries == NULL) {
+    allocator.Free(archive->entries);
+    allocator.Free(names);
+    state->list_failed = true;
+    return;
+  }
+  for (uint32_t i = 0; i < name_count; i++) {
+    SARCentry* entry = findEntry(ctx, names[i]);
+    if (entry != NULL && entry->size > 0) {
+      archive->entries[archive->count++] = entry;
+      archive->bytes += entry->size;
+    }
+  }
+  allocator.Free(names);
+  qsort(archive->entries, archive->count, sizeof(*archive->entries), compare_entries);
+  // It's searched after the walk, without the registry lock
+  SARC_pinArchiveLocked(ctx);
+  state->count++;
+}
+
+static bool report_hit(search_state* state, SARC_ctx* ctx, const SARCentry* entry, uint64_t offset) {
+  SARC_searchHit hit = {
+    .archive = ctx->arc_filename,
+    .path = entry->tree.name,
+    .offset = offset
+  };
+  ZSTD_pthread_mutex_lock(&state->lock);
+  bool more = (ATOMIC_LOAD64(&state->stopped) == 0);
+  if (more) {
+    state->hits++;
+    more = state->callback(&hit, state->data);
+    if (!more) {
+      ATOMIC_STORE64(&state->stopped, 1);
+    }
+  }
+  ZSTD_pthread_mutex_unlock(&state->lock);
+  return more;
+}
+
+// Report every match that starts in data. base is the offset of data in the
+// entry.
+static bool scan_block(search_state* state, SARC_ctx* ctx, const SARCentry* entry, const uint8_t* data, size_t size,
+                       uint64_t base) {
+  const uint8_t* pos = data;
+  const uint8_t* end = data + size;
+  while ((size_t)(end - pos) >= state->pattern_len) {
+    const uint8_t* found = state->find(pos, (size_t)(end - pos), state->pattern, state->pattern_len);
+    if (found == NULL) {
+      break;
+    }
+    if (!report_hit(state, ctx, entry, base + (uint64_t)(found - data))) {
+      return false;
+    }
+    pos = found + 1;
+  }
+  return true;
+}
+
+// The last pattern_len - 1 bytes of each block are kept at the front of the
+// buffer for the next, so matches that cross blocks are found. They're too
+// short to hold a match themselves, so nothing is reported twice.
+static bool search_archive_entries(search_state* state, const search_archive* archive, uint8_t* buffer) {
+  SARC_ctx* ctx = archive->ctx;
+  PHYSFS_Io* base = NULL;
+  PHYSFS_Io* overlay = NULL;
+  bool ok = true;
+  for (uint32_t i = 0; i < archive->count && ATOMIC_LOAD64(&state->stopped) == 0; i++) {
+    const SARCentry* entry = archive->entries[i];
+    if (entry->data_ptr != 0) {
+      scan_block(state, ctx, entry, (const uint8_t*)entry->data_ptr, entry->size, 0);
+      continue;
+    }
+    uint64_t done = 0;
+    size_t kept = 0;
+    while (done < entry->size) {
+      size_t size = (size_t)MIN(entry->size - done, SEARCH_BLOCK_SIZE);
+      if (!SARC_readEntry(ctx, entry, done, buffer + kept, size, &base, &overlay)) {
+        LOG_MSG(error, "Failed to read %s from %s\n", entry->tree.name, ctx->arc_filename);
+        ok = false;
+        break;
+      }
+      if (!scan_block(state, ctx, entry, buffer, kept + size, done - kept)) {
+        break;
+      }
+      done += size;
+      size_t filled = kept + size;
+      kept = MIN(filled, state->pattern_len - 1);
+      memmove(buffer, buffer + filled - kept, kept);
+    }
+  }
+
+  if (base != NULL) {
+    base->destroy(base);
+  }
+  if (overlay != NULL) {
+    overlay->destroy(overlay);
+  }
+  return ok;
+}
+
+static void* search_worker_main(void* arg) {
+  search_state* state = (search_state*)arg;
+  uint8_t* buffer = allocator.Malloc(SEARCH_BLOCK_SIZE + state->pattern_len - 1);
+  while (ATOMIC_LOAD64(&state->stopped) == 0) {
+    ZSTD_pthread_mutex_lock(&state->lock);
+    uint32_t next = state->next_archive;
+    if (next < state->count) {
+      state->next_archive++;
+    }
+    if (buffer == NULL) {
+      LOG_MSG(error, "Out of memory searching archives\n");
+      state->failed = true;
+      next = state->count;
+    }
+    ZSTD_pthread_mutex_unlock(&state->lock);
+    if (next >= state->count) {
+      break;
+    }
+
+    if (!search_archive_entries(state, &state->archives[next], buffer)) {
+      ZSTD_pthread_mutex_lock(&state->lock);
+      state->failed = true;
+      ZSTD_pthread_mutex_unlock(&state->lock);
+    }
+  }
+  allocator.Free(buffer);
+  return NULL;
+}
+
+PHYSFS_sint64 SARC_search(const void* pattern, size_t pattern_len, uint32_t threads, SARC_searchCallback callback,
+                          void* data) {
+  TRACE_BEGIN(span);
+  BAIL_IF(pattern == NULL || pattern_len == 0 || callback == NULL, PHYSFS_ERR_INVALID_ARGUMENT, -1);
+
+  const char* impl = NULL;
+  search_state state = {
+    .pattern = (const uint8_t*)pattern,
+    .pattern_len = pattern_len,
+    .find = pick_find(&impl),
+    .callback = callback,
+    .data = data
+  };
+  SARC_forEachArchive(list_archive, &state);
+  if (state.list_failed) {
+    LOG_MSG(error, "Out of memory listing archives to search\n");
+    for (uint32_t i = 0; i < state.count; i++) {
+      allocator.Free(state.archives[i].entries);
+      SARC_unpinArchive(state.archives[i].ctx);
+    }
+    allocator.Free(state.archives);
+    BAIL(PHYSFS_ERR_OUT_OF_MEMORY, -1);
+  }
+  qsort(state.archives, state.count, sizeof(*state.archives), compare_archives);
+  LOG_MSG(debug, "Searching %u archives for a %zu byte pattern (%s)\n", state.count, pattern_len, impl);
+
+  if (threads == 0) {
+    threads = thread_core_count();
+  }
+  if (threads > state.count) {
+    threads = (state.count > 0) ? state.count : 1;
+  }
+  ZSTD_pthread_t* workers = allocator.Malloc(sizeof(*workers) * threads);
+  if (workers == NULL) {
+    threads = 1;
+  }
+  ZSTD_pthread_mutex_init(&state.lock, NULL);
+
+  // The calling thread is the first worker
+  uint32_t started = 1;
+  for (; started < threads; started++) {
+    if (ZSTD_pthread_create(&workers[started], NULL, search_worker_main, &state) != 0) {
+      LOG_MSG(warning, "Only started %u search threads\n", started);
+      break;
+    }
+  }
+  search_worker_main(&state);
+  for (uint32_t i = 1; i < started; i++) {
+    ZSTD_pthread_join(workers[i]);
+  }
+
+  ZSTD_pthread_mutex_destroy(&state.lock);
+  allocator.Free(workers);
+  for (uint32_t i = 0; i < state.count; i++) {
+    allocator.Free(state.archives[i].entries);
+    SARC_unpinArchive(state.archives[i].ctx);
+  }
+  allocator.Free(state.archives);
+
+  if (state.failed) {
+    return -1;
+  }
+  TRACE_END(span, "SARC_search", NULL, NULL);
+  return (PHYSFS_sint64)state.hits;
+} /* SARC_search */
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <physfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Searching the content of every mounted archive for a byte string, for
+// finding what refers to an actor or asset without extracting everything.
+// Archives are searched in parallel, biggest first, and each is read once
+// front to back through its own stream, so a zstd archive is decompressed
+// once. Entries are scanned in blocks with SSE2 or AVX2 (when the CPU has it),
+// which check the pattern's first and last bytes at every position of a block
+// at once and only compare the rest where both match.
+//
+// The search reads the archives' live contents, including edits and overlays,
+// so nothing may be written while it runs. Archives mounted meanwhile aren't
+// searched, and unmounting one waits until the search is over, so the
+// callback mustn't wait on a thread that's unmounting.
+
+typedef struct {
+  const char* archive; // Real path of the archive
+  const char* path; // Path of the entry inside it
+  PHYSFS_uint64 offset; // Where the match starts in the entry
+}SARC_searchHit;
+
+// Called for each match, from whichever thread found it, but never from two
+// at once. Matches in an entry come in order; entries and archives don't.
+// The strings are only valid during the call. Return false to stop the search.
+typedef bool (*SARC_searchCallback)(const SARC_searchHit* hit, void* data);
+
+/// Find every occurrence of pattern in every entry of every mounted archive.
+/// Overlapping matches are all reported.
+/// \param threads Number of archives to search at once. 0 for one per core.
+/// \return Number of matches reported, or -1 if an archive couldn't be read
+/// (with the reason logged). The other archives are still searched.
+PHYSFS_sint64 SARC_search(const void* pattern, size_t pattern_len, uint32_t threads, SARC_searchCallback callback,
+                          void* data);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <common/xxhash.h>
+#include <physfs.h>
+#define __PHYSICSFS_INTERNAL__
+#include <physfs_internal.h>
+
+#include "sarc.h"
+#include "sarc_shm.h"
+#include "sarc_cache.h"
+#include "sarc_image.h"
+#include "sarc_stats.h"
+#include "logging.h"
+
+// A region is the archive followed by this marker, written once the archive
+// is complete. A process that dies halfway through decompressing leaves a
+// region without it, which is thrown away and made again.
+#define SHM_READY 0x59444145524d4853ULL // 'SHMREADY'
+#define SHM_TRAILER_SIZE sizeof(uint64_t)
+#define SHM_LOCK_EXTENSION ".lock"
+
+static char* lock_dir = NULL;
+
+// Where a region is being made, for the sarc_image_load_into() callback
+typedef struct {
+  const char* name;
+  uint8_t* data;
+  uint64_t size; // Bytes mapped, the archive and the trailer
+#ifdef _WIN32
+  void* mapping;
+#else
+  int fd;
+#endif
+}shm_region;
+
+static bool region_complete(const uint8_t* data, uint64_t size) {
+  const sarc_header* header = (const sarc_header*)data;
+  if (size < sizeof(*header) + SHM_TRAILER_SIZE || header->magic != SARC_MAGIC ||
+      (uint64_t)header->archive_size + SHM_TRAILER_SIZE > size) {
+    return false;
+  }
+  uint64_t marker = 0;
+  memcpy(&marker, data + header->archive_size, sizeof(marker));
+  return marker == SHM_READY;
+}
+
+static void region_mark_ready(shm_region* region) {
+  uint64_t marker = SHM_READY;
+  memcpy(region->data + region->size - SHM_TRAILER_SIZE, &marker, sizeof(marker));
+}
+
+// Complete, and a SARC we can serve files from without checking again
+static bool region_valid(const uint8_t* data, uint64_t size, const char* name) {
+  return region_complete(data, size) &&
+         sarc_image_check(data, ((const sarc_header*)data)->archive_size, name);
+}
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE shm_lock;
+#define SHM_NO_LOCK INVALID_HANDLE_VALUE
+
+// Named sections live in the session's namespace, so only this user's
+// processes (in this session) share them.
+static uint64_t region_owner(void) {
+  return 0;
+}
+
+static void region_name(char* out, size_t out_size, uint64_t key) {
+  snprintf(out, out_size, "Local\\sarc-%016llx", (unsigned long long)key);
+}
+
+static shm_lock lock_acquire(const char* path) {
+  HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return SHM_NO_LOCK;
+  }
+  OVERLAPPED overlapped = {0};
+  if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+    CloseHandle(file);
+    return SHM_NO_LOCK;
+  }
+  return file;
+}
+
+static void lock_release(shm_lock lock) {
+  OVERLAPPED overlapped = {0};
+  UnlockFileEx(lock, 0, 1, 0, &overlapped);
+  CloseHandle(lock);
+}
+
+// Map an existing region read-only, or NULL if there's none or it's broken.
+// The view keeps the section alive, so the handle is closed right away.
+static uint8_t* region_attach(const char* name) {
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+  if (mapping == NULL) {
+    return NULL;
+  }
+  uint8_t* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (data == NULL) {
+    return NULL;
+  }
+  MEMORY_BASIC_INFORMATION info = {0};
+  if (VirtualQuery(data, &info, sizeof(info)) == 0 || !region_valid(data, info.RegionSize, name)) {
+    // Sections die with the last process using them, so this one was
+    // abandoned by a process that's still running. Mount without it.
+    LOG_MSG(warning, "Ignoring broken shared image %s\n", name);
+    UnmapViewOfFile(data);
+    return NULL;
+  }
+  return data;
+}
+
+static void* region_alloc(uint64_t size, void* data) {
+  shm_region* region = (shm_region*)data;
+  region->size = size + SHM_TRAILER_SIZE;
+  region->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(region->size >> 32),
+                                       (DWORD)region->size, region->name);
+  if (region->mapping == NULL) {
+    return NULL;
+  }
+  if (GetLastError() == ERROR_ALREADY_EXISTS) {
+    // Someone else's, we can't tell how far it got
+    CloseHandle(region->mapping);
+    region->mapping = NULL;
+    return NULL;
+  }
+  region->data = MapViewOfFile(region->mapping, FILE_MAP_WRITE, 0, 0, 0);
+  return region->data;
+}
+
+static void region_publish(shm_region* region) {
+  region_mark_ready(region);
+  DWORD old_protect = 0;
+  VirtualProtect(region->data, region->size, PAGE_READONLY, &old_protect);
+  CloseHandle(region->mapping);
+  region->mapping = NULL;
+}
+
+static void region_discard(shm_region* region) {
+  if (region->data != NULL) {
+    UnmapViewOfFile(region->data);
+  }
+  if (region->mapping != NULL) {
+    CloseHandle(region->mapping);
+  }
+}
+
+static void region_unmap(void* data) {
+  UnmapViewOfFile(data);
+}
+
+static void region_remove(const char* name) {
+  // Nothing to do, sections don't outlive their users
+}
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef int shm_lock;
+#define SHM_NO_LOCK -1
+
+// Region names are global to the machine, so each user gets their own
+static uint64_t region_owner(void) {
+  return (uint64_t)geteuid();
+}
+
+static void region_name(char* out, size_t out_size, uint64_t key) {
+  snprintf(out, out_size, "/sarc-%016llx", (unsigned long long)key);
+}
+
+static shm_lock lock_acquire(const char* path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return SHM_NO_LOCK;
+  }
+  int rc;
+  do {
+    rc = flock(fd, LOCK_EX);
+  } while (rc != 0 && errno == EINTR);
+  if (rc != 0) {
+    close(fd);
+    return SHM_NO_LOCK;
+  }
+  return fd;
+}
+
+static void lock_release(shm_lock lock) {
+  flock(lock, LOCK_UN);
+  close(lock);
+}
+
+// Map an existing region read-only, or NULL if there's none. A broken one is
+// removed, so it can be made again. One another user made is left alone, and
+// the archive gets mounted without it.
+static uint8_t* region_attach(const char* name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  uint8_t* data = NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_uid != geteuid()) {
+    LOG_MSG(warning, "Ignoring shared image %s, it isn't ours\n", name);
+    close(fd);
+    return NULL;
+  }
+  sarc_header header = {0};
+  if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+      header.magic == SARC_MAGIC && (uint64_t)header.archive_size + SHM_TRAILER_SIZE <= (uint64_t)st.st_size) {
+    // Only what we'll unmap later: region_unmap() goes by the header
+    size_t size = (size_t)header.archive_size + SHM_TRAILER_SIZE;
+    void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      if (region_valid(addr, size, name)) {
+        data = addr;
+      }
+      else {
+        munmap(addr, size);
+      }
+    }
+  }
+  close(fd);
+  if (data == NULL) {
+    LOG_MSG(warning, "Removing broken shared image %s\n", name);
+    shm_unlink(name);
+  }
+  return data;
+}
+
+static void* region_alloc(uint64_t size, void* data) {
+  shm_region* region = (shm_region*)data;
+  region->size = size + SHM_TRAILER_SIZE;
+  // Only this user's processes map it, and only its maker writes it
+  region->fd = shm_open(region->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (region->fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(region->fd, (off_t)region->size) != 0) {
+    return NULL;
+  }
+  void* addr = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_SHARED, region->fd, 0);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+  region->data = addr;
+  return addr;
+}
+
+static void region_publish(shm_region* region) {
+  region_mark_ready(region);
+  close(region->fd);
+  region->fd = -1;
+  // Other processes can only map it read-only, so neither should we
+  mprotect(region->data, region->size, PROT_READ);
+}
+
+static void region_discard(shm_region* region) {
+  if (region->data != NULL) {
+    munmap(region->data, region->size);
+  }
+  if (region->fd >= 0) {
+    close(region->fd);
+    shm_unlink(region->name);
+  }
+}
+
+static void region_unmap(void* data) {
+  munmap(data, (size_t)((const sarc_header*)data)->archive_size + SHM_TRAILER_SIZE);
+}
+
+static void region_remove(const char* name) {
+  shm_unlink(name);
+}
+#endif
+
+void SARC_setSharedImages(const char* dir) {
+  allocator.Free(lock_dir);
+  lock_dir = NULL;
+  if (dir == NULL) {
+    return;
+  }
+
+  lock_dir = allocator.Malloc(strlen(dir) + 1);
+  if (lock_dir == NULL) {
+    return;
+  }
+  strcpy(lock_dir, dir);
+  // Fails harmlessly if it's already there
+  __PHYSFS_platformMkDir(dir);
+} /* SARC_setSharedImages */
+
+static char* lock_path(const char* dir, const char* fname) {
+  const char* separator = PHYSFS_getDirSeparator();
+  size_t len = strlen(dir) + strlen(separator) + strlen(fname) + 1;
+  char* path = allocator.Malloc(len);
+  if (path != NULL) {
+    snprintf(path, len, "%s%s%s", dir, separator, fname);
+  }
+  return path;
+}
+
+// Names regions and their lock files. Processes only agree on it if they
+// have the same lock directory and user, as well as the same archive.
+static uint64_t region_key(const char* arc_filename, const PHYSFS_Stat* stat) {
+  uint64_t fields[2] = { sarc_cache_key(arc_filename, stat), region_owner() };
+  uint64_t seed = XXH64(lock_dir, strlen(lock_dir), 0);
+  return XXH64(fields, sizeof(fields), seed);
+}
+
+static PHYSFS_EnumerateCallbackResult clear_image(void* data, const char* origdir, const char* fname) {
+  const char* dir = (const char*)data;
+  unsigned long long key = 0;
+  char extension[8] = {0};
+  if (strlen(fname) != 16 + strlen(SHM_LOCK_EXTENSION) || sscanf(fname, "%16llx%7s", &key, extension) != 2 ||
+      strcmp(extension, SHM_LOCK_EXTENSION) != 0) {
+    return PHYSFS_ENUM_OK;
+  }
+  char name[32] = {0};
+  region_name(name, sizeof(name), key);
+  region_remove(name);
+
+  char* path = lock_path(dir, fname);
+  if (path != NULL) {
+    __PHYSFS_platformDelete(path);
+    allocator.Free(path);
+  }
+  LOG_MSG(debug, "Removed shared image %s\n", name);
+  return PHYSFS_ENUM_OK;
+}
+
+void SARC_clearSharedImages(const char* dir) {
+  __PHYSFS_platformEnumerate(dir, clear_image, dir, (void*)dir);
+} /* SARC_clearSharedImages */
+
+PHYSFS_Io* sarc_shm_open(const char* arc_filename) {
+  if (lock_dir == NULL) {
+    return NULL;
+  }
+  PHYSFS_Stat stat = {0};
+  if (!__PHYSFS_platformStat(arc_filename, &stat, 1)) {
+    return NULL; // Not a real file
+  }
+  uint64_t key = region_key(arc_filename, &stat);
+  char name[32] = {0};
+  region_name(name, sizeof(name), key);
+  char fname[32] = {0};
+  snprintf(fname, sizeof(fname), "%016llx%s", (unsigned long long)key, SHM_LOCK_EXTENSION);
+  char* path = lock_path(lock_dir, fname);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  // Held until the region is complete, so other processes wait for it rather
+  // than decompressing their own
+  shm_lock lock = lock_acquire(path);
+  if (lock == SHM_NO_LOCK) {
+    LOG_MSG(warning, "Can't lock %s\n", path);
+    allocator.Free(path);
+    return NULL;
+  }
+
+  uint8_t* data = region_attach(name);
+  if (data != NULL) {
+    SARC_STATS_ADD(NULL, shared_hits, 1);
+  }
+  else {
+    shm_region region = { .name = name };
+#ifndef _WIN32
+    region.fd = -1;
+#endif
+    sarc_image image;
+    if (sarc_image_load_into(&image, arc_filename, region_alloc, &region)) {
+      region_publish(&region);
+      LOG_MSG(debug, "Shared %s as %s\n", arc_filename, name);
+      SARC_STATS_ADD(NULL, shared_misses, 1);
+      data = region.data;
+    }
+    else {
+      LOG_MSG(warning, "Can't share %s as %s\n", arc_filename, name);
+      region_discard(&region);
+    }
+  }
+  lock_release(lock);
+  allocator.Free(path);
+  if (data == NULL) {
+    return NULL;
+  }
+
+  uint64_t size = ((const sarc_header*)data)->archive_size;
+  PHYSFS_Io* io = __PHYSFS_createMemoryIo(data, size, region_unmap);
+  if (io == NULL) {
+    region_unmap(data);
+  }
+  return io;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <physfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Decompressed zstd archives shared between processes on the same machine.
+// The first process to mount an archive decompresses it into a named shared
+// memory region, and every other process maps that region read-only instead
+// of decompressing its own copy. A dozen tools mounting the same archives keep
+// one copy in RAM between them.
+//
+// Processes take turns through a lock file per archive, so only one of them
+// decompresses it while the rest wait for the result. Regions are named from
+// the disk cache's key (see sarc_cache.h), the lock directory and the user, so
+// editing an archive gives it a new region, and processes with different lock
+// directories or users never share one. Regions are checked like any other
+// archive before they're used.
+//
+// On Unix, regions (POSIX shared memory) outlive the processes that made them,
+// until SARC_clearSharedImages() or a reboot. Only regions the user owns are
+// mapped. On Windows, a region goes away once no process has it mapped.
+
+/// Share images for zstd archives mounted from now on.
+/// \param lock_dir Directory for the lock files, created if it doesn't exist.
+/// Processes only share images if they pass the same path here. NULL turns
+/// sharing off.
+void SARC_setSharedImages(const char* lock_dir);
+
+/// Remove every shared image made with lock_dir. Processes that have them
+/// mapped keep their mapping. Don't call it while other processes might be
+/// mounting archives.
+void SARC_clearSharedImages(const char* lock_dir);
+
+// Get an IO over the shared image of a zstd archive, making it first if no
+// other process has. Returns NULL if sharing is off or anything goes wrong, in
+// which case the archive should be mounted as usual.
+PHYSFS_Io* sarc_shm_open(const char* arc_filename);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "archiver_sarc_internal.h"
+#include "sarc_stats.h"
+#include "logging.h"
+
+sarc_stats sarc_global_stats;
+
+// Must be in the same order as the fields of sarc_stats
+static const char* stat_names[] = {
+    "archives_mounted",
+    "files_opened",
+    "read_calls",
+    "bytes_served",
+    "bytes_decompressed",
+    "blocks_decompressed",
+    "zstd_contexts_created",
+    "zstd_seek_restarts",
+    "rebuilds",
+    "cache_hits",
+    "cache_misses",
+    "vmem_bytes_mapped",
+    "fd_reopens",
+    "shared_hits",
+    "shared_misses",
+    "prefetch_hits",
+    "prefetch_bytes",
+};
+
+#define STAT_COUNT (sizeof(sarc_stats) / sizeof(uint64_t))
+
+void sarc_stats_copy(sarc_stats* out, const sarc_stats* stats) {
+    const uint64_t* src = (const uint64_t*)stats;
+    uint64_t* dest = (uint64_t*)out;
+    for (uint32_t i = 0; i < STAT_COUNT; i++) {
+        dest[i] = ATOMIC_LOAD64(&src[i]);
+    }
+}
+
+void SARC_getGlobalStats(sarc_stats* out) {
+    sarc_stats_copy(out, &sarc_global_stats);
+} /* SARC_getGlobalStats */
+
+static void copy_archive_callback(SARC_ctx* ctx, void* data) {
+    sarc_stats_copy((sarc_stats*)data, &ctx->stats);
+}
+
+bool SARC_getArchiveStats(const char* arc_filename, sarc_stats* out) {
+    // Copied with the registry locked, so the archive can't be unmounted and
+    // freed halfway through
+    return SARC_withArchive(arc_filename, copy_archive_callback, out);
+} /* SARC_getArchiveStats */
+
+static void reset_counters(sarc_stats* stats) {
+    uint64_t* counters = (uint64_t*)stats;
+    for (uint32_t i = 0; i < STAT_COUNT; i++) {
+        if (&counters[i] != &stats->vmem_bytes_mapped) {
+            ATOMIC_STORE64(&counters[i], 0);
+        }
+    }
+}
+
+static void reset_archive_callback(SARC_ctx* ctx, void* data) {
+    reset_counters(&ctx->stats);
+}
+
+void SARC_resetStats(void) {
+    reset_counters(&sarc_global_stats);
+    SARC_forEachArchive(reset_archive_callback, NULL);
+} /* SARC_resetStats */
+
+void sarc_stats_write_json(FILE* out, const sarc_stats* stats) {
+    sarc_stats snapshot;
+    sarc_stats_copy(&snapshot, stats);
+    const uint64_t* counters = (const uint64_t*)&snapshot;
+
+    fprintf(out, "{");
+    for (uint32_t i = 0; i < STAT_COUNT; i++) {
+        fprintf(out, "%s\"%s\": %llu", (i > 0) ? ", " : "", stat_names[i], (unsigned long long)counters[i]);
+    }
+    fprintf(out, "}");
+}
+
+typedef struct {
+    FILE* out;
+    bool first;
+}dump_data;
+
+static void dump_archive_callback(SARC_ctx* ctx, void* data) {
+    dump_data* dump = (dump_data*)data;
+    fprintf(dump->out, "%s\n    {\"archive\": ", dump->first ? "" : ",");
+    json_write_string(dump->out, ctx->arc_filename);
+    fprintf(dump->out, ", \"stats\": ");
+    sarc_stats_write_json(dump->out, &ctx->stats);
+    fprintf(dump->out, "}");
+    dump->first = false;
+}
+
+void SARC_dumpStatsJson(FILE* out) {
+    dump_data dump = {
+        .out = out,
+        .first = true
+    };
+    fprintf(out, "{\n  \"global\": ");
+    sarc_stats_write_json(out, &sarc_global_stats);
+    fprintf(out, ",\n  \"archives\": [");
+    SARC_forEachArchive(dump_archive_callback, &dump);
+    fprintf(out, "\n  ]\n}\n");
+} /* SARC_dumpStatsJson */
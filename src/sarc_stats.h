@@ -0,0 +1,70 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "atomics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Performance counters, kept globally and for each mounted archive. They're
+// updated with relaxed atomics, so keeping them on costs next to nothing.
+// Comparing bytes_decompressed to bytes_served shows how much decompression
+// work is thrown away (mostly by seeking backwards in zstd archives).
+
+// Every field must be a uint64_t, they're copied and printed as an array.
+typedef struct {
+    uint64_t archives_mounted; // Global only
+    uint64_t files_opened; // SARC_openRead() calls
+    uint64_t read_calls; // SARC_read() calls
+    uint64_t bytes_served; // Bytes returned by SARC_read()
+    uint64_t bytes_decompressed; // Bytes produced by the zstd decompressor
+    uint64_t blocks_decompressed; // Calls to zstd_decompress_block()
+    uint64_t zstd_contexts_created; // Decompression streams set up
+    uint64_t zstd_seek_restarts; // Seeks that had to decompress from the start again
+    uint64_t rebuilds; // Times an archive was rewritten to disk
+    uint64_t cache_hits; // zstd archives mounted from a decompressed copy in the cache
+    uint64_t cache_misses; // zstd archives decompressed into the cache
+    uint64_t vmem_bytes_mapped; // Global only, currently reserved by vmem.c
+    uint64_t fd_reopens; // Global only, archive files reopened after fd_pool.c closed them
+    uint64_t shared_hits; // zstd archives mapped from an image another process decompressed
+    uint64_t shared_misses; // zstd archives decompressed into a new shared image
+    uint64_t prefetch_hits; // Opens served from data a profile replay read ahead
+    uint64_t prefetch_bytes; // Bytes a profile replay decompressed ahead of the tool
+}sarc_stats;
+
+extern sarc_stats sarc_global_stats;
+
+// Add to a counter globally, and for an archive if archive_stats isn't NULL.
+#define SARC_STATS_ADD(archive_stats, field, n) do { \
+    ATOMIC_ADD64(&sarc_global_stats.field, (uint64_t)(n)); \
+    if ((archive_stats) != NULL) { \
+        ATOMIC_ADD64(&((sarc_stats*)(archive_stats))->field, (uint64_t)(n)); \
+    } \
+} while (0)
+
+// Take a consistent-enough snapshot of a set of counters.
+void sarc_stats_copy(sarc_stats* out, const sarc_stats* stats);
+
+// Get a snapshot of the process-wide counters.
+void SARC_getGlobalStats(sarc_stats* out);
+
+// Get a snapshot of one archive's counters, by its real path (as returned by
+// PHYSFS_getRealDir()). Returns false if the archive isn't mounted.
+bool SARC_getArchiveStats(const char* arc_filename, sarc_stats* out);
+
+// Reset every counter, globally and for all archives. vmem_bytes_mapped is
+// left alone because it tracks live memory.
+void SARC_resetStats(void);
+
+// Write one set of counters as a JSON object.
+void sarc_stats_write_json(FILE* out, const sarc_stats* stats);
+
+// Write the global counters and every mounted archive's counters as JSON.
+void SARC_dumpStatsJson(FILE* out);
+
+#ifdef __cplusplus
+}
+#endif
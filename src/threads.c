@@ -0,0 +1,60 @@
+#include "threads.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static BOOL CALLBACK once_callback(PINIT_ONCE once, PVOID init, PVOID* context) {
+  ((void (*)(void))init)();
+  return TRUE;
+}
+
+void thread_once(thread_once_t* once, void (*init)(void)) {
+  InitOnceExecuteOnce(once, once_callback, (PVOID)init, NULL);
+}
+
+uint32_t thread_core_count(void) {
+  SYSTEM_INFO info = {0};
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+}
+
+void thread_sleep_ms(uint32_t ms) {
+  Sleep(ms);
+}
+
+uint64_t thread_now_ns(void) {
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+}
+#else
+#include <time.h>
+#include <unistd.h>
+
+void thread_once(thread_once_t* once, void (*init)(void)) {
+  pthread_once(once, init);
+}
+
+uint32_t thread_core_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (count < 1) {
+    return 1;
+  }
+  return (uint32_t)count;
+}
+
+void thread_sleep_ms(uint32_t ms) {
+  struct timespec ts = {
+    .tv_sec = ms / 1000,
+    .tv_nsec = (long)(ms % 1000) * 1000000
+  };
+  nanosleep(&ts, NULL);
+}
+
+uint64_t thread_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
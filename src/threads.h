@@ -0,0 +1,33 @@
+#pragma once
+// Threads, mutexes and condition variables for the archiver's worker pools.
+// We borrow the wrappers zstd uses for its own workers, which map to pthreads
+// or Win32 depending on the platform.
+
+#include <stdint.h>
+
+#include <common/threading.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef INIT_ONCE thread_once_t;
+#define THREAD_ONCE_INIT INIT_ONCE_STATIC_INIT
+#else
+#include <pthread.h>
+typedef pthread_once_t thread_once_t;
+#define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
+#endif
+
+// Call init exactly once for a guard that starts as THREAD_ONCE_INIT, however
+// many threads get here at the same time. The rest wait for it to finish. Used
+// to create locks the first time they're needed.
+void thread_once(thread_once_t* once, void (*init)(void));
+
+// Number of logical CPU cores, used to size thread pools.
+uint32_t thread_core_count(void);
+
+// Put the calling thread to sleep for a while.
+void thread_sleep_ms(uint32_t ms);
+
+// Current time in nanoseconds, from a monotonic clock. Only differences
+// between two calls mean anything.
+uint64_t thread_now_ns(void);
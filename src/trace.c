@@ -0,0 +1,126 @@
+#include <stdio.h>
+
+#include "trace.h"
+#include "logging.h"
+
+#ifdef SARC_ARCHIVER_TRACING
+#include "threads.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+volatile bool trace_enabled = false;
+
+// Everything below is only touched with trace_mutex held
+static ZSTD_pthread_mutex_t trace_mutex;
+static bool trace_mutex_ready = false;
+static FILE* trace_file = NULL;
+static bool trace_first_event = true;
+
+uint64_t trace_now(void) {
+  return thread_now_ns();
+}
+
+static uint64_t trace_pid(void) {
+#ifdef _WIN32
+  return GetCurrentProcessId();
+#else
+  return (uint64_t)getpid();
+#endif
+}
+
+static uint64_t trace_tid(void) {
+#ifdef _WIN32
+  return GetCurrentThreadId();
+#elif defined(__linux__)
+  return (uint64_t)syscall(SYS_gettid);
+#else
+  return (uint64_t)(uintptr_t)pthread_self();
+#endif
+}
+
+void trace_emit(const char* name, uint64_t start, const char* archive, const char* entry) {
+  uint64_t end = trace_now();
+  uint64_t tid = trace_tid();
+
+  ZSTD_pthread_mutex_lock(&trace_mutex);
+  // Tracing may have been stopped while this span was running
+  if (trace_file == NULL) {
+    ZSTD_pthread_mutex_unlock(&trace_mutex);
+    return;
+  }
+
+  // Timestamps are in microseconds, but fractions are allowed
+  fprintf(trace_file, "%s\n{\"name\": \"%s\", \"cat\": \"sarc\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %llu, \"tid\": %llu, \"args\": {",
+          trace_first_event ? "" : ",", name, (double)start / 1000.0, (double)(end - start) / 1000.0,
+          (unsigned long long)trace_pid(), (unsigned long long)tid);
+  if (archive != NULL) {
+    fprintf(trace_file, "\"archive\": ");
+    json_write_string(trace_file, archive);
+  }
+  if (entry != NULL) {
+    fprintf(trace_file, "%s\"entry\": ", (archive != NULL) ? ", " : "");
+    json_write_string(trace_file, entry);
+  }
+  fprintf(trace_file, "}}");
+  trace_first_event = false;
+  ZSTD_pthread_mutex_unlock(&trace_mutex);
+}
+
+bool SARC_traceStart(const char* path) {
+  if (!trace_mutex_ready) {
+    ZSTD_pthread_mutex_init(&trace_mutex, NULL);
+    trace_mutex_ready = true;
+  }
+  SARC_traceStop();
+
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    LOG_MSG(error, "Can't open trace file %s\n", path);
+    return false;
+  }
+  fprintf(file, "[");
+
+  ZSTD_pthread_mutex_lock(&trace_mutex);
+  trace_file = file;
+  trace_first_event = true;
+  ZSTD_pthread_mutex_unlock(&trace_mutex);
+
+  trace_enabled = true;
+  return true;
+} /* SARC_traceStart */
+
+void SARC_traceStop(void) {
+  if (!trace_mutex_ready) {
+    return;
+  }
+  trace_enabled = false;
+
+  ZSTD_pthread_mutex_lock(&trace_mutex);
+  if (trace_file != NULL) {
+    fprintf(trace_file, "\n]\n");
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+  ZSTD_pthread_mutex_unlock(&trace_mutex);
+} /* SARC_traceStop */
+
+#else
+
+bool SARC_traceStart(const char* path) {
+  LOG_MSG(warning, "Tracing isn't compiled in, rebuild with SARC_ARCHIVER_TRACING\n");
+  return false;
+} /* SARC_traceStart */
+
+void SARC_traceStop(void) {
+} /* SARC_traceStop */
+
+#endif
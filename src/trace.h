@@ -0,0 +1,47 @@
+#pragma once
+// Timed spans written out in Chrome's trace event format, which can be opened
+// in chrome://tracing or https://ui.perfetto.dev. Tracing has to be compiled
+// in with SARC_ARCHIVER_TRACING, otherwise the TRACE_ macros expand to nothing.
+// When it's compiled in but not started, each span costs a single branch.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start recording spans to a JSON file at path (a real path, not a PhysicsFS
+// one). Returns false if the file can't be opened, or tracing isn't compiled in.
+bool SARC_traceStart(const char* path);
+
+// Stop recording and finish the trace file. Safe to call if tracing never started.
+void SARC_traceStop(void);
+
+#ifdef SARC_ARCHIVER_TRACING
+extern volatile bool trace_enabled;
+
+// Current time in nanoseconds, from a monotonic clock.
+uint64_t trace_now(void);
+
+// Record a span that started at start (from trace_now()) and ends now.
+// archive and entry are shown as arguments of the span, and can be NULL.
+void trace_emit(const char* name, uint64_t start, const char* archive, const char* entry);
+
+// Start a span, storing its start time in a new local variable.
+#define TRACE_BEGIN(span) uint64_t span = trace_enabled ? trace_now() : 0
+// End a span started with TRACE_BEGIN(). Spans that bail out before reaching
+// this aren't recorded.
+#define TRACE_END(span, name, archive, entry) do { \
+    if (span != 0) { \
+        trace_emit(name, span, archive, entry); \
+    } \
+} while (0)
+#else
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name, archive, entry) do {} while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
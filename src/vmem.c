@@ -1,5 +1,12 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For mremap()
+#endif
 #include <stdlib.h> // For NULL
 #include <stdint.h> // For uint64_t
+#include <string.h> // For memcpy()
+
+#include "vmem.h"
+#include "sarc_stats.h"
 
 // Platform definition macros.
 
@@ -23,23 +30,125 @@
 // Unix / POSIX implementation
 #if defined(PLATFORM_UNIX) || defined(PLATFORM_MACOS)
 #include <sys/mman.h>
+#include <unistd.h>
 
 void* virtual_reserve(uint64_t size) {
-  return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return virtual_reserve_hinted(size, VMEM_HINT_NONE);
+}
+void* virtual_reserve_hinted(uint64_t size, uint32_t hints) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+  if (hints & VMEM_HINT_POPULATE) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+
+  void* addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  // Explicit huge pages have to be set aside by the admin, and the size has to
+  // be a multiple of the huge page size.
+  if ((hints & VMEM_HINT_HUGETLB) && (size % VMEM_HUGE_PAGE_SIZE) == 0) {
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+      SARC_STATS_ADD(NULL, vmem_bytes_mapped, size);
+      return addr;
+    }
+    hints |= VMEM_HINT_HUGE_PAGES;
+  }
+#endif
+  addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+  SARC_STATS_ADD(NULL, vmem_bytes_mapped, size);
+  virtual_advise(addr, size, hints);
+  return addr;
+}
+int virtual_advise(void* addr, uint64_t size, uint32_t hints) {
+  int rc = 0;
+#ifdef MADV_HUGEPAGE
+  if (hints & (VMEM_HINT_HUGE_PAGES | VMEM_HINT_HUGETLB)) {
+    rc |= madvise(addr, size, MADV_HUGEPAGE);
+  }
+#endif
+  if (hints & VMEM_HINT_SEQUENTIAL) {
+    rc |= madvise(addr, size, MADV_SEQUENTIAL);
+  }
+  if (hints & VMEM_HINT_RANDOM) {
+    rc |= madvise(addr, size, MADV_RANDOM);
+  }
+#if defined(MADV_WILLNEED) && !defined(MAP_POPULATE)
+  // MAP_POPULATE only exists on Linux, this is the next best thing.
+  if (hints & VMEM_HINT_POPULATE) {
+    rc |= madvise(addr, size, MADV_WILLNEED);
+  }
+#endif
+  return rc;
+}
+int virtual_release(void* addr, uint64_t size) {
+  return madvise(addr, size, MADV_DONTNEED);
 }
 int virtual_commit(void* addr, uint64_t size) {
   return 0;
 }
 int virtual_free(void* addr, uint64_t size) {
+  SARC_STATS_ADD(NULL, vmem_bytes_mapped, -size);
   return munmap(addr, size);
 }
+
+uint64_t virtual_page_align(uint64_t size) {
+  uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+  return ((size + page_size - 1) / page_size) * page_size;
+}
+#endif
+
+#ifdef __linux__
+void* virtual_resize(void* addr, uint64_t old_size, uint64_t new_size) {
+  // The kernel just moves the page table entries, no matter how big it is.
+  void* new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+  if (new_addr == MAP_FAILED) {
+    return NULL;
+  }
+  SARC_STATS_ADD(NULL, vmem_bytes_mapped, new_size - old_size);
+  return new_addr;
+}
+#else
+void* virtual_resize(void* addr, uint64_t old_size, uint64_t new_size) {
+  void* new_addr = virtual_reserve(new_size);
+  if (new_addr == NULL) {
+    return NULL;
+  }
+  memcpy(new_addr, addr, (old_size < new_size) ? old_size : new_size);
+  virtual_free(addr, old_size);
+  return new_addr;
+}
 #endif
 
 #ifdef PLATFORM_WINDOWS
 #include <Windows.h>
 
 void* virtual_reserve(uint64_t size) {
-  return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  void* addr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (addr != NULL) {
+    SARC_STATS_ADD(NULL, vmem_bytes_mapped, size);
+  }
+  return addr;
+}
+void* virtual_reserve_hinted(uint64_t size, uint32_t hints) {
+  // Large pages need SeLockMemoryPrivilege, which we almost never have. The
+  // access pattern hints don't have an equivalent for private memory.
+  return virtual_reserve(size);
+}
+int virtual_advise(void* addr, uint64_t size, uint32_t hints) {
+  return 0;
+}
+int virtual_release(void* addr, uint64_t size) {
+  // MEM_RESET tells Windows the contents don't matter anymore, so the pages
+  // can be dropped instead of being written to the page file.
+  if (VirtualAlloc(addr, size, MEM_RESET, PAGE_READWRITE) != NULL)
+    return 0;
+  else
+    return -1;
 }
 int virtual_commit(void* addr, uint64_t size) {
   // We reserve with MEM_RESERVE | MEM_COMMIT, so Windows will automatically
@@ -47,11 +156,18 @@ int virtual_commit(void* addr, uint64_t size) {
   return 0;
 }
 int virtual_free(void* addr, uint64_t size) {
+  SARC_STATS_ADD(NULL, vmem_bytes_mapped, -size);
   if (VirtualFree(addr, 0, MEM_RELEASE))
     return 0;
   else
 	return -1;
 }
+uint64_t virtual_page_align(uint64_t size) {
+  SYSTEM_INFO info = {0};
+  GetSystemInfo(&info);
+  uint64_t page_size = info.dwPageSize;
+  return ((size + page_size - 1) / page_size) * page_size;
+}
 #endif
 
 // Reserving / committing doesn't really exist as a kernel concept on HorizonOS
@@ -72,6 +188,16 @@ struct ReservationMapping {
 
 static ReservationMapping* g_ReservationMappings;
 
+void* virtual_reserve_hinted(uint64_t size, uint32_t hints) {
+	return virtual_reserve(size);
+}
+int virtual_advise(void* addr, uint64_t size, uint32_t hints) {
+	return 0;
+}
+int virtual_release(void* addr, uint64_t size) {
+	return 0;
+}
+
 void* virtual_reserve(uint64_t size) {
 	virtmemLock();
 	void* addr = virtmemFindAslr(size, 0);
@@ -108,6 +234,9 @@ int virtual_commit(void* addr, uint64_t size) {
 	else
 		return -1;
 }
+uint64_t virtual_page_align(uint64_t size) {
+	return (size + 0xFFF) & ~(uint64_t)0xFFF;
+}
 int virtual_free(void* addr, uint64_t size) {
 	VirtmemReservation* reservation;
 
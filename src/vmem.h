@@ -5,12 +5,46 @@
 
 #include <stdint.h>
 
+// Hints about how a buffer will be used. Unsupported hints are ignored.
+typedef enum {
+  VMEM_HINT_NONE = 0,
+  // Back the buffer with (transparent) huge pages to cut down on TLB misses.
+  VMEM_HINT_HUGE_PAGES = 1 << 0,
+  // Use explicit huge pages (MAP_HUGETLB) if the system has any set aside,
+  // falling back to VMEM_HINT_HUGE_PAGES. Only for buffers that never resize.
+  VMEM_HINT_HUGETLB = 1 << 1,
+  // The buffer will be accessed front to back, read ahead aggressively.
+  VMEM_HINT_SEQUENTIAL = 1 << 2,
+  // The buffer will be accessed randomly, don't bother reading ahead.
+  VMEM_HINT_RANDOM = 1 << 3,
+  // Fault in every page up front, because we're about to fill it anyway.
+  VMEM_HINT_POPULATE = 1 << 4,
+}vmem_hint;
+
+// Buffers at least this big are worth backing with huge pages.
+#define VMEM_HUGE_PAGE_SIZE 0x200000
+
 // Reserve virtual memory without committing any physical RAM.
 void* virtual_reserve(uint64_t size);
+// Same as virtual_reserve(), with hints about how the memory will be used.
+// hints is any combination of vmem_hint flags.
+void* virtual_reserve_hinted(uint64_t size, uint32_t hints);
+// Apply usage hints to an existing buffer (or part of one).
+int virtual_advise(void* addr, uint64_t size, uint32_t hints);
+// Give the physical memory behind part of a buffer back to the OS, but keep
+// the address space reserved. The contents are lost.
+int virtual_release(void* addr, uint64_t size);
 // Commit physical memory to virtual memory starting at a specified position.
 // Returns 0 on success, -1 on failure.
 int virtual_commit(void* addr, uint64_t size);
 // Free a virtual memory buffer you reserved with virtual_reserve(). This also
 // frees physical memory committed to the freed virtual memory.
 int virtual_free(void* addr, uint64_t size);
+// Resize a buffer you reserved with virtual_reserve(), keeping its contents.
+// The buffer may move, so use the returned pointer from now on. On Linux this
+// remaps the existing pages instead of copying them. Returns NULL on failure,
+// in which case the original buffer is untouched.
+void* virtual_resize(void* addr, uint64_t old_size, uint64_t new_size);
+// Round a size up to a whole number of pages.
+uint64_t virtual_page_align(uint64_t size);
 
@@ -6,11 +6,22 @@
 
 #include "zstd_io.h"
 #include "physfs_utils.h"
+#include "vmem.h"
+#include "mem_budget.h"
+#include "trace.h"
+#include "threads.h"
 
 #include "int.h"
 #include "logging.h"
 
-ZSTD_DDict* dict_buffers[3];
+ZSTD_DDict* dict_buffers[8];
+// The raw dictionaries behind dict_buffers, kept for compression. name is the
+// file name without ".zsdic" ("pack", "bcett.byml", "zs").
+static struct {
+    const u8* buf;
+    u32 size;
+    char name[32];
+}dict_sources[ARRAY_SIZE(dict_buffers)];
 typedef struct {
     PHYSFS_Io* io;
     // Stream object for decompression
@@ -26,48 +37,171 @@ typedef struct {
     u8* in_buf;
     size_t in_buf_idx;
     size_t in_pos;
+    size_t in_size; // Bytes of in_buf filled by the last read
 
     u32 max_block_size;
+
+    bool owns_io; // Destroy the wrapped IO along with this one
+    u64 charged; // Bytes taken from the memory budget for our decoder and buffers
+    bool shared; // There was no room in the budget, so we borrow shared_decoder
+    u64 shared_pos; // Where a shared stream is, to get back to when it gets the decoder again
+    sarc_stats* stats; // Archive counters to update, may be NULL
+    const char* name; // Archive name for traces, may be NULL
+    bool can_wait; // May wait for room in the memory budget
 }zstd_ctx;
 
-void zstd_io_add_dict(const char* path) {
+// Size of the staging buffer for compressed input
+#define IN_BUF_SIZE(ctx) ((ctx)->max_block_size + ZSTD_BLOCKHEADERSIZE)
+
+// The decoder for streams opened with SARC_MEMORY_DEGRADE once the budget ran
+// out. Its buffers fit the largest blocks zstd allows, so any stream can use
+// it. Streams take turns, holding the lock for a whole read or seek.
+static struct {
+    void* lock;
+    ZSTD_DCtx* dstream;
+    u8* dbuf;
+    u8* in_buf;
+    u64 charged;
+    zstd_ctx* owner; // The stream whose state the decoder has, if any
+}shared_decoder;
+
+// Our buffers are filled front to back as soon as they're allocated, and then
+// over and over again for every block.
+static u8* zstd_alloc_buffer(u64 size) {
+    return virtual_reserve_hinted(size, VMEM_HINT_SEQUENTIAL | VMEM_HINT_POPULATE);
+}
+
+static void zstd_free_buffer(u8* buf, u64 size) {
+    if (buf != NULL) {
+        virtual_free(buf, size);
+    }
+}
+
+bool zstd_io_add_dict_buffer(const void* dict, size_t size, const char* name) {
     for (u32 i = 0; i < ARRAY_SIZE(dict_buffers); i++) {
         // Skip elements that are already filled
         if (dict_buffers[i] != NULL) {
             continue;
         }
-        // Load the file now that we've found an empty space
-        PHYSFS_File* file = PHYSFS_openRead(path);
-        if (file == NULL) {
-            return;
-        }
-        u32 size = PHYSFS_fileLength(file);
         u8* buf = allocator.Malloc(size);
         if (buf == NULL) {
-            return;
+            return false;
         }
-        PHYSFS_readBytes(file, buf, size);
+        memcpy(buf, dict, size);
+        dict_buffers[i] = ZSTD_createDDict_byReference(buf, size);
+        if (dict_buffers[i] == NULL) {
+            allocator.Free(buf);
+            return false;
+        }
+        dict_sources[i].buf = buf;
+        dict_sources[i].size = size;
+
+        // Name it after the file name, without ".zsdic"
+        const char* fname = strrchr(name, '/');
+        fname = (fname != NULL) ? fname + 1 : name;
+        size_t name_len = strlen(fname);
+        const char* ext = strstr(fname, ".zsdic");
+        if (ext != NULL) {
+            name_len = ext - fname;
+        }
+        if (name_len >= sizeof(dict_sources[i].name)) {
+            name_len = sizeof(dict_sources[i].name) - 1;
+        }
+        memcpy(dict_sources[i].name, fname, name_len);
+        dict_sources[i].name[name_len] = '\0';
+        return true;
+    }
+    LOG_MSG(error, "No room for dictionary %s\n", name);
+    return false;
+}
+
+void zstd_io_add_dict(const char* path) {
+    PHYSFS_File* file = PHYSFS_openRead(path);
+    if (file == NULL) {
+        return;
+    }
+    u32 size = PHYSFS_fileLength(file);
+    u8* buf = allocator.Malloc(size);
+    if (buf == NULL) {
         PHYSFS_close(file);
+        return;
+    }
+    PHYSFS_readBytes(file, buf, size);
+    PHYSFS_close(file);
 
-        // Add the dictionary to our list
-        dict_buffers[i] = ZSTD_createDDict_byReference(buf, size);
-        break;
+    // Add the dictionary to our list
+    zstd_io_add_dict_buffer(buf, size, path);
+    allocator.Free(buf);
+}
+
+void zstd_io_ref_dicts(ZSTD_DCtx* dctx) {
+    ZSTD_DCtx_setParameter(dctx, ZSTD_d_refMultipleDDicts, ZSTD_rmd_refMultipleDDicts);
+    // 0 is zstd's default limit
+    ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, (int)mem_budget_window_log_max());
+    for (u32 i = 0; i < ARRAY_SIZE(dict_buffers); i++) {
+        ZSTD_DDict* dict = dict_buffers[i];
+        if (dict != NULL) {
+            size_t rc = ZSTD_DCtx_refDDict(dctx, dict);
+            if (ZSTD_isError(rc)) {
+                ZSTD_ErrorCode err = ZSTD_getErrorCode(rc);
+                LOG_MSG(error, "ZSTD error code %d [%s]\n", err, ZSTD_getErrorString(err));
+            }
+        }
     }
 }
 
-bool zstd_decompress_block(zstd_ctx* ctx) {
+int zstd_io_find_dict(const char* arc_filename) {
+    // The extension under ".zs" says what's inside ("Foo.pack.zs" -> "pack")
+    size_t len = strlen(arc_filename);
+    if (len > 3 && strcmp(&arc_filename[len - 3], ".zs") == 0) {
+        len -= 3;
+    }
+    int generic = -1;
+    int count = 0;
+    int last = -1;
+    // Newest first, so a dictionary trained for our own content overrides the
+    // game's one of the same name
+    for (int i = ARRAY_SIZE(dict_sources) - 1; i >= 0; i--) {
+        if (dict_sources[i].buf == NULL) {
+            continue;
+        }
+        count++;
+        last = i;
+        size_t name_len = strlen(dict_sources[i].name);
+        if (name_len < len && arc_filename[len - name_len - 1] == '.' &&
+            strncmp(&arc_filename[len - name_len], dict_sources[i].name, name_len) == 0) {
+            return i;
+        }
+        if (generic < 0 && strcmp(dict_sources[i].name, "zs") == 0) {
+            generic = i;
+        }
+    }
+    if (generic < 0 && count == 1) {
+        return last;
+    }
+    return generic;
+}
+
+ZSTD_CDict* zstd_io_create_cdict(int dict, int level) {
+    if (dict < 0 || dict >= (int)ARRAY_SIZE(dict_sources) || dict_sources[dict].buf == NULL) {
+        return NULL;
+    }
+    return ZSTD_createCDict_byReference(dict_sources[dict].buf, dict_sources[dict].size, level);
+}
+
+static bool decompress_block(zstd_ctx* ctx) {
     // If we need more data but our buffers were freed, we need to re-alloc
     if (ctx->dbuf == NULL) {
         LOG_MSG(debug, "Had to alloc temp buffer.\n");
-        ctx->dbuf = allocator.Malloc(ctx->max_block_size);
-        if (ctx == NULL) {
+        ctx->dbuf = zstd_alloc_buffer(ctx->max_block_size);
+        if (ctx->dbuf == NULL) {
             return 0;
         }
     }
     if (ctx->in_buf == NULL) {
         LOG_MSG(debug, "Had to alloc temp buffer.\n");
-        ctx->in_buf = allocator.Malloc(ctx->max_block_size + ZSTD_BLOCKHEADERSIZE);
-        if (ctx == NULL) {
+        ctx->in_buf = zstd_alloc_buffer(IN_BUF_SIZE(ctx));
+        if (ctx->in_buf == NULL) {
             return 0;
         }
         // We need to get back the input data we freed
@@ -79,80 +213,201 @@ bool zstd_decompress_block(zstd_ctx* ctx) {
     ctx->dbuf_idx++;
     ctx->dpos = 0;
     size_t rc = 1;
-    while (rc != 0) {
-        bool input_remaining = (ctx->in_pos < ctx->max_block_size + ZSTD_BLOCKHEADERSIZE) && ctx->in_pos > 0;
-        if (!input_remaining) {
-            ctx->io->read(ctx->io, (void*)ctx->in_buf, ctx->max_block_size + ZSTD_BLOCKHEADERSIZE);
+    // A frame can end without producing anything (skippable frames do), so
+    // keep going until there's output
+    while (rc != 0 || ctx->dpos == 0) {
+        if (ctx->in_pos == ctx->in_size) {
+            // Start over at the front of the buffer, or the decompressor
+            // never sees the new input
+            PHYSFS_sint64 read = ctx->io->read(ctx->io, (void*)ctx->in_buf, ctx->max_block_size + ZSTD_BLOCKHEADERSIZE);
+            if (read <= 0) {
+                return false;
+            }
             ctx->in_buf_idx++;
+            ctx->in_size = (size_t)read;
+            ctx->in_pos = 0;
         }
-        rc = ZSTD_decompressStream_simpleArgs(ctx->dstream, ctx->dbuf, ctx->max_block_size, &ctx->dpos, ctx->in_buf, ctx->max_block_size + ZSTD_BLOCKHEADERSIZE, &ctx->in_pos);
+        rc = ZSTD_decompressStream_simpleArgs(ctx->dstream, ctx->dbuf, ctx->max_block_size, &ctx->dpos, ctx->in_buf, ctx->in_size, &ctx->in_pos);
         if (ZSTD_isError(rc)) {
             ZSTD_ErrorCode err = ZSTD_getErrorCode(rc);
             if (err == ZSTD_error_noForwardProgress_destFull) {
-                ctx->dpos = 0;
+                // dbuf is full, which is how a whole block ends. zstd only
+                // says so once the output has been full for a few calls, and
+                // leaves dpos alone, so it still counts the block's bytes.
                 break;
             }
             LOG_MSG(error, "ZSTD error code %d [%s]\n", err, ZSTD_getErrorString(err));
             return false;
         }
 
-        bool output_flushed = (ctx->dpos < ctx->max_block_size);
+        bool output_flushed = (ctx->dpos > 0 && ctx->dpos < ctx->max_block_size);
         if (output_flushed) {
             break;
         }
     }
+    SARC_STATS_ADD(ctx->stats, bytes_decompressed, ctx->dpos);
+    SARC_STATS_ADD(ctx->stats, blocks_decompressed, 1);
     ctx->dpos = 0;
     return true;
 }
 
+bool zstd_decompress_block(zstd_ctx* ctx) {
+    TRACE_BEGIN(span);
+    bool ok = decompress_block(ctx);
+    TRACE_END(span, "zstd_decompress_block", ctx->name, NULL);
+    return ok;
+}
+
 bool zstd_ctx_init(zstd_ctx* ctx) {
     // Setup compression & register dictionaries
     ctx->dstream = ZSTD_createDStream();
     ZSTD_initDStream(ctx->dstream);
-    ZSTD_DCtx_setParameter(ctx->dstream, ZSTD_d_refMultipleDDicts, ZSTD_rmd_refMultipleDDicts);
-    for (u32 i = 0; i < ARRAY_SIZE(dict_buffers); i++) {
-        ZSTD_DDict* dict = dict_buffers[i];
-        if (dict != NULL) {
-            size_t rc = ZSTD_DCtx_refDDict(ctx->dstream, dict);
-            if (ZSTD_isError(rc)) {
-                ZSTD_ErrorCode err = ZSTD_getErrorCode(rc);
-                LOG_MSG(error, "ZSTD error code %d [%s]\n", err, ZSTD_getErrorString(err));
-            }
+    SARC_STATS_ADD(ctx->stats, zstd_contexts_created, 1);
+    zstd_io_ref_dicts(ctx->dstream);
+
+    ZSTD_frameHeader frameHeader = {0};
+    u64 frame_pos = 0;
+    // Skippable frames don't have a block size, so we step over them to find
+    // the header of the real frame. The decompressor skips them on its own.
+    while (true) {
+        u8 header[ZSTD_FRAMEHEADERSIZE_MAX] = {0};
+        PHYSFS_sint64 read = -1;
+        if (ctx->io->seek(ctx->io, frame_pos)) {
+            read = ctx->io->read(ctx->io, header, sizeof(header));
+        }
+        if (read < ZSTD_SKIPPABLEHEADERSIZE) {
+            LOG_MSG(error, "Truncated zstd frame header at 0x%llx\n", frame_pos);
+            return false;
+        }
+        // Magic, then the size of the frame's content
+        u32 magic = MEM_readLE32(header);
+        if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START) {
+            frame_pos += ZSTD_SKIPPABLEHEADERSIZE + (u64)MEM_readLE32(header + 4);
+            continue;
         }
+        // Anything but 0 is an error, or a header that needs more bytes than
+        // the file has
+        if (ZSTD_getFrameHeader(&frameHeader, header, (size_t)read) != 0) {
+            LOG_MSG(error, "Invalid zstd frame header at 0x%llx\n", frame_pos);
+            return false;
+        }
+        break;
     }
-
-    ZSTD_frameHeader frameHeader;
-    ctx->in_buf = allocator.Malloc(ZSTD_FRAMEHEADERSIZE_PREFIX(ZSTD_f_zstd1));
-    ctx->io->read(ctx->io, (void*)ctx->in_buf, ZSTD_FRAMEHEADERSIZE_PREFIX(ZSTD_f_zstd1));
-    ctx->io->seek(ctx->io, 0);
-    size_t frameHeaderSize = ZSTD_frameHeaderSize((void*)ctx->in_buf, ZSTD_FRAMEHEADERSIZE_PREFIX(ZSTD_f_zstd1));
-    allocator.Free(ctx->in_buf);
-    ctx->in_buf = allocator.Malloc(frameHeaderSize);
-    ctx->io->read(ctx->io, (void*)ctx->in_buf, frameHeaderSize);
     ctx->io->seek(ctx->io, 0);
-    ZSTD_getFrameHeader(&frameHeader, (void*)ctx->in_buf, frameHeaderSize);
-    allocator.Free(ctx->in_buf);
     ctx->max_block_size = frameHeader.blockSizeMax;
 
-    // Alloc our decompression buffers
-    ctx->dbuf = allocator.Malloc(ctx->max_block_size);
-    ctx->in_buf = allocator.Malloc(ctx->max_block_size + ZSTD_BLOCKHEADERSIZE);
+    const char* name = (ctx->name != NULL) ? ctx->name : "zstd stream";
+    u32 window_log_max = mem_budget_window_log_max();
+    if (window_log_max != 0 && frameHeader.windowSize > (1ull << window_log_max)) {
+        LOG_MSG(error, "%s needs a %llu byte window, over the limit of 2^%u\n", name, frameHeader.windowSize, window_log_max);
+        PHYSFS_setErrorCode(PHYSFS_ERR_UNSUPPORTED);
+        return false;
+    }
 
-    
+    // Our buffers, plus the decoder and the window it'll allocate
+    u64 size = IN_BUF_SIZE(ctx) + ctx->max_block_size + ZSTD_estimateDStreamSize((size_t)frameHeader.windowSize);
+    if (!mem_budget_acquire(size, ctx->can_wait)) {
+        if (mem_budget_policy() != SARC_MEMORY_DEGRADE) {
+            LOG_MSG(error, "No room in the memory budget for %s (%llu bytes)\n", name, size);
+            PHYSFS_setErrorCode(PHYSFS_ERR_OUT_OF_MEMORY);
+            return false;
+        }
+        // The shared decoder is set up for us on our first read
+        LOG_MSG(debug, "%s is sharing a decoder\n", name);
+        ZSTD_freeDStream(ctx->dstream);
+        ctx->dstream = NULL;
+        ctx->shared = true;
+        ctx->shared_pos = 0;
+        return true;
+    }
+    ctx->charged = size;
+
+    // Alloc our decompression buffers
+    ctx->dbuf = zstd_alloc_buffer(ctx->max_block_size);
+    ctx->in_buf = zstd_alloc_buffer(IN_BUF_SIZE(ctx));
 
     // Decompress the first chunk so we have data to work with already
     zstd_decompress_block(ctx);
     return true;
 }
 
+static int stream_seek(zstd_ctx* ctx, PHYSFS_uint64 offset);
+static PHYSFS_sint64 stream_tell(zstd_ctx* ctx);
+
+static thread_once_t shared_once = THREAD_ONCE_INIT;
+
+static void shared_init(void) {
+    shared_decoder.lock = __PHYSFS_platformCreateMutex();
+}
+
+void zstd_io_setup_shared(void) {
+    thread_once(&shared_once, shared_init);
+}
+
+// Give a shared stream the decoder, in the state it left it in. When another
+// stream used it since, that means decompressing from the start again, up to
+// where this one was. Returns with the lock held, unless it fails.
+static bool shared_enter(zstd_ctx* ctx) {
+    __PHYSFS_platformGrabMutex(shared_decoder.lock);
+    if (shared_decoder.owner == ctx) {
+        return true;
+    }
+    if (shared_decoder.dstream == NULL) {
+        shared_decoder.dstream = ZSTD_createDStream();
+        shared_decoder.dbuf = zstd_alloc_buffer(ZSTD_BLOCKSIZE_MAX);
+        shared_decoder.in_buf = zstd_alloc_buffer(ZSTD_BLOCKSIZE_MAX + ZSTD_BLOCKHEADERSIZE);
+        if (shared_decoder.dstream == NULL || shared_decoder.dbuf == NULL || shared_decoder.in_buf == NULL) {
+            ZSTD_freeDStream(shared_decoder.dstream);
+            zstd_free_buffer(shared_decoder.dbuf, ZSTD_BLOCKSIZE_MAX);
+            zstd_free_buffer(shared_decoder.in_buf, ZSTD_BLOCKSIZE_MAX + ZSTD_BLOCKHEADERSIZE);
+            shared_decoder.dstream = NULL;
+            shared_decoder.dbuf = NULL;
+            shared_decoder.in_buf = NULL;
+            __PHYSFS_platformReleaseMutex(shared_decoder.lock);
+            BAIL(PHYSFS_ERR_OUT_OF_MEMORY, false);
+        }
+        SARC_STATS_ADD(NULL, zstd_contexts_created, 1);
+    }
+    shared_decoder.owner = NULL; // In case we fail halfway
+    ZSTD_DCtx_reset(shared_decoder.dstream, ZSTD_reset_session_and_parameters);
+    zstd_io_ref_dicts(shared_decoder.dstream);
+    ctx->dstream = shared_decoder.dstream;
+    ctx->dbuf = shared_decoder.dbuf;
+    ctx->in_buf = shared_decoder.in_buf;
+    ctx->io->seek(ctx->io, 0);
+    ctx->dbuf_idx = 0;
+    ctx->dpos = 0;
+    ctx->in_buf_idx = 0;
+    ctx->in_pos = 0;
+    ctx->in_size = 0;
+    SARC_STATS_ADD(ctx->stats, zstd_seek_restarts, 1);
+    if (!zstd_decompress_block(ctx) || !stream_seek(ctx, ctx->shared_pos)) {
+        __PHYSFS_platformReleaseMutex(shared_decoder.lock);
+        BAIL(PHYSFS_ERR_CORRUPT, false);
+    }
+    shared_decoder.owner = ctx;
+
+    // The window grows to fit the biggest frame the decoder has seen
+    u64 size = ZSTD_sizeof_DStream(shared_decoder.dstream) + ZSTD_BLOCKSIZE_MAX * 2 + ZSTD_BLOCKHEADERSIZE;
+    if (size > shared_decoder.charged) {
+        mem_budget_acquire_buffer(size - shared_decoder.charged);
+        shared_decoder.charged = size;
+    }
+    return true;
+}
+
+static void shared_leave(zstd_ctx* ctx) {
+    ctx->shared_pos = stream_tell(ctx);
+    __PHYSFS_platformReleaseMutex(shared_decoder.lock);
+}
+
 // PHYSFS_Io implementation for ZSTD files
 
-PHYSFS_sint64 zstd_read(PHYSFS_Io *io, void *buffer, PHYSFS_uint64 len) {
-    zstd_ctx* ctx = (zstd_ctx*)io->opaque;
+static PHYSFS_sint64 stream_read(zstd_ctx* ctx, void *buffer, PHYSFS_uint64 len) {
     if (ctx->dbuf == NULL) {
         LOG_MSG(debug, "Had to alloc temp buffer.\n");
-        ctx->dbuf = allocator.Malloc(ctx->max_block_size);
-        if (ctx == NULL) {
+        ctx->dbuf = zstd_alloc_buffer(ctx->max_block_size);
+        if (ctx->dbuf == NULL) {
             return 0;
         }
     }
@@ -187,13 +442,22 @@ PHYSFS_sint64 zstd_read(PHYSFS_Io *io, void *buffer, PHYSFS_uint64 len) {
     return len;
 }
 
+PHYSFS_sint64 zstd_read(PHYSFS_Io *io, void *buffer, PHYSFS_uint64 len) {
+    zstd_ctx* ctx = (zstd_ctx*)io->opaque;
+    if (!ctx->shared) {
+        return stream_read(ctx, buffer, len);
+    }
+    BAIL_IF_ERRPASS(!shared_enter(ctx), -1);
+    PHYSFS_sint64 rc = stream_read(ctx, buffer, len);
+    shared_leave(ctx);
+    return rc;
+}
+
 PHYSFS_sint64 zstd_write(PHYSFS_Io *io, const void* buf, PHYSFS_uint64 len){
     return 0;
 }
 
-int zstd_seek(PHYSFS_Io *io, PHYSFS_uint64 offset) {
-    zstd_ctx* ctx = (zstd_ctx*)io->opaque;
-
+static int stream_seek(zstd_ctx* ctx, PHYSFS_uint64 offset) {
     u64 block_pos = (ctx->dbuf_idx - 1) * ctx->max_block_size;
     // If the destination is in range of our decompressed buffer, just use that
     if (block_pos < offset && offset < block_pos + ctx->max_block_size) {
@@ -201,35 +465,75 @@ int zstd_seek(PHYSFS_Io *io, PHYSFS_uint64 offset) {
         return 1;
     }
 
+    // Only seeks that have to decompress something are worth tracing
+    TRACE_BEGIN(span);
+    bool ok = true;
     if (offset < block_pos) {
         // The target is behind the current position, we have to reset the
         // stream and then seek forward to hit it.
+        SARC_STATS_ADD(ctx->stats, zstd_seek_restarts, 1);
         ZSTD_DCtx_reset(ctx->dstream, ZSTD_reset_session_only);
         ctx->io->seek(ctx->io, 0);
         ctx->dbuf_idx = 0;
-        zstd_decompress_block(ctx);
+        ctx->in_buf_idx = 0;
+        ctx->in_pos = 0;
+        ctx->in_size = 0;
+        ok = zstd_decompress_block(ctx);
         block_pos = (ctx->dbuf_idx - 1) * ctx->max_block_size;
     }
 
     // Decompress blocks until the target offset is between the current decompressed block and the next
-    while (offset > block_pos && offset > block_pos + ctx->max_block_size) {
-        zstd_decompress_block(ctx);
+    while (ok && offset > block_pos && offset > block_pos + ctx->max_block_size) {
+        ok = zstd_decompress_block(ctx);
         block_pos = (ctx->dbuf_idx - 1) * ctx->max_block_size;
     }
-    ctx->dpos = offset - block_pos;
+    // Past the end of the stream, or it's corrupt
+    if (ok) {
+        ctx->dpos = offset - block_pos;
+    }
 
-    return 1;
+    TRACE_END(span, "zstd_seek", ctx->name, NULL);
+    return ok ? 1 : 0;
 }
 
-PHYSFS_sint64 zstd_tell(PHYSFS_Io *io) {
-    zstd_ctx* ctx = (zstd_ctx*)io->opaque;
+static PHYSFS_sint64 stream_tell(zstd_ctx* ctx) {
     // We subtract one because the idx is incremented on every decompression (including the first)
     u64 block_pos = (ctx->dbuf_idx - 1) * ctx->max_block_size;
     return block_pos + ctx->dpos;
 }
 
+int zstd_seek(PHYSFS_Io *io, PHYSFS_uint64 offset) {
+    zstd_ctx* ctx = (zstd_ctx*)io->opaque;
+    if (!ctx->shared) {
+        return stream_seek(ctx, offset);
+    }
+    // Without the decoder, there's nothing to do until the next read
+    __PHYSFS_platformGrabMutex(shared_decoder.lock);
+    int rc = 1;
+    if (shared_decoder.owner == ctx) {
+        rc = stream_seek(ctx, offset);
+        ctx->shared_pos = stream_tell(ctx);
+    }
+    else {
+        ctx->shared_pos = offset;
+    }
+    __PHYSFS_platformReleaseMutex(shared_decoder.lock);
+    return rc;
+}
+
+PHYSFS_sint64 zstd_tell(PHYSFS_Io *io) {
+    zstd_ctx* ctx = (zstd_ctx*)io->opaque;
+    if (ctx->shared) {
+        return ctx->shared_pos;
+    }
+    return stream_tell(ctx);
+}
+
 PHYSFS_sint64 zstd_length(PHYSFS_Io* io) {
     zstd_ctx* ctx = (zstd_ctx*)io->opaque;
+    if (ctx->shared) {
+        BAIL_IF_ERRPASS(!shared_enter(ctx), -1);
+    }
     ZSTD_DCtx_reset(ctx->dstream, ZSTD_reset_session_only);
 
     u64 size = 0;
@@ -237,10 +541,13 @@ PHYSFS_sint64 zstd_length(PHYSFS_Io* io) {
         size += ctx->max_block_size;
     }
 
+    if (ctx->shared) {
+        shared_leave(ctx);
+    }
     return size;
 }
 
-PHYSFS_Io* zstd_wrap_io(PHYSFS_Io* io) {
+static PHYSFS_Io* zstd_wrap(PHYSFS_Io* io, bool owns_io, sarc_stats* stats, const char* name, bool can_wait) {
     PHYSFS_Io* out = allocator.Malloc(sizeof(*out));
     zstd_ctx* new_ctx = allocator.Malloc(sizeof(*new_ctx));
     if (out == NULL || new_ctx == NULL) {
@@ -253,11 +560,29 @@ PHYSFS_Io* zstd_wrap_io(PHYSFS_Io* io) {
 
     // Setup our context for streaming decompression, and to wrap the other IO
     new_ctx->io = io;
-    zstd_ctx_init(new_ctx);
+    new_ctx->owns_io = owns_io;
+    new_ctx->stats = stats;
+    new_ctx->name = name;
+    new_ctx->can_wait = can_wait;
+    if (!zstd_ctx_init(new_ctx)) {
+        ZSTD_freeDStream(new_ctx->dstream);
+        allocator.Free(out);
+        allocator.Free(new_ctx);
+        return NULL;
+    }
     out->opaque = new_ctx;
 
     return out;
 }
+
+PHYSFS_Io* zstd_wrap_io(PHYSFS_Io* io) {
+    return zstd_wrap(io, false, NULL, NULL, false);
+}
+
+PHYSFS_Io* zstd_wrap_io_owned(PHYSFS_Io* io, sarc_stats* stats, const char* name, bool can_wait) {
+    return zstd_wrap(io, true, stats, name, can_wait);
+}
+
 PHYSFS_Io *zstd_duplicate(PHYSFS_Io *io) {
     zstd_ctx* old_ctx = (zstd_ctx*)io->opaque;
     PHYSFS_Io* out = allocator.Malloc(sizeof(*out));
@@ -271,8 +596,18 @@ PHYSFS_Io *zstd_duplicate(PHYSFS_Io *io) {
     memset(new_ctx, 0x00, sizeof(*new_ctx));
 
     new_ctx->io = old_ctx->io->duplicate(old_ctx->io);
-
-    zstd_ctx_init(new_ctx);
+    new_ctx->owns_io = true;
+    new_ctx->stats = old_ctx->stats;
+    new_ctx->name = old_ctx->name;
+    if (new_ctx->io == NULL || !zstd_ctx_init(new_ctx)) {
+        if (new_ctx->io != NULL) {
+            new_ctx->io->destroy(new_ctx->io);
+        }
+        ZSTD_freeDStream(new_ctx->dstream);
+        allocator.Free(out);
+        allocator.Free(new_ctx);
+        return NULL;
+    }
     out->opaque = new_ctx;
 
     return out;
@@ -284,9 +619,24 @@ int zstd_flush(PHYSFS_Io *io) {
 
 void zstd_destroy(PHYSFS_Io *io) {
     zstd_ctx* ctx = (zstd_ctx*)io->opaque;
-    ZSTD_freeDStream(ctx->dstream);
-    allocator.Free(ctx->dbuf);
+    if (ctx->shared) {
+        __PHYSFS_platformGrabMutex(shared_decoder.lock);
+        if (shared_decoder.owner == ctx) {
+            shared_decoder.owner = NULL;
+        }
+        __PHYSFS_platformReleaseMutex(shared_decoder.lock);
+    }
+    else {
+        ZSTD_freeDStream(ctx->dstream);
+        zstd_free_buffer(ctx->dbuf, ctx->max_block_size);
+        zstd_free_buffer(ctx->in_buf, IN_BUF_SIZE(ctx));
+        mem_budget_release(ctx->charged);
+    }
+    if (ctx->owns_io) {
+        ctx->io->destroy(ctx->io);
+    }
     allocator.Free(ctx);
+    allocator.Free(io);
     return;
 }
 
@@ -6,12 +6,38 @@ extern "C" {
 
 #include <int.h>
 #include <physfs.h>
+#include <zstd.h>
+
+#include "sarc_stats.h"
 // This is a PHYSFS_Io (file I/O interface) implementation for zstd-compressed
 // files.
 
 // Wrap an existing IO stream with ZSTD, to transparently handle (de)compression
 PHYSFS_Io* zstd_wrap_io(PHYSFS_Io* io);
+// Same as zstd_wrap_io(), but the wrapped IO is destroyed along with ours.
+// Decompression work is also counted in stats, unless it's NULL. name is the
+// archive name shown in traces, and must outlive the IO (or be NULL). can_wait
+// lets it wait for room in the memory budget (see mem_budget_acquire()).
+PHYSFS_Io* zstd_wrap_io_owned(PHYSFS_Io* io, sarc_stats* stats, const char* name, bool can_wait);
 void zstd_io_add_dict(const char* path);
+// Add a dictionary that's already in memory (it's copied). name is used like
+// a dictionary's file name, see zstd_io_find_dict().
+bool zstd_io_add_dict_buffer(const void* dict, size_t size, const char* name);
+// Let a decompression context use every dictionary added so far, with the
+// window limit from SARC_setWindowLogMax(), for code that decompresses
+// archives without going through our IO.
+void zstd_io_ref_dicts(ZSTD_DCtx* dctx);
+// Get the decoder shared by streams that don't fit in the memory budget ready
+// for use. Called by SARC_setMemoryBudget() when it picks SARC_MEMORY_DEGRADE.
+void zstd_io_setup_shared(void);
+// Pick the dictionary to compress an archive with: the one named after the
+// extension under ".zs" ("pack.zsdic" for "Foo.pack.zs"), otherwise "zs.zsdic",
+// otherwise the only one added. When names clash, the newest one wins.
+// Returns -1 if there's none.
+int zstd_io_find_dict(const char* arc_filename);
+// Compression dictionary for a dictionary from zstd_io_find_dict(), or NULL.
+// It references the loaded dictionary, and is freed with ZSTD_freeCDict().
+ZSTD_CDict* zstd_io_create_cdict(int dict, int level);
 
 // Custom IO
 PHYSFS_sint64 zstd_read(PHYSFS_Io *io, void *buffer, PHYSFS_uint64 len);